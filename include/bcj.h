@@ -0,0 +1,121 @@
+/**
+ * @file bcj.h
+ * @author Max Resch
+ * @brief branch conversion filters for executable code (xz BCJ style)
+ * @version 0.1
+ * @date 2021-10-24
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Relative call and jump targets are different at every call site, even if
+ *  they refer to the same function. build_image converts them to absolute
+ *  targets before compressing the kernel, so the compressor finds far more
+ *  repetitions, the loader converts them back after decompressing.
+ *
+ *  * x86: `CALL` and `JMP` with 32 bit displacement (E8, E9)
+ *  * ARM64: `BL` and `ADRP` (4 byte aligned relative to the start of the
+ *    filtered range)
+ *
+ *  A header in front of the compressed data says which filter was applied
+ *  to which range of the content. It is stored as a skippable frame, so the
+ *  section still decompresses with the standard tools (to filtered data).
+ *  All values are little endian.
+ *
+ *  | header | frame table (optional) | frame 0 | ... |
+ *
+ *  The filters process data in chunks of any size, a few bytes at the end
+ *  of a chunk may have to be seen again with the following data. This
+ *  header does not depend on the rest of the loader, so the filters can be
+ *  compiled for the host (see tools/build_image.c).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* magic of a skippable frame, next to FRAME_TABLE_MAGIC */
+#define BCJ_HEADER_MAGIC        UINT32_C(0x184D2A5B)
+#define BCJ_HEADER_SIGNATURE    UINT32_C(0x4A43425A)   /* ZBCJ */
+
+/* bytes at the end of a chunk which may stay unprocessed */
+#define BCJ_LOOKAHEAD           4
+
+enum bcj_filter {
+    BCJ_FILTER_NONE,
+    BCJ_FILTER_X86,             ///< x86 and x86_64
+    BCJ_FILTER_ARM64,           ///< AArch64
+};
+
+struct bcj_header {
+    uint32_t magic;             ///< BCJ_HEADER_MAGIC
+    uint32_t size;              ///< size of the skippable frame after this field
+    uint32_t signature;         ///< BCJ_HEADER_SIGNATURE
+    uint16_t filter;            ///< `enum bcj_filter`
+    uint16_t reserved;
+    uint64_t start;             ///< first filtered byte of the content
+    uint64_t end;               ///< end of the filtered range
+};
+
+/**
+ * @brief progress of a filter through its range
+ *
+ * @details
+ *  Everything in front of pos and everything from end on is final.
+ */
+struct bcj_state {
+    enum bcj_filter filter;
+    uint64_t start;
+    uint64_t end;
+    uint64_t pos;               ///< first byte that still has to be converted
+    uint32_t x86_prev_mask;     ///< E8/E9 bytes seen in front of pos
+    uint64_t x86_prev_pos;
+};
+
+/**
+ * @brief prepare s for a filter of the range [start, end)
+ */
+void bcj_init(
+    struct bcj_state* s,
+    enum bcj_filter filter,
+    uint64_t start,
+    uint64_t end
+);
+
+/**
+ * @brief convert the part of the filtered range in data
+ *
+ * @param[in,out] data
+ *  bytes from offset to offset + size of the content, data in front of
+ *  s->pos has to be final already
+ * @param[in] encode
+ *  convert to absolute (build_image) or back to relative (loader) targets
+ *
+ * @returns the new s->pos, bytes from there on have to be passed again
+ *  together with the next chunk (at most BCJ_LOOKAHEAD bytes)
+ */
+uint64_t bcj_convert(
+    struct bcj_state* s,
+    uint8_t* data,
+    uint64_t offset,
+    size_t size,
+    bool encode
+);
+
+/**
+ * @brief whether the header is valid for content of content_size bytes
+ */
+static inline
+bool bcj_header_valid(
+    const struct bcj_header* header,
+    uint64_t content_size
+) {
+    return header->magic == BCJ_HEADER_MAGIC
+        && header->size == sizeof(*header) - offsetof(struct bcj_header, signature)
+        && header->signature == BCJ_HEADER_SIGNATURE
+        && (header->filter == BCJ_FILTER_X86 || header->filter == BCJ_FILTER_ARM64)
+        && header->start % 4 == 0
+        && header->start <= header->end
+        && header->end <= content_size;
+}
@@ -10,6 +10,8 @@
 #include "efi/simple_file_system_protocol.h"
 #include "efi/file.h"
 #include "efi/loaded_image.h"
+#include "efi/mp_services_protocol.h"
+#include "efi/timestamp_protocol.h"
 #include "efi/event.h"
 #include "efi/boot_services.h"
 #include "efi/runtime_services.h"
@@ -85,7 +85,7 @@ struct __packed efi_boot_services_table {
 			efi_tpl_t notify_tpl,
 			efi_event_notify notify_function,
 			void* notify_context,
-			efi_event_t event
+			efi_event_t* event
         );
 
         efi_status_t (efi_api *set_timer) (
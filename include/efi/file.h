@@ -91,7 +91,7 @@ struct efi_file_protocol {
     
     efi_status_t (efi_api *set_position) (
         efi_file_handle_t self,
-        efi_size_t* pos
+        uint64_t pos
     );
 
     efi_status_t (efi_api *get_info) (
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "defs.h"
+#include "event.h"
+
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+    { 0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08} }
+
+#define PROCESSOR_AS_BSP_BIT        UINT32_C(0x00000001)
+#define PROCESSOR_ENABLED_BIT       UINT32_C(0x00000002)
+#define PROCESSOR_HEALTH_STATUS_BIT UINT32_C(0x00000004)
+
+#define END_OF_CPU_LIST             SIZE_MAX
+
+/**
+ * @brief function executed by an application processor
+ *
+ * @details
+ *  APs must not call any boot services (except the MP services WhoAmI)
+ */
+typedef void (efi_api *efi_ap_procedure_t) (void* argument);
+
+struct efi_cpu_physical_location {
+    uint32_t package;
+    uint32_t core;
+    uint32_t thread;
+};
+
+struct efi_processor_information {
+    uint64_t processor_id;
+    uint32_t status_flag;
+    struct efi_cpu_physical_location location;
+};
+
+typedef struct efi_processor_information* efi_processor_information_t;
+
+typedef struct efi_mp_services_protocol* efi_mp_services_protocol_t;
+
+struct efi_mp_services_protocol {
+    efi_status_t (efi_api *get_number_of_processors) (
+        efi_mp_services_protocol_t this,
+        efi_size_t* number_of_processors,
+        efi_size_t* number_of_enabled_processors);
+
+    efi_status_t (efi_api *get_processor_info) (
+        efi_mp_services_protocol_t this,
+        efi_size_t processor_number,
+        efi_processor_information_t processor_info);
+
+    /**
+     * @brief Execute procedure on all enabled APs
+     *
+     * @param[in] wait_event
+     *  if not NULL return immediately and signal the event when all APs
+     *  finished (non-blocking mode)
+     * @param[in] timeout
+     *  microseconds, 0 waits indefinitely
+     */
+    efi_status_t (efi_api *startup_all_aps) (
+        efi_mp_services_protocol_t this,
+        efi_ap_procedure_t procedure,
+        bool single_thread,
+        efi_event_t wait_event,
+        efi_size_t timeout,
+        void* argument,
+        efi_size_t** failed_cpu_list);
+
+    efi_status_t (efi_api *startup_this_ap) (
+        efi_mp_services_protocol_t this,
+        efi_ap_procedure_t procedure,
+        efi_size_t processor_number,
+        efi_event_t wait_event,
+        efi_size_t timeout,
+        void* argument,
+        bool* finished);
+
+    efi_status_t (efi_api *switch_bsp) (
+        efi_mp_services_protocol_t this,
+        efi_size_t processor_number,
+        bool enable_old_bsp);
+
+    efi_status_t (efi_api *enable_disable_ap) (
+        efi_mp_services_protocol_t this,
+        efi_size_t processor_number,
+        bool enable_ap,
+        uint32_t* health_flag);
+
+    efi_status_t (efi_api *who_am_i) (
+        efi_mp_services_protocol_t this,
+        efi_size_t* processor_number);
+};
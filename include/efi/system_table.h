@@ -8,6 +8,19 @@
 
 #define EFI_SYSTEM_TABLE_SIGNATURE UINT64_C(0x5453595320494249) /* "IBI SYST" */
 
+#define EFI_ACPI_20_TABLE_GUID \
+    { 0x8868e871, 0xe4f1, 0x11d3, {0xbc, 0x22, 0x00, 0x80, 0xc7, 0x3c, 0x88, 0x81} }
+
+#define EFI_FDT_GUID \
+    { 0xb1b621d5, 0xf19c, 0x41a5, {0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa, 0xe0} }
+
+struct efi_configuration_table {
+	struct efi_guid vendor_guid;
+	void* vendor_table;
+};
+
+typedef struct efi_configuration_table* efi_configuration_table_t;
+
 struct efi_system_table {
 	struct efi_table_header hdr;
 	char16_t* firmware_vendor;
@@ -21,7 +34,7 @@ struct efi_system_table {
 	efi_runtime_services_table_t runtime_services;
 	efi_boot_services_table_t boot_services;
 	efi_size_t number_of_table_entries;
-	void* configuration_table;
+	efi_configuration_table_t configuration_table;
 };
 
 typedef struct efi_system_table* efi_system_table_t;
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "defs.h"
+
+#define EFI_TIMESTAMP_PROTOCOL_GUID \
+    { 0xafbfde41, 0x2e6e, 0x4262, {0xba, 0x65, 0x62, 0xb9, 0x23, 0x6e, 0x54, 0x95} }
+
+struct efi_timestamp_properties {
+    uint64_t frequency;
+    uint64_t end_value;
+};
+
+typedef struct efi_timestamp_properties* efi_timestamp_properties_t;
+
+typedef struct efi_timestamp_protocol* efi_timestamp_protocol_t;
+
+struct efi_timestamp_protocol {
+    uint64_t (efi_api *get_timestamp)(void);
+    efi_status_t (efi_api *get_properties)(
+        efi_timestamp_properties_t properties);
+};
@@ -7,12 +7,19 @@
 #include "efilib/externs.h"
 #include "efilib/debug.h"
 #include "efilib/rtlib.h"
+#include "efilib/alloc.h"
+#include "efilib/trace.h"
+#include "efilib/pmu.h"
+#include "efilib/log.h"
+#include "efilib/mem.h"
+#include "efilib/mp.h"
 #include "efilib/string.h"
 #include "efilib/file.h"
 #include "efilib/guid.h"
 #include "efilib/misc.h"
 #include "efilib/var.h"
 #include "efilib/print.h"
+#include "efilib/uart.h"
 
 void initialize_library(
     efi_handle_t image,
@@ -22,7 +29,7 @@ void initialize_library(
 static inline
 efi_status_t clear_screen() {
     EFILIB_ASSERT(ST);
-    return ST->out->clear_screen(ST->out);
+    return CON_OUT->clear_screen(CON_OUT);
 }
 
 /**
@@ -0,0 +1,151 @@
+/**
+ * @file alloc.h
+ * @author Max Resch
+ * @brief page backed arena for malloc and friends
+ * @version 0.1
+ * @date 2021-09-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  malloc, calloc and free take small objects from size class slabs in an
+ *  arena of pages, which is allocated once with AllocatePages. Larger
+ *  objects and anything that doesn't fit anymore come from the firmware's
+ *  pool. The top of the arena is a bump region for short lived scratch
+ *  memory, which is released in one go with `scratch_release`.
+ *
+ *  Like the firmware pool, the allocator must not be used on the APs.
+ */
+#pragma once
+
+#include <efi.h>
+#include <trace_buffer.h>
+
+/* default size of the arena in pages, 0 disables it */
+#ifndef EFILIB_ARENA_PAGES
+#  define EFILIB_ARENA_PAGES 256
+#endif
+
+/**
+ * @brief subsystem an allocation is accounted to
+ */
+enum alloc_tag {
+#define ALLOC_TAG(id, name) ALLOC_TAG_##id,
+    TRACE_MEMORY_SERIES(ALLOC_TAG)
+#undef ALLOC_TAG
+    _ALLOC_TAG_MAX
+};
+
+/**
+ * @brief memory held by a subsystem
+ *
+ * @details
+ *  bytes are requested malloc sizes, pages come from AllocatePages through
+ *  `alloc_account`. Scratch memory and the arena itself are not included.
+ */
+struct alloc_usage {
+    size_t bytes;
+    size_t pages;
+    size_t peak_bytes;
+    size_t peak_pages;
+    size_t peak;                ///< highest value of bytes + pages in bytes
+};
+
+/**
+ * @brief allocation counters since the start of the program
+ */
+struct alloc_stats {
+    uint32_t allocs;            ///< successful malloc and calloc calls
+    uint32_t frees;             ///< free calls with an allocation
+    uint32_t firmware_calls;    ///< AllocatePool, FreePool, AllocatePages, FreePages calls
+    size_t arena_used;          ///< bytes used by slabs and scratch
+    size_t arena_peak;          ///< highest value of arena_used
+    struct alloc_usage total;
+    struct alloc_usage tags[_ALLOC_TAG_MAX];
+};
+
+void alloc_get_stats(
+    struct alloc_stats* stats
+);
+
+/**
+ * @brief set the tag of the following malloc calls
+ *
+ * @returns the previous tag
+ */
+enum alloc_tag alloc_tag_enter(
+    enum alloc_tag tag
+);
+
+enum alloc_tag alloc_tag_current(void);
+
+static inline
+void alloc_tag_leave(enum alloc_tag* previous) {
+    alloc_tag_enter(*previous);
+}
+
+/* account the allocations until the end of the scope to tag */
+#define ALLOC_TAG_SCOPE(tag) \
+    __attribute__((cleanup(alloc_tag_leave), unused)) \
+    enum alloc_tag __alloc_tag_previous = alloc_tag_enter(ALLOC_TAG_##tag)
+
+/**
+ * @brief account memory that doesn't come from malloc
+ *
+ * @param bytes
+ *  pool bytes allocated (positive) or freed (negative)
+ * @param pages
+ *  pages allocated (positive) or freed (negative)
+ */
+void alloc_account(
+    enum alloc_tag tag,
+    int64_t bytes,
+    int64_t pages
+);
+
+/**
+ * @brief record the peak of each tag and the total as MEMORY_PEAK counters
+ *  in the boot trace
+ */
+void alloc_trace_usage(void);
+
+/**
+ * @brief position of the scratch region to return to
+ */
+typedef efi_size_t scratch_mark_t;
+
+scratch_mark_t scratch_mark(void);
+
+/**
+ * @brief allocate short lived memory
+ *
+ * @details
+ *  The memory stays valid until `scratch_release` is called with a mark
+ *  taken before this allocation. It may be passed to free, which does
+ *  nothing. Falls back to malloc if the arena is full.
+ */
+[[ gnu::malloc, nodiscard ]]
+void* scratch_alloc(
+    efi_size_t size
+);
+
+/**
+ * @brief release all scratch allocations made after mark
+ */
+void scratch_release(
+    scratch_mark_t mark
+);
+
+static inline
+void scratch_release_p(scratch_mark_t* mark) {
+    scratch_release(*mark);
+}
+
+/**
+ * @brief release the arena with a single FreePages
+ *
+ * @details
+ *  Called on exit, all memory from malloc and scratch_alloc in the arena
+ *  becomes invalid.
+ */
+void arena_release(void);
@@ -3,14 +3,19 @@
 #include <efi.h>
 
 extern efi_handle_t EFI_IMAGE;
-extern efi_file_handle_t EFI_ROOT;
 extern efi_system_table_t ST;
 extern efi_boot_services_table_t BS;
 extern efi_runtime_services_table_t RT;
+extern efi_simple_text_output_t CON_OUT;
 extern efi_memory_t _EFI_POOL_ALLOCATION;
 extern efi_loaded_image_t EFI_LOADED_IMAGE;
 extern uint64_t BOOT_TIME_USECS;
 
-#ifdef EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL
-extern efi_device_path_to_text_t _EFI_DEVPATH_TO_TEXT;
-#endif
+/**
+ * @brief the volume the image was loaded from, opened on first use
+ *
+ * @return NULL if the image doesn't come from a file system
+ */
+efi_file_handle_t lib_get_root(void);
+
+#define EFI_ROOT lib_get_root()
@@ -22,6 +22,22 @@ extern struct efi_guid efi_device_path_utilities_guid;
 
 extern struct efi_guid efi_device_path_to_text_guid;
 
+extern struct efi_guid efi_mp_services_protocol_guid;
+
+extern struct efi_guid efi_acpi_20_table_guid;
+
+extern struct efi_guid efi_fdt_guid;
+
+extern struct efi_guid efi_timestamp_protocol_guid;
+
+/**
+ * @brief vendor GUID of the variables efilib shares between boot stages
+ */
+#define EFILIB_VENDOR_GUID \
+    { 0x38f408f3, 0x6b54, 0x4698, {0x9f, 0x98, 0x3c, 0xdc, 0x31, 0xf5, 0x70, 0xef} }
+
+extern struct efi_guid efilib_vendor_guid;
+
 static inline
 bool guidcmp(efi_guid_t a, efi_guid_t b) {
 #if __SIZE_WIDTH__ == 64
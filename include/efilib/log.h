@@ -0,0 +1,55 @@
+/**
+ * @file log.h
+ * @author Max Resch
+ * @brief deferred console messages
+ * @version 0.1
+ * @date 2021-09-26
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Printing to the firmware console is slow (a serial console takes about
+ *  a millisecond per line), `log_write` only stores the format pointer,
+ *  the arguments and the time stamp of a message in a static ring. Strings,
+ *  GUIDs, device paths and times are copied into the record because the
+ *  buffers they point to may be gone when the record is printed.
+ *
+ *  The records are formatted by `log_flush`, which `exit` calls too, and
+ *  as text by `log_publish` for retrieval from the booted system. Only the
+ *  BSP may write to the log.
+ */
+#pragma once
+
+#include <efi.h>
+
+#define LOG_RING_ENTRIES    128
+#define LOG_VARIABLE        "ZloaderLog"
+
+/**
+ * @brief maximum size of the text written by `log_publish`
+ *
+ * @details
+ *  The default limit of 8 KiB in OVMF includes the variable header and
+ *  name, this leaves room for both.
+ */
+#define LOG_PUBLISH_SIZE    7168
+
+/**
+ * @brief record a message, takes the same format as `wprintf`
+ */
+void log_write(
+    const char16_t* fmt,
+    ...
+);
+
+/**
+ * @brief print the records not printed yet to the console
+ */
+void log_flush(void);
+
+/**
+ * @brief write the newest records as ASCII text to the volatile variable LOG_VARIABLE
+ */
+efi_status_t log_publish(
+    const efi_guid_t guid
+);
@@ -0,0 +1,108 @@
+/**
+ * @file mem.h
+ * @author Max Resch
+ * @brief memory copy and fill engine
+ * @version 0.1
+ * @date 2021-09-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Size tiered copy, fill and compare functions backing memcpy, memmove,
+ *  memset, memzero and memcmp. The vector paths are selected at runtime after
+ *  `mem_detect_features` was called. Until then only paths are used, which
+ *  every CPU supported by UEFI has (SSE2 on x86_64, NEON on AArch64).
+ *
+ *  This header does not depend on the rest of the library, so the engine
+ *  can be compiled for the host (see tools/memperf.c).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum mem_feature {
+    MEM_FEATURE_AVX2        = 1 << 0,   ///< 32 byte vectors (x86_64)
+    MEM_FEATURE_ERMS        = 1 << 1,   ///< enhanced `rep movsb` (x86_64)
+    MEM_FEATURE_NONTEMPORAL = 1 << 2,   ///< streaming stores for large copies
+    MEM_FEATURE_DCZVA       = 1 << 3,   ///< zero cache line blocks with `DC ZVA` (AArch64)
+};
+
+/**
+ * @brief paths the engine may use, a combination of `enum mem_feature`
+ *
+ * @details
+ *  Set by `mem_detect_features`, clearing bits disables the corresponding
+ *  path (used by the benchmark).
+ */
+extern uint32_t mem_features;
+
+/**
+ * @brief copies of at least this size use streaming stores
+ */
+extern size_t mem_nontemporal_threshold;
+
+/**
+ * @brief query the CPU for supported features and set `mem_features`
+ */
+uint32_t mem_detect_features(void);
+
+/**
+ * @brief features of the executing processor without changing
+ *  `mem_features`
+ *
+ * @details
+ *  Safe to call on application processors, which may have been set up
+ *  differently by the firmware than the boot processor.
+ */
+uint32_t mem_cpu_features(void);
+
+/**
+ * @brief copy size bytes, the regions must not overlap
+ */
+void* mem_copy(
+    void* dst,
+    const void* src,
+    size_t size
+);
+
+/**
+ * @brief copy size bytes, the regions may overlap
+ */
+void* mem_move(
+    void* dst,
+    const void* src,
+    size_t size
+);
+
+/**
+ * @brief compare size bytes
+ *
+ * @returns -1, 0 or 1
+ */
+int mem_compare(
+    const void* a,
+    const void* b,
+    size_t size
+);
+
+/**
+ * @brief set size bytes to value
+ */
+void* mem_set(
+    void* dst,
+    uint8_t value,
+    size_t size
+);
+
+/**
+ * @brief set size bytes to zero
+ *
+ * @details
+ *  Prefer this over `mem_set` with 0, large ranges are cleared with
+ *  `DC ZVA` on AArch64.
+ */
+void* mem_zero(
+    void* dst,
+    size_t size
+);
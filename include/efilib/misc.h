@@ -4,6 +4,9 @@
 
 #include "externs.h"
 #include "config.h"
+#include "alloc.h"
+#include "log.h"
+#include "var.h"
 
 static inline
 efi_status_t stall(efi_size_t microseconds) {
@@ -12,9 +15,11 @@ efi_status_t stall(efi_size_t microseconds) {
 
 static inline _Noreturn
 void exit(efi_status_t status) {
+    efi_var_flush();
+    log_flush();
 #ifdef EFILIB_SHUTDOWN
     /* don't use macro here, file included in debug.h */
-    ST->out->output_string(ST->out, u"System is now shutting down...\r\n");
+    CON_OUT->output_string(CON_OUT, u"System is now shutting down...\r\n");
 #endif
 #ifdef EFILIB_STALL_ON_EXIT
     stall(EFILIB_STALL_ON_EXIT);
@@ -22,6 +27,7 @@ void exit(efi_status_t status) {
 #ifdef EFILIB_SHUTDOWN
     RT->reset_system(EFI_RESET_SHUTDOWN, status, 0, NULL);
 #endif
+    arena_release();
     BS->exit(EFI_IMAGE, status, 0, NULL);
 }
 
@@ -54,3 +60,13 @@ efi_status_t lib_get_protocol_interface(
     efi_handle_t* handle,
     void** interface
 );
+
+/**
+ * @brief Find a table in the configuration table of the system table
+ * 
+ * @param[in] guid 
+ * @return the vendor table, NULL if not found
+ */
+void* lib_get_configuration_table(
+    efi_guid_t guid
+);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <efi.h>
+
+/**
+ * @brief number of processors `mp_run` executes on, including the BSP
+ *
+ * @details
+ *  The MP services protocol is located on the first call. Without it
+ *  (e.g. under U-Boot) or if the APs are unusable this is 1.
+ */
+size_t mp_processor_count(void);
+
+/**
+ * @brief run procedure on all enabled processors and wait for them
+ *
+ * @details
+ *  The APs are started in non-blocking mode, so the calling BSP runs
+ *  procedure as well. The procedure must not call any boot services, this
+ *  includes printing messages and allocating memory.
+ *
+ * @returns number of processors that ran procedure
+ */
+size_t mp_run(
+    efi_ap_procedure_t procedure,
+    void* argument
+);
+
+/**
+ * @brief body of `mp_for`, processes the bytes [begin, end)
+ */
+typedef void (*mp_for_body_t)(
+    size_t begin,
+    size_t end,
+    void* argument
+);
+
+/**
+ * @brief split [0, size) into chunks and process them on all processors
+ *
+ * @details
+ *  Every processor starts with an equal share of the chunks and steals
+ *  from the end of the other shares once its own share is done. body is
+ *  called once per chunk, chunk boundaries don't depend on the number of
+ *  processors. The restrictions of `mp_run` apply to body.
+ *
+ * @returns number of processors that took part
+ */
+size_t mp_for(
+    size_t size,
+    size_t chunk_size,
+    mp_for_body_t body,
+    void* argument
+);
+
+/**
+ * @brief memcpy that uses all processors for large sizes
+ */
+void* mp_copy(
+    void* dst,
+    const void* src,
+    size_t size
+);
+
+/**
+ * @brief memzero that uses all processors for large sizes
+ */
+void* mp_zero(
+    void* dst,
+    size_t size
+);
@@ -0,0 +1,56 @@
+/**
+ * @file pmu.h
+ * @author Max Resch
+ * @brief hardware performance counters
+ * @version 0.1
+ * @date 2021-09-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Counts events of the calling processor with its PMU: PMUv3 on AArch64
+ *  and architectural performance monitoring (CPUID leaf 0xA) on x86_64.
+ *  UEFI runs at EL1/EL2 or in ring 0, so the counters are programmed
+ *  directly on first use. Events the processor doesn't implement or a
+ *  hypervisor doesn't expose (QEMU TCG has no PMU on x86_64 and only some
+ *  events on AArch64) are missing from `valid`; without a PMU samples stay
+ *  empty.
+ *
+ *  Only the BSP should sample, work done by the APs is not counted.
+ */
+#pragma once
+
+#include <efi.h>
+
+enum pmu_event {
+    PMU_CYCLES,
+    PMU_INSTRUCTIONS,
+    PMU_L1D_MISSES,
+    PMU_LLC_MISSES,         ///< L2 refills on AArch64, the last level on Cortex-A53
+    PMU_BRANCH_MISSES,
+    _PMU_EVENT_MAX
+};
+
+struct pmu_sample {
+    uint64_t count[_PMU_EVENT_MAX];
+    uint32_t valid;         ///< bit for each event that was counted
+};
+
+/**
+ * @brief read the counters at the beginning of a sample
+ */
+void pmu_start(
+    struct pmu_sample* sample
+);
+
+/**
+ * @brief set sample to the events counted since `pmu_start`
+ */
+void pmu_stop(
+    struct pmu_sample* sample
+);
+
+static inline
+bool pmu_valid(const struct pmu_sample* sample, enum pmu_event event) {
+    return sample->valid & (1u << event);
+}
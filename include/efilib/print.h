@@ -60,7 +60,7 @@ static inline
 efi_status_t print(
     const char16_t* string
 ) {
-    return ST->out->output_string(ST->out, string);
+    return CON_OUT->output_string(CON_OUT, string);
 }
 
 /**
@@ -98,6 +98,22 @@ efi_size_t vswprintf(
     va_list args
 );
 
+/**
+ * @brief print with arguments stored as 64 bit words (see log.h)
+ */
+efi_size_t _iprint_words(
+    efi_simple_text_output_t out,
+    const char16_t* fmt,
+    const uint64_t* words
+);
+
+efi_size_t swprint_words(
+    char16_t* restrict str,
+    size_t maxlen,
+    const char16_t* restrict fmt,
+    const uint64_t* words
+);
+
 static inline
 efi_size_t wprintf(
     const char16_t* restrict fmt,
@@ -106,7 +122,7 @@ efi_size_t wprintf(
     va_list args;
     efi_size_t ret;
     va_start(args, fmt);
-    ret = _iprint((efi_size_t) -1, (efi_size_t) -1, ST->out, fmt, NULL, args);
+    ret = _iprint((efi_size_t) -1, (efi_size_t) -1, CON_OUT, fmt, NULL, args);
     va_end(args);
     return ret;
 }
@@ -121,7 +137,7 @@ efi_size_t wprintf_at(
     va_list args;
     efi_size_t ret;
     va_start(args, fmt);
-    ret = _iprint(column, row, ST->out, fmt, NULL, args);
+    ret = _iprint(column, row, CON_OUT, fmt, NULL, args);
     va_end(args);
     return ret;
 }
@@ -148,7 +164,7 @@ efi_size_t printf(
 ) {
     va_list args;
     va_start(args, fmt);
-    efi_size_t ret = _iprint((efi_size_t) -1, (efi_size_t) -1, ST->out, NULL, fmt, args);
+    efi_size_t ret = _iprint((efi_size_t) -1, (efi_size_t) -1, CON_OUT, NULL, fmt, args);
     va_end(args);
     return ret;
 }
@@ -163,7 +179,7 @@ efi_size_t printf_at(
 ) {
     va_list args;
     va_start(args, fmt);
-    efi_size_t ret = _iprint(column, row, ST->out, NULL, fmt, args);
+    efi_size_t ret = _iprint(column, row, CON_OUT, NULL, fmt, args);
     va_end(args);
     return ret;
 }
@@ -11,7 +11,7 @@
  *  Define runtime memory and string support functions
  *  using either inline or builtin functions.
  * 
- *  malloc, calloc, free, memcpy and memmove are symbols
+ *  malloc, calloc, free, memzero, memcpy and memmove are symbols
  */
 #pragma once
 
@@ -40,6 +40,18 @@ void* memset (
     efi_size_t size    
 );
 
+/**
+ * @brief fill buffer with zeros
+ *
+ * @details
+ *  faster than memset for large buffers (BSS, page allocations), since
+ *  it can clear whole cache lines without reading them first
+ */
+void* memzero (
+    void* buffer,
+    efi_size_t size
+);
+
 #if __has_builtin(__builtin_memcmp)
 # define memcpy __builtin_memcpy
 #else
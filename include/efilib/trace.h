@@ -0,0 +1,84 @@
+/**
+ * @file trace.h
+ * @author Max Resch
+ * @brief tracepoints for the boot timeline
+ * @version 0.1
+ * @date 2021-09-24
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Recording an event reads the CPU counter and writes 16 bytes to a static
+ *  ring, it doesn't call the firmware and is safe on the APs. The ring is
+ *  only written to an EFI variable by `trace_publish`.
+ *
+ * @see trace_buffer.h
+ */
+#pragma once
+
+#include <efi.h>
+#include <trace_buffer.h>
+
+/**
+ * @brief read the CPU ticks counter
+ */
+static inline
+uint64_t ticks_read() {
+    /* x64 and some i686 may know rdtscp which could be more accurate
+       but this requires feature testing with cpu id */
+#ifdef __x86_64__
+    uint64_t a, d;
+    __asm__ volatile ("rdtsc" : "=a"(a), "=d"(d));
+    return (d << 32) | a;
+#elif defined(__i386__)
+    uint64_t val;
+    __asm__ volatile ("rdtsc" : "=A"(val));
+    return val;
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ volatile ("mrs %0, cntpct_el0" : "=r"(val));
+    return val;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief frequency of `ticks_read` in Hz (0 before `initialize_library`)
+ */
+uint64_t ticks_frequency(void);
+
+/**
+ * @brief convert a value of `ticks_read` to microseconds (0 if unknown)
+ */
+uint64_t ticks_to_usec(
+    uint64_t ticks
+);
+
+/*
+ * EFILIB_TRACE is only defined for efilib itself, without it these
+ * functions do nothing and `trace_publish` returns EFI_UNSUPPORTED.
+ */
+void trace_event_at(
+    uint64_t ticks,
+    enum trace_id id,
+    enum trace_phase phase,
+    uint8_t cpu,
+    uint32_t arg
+);
+
+/**
+ * @brief write the ring to the volatile variable TRACE_BUFFER_VARIABLE
+ */
+efi_status_t trace_publish(
+    const efi_guid_t guid
+);
+
+static inline
+void trace_event(enum trace_id id, enum trace_phase phase, uint8_t cpu, uint32_t arg) {
+    trace_event_at(ticks_read(), id, phase, cpu, arg);
+}
+
+#define trace_begin(id, arg)    trace_event(TRACE_##id, TRACE_BEGIN, 0, (arg))
+#define trace_end(id, arg)      trace_event(TRACE_##id, TRACE_END, 0, (arg))
+#define trace_instant(id, arg)  trace_event(TRACE_##id, TRACE_INSTANT, 0, (arg))
@@ -0,0 +1,65 @@
+/**
+ * @file uart.h
+ * @author Max Resch
+ * @brief console on the UART registers
+ * @version 0.1
+ * @date 2021-09-27
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  ConOut of OVMF and U-Boot goes through terminal emulation and, if there
+ *  is one, the graphics console. `uart_console` finds the UART of the
+ *  firmware console and makes CON_OUT a text output protocol that writes
+ *  to its transmit register, so everything efilib prints goes there.
+ *
+ *  16550 (memory mapped or x86 I/O ports) and PL011 UARTs are supported.
+ *  They must have been set up by the firmware, the line settings aren't
+ *  changed.
+ */
+#pragma once
+
+#include <efi.h>
+
+enum uart_type {
+    UART_NONE,
+    UART_16550,
+    UART_PL011,
+};
+
+struct uart {
+    enum uart_type type;
+    uintptr_t base;
+    uint8_t shift;          ///< 16550 registers are 1 << shift bytes apart
+    uint8_t width;          ///< 16550 register access width in bytes (1 or 4)
+    bool io_port;           ///< 16550 in the x86 I/O port space
+};
+
+/**
+ * @brief find the UART of `/chosen/stdout-path` in a flattened devicetree
+ */
+bool uart_from_fdt(
+    const void* fdt,
+    struct uart* uart
+);
+
+/**
+ * @brief find the UART of the ACPI Serial Port Console Redirection table
+ */
+bool uart_from_spcr(
+    struct uart* uart
+);
+
+/**
+ * @brief write CON_OUT to the console UART
+ *
+ * @details
+ *  The UART is searched in fdt, the devicetree and the SPCR table of the
+ *  firmware and on x86_64 at the COM1 port, in that order.
+ *
+ * @param fdt devicetree to search first, can be NULL
+ * @return EFI_NOT_FOUND if there is no UART and CON_OUT stays ConOut
+ */
+efi_status_t uart_console(
+    const void* fdt
+);
@@ -1,23 +1,41 @@
+/**
+ * @file var.h
+ * @author Max Resch
+ * @brief cached EFI variables
+ * @version 0.1
+ * @date 2021-09-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Variable services are slow on some firmware (U-Boot keeps the store in a
+ *  file and walks it for every call). Small variables are kept in a static
+ *  cache after they were read once, `efi_var_attributes` and `efi_var_get`
+ *  answer from it.
+ *
+ *  `efi_var_set_printf` and `efi_var_set_device_path` only queue the value,
+ *  a write that doesn't change the cached value is dropped and repeated
+ *  writes of the same variable are coalesced. `efi_var_flush` writes what is
+ *  queued, it has to be called before the next image is started.
+ *  `efi_var_set` writes immediately (authenticated writes must be ordered
+ *  and their result checked).
+ */
 #pragma once
 
 #include <efi.h>
-#include "debug.h"
+#include "config.h"
+
+#define EFI_VAR_CACHE_ENTRIES   16
+#define EFI_VAR_CACHE_NAME_LEN  32      ///< longer names aren't cached
+#define EFI_VAR_CACHE_DATA_SIZE 128     ///< larger values aren't cached
 
-static inline
 efi_status_t efi_var_get(
     const efi_guid_t guid,
     const char16_t* name,
     uint32_t* attributes,
     efi_size_t* size,
     void* data
-) {
-    EFILIB_ASSERT(RT);
-
-    efi_status_t err = RT->get_variable(name, guid, attributes, size, data);
-    if (EFI_ERROR(err))
-        EFILIB_DBG_PRINTF("GetVariable {%g} %ls %r", guid, name, err);
-    return err;
-}
+);
 
 void* efi_var_get_pool(
     const efi_guid_t guid,
@@ -26,42 +44,50 @@ void* efi_var_get_pool(
     efi_size_t* buffer_size
 );
 
-static inline
 efi_status_t efi_var_set(
     const efi_guid_t guid,
     const char16_t* name,
     uint32_t attributes,
     efi_size_t size,
     const void* data
-) {
-    EFILIB_ASSERT(RT);
-
-    efi_status_t err = RT->set_variable(name, guid, attributes, size, data);
-    if (EFI_ERROR(err))
-        EFILIB_DBG_PRINTF("SetVariable {%g} %ls %r", guid, name, err);
-    return err;
-}
+);
 
 #if EFILIB_PRINTF
+/**
+ * @brief queue a formatted string value, written by `efi_var_flush`
+ */
 efi_size_t efi_var_set_printf(
     const efi_guid_t guid,
     const char16_t* name,
     uint32_t attributes,
     const char16_t* fmt, ...
 );
+
+/**
+ * @brief queue the text of a device path, written by `efi_var_flush`
+ *
+ * @details
+ *  The text is only formatted when the write is flushed (or the variable
+ *  read), dp must stay valid until then.
+ */
+efi_status_t efi_var_set_device_path(
+    const efi_guid_t guid,
+    const char16_t* name,
+    uint32_t attributes,
+    efi_device_path_t dp
+);
 #endif
 
-static inline
+/**
+ * @brief write all queued variables
+ * @return the first error of a write, the others are still tried
+ */
+efi_status_t efi_var_flush(void);
+
+/**
+ * @brief attributes of a variable, 0 if it doesn't exist
+ */
 uint32_t efi_var_attributes(
     const efi_guid_t guid,
     const char16_t* name
-) {
-    efi_size_t size = 0; 
-    uint32_t attributes = 0;
-    efi_status_t err = RT->get_variable(name, guid, &attributes, &size, NULL);
-    if (err == EFI_BUFFER_TOO_SMALL)
-        return attributes;
-    else
-        EFILIB_DBG_PRINTF("GetVariable {%g} %ls %r", guid, name, err);
-    return 0;
-}
+);
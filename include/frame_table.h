@@ -0,0 +1,37 @@
+/**
+ * @file frame_table.h
+ * @brief seek table for data split into independently decodable frames
+ *
+ * @details
+ *  build_image puts the table in front of a section consisting of several
+ *  concatenated LZ4 or ZSTD frames. It is stored as a skippable frame, so
+ *  the section still decompresses with the standard tools. All values are
+ *  little endian.
+ *
+ *  | table | frame 0 | frame 1 | ... | frame count - 1 |
+ */
+#pragma once
+
+#include <stdint.h>
+
+/* magic of a skippable frame, both LZ4 and ZSTD use 0x184D2A50 - 0x184D2A5F */
+#define FRAME_TABLE_MAGIC       UINT32_C(0x184D2A5A)
+#define FRAME_TABLE_SIGNATURE   UINT32_C(0x54464C5A)   /* ZLFT */
+
+/* size of the table with count entries */
+#define FRAME_TABLE_SIZE(count) \
+    (sizeof(struct frame_table) + (count) * sizeof(struct frame_table_entry))
+
+struct frame_table_entry {
+    uint64_t offset;            ///< begin of the frame, relative to the end of the table
+    uint64_t content_offset;    ///< begin of the decompressed frame in the content
+};
+
+struct frame_table {
+    uint32_t magic;             ///< FRAME_TABLE_MAGIC
+    uint32_t size;              ///< size of the skippable frame after this field
+    uint32_t signature;         ///< FRAME_TABLE_SIGNATURE
+    uint32_t count;             ///< number of frames
+    uint64_t content_size;      ///< size of the decompressed data
+    struct frame_table_entry entries[];
+};
@@ -0,0 +1,208 @@
+/**
+ * @file inflate.h
+ * @author Max Resch
+ * @brief table driven deflate decoder (RFC 1951) with gzip framing (RFC 1952)
+ * @version 0.1
+ * @date 2021-10-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  The whole compressed input has to be in memory, the decoder only stops
+ *  when the output space runs out and continues where it stopped on the
+ *  next call. Decoding into a buffer that holds the complete content needs
+ *  no window, streams keep the last INFLATE_WINDOW_SIZE bytes of their
+ *  output in front of the free space (see src/decompress.c).
+ *
+ *  This header does not depend on the rest of the loader, so the decoder
+ *  can be compiled for the host (see tools/decompperf.c).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* matches reach back up to 32 KiB */
+#define INFLATE_WINDOW_SIZE     32768
+#define INFLATE_MAX_MATCH       258
+
+/* ID1, ID2 and CM (deflate) of a gzip member, little endian */
+#define GZIP_MAGIC              UINT32_C(0x088b1f)
+#define GZIP_MAGIC_MASK         UINT32_C(0xffffff)
+/* CRC32 and ISIZE */
+#define GZIP_TRAILER_SIZE       8
+
+/* bits resolved by the first lookup, longer codes continue in a subtable */
+#define INFLATE_LITLEN_BITS     11
+#define INFLATE_DIST_BITS       8
+
+/* every symbol with a code longer than the first lookup may open a subtable */
+#define INFLATE_LITLEN_ENTRIES  ((1 << INFLATE_LITLEN_BITS) + 286 * (1 << (15 - INFLATE_LITLEN_BITS)))
+#define INFLATE_DIST_ENTRIES    ((1 << INFLATE_DIST_BITS) + 30 * (1 << (15 - INFLATE_DIST_BITS)))
+
+enum inflate_status {
+    INFLATE_DONE,               ///< the last block is decoded
+    INFLATE_OUTPUT_FULL,        ///< more output space is needed
+    INFLATE_TRUNCATED,          ///< the input ended before the last block
+    INFLATE_CORRUPT,            ///< invalid codes, lengths or distances
+    INFLATE_CHECKSUM,           ///< CRC32 or size in the gzip trailer don't match
+    INFLATE_UNSUPPORTED,        ///< no gzip member or reserved flags set
+};
+
+/**
+ * @brief decoder state, about 43 KiB because of the tables
+ */
+struct inflate_state {
+    const uint8_t* in;          ///< next byte to load into bitbuf
+    const uint8_t* in_end;
+    uint64_t bitbuf;            ///< pending input bits, LSB first
+    uint32_t bitcnt;            ///< valid bits in bitbuf
+    uint32_t overrun;           ///< zero bytes loaded behind in_end
+    uint32_t mode;              ///< what is decoded next
+    bool final;                 ///< the current block is the last one
+    bool fixed;                 ///< the tables hold the fixed codes
+    uint32_t stored;            ///< bytes left in a stored block
+    uint32_t match_length;      ///< bytes left of an interrupted match
+    uint32_t match_distance;
+    /**
+     * @brief lookup tables indexed with the next bits of the input
+     *
+     * @details
+     *  Entries of the first litlen lookup whose code leaves enough bits
+     *  for another short literal code decode both literals at once.
+     */
+    uint32_t litlen[INFLATE_LITLEN_ENTRIES];
+    uint32_t dist[INFLATE_DIST_ENTRIES];
+};
+
+/**
+ * @brief prepare s for decoding raw deflate data
+ */
+void inflate_init(
+    struct inflate_state* s,
+    const void* in,
+    size_t in_size
+);
+
+/**
+ * @brief decode until the last block ends or *out reaches out_end
+ *
+ * @param[in] window
+ *  start of the output that matches may reference
+ * @param[in,out] out
+ *  where the next byte is written, advanced by the decoded bytes
+ *
+ * @details
+ *  Matches are copied in chunks of 16 bytes while there is space, so up to
+ *  16 bytes behind the decoded data are overwritten but never beyond
+ *  out_end.
+ */
+enum inflate_status inflate_run(
+    struct inflate_state* s,
+    uint8_t* window,
+    uint8_t** out,
+    uint8_t* out_end
+);
+
+/**
+ * @brief first byte behind the deflate data after INFLATE_DONE
+ */
+static inline
+const uint8_t* inflate_input(
+    const struct inflate_state* s
+) {
+    return s->in;
+}
+
+/**
+ * @brief CRC32 as used by gzip, initial crc is 0
+ */
+uint32_t gzip_crc32(
+    uint32_t crc,
+    const void* data,
+    size_t length
+);
+
+/**
+ * @brief parse the header of a gzip member
+ *
+ * @param[out] header_size
+ *  offset of the deflate data
+ */
+enum inflate_status gzip_header(
+    const uint8_t* in,
+    size_t in_size,
+    size_t* header_size
+);
+
+/**
+ * @brief check the trailer of a member after inflate_run returned INFLATE_DONE
+ *
+ * @param[in] crc
+ *  CRC32 of the decoded data, only compared if verify is set
+ * @param[in] size
+ *  number of decoded bytes
+ */
+enum inflate_status gzip_trailer(
+    struct inflate_state* s,
+    uint32_t crc,
+    size_t size,
+    bool verify
+);
+
+/**
+ * @brief check whether another member might follow the first one
+ *
+ * @details
+ *  Looks for bytes that could start a gzip member header anywhere behind
+ *  the first member. Without a match the input is a single member and its
+ *  size is in the trailer at the end, otherwise gzip_members has to decode
+ *  the input to find where the members end.
+ */
+bool gzip_multi_member(
+    const uint8_t* in,
+    size_t in_size
+);
+
+/**
+ * @brief decoded size of all members in in without keeping the output
+ *
+ * @param[in] buffer
+ *  decoding space, larger than INFLATE_WINDOW_SIZE
+ * @param[out] size
+ *  sum of the decoded member sizes
+ *
+ * @details
+ *  Fails if the members don't end exactly at the end of in.
+ */
+enum inflate_status gzip_members(
+    struct inflate_state* s,
+    const uint8_t* in,
+    size_t in_size,
+    uint8_t* buffer,
+    size_t buffer_size,
+    size_t* size
+);
+
+/**
+ * @brief decode all gzip members in in one after another into out
+ *
+ * @param[in] length
+ *  size of the decoded members (e.g. from ISIZE or gzip_members)
+ * @param[in] capacity
+ *  size of out, at least length, matches are copied faster with 16 bytes
+ *  of slack
+ * @param[out] consumed
+ *  size of the members including headers and trailers
+ */
+enum inflate_status gzip_decompress(
+    struct inflate_state* s,
+    const uint8_t* in,
+    size_t in_size,
+    uint8_t* out,
+    size_t length,
+    size_t capacity,
+    bool verify,
+    size_t* consumed
+);
@@ -0,0 +1,72 @@
+/**
+ * @file load_plan.h
+ * @brief precomputed steps to load the embedded kernel
+ *
+ * @details
+ *  build_image parses the PE headers of an uncompressed kernel and stores
+ *  what the loader would derive from them in the `.zlplan` section: the
+ *  copy and zero operations of the headers and sections, the base
+ *  relocation blocks and the image geometry. The loader executes the plan
+ *  in one pass and only parses the kernel if the plan doesn't belong to it.
+ *  All values are little endian.
+ *
+ *  | struct load_plan | op_count * struct load_plan_op | reloc_count * struct load_plan_reloc |
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define LOAD_PLAN_SIGNATURE     UINT32_C(0x4C504C5A)   /* ZLPL */
+#define LOAD_PLAN_VERSION       1
+#define LOAD_PLAN_SECTION       ".zlplan"
+
+/* size of the plan with ops operations and relocs relocation blocks */
+#define LOAD_PLAN_SIZE(ops, relocs) \
+    (sizeof(struct load_plan) \
+    + (uint64_t) (ops) * sizeof(struct load_plan_op) \
+    + (uint64_t) (relocs) * sizeof(struct load_plan_reloc))
+
+/**
+ * @brief copy length bytes from the file and zero the following ones
+ */
+struct load_plan_op {
+    uint32_t rva;               ///< destination in the image
+    uint32_t offset;            ///< source in the file
+    uint32_t copy_length;
+    uint32_t zero_length;
+};
+
+/**
+ * @brief a block of base relocations in the file
+ */
+struct load_plan_reloc {
+    uint32_t offset;            ///< first fixup of the block in the file
+    uint32_t rva;               ///< page the fixups are relative to
+    uint32_t count;             ///< number of 16 bit fixups
+};
+
+struct load_plan {
+    uint32_t signature;         ///< LOAD_PLAN_SIGNATURE
+    uint16_t version;           ///< LOAD_PLAN_VERSION
+    uint16_t machine;           ///< PE machine type of the kernel
+    /**
+     * @brief xxh64 of everything after this field, seeded with the xxh64 of
+     *  the first size_of_headers bytes of the kernel
+     */
+    uint64_t hash;
+    uint64_t image_base;        ///< address the kernel was linked for
+    uint32_t size_of_image;
+    uint32_t size_of_headers;
+    uint32_t section_alignment;
+    uint32_t entry_point;       ///< RVA
+    uint32_t op_count;
+    uint32_t reloc_count;
+    struct load_plan_op ops[];
+};
+
+static inline
+const struct load_plan_reloc* load_plan_relocs(
+    const struct load_plan* plan
+) {
+    return (const struct load_plan_reloc*) &plan->ops[plan->op_count];
+}
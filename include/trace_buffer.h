@@ -0,0 +1,89 @@
+/**
+ * @file trace_buffer.h
+ * @brief boot timeline recorded by the loader
+ *
+ * @details
+ *  The loader records begin, end and instant events into a fixed ring and
+ *  publishes it as the volatile EFI variable `TRACE_BUFFER_VARIABLE`
+ *  (systemd's loader vendor GUID), so it can be read from
+ *  /sys/firmware/efi/efivars after boot. Timestamps are raw values of the
+ *  CPU counter (TSC, CNTPCT), which starts at reset. All values are little
+ *  endian.
+ *
+ *  | struct trace_buffer | capacity * struct trace_event |
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define TRACE_BUFFER_SIGNATURE  UINT32_C(0x4352545A)   /* ZTRC */
+#define TRACE_BUFFER_VERSION    1
+#define TRACE_BUFFER_VARIABLE   "ZloaderTrace"
+
+/* keeps the variable below 8 KiB, the default limit in OVMF */
+#define TRACE_BUFFER_CAPACITY   256
+
+/* size of the buffer with capacity events */
+#define TRACE_BUFFER_SIZE(capacity) \
+    (sizeof(struct trace_buffer) + (capacity) * sizeof(struct trace_event))
+
+/**
+ * @brief tracepoints and their names in the timeline
+ */
+#define TRACE_IDS(X) \
+    X(LIBRARY_INIT,     "library init") \
+    X(VARIABLE_WRITE,   "SetVariable") \
+    X(LOCATE_SECTIONS,  "locate sections") \
+    X(DTB_FIXUP,        "DTB fixup") \
+    X(DECOMPRESS,       "decompress") \
+    X(DECOMPRESS_FRAME, "decompress frame") \
+    X(PE_LOAD,          "PE load") \
+    X(PE_RELOCATE,      "PE relocate") \
+    X(INITRD_LOAD,      "initrd LoadFile2") \
+    X(HANDOFF,          "kernel handoff") \
+    X(MEMORY_PEAK,      "memory peak KiB")
+
+enum trace_id {
+#define TRACE_ID(id, name) TRACE_##id,
+    TRACE_IDS(TRACE_ID)
+#undef TRACE_ID
+    _TRACE_ID_MAX
+};
+
+/**
+ * @brief series of the MEMORY_PEAK counters, the allocation tags of efilib
+ *  followed by the total
+ */
+#define TRACE_MEMORY_SERIES(X) \
+    X(OTHER,            "other") \
+    X(DECOMPRESS,       "decompress") \
+    X(PE_LOADER,        "PE loader") \
+    X(INITRD,           "initrd") \
+    X(DTB,              "DTB") \
+    X(VARS,             "vars")
+
+/* same letters as the Chrome trace event format */
+enum trace_phase {
+    TRACE_BEGIN = 'B',
+    TRACE_END = 'E',
+    TRACE_INSTANT = 'i',
+    TRACE_COUNTER = 'C',
+};
+
+struct trace_event {
+    uint64_t ticks;             ///< CPU counter
+    uint16_t id;                ///< enum trace_id
+    uint8_t phase;              ///< enum trace_phase
+    uint8_t cpu;                ///< processor (worker) index, 0 is the BSP, or the series of a counter
+    uint32_t arg;               ///< tracepoint specific, e.g. a frame number
+};
+
+struct trace_buffer {
+    uint32_t signature;         ///< TRACE_BUFFER_SIGNATURE
+    uint16_t version;           ///< TRACE_BUFFER_VERSION
+    uint16_t event_size;        ///< sizeof(struct trace_event)
+    uint64_t ticks_per_second;  ///< frequency of the CPU counter
+    uint32_t count;             ///< events recorded, the ring keeps the last capacity
+    uint32_t capacity;          ///< number of event slots
+    struct trace_event events[];
+};
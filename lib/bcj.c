@@ -0,0 +1,222 @@
+/**
+ * @file bcj.c
+ * @author Max Resch
+ * @brief branch conversion filters for executable code (xz BCJ style)
+ * @version 0.1
+ * @date 2021-10-24
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  The conversions are the ones of the xz BCJ filters, positions are the
+ *  offsets in the content.
+ *
+ *  ARM64 instructions are converted four at a time: the BL and ADRP forms
+ *  of every word are computed with vector operations and blended into the
+ *  words that match them, there are no branches per instruction. x86 code
+ *  has instructions of any length, so the filter has to look at every E8
+ *  and E9 byte in order. It skips 16 bytes at once as long as none of them
+ *  is one.
+ */
+#include <bcj.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef uint8_t v16u8_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint32_t v4u32_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint64_t v2u64_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint32_t u32u_t __attribute__((aligned(1), may_alias));
+
+#define BL_MASK         UINT32_C(0xFC000000)
+#define BL_OPCODE       UINT32_C(0x94000000)
+#define ADRP_MASK       UINT32_C(0x9F000000)
+#define ADRP_OPCODE     UINT32_C(0x90000000)
+
+/**
+ * @brief BL: 26 bit offset in words, ADRP: 21 bit offset in pages
+ *
+ * @details
+ *  Only ADRP with a target within +-512 MiB is converted, so the sign
+ *  extension of the converted offset marks it. This is the scalar version
+ *  of `arm64_words`.
+ */
+static inline
+uint32_t arm64_word(uint32_t w, uint32_t pc, bool encode) {
+    if ((w & BL_MASK) == BL_OPCODE) {
+        uint32_t delta = encode ? pc >> 2 : 0 - (pc >> 2);
+        return BL_OPCODE | ((w + delta) & 0x03FFFFFF);
+    }
+    if ((w & ADRP_MASK) == ADRP_OPCODE) {
+        uint32_t src = ((w >> 29) & 3) | ((w >> 3) & 0x001FFFFC);
+        if ((src + 0x00020000) & 0x001C0000)
+            return w;
+        uint32_t dest = src + (encode ? pc >> 12 : 0 - (pc >> 12));
+        return (w & 0x9000001F) | ((dest & 3) << 29) | ((dest & 0x0003FFFC) << 3)
+            | ((0 - (dest & 0x00020000)) & 0x00E00000);
+    }
+    return w;
+}
+
+static inline
+v4u32_t arm64_words(v4u32_t w, v4u32_t pc, bool encode) {
+    v4u32_t bl_delta = encode ? pc >> 2 : -(pc >> 2);
+    v4u32_t bl = BL_OPCODE | ((w + bl_delta) & 0x03FFFFFF);
+    v4u32_t is_bl = (v4u32_t) ((w & BL_MASK) == BL_OPCODE);
+
+    v4u32_t src = ((w >> 29) & 3) | ((w >> 3) & 0x001FFFFC);
+    v4u32_t dest = src + (encode ? pc >> 12 : -(pc >> 12));
+    v4u32_t adrp = (w & 0x9000001F) | ((dest & 3) << 29) | ((dest & 0x0003FFFC) << 3)
+        | (-(dest & 0x00020000) & 0x00E00000);
+    v4u32_t is_adrp = (v4u32_t) ((w & ADRP_MASK) == ADRP_OPCODE)
+        & (v4u32_t) (((src + 0x00020000) & 0x001C0000) == 0);
+
+    return (bl & is_bl) | (adrp & is_adrp) | (w & ~(is_bl | is_adrp));
+}
+
+/**
+ * @returns the number of converted bytes (all whole words)
+ */
+static
+size_t arm64_convert(uint8_t* data, uint64_t pos, size_t size, bool encode) {
+    size_t i = 0;
+    v4u32_t pc = (uint32_t) pos + (v4u32_t) { 0, 4, 8, 12 };
+    for (; i + 32 <= size; i += 32, pc += 32) {
+        v4u32_t a = *(v4u32_t*) (data + i), b = *(v4u32_t*) (data + i + 16);
+        *(v4u32_t*) (data + i) = arm64_words(a, pc, encode);
+        *(v4u32_t*) (data + i + 16) = arm64_words(b, pc + 16, encode);
+    }
+    for (; i + 4 <= size; i += 4) {
+        uint32_t* w = (u32u_t*) (data + i);
+        *w = arm64_word(*w, (uint32_t) (pos + i), encode);
+    }
+    return i;
+}
+
+/* the most significant byte of a displacement within +-16 MiB */
+#define X86_MS_BYTE(b) ((((b) + 1) & 0xFE) == 0)
+
+static inline
+bool x86_opcode(uint8_t b) {
+    return (b & 0xFE) == 0xE8;
+}
+
+static inline
+bool x86_any_opcode(const uint8_t* p) {
+    v2u64_t m = (v2u64_t) ((*(const v16u8_t*) p & 0xFE) == 0xE8);
+    return m[0] | m[1];
+}
+
+/**
+ * @returns the number of processed bytes, an opcode in the last 4 bytes is
+ *  processed with the next chunk
+ */
+static
+size_t x86_convert(struct bcj_state* s, uint8_t* data, uint64_t pos, size_t size, bool encode) {
+    static const bool allowed[8] = { true, true, true, false, true, false, false, false };
+    static const uint32_t bit_number[8] = { 0, 1, 2, 2, 3, 3, 3, 3 };
+
+    if (size < 5)
+        return 0;
+
+    uint32_t prev_mask = s->x86_prev_mask;
+    uint64_t prev_pos = s->x86_prev_pos;
+    size_t limit = size - 5;
+    size_t i = 0;
+    while (i <= limit) {
+        if (!x86_opcode(data[i])) {
+            i++;
+            /* most bytes are no opcode */
+            while (i + 16 <= size && !x86_any_opcode(data + i))
+                i += 16;
+            continue;
+        }
+
+        uint64_t distance = pos + i - prev_pos;
+        prev_pos = pos + i;
+        if (distance > 5) {
+            prev_mask = 0;
+        } else {
+            for (uint32_t j = 0; j < distance; j++)
+                prev_mask = (prev_mask & 0x77) << 1;
+        }
+
+        uint8_t b = data[i + 4];
+        if (!X86_MS_BYTE(b) || !allowed[(prev_mask >> 1) & 0x7] || (prev_mask >> 1) >= 0x10) {
+            i++;
+            prev_mask |= 1;
+            if (X86_MS_BYTE(b))
+                prev_mask |= 0x10;
+            continue;
+        }
+
+        uint32_t src = *(const u32u_t*) (data + i + 1);
+        uint32_t pc = (uint32_t) (pos + i + 5);
+        uint32_t dest;
+        for (;;) {
+            dest = encode ? src + pc : src - pc;
+            if (prev_mask == 0)
+                break;
+            uint32_t j = bit_number[prev_mask >> 1];
+            b = (uint8_t) (dest >> (24 - j * 8));
+            if (!X86_MS_BYTE(b))
+                break;
+            src = dest ^ ((UINT32_C(1) << (32 - j * 8)) - 1);
+        }
+        /* sign extend from bit 24 */
+        *(u32u_t*) (data + i + 1) = (dest & 0x00FFFFFF) | ((0 - ((dest >> 24) & 1)) << 24);
+        i += 5;
+        prev_mask = 0;
+    }
+
+    s->x86_prev_mask = prev_mask;
+    s->x86_prev_pos = prev_pos;
+    return MIN(i, size);
+}
+
+void bcj_init(
+    struct bcj_state* s,
+    enum bcj_filter filter,
+    uint64_t start,
+    uint64_t end
+) {
+    *s = (struct bcj_state) {
+        .filter = filter,
+        .start = start,
+        .end = end,
+        .pos = start,
+        .x86_prev_pos = start,
+    };
+}
+
+uint64_t bcj_convert(
+    struct bcj_state* s,
+    uint8_t* data,
+    uint64_t offset,
+    size_t size,
+    bool encode
+) {
+    uint64_t begin = MAX(s->pos, offset);
+    uint64_t end = MIN(offset + size, s->end);
+    if (begin >= s->end)
+        return s->pos = s->end;
+    if (begin >= end)
+        return s->pos;
+
+    size_t done;
+    switch (s->filter) {
+        case BCJ_FILTER_ARM64:
+            done = arm64_convert(data + (begin - offset), begin, end - begin, encode);
+            break;
+        case BCJ_FILTER_X86:
+            done = x86_convert(s, data + (begin - offset), begin, end - begin, encode);
+            break;
+        default:
+            done = end - begin;
+            break;
+    }
+
+    /* the last bytes of the range stay as they are */
+    s->pos = end == s->end ? s->end : begin + done;
+    return s->pos;
+}
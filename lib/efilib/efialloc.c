@@ -0,0 +1,285 @@
+/**
+ * @file efialloc.c
+ * @author Max Resch
+ * @brief page backed arena for malloc and friends
+ * @version 0.1
+ * @date 2021-09-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Every pool call walks the memory map in some firmware (U-Boot), while
+ *  the loader makes many small, short lived allocations. The arena is one
+ *  AllocatePages call: slab pages for the size classes grow from the bottom,
+ *  scratch memory from the top.
+ *
+ *  Every object starts with a header that tells free where it came from.
+ *  Slab objects are kept on a free list per size class and never returned
+ *  to the arena. The header also carries the tag the allocation is
+ *  accounted to.
+ */
+#include <efi.h>
+#include <efilib.h>
+
+/* UEFI pages are always 4 KiB */
+#define ARENA_PAGE_SIZE     0x1000
+
+/* objects including header of 32 B to 4 KiB */
+#define SLAB_MIN_SHIFT      5
+#define SLAB_CLASSES        8
+
+#define ALLOC_MAGIC_SLAB    0x534C4142  ///< "SLAB"
+#define ALLOC_MAGIC_POOL    0x504F4F4C  ///< "POOL"
+#define ALLOC_MAGIC_SCRATCH 0x53435254  ///< "SCRT"
+
+struct alloc_header {
+    uint32_t magic;
+    uint16_t size_class;
+    uint16_t tag;           ///< enum alloc_tag
+    uint64_t size;          ///< requested size
+};
+
+static_assert(sizeof(struct alloc_header) == 16, "allocations have to stay 16 byte aligned");
+
+struct free_object {
+    struct free_object* next;
+};
+
+static struct {
+    uint8_t* base;
+    size_t size;
+    size_t bottom;          ///< end of the slab pages
+    size_t top;             ///< beginning of the scratch region
+    bool initialized;
+    struct free_object* free[SLAB_CLASSES];
+} arena = { 0 };
+
+static struct alloc_stats stats = { 0 };
+static enum alloc_tag current_tag = ALLOC_TAG_OTHER;
+
+static inline
+void update_usage() {
+    stats.arena_used = arena.bottom + (arena.size - arena.top);
+    if (stats.arena_used > stats.arena_peak)
+        stats.arena_peak = stats.arena_used;
+}
+
+static inline
+void usage_add(struct alloc_usage* usage, int64_t bytes, int64_t pages) {
+    usage->bytes += bytes;
+    usage->pages += pages;
+    if (usage->bytes > usage->peak_bytes)
+        usage->peak_bytes = usage->bytes;
+    if (usage->pages > usage->peak_pages)
+        usage->peak_pages = usage->pages;
+    size_t memory = usage->bytes + usage->pages * ARENA_PAGE_SIZE;
+    if (memory > usage->peak)
+        usage->peak = memory;
+}
+
+void alloc_account(
+    enum alloc_tag tag,
+    int64_t bytes,
+    int64_t pages
+) {
+    if (tag >= _ALLOC_TAG_MAX)
+        tag = ALLOC_TAG_OTHER;
+    usage_add(&stats.tags[tag], bytes, pages);
+    usage_add(&stats.total, bytes, pages);
+}
+
+enum alloc_tag alloc_tag_enter(
+    enum alloc_tag tag
+) {
+    enum alloc_tag previous = current_tag;
+    current_tag = tag;
+    return previous;
+}
+
+enum alloc_tag alloc_tag_current(void) {
+    return current_tag;
+}
+
+void alloc_trace_usage(void) {
+    for (unsigned tag = 0; tag < _ALLOC_TAG_MAX; tag++) {
+        if (stats.tags[tag].peak)
+            trace_event(TRACE_MEMORY_PEAK, TRACE_COUNTER, tag, stats.tags[tag].peak >> 10);
+    }
+    trace_event(TRACE_MEMORY_PEAK, TRACE_COUNTER, _ALLOC_TAG_MAX, stats.total.peak >> 10);
+}
+
+static inline
+bool in_arena(const void* p) {
+    return (const uint8_t*) p >= arena.base && (const uint8_t*) p < arena.base + arena.size;
+}
+
+/**
+ * @brief allocate the arena on first use
+ */
+static
+bool arena_init() {
+    if (arena.initialized)
+        return arena.base != NULL;
+    arena.initialized = true;
+
+#if EFILIB_ARENA_PAGES > 0
+    efi_physical_address_t address;
+    stats.firmware_calls++;
+    efi_status_t err = BS->allocate_pages(EFI_ALLOCATE_ANY_PAGES, _EFI_POOL_ALLOCATION, EFILIB_ARENA_PAGES, &address);
+    if (EFI_ERROR(err)) {
+        EFILIB_DBG_MESSAGE("Could not allocate arena, using pool memory");
+        return false;
+    }
+
+    arena.base = (uint8_t*) address;
+    arena.size = EFILIB_ARENA_PAGES * ARENA_PAGE_SIZE;
+    arena.bottom = 0;
+    arena.top = arena.size;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief size class for an object of size bytes or SLAB_CLASSES if too large
+ */
+__pure
+static inline
+unsigned size_class(efi_size_t size) {
+    efi_size_t total = size + sizeof(struct alloc_header);
+    if (size > ARENA_PAGE_SIZE || total > ARENA_PAGE_SIZE)
+        return SLAB_CLASSES;
+    if (total <= (1 << SLAB_MIN_SHIFT))
+        return 0;
+    /* ceil(log2(total)) */
+    return (sizeof(unsigned long) * 8 - __builtin_clzl(total - 1)) - SLAB_MIN_SHIFT;
+}
+
+static
+struct alloc_header* slab_alloc(unsigned class) {
+    if (!arena.free[class]) {
+        /* carve a new page into objects of this class */
+        if (arena.top - arena.bottom < ARENA_PAGE_SIZE)
+            return NULL;
+        uint8_t* page = arena.base + arena.bottom;
+        arena.bottom += ARENA_PAGE_SIZE;
+        update_usage();
+
+        size_t object_size = 1 << (class + SLAB_MIN_SHIFT);
+        for (size_t offset = ARENA_PAGE_SIZE; offset >= object_size; offset -= object_size) {
+            struct free_object* object = (struct free_object*) (page + offset - object_size);
+            object->next = arena.free[class];
+            arena.free[class] = object;
+        }
+    }
+
+    struct free_object* object = arena.free[class];
+    arena.free[class] = object->next;
+    return (struct alloc_header*) object;
+}
+
+void* malloc(efi_size_t size) {
+    EFILIB_ASSERT(BS);
+
+    struct alloc_header* header = NULL;
+    unsigned class = size_class(size);
+    if (class < SLAB_CLASSES && arena_init())
+        header = slab_alloc(class);
+
+    if (header) {
+        *header = (struct alloc_header) { ALLOC_MAGIC_SLAB, class, current_tag, size };
+    } else {
+        stats.firmware_calls++;
+        void* ptr;
+        efi_status_t err = BS->allocate_pool(_EFI_POOL_ALLOCATION, size + sizeof(struct alloc_header), &ptr);
+        if (EFI_ERROR(err)) {
+            EFILIB_DBG_MESSAGE("Could not allocate pool memory");
+            return NULL;
+        }
+        header = ptr;
+        *header = (struct alloc_header) { ALLOC_MAGIC_POOL, SLAB_CLASSES, current_tag, size };
+    }
+
+    alloc_account(current_tag, size, 0);
+    stats.allocs++;
+    return header + 1;
+}
+
+void* calloc(efi_size_t num, efi_size_t size) {
+    if (size && num > (efi_size_t) -1 / size)
+        return NULL;
+
+    void* ptr = malloc(num * size);
+    if (ptr)
+        memzero(ptr, num * size);
+    return ptr;
+}
+
+void free(void* p) {
+    EFILIB_ASSERT(BS);
+    if (!p)
+        return;
+
+    struct alloc_header* header = (struct alloc_header*) p - 1;
+    if (in_arena(p)) {
+        /* scratch memory is released with its mark */
+        if (header->magic != ALLOC_MAGIC_SLAB)
+            return;
+        alloc_account(header->tag, -(int64_t) header->size, 0);
+        unsigned class = header->size_class;
+        struct free_object* object = (struct free_object*) header;
+        object->next = arena.free[class];
+        arena.free[class] = object;
+    } else if (header->magic == ALLOC_MAGIC_POOL) {
+        alloc_account(header->tag, -(int64_t) header->size, 0);
+        stats.firmware_calls++;
+        BS->free_pool(header);
+    } else {
+        /* memory allocated by the firmware is handed back as it is */
+        stats.firmware_calls++;
+        BS->free_pool(p);
+    }
+    stats.frees++;
+}
+
+scratch_mark_t scratch_mark(void) {
+    return arena_init() ? arena.top : 0;
+}
+
+void* scratch_alloc(efi_size_t size) {
+    efi_size_t total = (size + 2 * sizeof(struct alloc_header) - 1) & ~(sizeof(struct alloc_header) - 1);
+    if (!arena_init() || total < size || arena.top - arena.bottom < total)
+        return malloc(size);
+
+    arena.top -= total;
+    update_usage();
+
+    struct alloc_header* header = (struct alloc_header*) (arena.base + arena.top);
+    *header = (struct alloc_header) { ALLOC_MAGIC_SCRATCH, SLAB_CLASSES, ALLOC_TAG_OTHER, size };
+    stats.allocs++;
+    return header + 1;
+}
+
+void scratch_release(scratch_mark_t mark) {
+    if (arena.base && mark > arena.top && mark <= arena.size) {
+        arena.top = mark;
+        update_usage();
+    }
+}
+
+void alloc_get_stats(struct alloc_stats* out) {
+    *out = stats;
+}
+
+void arena_release(void) {
+    if (!arena.base)
+        return;
+
+    stats.firmware_calls++;
+    BS->free_pages((efi_physical_address_t) arena.base, arena.size / ARENA_PAGE_SIZE);
+    arena.base = NULL;
+    arena.size = arena.bottom = arena.top = 0;
+    for (unsigned i = 0; i < SLAB_CLASSES; i++)
+        arena.free[i] = NULL;
+}
@@ -2,22 +2,6 @@
 #include <efilib.h>
 #include <minmax.h>
 
-#ifdef EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL
-
-char16_t* device_path_to_string(
-    char16_t* buffer,
-    efi_device_path_t dp
-) {
-    EFILIB_ASSERT(dp);
-    char16_t* tmp = _EFI_DEVPATH_TO_TEXT->device_path_to_text(dp, true, true);
-    buffer = wcsncpy(buffer, tmp, _PRINT_ITEM_BUFFER_LEN);
-    *buffer = '\0';
-    free(tmp);
-    return buffer;
-}
-
-#else /* EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL */
-
 static inline
 char16_t* _device_path_pci(char16_t* buffer, efi_pci_device_path_t dp) {
     efi_size_t len = wsprintf(buffer, _PRINT_ITEM_BUFFER_LEN - 1, u"Pci(0x%lx,0x%x)", dp->device, dp->function);
@@ -166,7 +150,9 @@ char16_t* _device_instance_end(char16_t* buffer, efi_device_path_t dp) {
     return buffer;
 }
 
-char16_t* device_path_to_string(
+/* also the fallback for firmware without DevicePathToTextProtocol */
+static
+char16_t* _device_path_to_string(
     char16_t* buffer,
     efi_device_path_t dp
 ) {
@@ -219,4 +205,50 @@ char16_t* device_path_to_string(
     return buffer;
 }
 
+#ifdef EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL
+
+/**
+ * @brief the protocol is located on the first `%D`, many boots never need it
+ */
+static
+efi_device_path_to_text_t devpath_to_text() {
+    static efi_device_path_to_text_t protocol = NULL;
+    static bool located = false;
+
+    if (!located) {
+        located = true;
+        efi_status_t err = BS->locate_protocol(&efi_device_path_to_text_guid, NULL, (void**) &protocol);
+        if (EFI_ERROR(err)) {
+            EFILIB_DBG_PRINTF("DevicePathToTextProtocol not found: %r", err);
+            protocol = NULL;
+        }
+    }
+    return protocol;
+}
+
+char16_t* device_path_to_string(
+    char16_t* buffer,
+    efi_device_path_t dp
+) {
+    EFILIB_ASSERT(dp);
+    efi_device_path_to_text_t protocol = devpath_to_text();
+    char16_t* tmp = protocol ? protocol->device_path_to_text(dp, true, true) : NULL;
+    if (!tmp)
+        return _device_path_to_string(buffer, dp);
+
+    buffer = wcsncpy(buffer, tmp, _PRINT_ITEM_BUFFER_LEN);
+    *buffer = '\0';
+    BS->free_pool(tmp);
+    return buffer;
+}
+
+#else /* EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL */
+
+char16_t* device_path_to_string(
+    char16_t* buffer,
+    efi_device_path_t dp
+) {
+    return _device_path_to_string(buffer, dp);
+}
+
 #endif /* EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL */
@@ -5,59 +5,157 @@
 #include "efi/pe.h"
 
 efi_handle_t EFI_IMAGE = NULL;
-efi_file_handle_t EFI_ROOT = NULL;
 efi_system_table_t ST = NULL;
 efi_boot_services_table_t BS = NULL;
 efi_runtime_services_table_t RT = NULL;
+efi_simple_text_output_t CON_OUT = NULL;
 efi_memory_t _EFI_POOL_ALLOCATION = EFI_BOOT_SERVICES_DATA;
 efi_loaded_image_t EFI_LOADED_IMAGE = NULL;
 uint64_t BOOT_TIME_USECS = 0;
 
-#ifdef EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL
-efi_device_path_to_text_t _EFI_DEVPATH_TO_TEXT = NULL;
-#endif
+static uint64_t freq = 0;
+
+/* measured frequencies are kept for the following boot stages */
+#define TICKS_FREQUENCY_VARIABLE    u"EfilibTicksFrequency"
+#define TICKS_FREQUENCY_MIN         UINT64_C(1000000)
+#define TICKS_FREQUENCY_MAX         UINT64_C(100000000000)
+#define TICKS_CALIBRATION_USEC      100
+
+static inline
+bool ticks_freq_valid(uint64_t freq) {
+    return freq >= TICKS_FREQUENCY_MIN && freq <= TICKS_FREQUENCY_MAX;
+}
+
+#if defined(__x86_64__)
+static inline
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    __asm__ volatile ("cpuid"
+        : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+        : "a"(leaf), "c"(subleaf));
+}
 
 /**
- * @brief Use assembly instruction to read CPU ticks counter
+ * @brief TSC frequency reported by the processor or the hypervisor (0 if unknown)
  */
-static inline
-uint64_t ticks_read() {
-    /* x64 and some i686 may know rdtscp which could be more accurate
-       but this requires feature testing with cpu id */
-#ifdef __x86_64__
-    uint64_t a, d;
-    __asm__ volatile ("rdtsc" : "=a"(a), "=d"(d));
-    return (d << 32) | a;
-#elif defined(__i386__)
-    uint64_t val;
-    __asm__ volatile ("rdtsc" : "=A"(val));
-    return val;
-#elif defined(__aarch64__)
-    uint64_t val;
-    __asm__ volatile ("mrs %0, cntpct_el0" : "=r"(val));
-    return val;
-#else
+static
+uint64_t tsc_freq_cpuid() {
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+
+    /* TSC/crystal ratio and crystal frequency */
+    if (max_leaf >= 0x15) {
+        cpuid(0x15, 0, regs);
+        uint64_t denominator = regs[0], numerator = regs[1], crystal = regs[2];
+        /* Skylake and Kaby Lake leave out the crystal, derive it from the base frequency */
+        if (!crystal && numerator && denominator && max_leaf >= 0x16) {
+            cpuid(0x16, 0, regs);
+            crystal = (regs[0] & 0xffff) * UINT64_C(1000000) * denominator / numerator;
+        }
+        if (crystal && numerator && denominator)
+            return crystal * numerator / denominator;
+    }
+
+    /* the timing leaf of VMware, also in QEMU/KVM with vmware-cpuid-freq */
+    cpuid(1, 0, regs);
+    if (regs[2] & (UINT32_C(1) << 31)) {
+        cpuid(0x40000000, 0, regs);
+        if (regs[0] >= 0x40000010) {
+            cpuid(0x40000010, 0, regs);
+            if (regs[0])
+                return regs[0] * UINT64_C(1000);
+        }
+    }
+
+    /* the TSC of Intel processors runs at the base frequency (in MHz) */
+    if (max_leaf >= 0x16) {
+        cpuid(0x16, 0, regs);
+        if (regs[0] & 0xffff)
+            return (regs[0] & 0xffff) * UINT64_C(1000000);
+    }
     return 0;
-#endif
 }
 
-static uint64_t freq = 0;
+/**
+ * @brief measure the TSC against the counter of EFI_TIMESTAMP_PROTOCOL (0 if unavailable)
+ */
+static
+uint64_t tsc_freq_timestamp() {
+    efi_timestamp_protocol_t timestamp;
+    struct efi_timestamp_properties properties;
+    if (EFI_ERROR(BS->locate_protocol(&efi_timestamp_protocol_guid, NULL, (void**) &timestamp))
+        || EFI_ERROR(timestamp->get_properties(&properties))
+        || !properties.frequency || !properties.end_value)
+        return 0;
+
+    /* the counter counts from 0 to end_value, which is 2^n - 1 */
+    uint64_t wait = properties.frequency * TICKS_CALIBRATION_USEC / UINT64_C(1000000);
+    uint64_t start = timestamp->get_timestamp();
+    uint64_t ticks_start = ticks_read();
+    uint64_t elapsed, ticks;
+    do {
+        elapsed = (timestamp->get_timestamp() - start) & properties.end_value;
+        ticks = ticks_read() - ticks_start;
+    } while (elapsed < wait && ticks < UINT32_MAX);
+
+    return elapsed ? ticks * properties.frequency / elapsed : 0;
+}
+
+/**
+ * @brief frequency stored by a previous boot stage (0 if there is none)
+ */
+static
+uint64_t ticks_freq_cached() {
+    uint64_t value;
+    efi_size_t size = sizeof(value);
+    if (EFI_ERROR(RT->get_variable(TICKS_FREQUENCY_VARIABLE, &efilib_vendor_guid, NULL, &size, &value))
+        || size != sizeof(value))
+        return 0;
+    return value;
+}
+#endif
 
 /**
- * @brief measure 1ms in cpu ticks
+ * @brief frequency of the cpu ticks counter in Hz
+ *
+ * @details
+ *  On x86_64 the sources are tried from the cheapest to the most expensive:
+ *  CPUID, the variable of a previous stage, EFI_TIMESTAMP_PROTOCOL and as
+ *  last resort counting the ticks during a 500 us stall.
  */
 static inline
 uint64_t ticks_freq() {
     uint64_t freq;
+    [[ maybe_unused ]] const char8_t* source;
 #if defined(__aarch64__)
     __asm__ volatile ("mrs %0, cntfrq_el0": "=r"(freq));
+    source = "CNTFRQ";
 #else
-    uint64_t ticks_start;
-    ticks_start = ticks_read();
-    stall(500);
-    freq = (ticks_read() - ticks_start) / UINT64_C(500);
+    bool measured = false;
+    freq = tsc_freq_cpuid();
+    source = "CPUID";
+    if (!ticks_freq_valid(freq)) {
+        freq = ticks_freq_cached();
+        source = "variable";
+    }
+    if (!ticks_freq_valid(freq)) {
+        freq = tsc_freq_timestamp();
+        source = "TimestampProtocol";
+        measured = true;
+    }
+    if (!ticks_freq_valid(freq)) {
+        uint64_t ticks_start;
+        ticks_start = ticks_read();
+        stall(500);
+        freq = (ticks_read() - ticks_start) * UINT64_C(2000);
+        source = "Stall";
+    }
+    if (measured)
+        RT->set_variable(TICKS_FREQUENCY_VARIABLE, &efilib_vendor_guid,
+            EFI_VARIABLE_BOOTSERVICE_ACCESS, sizeof(freq), &freq);
 #endif
-    EFILIB_DBG_PRINTF("boottime: %.4fms counter freq: %lu", UINT64_C(1000) * BOOT_TIME_USECS / (double) freq, freq);
+    EFILIB_DBG_PRINTF("boottime: %.4fms counter freq: %lu (%s)",
+        UINT64_C(1000) * BOOT_TIME_USECS / (double) freq, freq, source);
     return freq;
 }
 
@@ -80,11 +178,15 @@ void initialize_library(
     efi_system_table_t system_table
 ) {
     BOOT_TIME_USECS = ticks_read();
+    trace_event_at(BOOT_TIME_USECS, TRACE_LIBRARY_INIT, TRACE_BEGIN, 0, 0);
     EFI_IMAGE = image;
 
+    mem_detect_features();
+
     ST = system_table;
     BS = system_table->boot_services;
     RT = system_table->runtime_services;
+    CON_OUT = system_table->out;
 
     EFILIB_DBG_PRINTF("%ls %hX.%hX UEFI %hu.%hu",
         ST->firmware_vendor,
@@ -105,7 +207,7 @@ void initialize_library(
         ST->out->mode->cursor_column, ST->out->mode->cursor_row );
 
     freq = ticks_freq();
-    BOOT_TIME_USECS = UINT64_C(1000000) * BOOT_TIME_USECS / freq;
+    BOOT_TIME_USECS = ticks_to_usec(BOOT_TIME_USECS);
 
     if (!EFI_IMAGE) {
         EFILIB_ERROR("EFI_IMAGE_HANDLE was empty");
@@ -133,27 +235,34 @@ void initialize_library(
         exit(EFI_INCOMPATIBLE_VERSION);
     }
 
+    /* the file system and DevicePathToTextProtocol are resolved on first use */
+    EFILIB_DBG_MESSAGE("Initalization Done");
+    trace_end(LIBRARY_INIT, 0);
+}
+
+efi_file_handle_t lib_get_root(void) {
+    static efi_file_handle_t root = NULL;
+    static bool opened = false;
+
+    /* opening the volume can mean disk and FAT I/O, only do it once */
+    if (opened)
+        return root;
+    opened = true;
+
     efi_simple_file_system_protocol_t fs;
-    err = BS->open_protocol(
+    efi_status_t err = BS->open_protocol(
         EFI_LOADED_IMAGE->device_handle, &efi_simple_fs_protocol_guid, (efi_handle_t*) &fs,
         EFI_IMAGE, NULL, EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
     if (EFI_ERROR(err)) {
-        EFILIB_ERROR("Could not get SimpleFileSystemProtocol");
-        exit(EFI_INCOMPATIBLE_VERSION);
-    } else {
-        err = fs->open_volume(fs, &EFI_ROOT);
-        if (EFI_ERROR(err)) {
-            EFILIB_ERROR("Could not open root directoy");
-            exit(err);
-        }
+        EFILIB_DBG_PRINTF("Could not get SimpleFileSystemProtocol: %r", err);
+        return NULL;
     }
-
-#ifdef EFILIB_USE_DEVICE_PATH_TO_TEXT_PROTOCOL
-    err = lib_get_protocol_interface(&efi_device_path_to_text_guid, NULL, (void**) &_EFI_DEVPATH_TO_TEXT);
-    if (EFI_ERROR(err))
-        EFILIB_ERROR("DevicePathToTextProtocol not found");
-#endif
-    EFILIB_DBG_MESSAGE("Initalization Done");
+    err = fs->open_volume(fs, &root);
+    if (EFI_ERROR(err)) {
+        EFILIB_ERROR("Could not open root directoy");
+        root = NULL;
+    }
+    return root;
 }
 
 efi_file_info_t lib_get_file_info(efi_file_handle_t handle) {
@@ -230,6 +339,26 @@ efi_status_t lib_get_protocol_interface(
     return EFI_SUCCESS;
 }
 
+void* lib_get_configuration_table(
+    efi_guid_t guid
+) {
+    for (efi_size_t i = 0; i < ST->number_of_table_entries; i++) {
+        if (guidcmp(&ST->configuration_table[i].vendor_guid, guid))
+            return ST->configuration_table[i].vendor_table;
+    }
+    return NULL;
+}
+
+uint64_t ticks_to_usec(
+    uint64_t ticks
+) {
+    if (freq == 0)
+        __unlikely__ return 0;
+
+    /* split to not overflow after a few hours of uptime */
+    return ticks / freq * UINT64_C(1000000) + ticks % freq * UINT64_C(1000000) / freq;
+}
+
 uint64_t monotonic_time_usec() {
     uint64_t ticks;
 
@@ -237,8 +366,9 @@ uint64_t monotonic_time_usec() {
     if (ticks == 0)
         __unlikely__ return 0;
 
-    if (freq == 0)
-        __unlikely__ return 0;
+    return ticks_to_usec(ticks);
+}
 
-    return UINT64_C(1000000) * ticks / freq;
+uint64_t ticks_frequency(void) {
+    return freq;
 }
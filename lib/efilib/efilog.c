@@ -0,0 +1,317 @@
+/**
+ * @file efilog.c
+ * @author Max Resch
+ * @brief deferred console messages
+ * @version 0.1
+ * @date 2021-09-26
+ *
+ * @copyright Copyright (c) 2021
+ */
+#include <efi.h>
+#include <efilib.h>
+#include <stdarg.h>
+
+#include <minmax.h>
+
+#define LOG_WORDS       12
+#define LOG_DATA_SIZE   320     /* enough for a line of PMU counters */
+#define LOG_LINE_LEN    _PRINT_STRING_LEN
+
+struct log_record {
+    uint64_t ticks;
+    const char16_t* fmt;
+    uint64_t words[LOG_WORDS];      ///< arguments in the order of fmt
+    uint8_t data[LOG_DATA_SIZE];    ///< copies of what pointer arguments point to
+};
+
+static struct {
+    uint32_t count;                 ///< records written
+    uint32_t printed;               ///< records printed by log_flush
+    struct log_record records[LOG_RING_ENTRIES];
+} log_ring = { 0 };
+
+struct log_data {
+    uint8_t* pos;
+    uint8_t* end;
+};
+
+/* keep the original pointer if the data area is full */
+static
+uint64_t log_copy(
+    struct log_data* data,
+    const void* p,
+    efi_size_t size,
+    efi_size_t align
+) {
+    uint8_t* dst = (uint8_t*) (((uintptr_t) data->pos + align - 1) & ~(align - 1));
+    if (!p || dst > data->end || size > (efi_size_t) (data->end - dst))
+        return (uintptr_t) p;
+
+    memcpy(dst, p, size);
+    data->pos = dst + size;
+    return (uintptr_t) dst;
+}
+
+/* strings are cut to the space left, but always terminated */
+static
+uint64_t log_copy_string(
+    struct log_data* data,
+    const void* p,
+    efi_size_t length,
+    efi_size_t char_size
+) {
+    uint8_t* dst = (uint8_t*) (((uintptr_t) data->pos + char_size - 1) & ~(char_size - 1));
+    if (!p || dst > data->end || (efi_size_t) (data->end - dst) < char_size)
+        return (uintptr_t) p;
+
+    length = MIN(length, (efi_size_t) (data->end - dst) / char_size - 1);
+    memcpy(dst, p, length * char_size);
+    memset(dst + length * char_size, 0, char_size);
+    data->pos = dst + (length + 1) * char_size;
+    return (uintptr_t) dst;
+}
+
+static
+efi_size_t device_path_size(
+    efi_device_path_t dp
+) {
+    efi_size_t size = 0;
+    for (;; dp = NextDevicePathNode(dp)) {
+        if (dp->length < sizeof(struct efi_device_path_protocol))
+            return 0;
+        size += dp->length;
+        if (IsDevicePathEndNode(dp))
+            return size;
+        if (size > LOG_DATA_SIZE)
+            return 0;
+    }
+}
+
+void log_write(
+    const char16_t* fmt,
+    ...
+) {
+    struct log_record* record = &log_ring.records[log_ring.count++ % LOG_RING_ENTRIES];
+    struct log_data data = { record->data, record->data + LOG_DATA_SIZE };
+    efi_size_t n = 0;
+
+    record->ticks = ticks_read();
+    record->fmt = fmt;
+
+    va_list args;
+    va_start(args, fmt);
+
+    /* same parser as _print, but only to know the type of each argument */
+    for (const char16_t* p = fmt; *p; p++) {
+        if (*p != '%')
+            continue;
+
+        bool is_long = false, is_short = false, precision = false;
+        efi_size_t field_width = (efi_size_t) -1;
+        bool done = false;
+
+        while (!done && *++p) {
+            uint64_t word;
+
+            switch (*p) {
+                case '.':
+                    precision = true;
+                    continue;
+
+                case '1' ... '9':
+                    if (precision)
+                        field_width = 0;
+                    for (; *p >= '0' && *p <= '9'; p++) {
+                        if (precision)
+                            field_width = field_width * 10 + *p - '0';
+                    }
+                    p--;
+                    continue;
+
+                case '*':
+                    word = va_arg(args, efi_size_t);
+                    if (precision)
+                        field_width = word;
+                    break;
+
+                case 'h':
+                    is_short = true;
+                    continue;
+
+                case 'l':
+                    is_long = true;
+                    continue;
+
+                case 'z':
+                    is_long = sizeof(efi_size_t) == 8;
+                    continue;
+
+                case '0':
+                case '-':
+                case 'n':
+                case 'b':
+                case 'e':
+                    continue;
+
+                case 's':
+                    done = true;
+                    if (is_long) {
+                        const char16_t* s = va_arg(args, char16_t*);
+                        word = log_copy_string(&data, s, s ? MIN(wcslen(s), field_width) : 0, sizeof(char16_t));
+                    } else {
+                        const char8_t* s = va_arg(args, char8_t*);
+                        word = log_copy_string(&data, s, s ? MIN(strlen((const char*) s), field_width) : 0, sizeof(char8_t));
+                    }
+                    break;
+
+                case 'c':
+                    done = true;
+                    word = va_arg(args, efi_size_t);
+                    break;
+
+                case 'p':
+                case 'X':
+                case 'x':
+                    done = true;
+                    word = is_long && !is_short ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+                    break;
+
+                case 'd':
+                case 'i':
+                case 'u':
+                    done = true;
+                    word = is_short ? (uint64_t) va_arg(args, int) :
+                        is_long ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+                    break;
+
+                case 'D': {
+                    done = true;
+                    efi_device_path_t dp = va_arg(args, efi_device_path_t);
+                    word = log_copy(&data, dp, dp ? device_path_size(dp) : 0, 1);
+                    break;
+                }
+
+                case 'g':
+                    done = true;
+                    word = log_copy(&data, va_arg(args, efi_guid_t), sizeof(struct efi_guid), 4);
+                    break;
+
+#if EFILIB_FLOATING_POINT
+                case 'f': {
+                    done = true;
+                    double value = va_arg(args, double);
+                    memcpy(&word, &value, sizeof(word));
+                    break;
+                }
+#endif
+
+                case 't':
+                    done = true;
+                    word = log_copy(&data, va_arg(args, efi_time_t), sizeof(struct efi_time), 4);
+                    break;
+
+                case 'r':
+                    done = true;
+                    word = va_arg(args, efi_status_t);
+                    break;
+
+                case 'T':
+                case 'A':
+                    done = true;
+                    word = va_arg(args, uint32_t);
+                    break;
+
+                default:
+                    /* %, N, B, E and unknown formats take no argument */
+                    done = true;
+                    continue;
+            }
+
+            if (n == LOG_WORDS) {
+                /* print the format itself instead of garbage */
+                record->fmt = u"%ls";
+                record->words[0] = (uintptr_t) fmt;
+                va_end(args);
+                return;
+            }
+            record->words[n++] = word;
+        }
+
+        if (!*p)
+            break;
+    }
+
+    va_end(args);
+}
+
+static
+efi_size_t log_stamp(
+    char16_t* str,
+    efi_size_t maxlen,
+    const struct log_record* record
+) {
+    uint64_t usec = ticks_to_usec(record->ticks);
+    return wsprintf(str, maxlen, u"[%lu.%06lu] ", usec / 1000000, usec % 1000000);
+}
+
+/* oldest record still in the ring */
+static
+uint32_t log_first(
+    uint32_t from
+) {
+    return log_ring.count - from > LOG_RING_ENTRIES
+        ? log_ring.count - LOG_RING_ENTRIES
+        : from;
+}
+
+void log_flush(void) {
+    if (!CON_OUT)
+        return;
+
+    uint32_t first = log_first(log_ring.printed);
+    if (first != log_ring.printed)
+        wprintf(u"LOG: %u messages were dropped\n", first - log_ring.printed);
+
+    char16_t stamp[24];
+    for (uint32_t i = first; i < log_ring.count; i++) {
+        const struct log_record* record = &log_ring.records[i % LOG_RING_ENTRIES];
+        log_stamp(stamp, sizeof(stamp) / sizeof(char16_t), record);
+        print(stamp);
+        _iprint_words(CON_OUT, record->fmt, record->words);
+    }
+    log_ring.printed = log_ring.count;
+}
+
+efi_status_t log_publish(
+    const efi_guid_t guid
+) {
+    EFILIB_ASSERT(RT);
+
+    static char8_t text[LOG_PUBLISH_SIZE];
+    char16_t line[LOG_LINE_LEN];
+    efi_size_t size = 0;
+
+    for (uint32_t i = log_first(0); i < log_ring.count; i++) {
+        const struct log_record* record = &log_ring.records[i % LOG_RING_ENTRIES];
+        efi_size_t length = log_stamp(line, LOG_LINE_LEN, record);
+        length += swprint_words(line + length, LOG_LINE_LEN - length, record->fmt, record->words);
+        length = MIN(length, LOG_LINE_LEN - 1);
+
+        /* drop the oldest lines to keep the newest ones */
+        if (size + length > sizeof(text)) {
+            efi_size_t drop = size + length - sizeof(text);
+            while (drop < size && text[drop - 1] != '\n')
+                drop++;
+            memmove(text, text + drop, size - drop);
+            size -= drop;
+        }
+
+        for (efi_size_t c = 0; c < length; c++)
+            text[size++] = line[c] < 0x80 ? (char8_t) line[c] : '?';
+    }
+
+    /* not efi_var_set, that records a trace event for every call */
+    return RT->set_variable(_u(LOG_VARIABLE), guid,
+        EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+        size, text);
+}
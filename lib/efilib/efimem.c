@@ -0,0 +1,560 @@
+/**
+ * @file efimem.c
+ * @author Max Resch
+ * @brief memory copy and fill engine
+ * @version 0.1
+ * @date 2021-09-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Copies are split in size tiers:
+ *   * up to 64 bytes: a few (overlapping) scalar or vector loads, all loads
+ *     are issued before the first store, so this is safe for memmove
+ *   * larger: vector loop with aligned stores, first and last block are
+ *     loaded up front and stored at the end to cover the unaligned edges.
+ *     On x86_64 `rep movsb` is used instead when the CPU has ERMS, and
+ *     32 byte vectors when it has AVX2.
+ *   * from `mem_nontemporal_threshold` on: streaming stores, which don't
+ *     pollute the cache with data that will not be read again soon
+ *
+ *  Overlapping moves copy backwards without a temporary buffer.
+ *
+ *  Fills use the same tiers with stores only (`rep stosb` for ERMS). Zeroing
+ *  large ranges on AArch64 uses `DC ZVA`, which clears a whole block of
+ *  cache lines per instruction without reading them first.
+ *
+ *  The file only depends on compiler headers, so it can be built for the
+ *  host as well (tools/memperf.c).
+ */
+#include <efilib/mem.h>
+#include <stdbool.h>
+
+#ifndef __has_builtin
+#  define __has_builtin(x) 0
+#endif
+
+#ifndef EFILIB_MEM_NONTEMPORAL_THRESHOLD
+/* larger copies can't stay in the last level cache anyway */
+#  define EFILIB_MEM_NONTEMPORAL_THRESHOLD (UINT64_C(4) << 20)
+#endif
+
+/* below this size the startup cost of `rep movsb` is too high */
+#define MEM_ERMS_THRESHOLD 2048
+
+/* zeroing with DC ZVA only pays off for a few blocks */
+#define MEM_ZVA_THRESHOLD 256
+
+uint32_t mem_features = 0;
+size_t mem_nontemporal_threshold = EFILIB_MEM_NONTEMPORAL_THRESHOLD;
+
+#ifdef __aarch64__
+/* bytes cleared by one DC ZVA instruction */
+static size_t zva_size = 0;
+#endif
+
+typedef uint8_t v16_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint8_t v16a_t __attribute__((vector_size(16), may_alias));
+typedef uint64_t v2u64_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint64_t u64u_t __attribute__((aligned(1), may_alias));
+typedef uint32_t u32u_t __attribute__((aligned(1), may_alias));
+typedef uint16_t u16u_t __attribute__((aligned(1), may_alias));
+
+#define load16(p)       (*(const v16_t*) (p))
+#define store16(p, v)   (*(v16_t*) (p) = (v))
+#define store16a(p, v)  (*(v16a_t*) (p) = (v16a_t) (v))
+
+/**
+ * @brief store bypassing the cache, p has to be aligned
+ */
+static inline
+void stream16(void* p, v16_t v) {
+#if __has_builtin(__builtin_nontemporal_store)
+    __builtin_nontemporal_store((v16a_t) v, (v16a_t*) p);
+#elif defined(__x86_64__)
+    __asm__ ("movntdq %1, %0" : "=m"(*(v16a_t*) p) : "x"(v));
+#else
+    store16a(p, v);
+#endif
+}
+
+/**
+ * @brief order streaming stores before following stores
+ */
+static inline
+void stream_fence(void) {
+#if defined(__x86_64__)
+    __asm__ volatile ("sfence" ::: "memory");
+#elif defined(__aarch64__)
+    __asm__ volatile ("dmb ishst" ::: "memory");
+#endif
+}
+
+/**
+ * @brief copy up to 64 bytes, safe for overlapping regions
+ */
+static inline
+void copy_small(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n >= 32) {
+        v16_t a = load16(s), b = load16(s + 16);
+        v16_t c = load16(s + n - 32), e = load16(s + n - 16);
+        store16(d, a); store16(d + 16, b);
+        store16(d + n - 32, c); store16(d + n - 16, e);
+    } else if (n >= 16) {
+        v16_t a = load16(s), b = load16(s + n - 16);
+        store16(d, a); store16(d + n - 16, b);
+    } else if (n >= 8) {
+        uint64_t a = *(const u64u_t*) s, b = *(const u64u_t*) (s + n - 8);
+        *(u64u_t*) d = a; *(u64u_t*) (d + n - 8) = b;
+    } else if (n >= 4) {
+        uint32_t a = *(const u32u_t*) s, b = *(const u32u_t*) (s + n - 4);
+        *(u32u_t*) d = a; *(u32u_t*) (d + n - 4) = b;
+    } else if (n >= 2) {
+        uint16_t a = *(const u16u_t*) s, b = *(const u16u_t*) (s + n - 2);
+        *(u16u_t*) d = a; *(u16u_t*) (d + n - 2) = b;
+    } else if (n) {
+        *d = *s;
+    }
+}
+
+/**
+ * @brief copy more than 64 bytes in ascending order, safe if d < s
+ */
+static inline
+void copy_forward(uint8_t* d, const uint8_t* s, size_t n, bool nontemporal) {
+    v16_t head = load16(s);
+    v16_t t0 = load16(s + n - 64), t1 = load16(s + n - 48);
+    v16_t t2 = load16(s + n - 32), t3 = load16(s + n - 16);
+
+    size_t skew = 16 - ((uintptr_t) d & 15);
+    uint8_t* dp = d + skew;
+    const uint8_t* sp = s + skew;
+    size_t rem = n - skew;
+
+    if (nontemporal) {
+        for (; rem > 64; rem -= 64, dp += 64, sp += 64) {
+            v16_t a = load16(sp), b = load16(sp + 16), c = load16(sp + 32), e = load16(sp + 48);
+            stream16(dp, a); stream16(dp + 16, b); stream16(dp + 32, c); stream16(dp + 48, e);
+        }
+        stream_fence();
+    } else {
+        for (; rem > 64; rem -= 64, dp += 64, sp += 64) {
+            v16_t a = load16(sp), b = load16(sp + 16), c = load16(sp + 32), e = load16(sp + 48);
+            store16a(dp, a); store16a(dp + 16, b); store16a(dp + 32, c); store16a(dp + 48, e);
+        }
+    }
+
+    store16(d + n - 64, t0); store16(d + n - 48, t1);
+    store16(d + n - 32, t2); store16(d + n - 16, t3);
+    store16(d, head);
+}
+
+/**
+ * @brief copy more than 64 bytes in descending order, safe if d > s
+ */
+static inline
+void copy_backward(uint8_t* d, const uint8_t* s, size_t n) {
+    v16_t h0 = load16(s), h1 = load16(s + 16), h2 = load16(s + 32), h3 = load16(s + 48);
+    v16_t tail = load16(s + n - 16);
+
+    size_t skew = (uintptr_t) (d + n) & 15;
+    if (!skew)
+        skew = 16;
+    uint8_t* dp = d + n - skew;
+    const uint8_t* sp = s + n - skew;
+    size_t rem = n - skew;
+
+    for (; rem > 64; rem -= 64) {
+        dp -= 64; sp -= 64;
+        v16_t a = load16(sp), b = load16(sp + 16), c = load16(sp + 32), e = load16(sp + 48);
+        store16a(dp, a); store16a(dp + 16, b); store16a(dp + 32, c); store16a(dp + 48, e);
+    }
+
+    store16(d + n - 16, tail);
+    store16(d, h0); store16(d + 16, h1); store16(d + 32, h2); store16(d + 48, h3);
+}
+
+/**
+ * @brief fill up to 64 bytes
+ */
+static inline
+void fill_small(uint8_t* d, uint8_t value, size_t n) {
+    if (n >= 16) {
+        v16_t v = (v16_t) {} + value;
+        store16(d, v); store16(d + n - 16, v);
+        if (n > 32) {
+            store16(d + 16, v); store16(d + n - 32, v);
+        }
+    } else if (n >= 8) {
+        uint64_t v = UINT64_C(0x0101010101010101) * value;
+        *(u64u_t*) d = v; *(u64u_t*) (d + n - 8) = v;
+    } else if (n >= 4) {
+        uint32_t v = UINT32_C(0x01010101) * value;
+        *(u32u_t*) d = v; *(u32u_t*) (d + n - 4) = v;
+    } else if (n >= 2) {
+        uint16_t v = UINT16_C(0x0101) * value;
+        *(u16u_t*) d = v; *(u16u_t*) (d + n - 2) = v;
+    } else if (n) {
+        *d = value;
+    }
+}
+
+/**
+ * @brief fill more than 64 bytes
+ */
+static inline
+void fill_forward(uint8_t* d, uint8_t value, size_t n, bool nontemporal) {
+    v16_t v = (v16_t) {} + value;
+    uint8_t* end = d + n;
+
+    store16(d, v);
+    uint8_t* dp = d + 16 - ((uintptr_t) d & 15);
+
+    if (nontemporal) {
+        for (; end - dp > 64; dp += 64) {
+            stream16(dp, v); stream16(dp + 16, v); stream16(dp + 32, v); stream16(dp + 48, v);
+        }
+        stream_fence();
+    } else {
+        for (; end - dp > 64; dp += 64) {
+            store16a(dp, v); store16a(dp + 16, v); store16a(dp + 32, v); store16a(dp + 48, v);
+        }
+    }
+
+    store16(end - 64, v); store16(end - 48, v);
+    store16(end - 32, v); store16(end - 16, v);
+}
+
+#ifdef __aarch64__
+/**
+ * @brief zero more than MEM_ZVA_THRESHOLD bytes with DC ZVA
+ */
+static inline
+void zero_zva(uint8_t* d, size_t n) {
+    uint8_t* end = d + n;
+    uint8_t* block = (uint8_t*) (((uintptr_t) d + zva_size - 1) & ~(uintptr_t) (zva_size - 1));
+    uint8_t* block_end = (uint8_t*) ((uintptr_t) end & ~(uintptr_t) (zva_size - 1));
+
+    /* unaligned head and tail with vector stores, zva_size is at least 64 */
+    if (block > d)
+        fill_forward(d, 0, zva_size, false);
+    for (; block < block_end; block += zva_size)
+        __asm__ volatile ("dc zva, %0" :: "r"(block) : "memory");
+    if (end > block_end)
+        fill_forward(end - zva_size, 0, zva_size, false);
+}
+#endif
+
+#ifdef __x86_64__
+typedef uint8_t v32_t __attribute__((vector_size(32), aligned(1), may_alias));
+typedef uint8_t v32a_t __attribute__((vector_size(32), may_alias));
+
+#define load32(p)       (*(const v32_t*) (p))
+#define store32(p, v)   (*(v32_t*) (p) = (v))
+#define store32a(p, v)  (*(v32a_t*) (p) = (v32a_t) (v))
+
+[[ gnu::target("avx2") ]]
+static inline
+void stream32(void* p, v32_t v) {
+#if __has_builtin(__builtin_nontemporal_store)
+    __builtin_nontemporal_store((v32a_t) v, (v32a_t*) p);
+#else
+    __asm__ ("vmovntdq %1, %0" : "=m"(*(v32a_t*) p) : "x"(v));
+#endif
+}
+
+/**
+ * @brief AVX2 version of `copy_forward` for more than 128 bytes
+ */
+[[ gnu::target("avx2") ]]
+static
+void copy_forward_avx2(uint8_t* d, const uint8_t* s, size_t n, bool nontemporal) {
+    v32_t head = load32(s);
+    v32_t t0 = load32(s + n - 128), t1 = load32(s + n - 96);
+    v32_t t2 = load32(s + n - 64), t3 = load32(s + n - 32);
+
+    size_t skew = 32 - ((uintptr_t) d & 31);
+    uint8_t* dp = d + skew;
+    const uint8_t* sp = s + skew;
+    size_t rem = n - skew;
+
+    if (nontemporal) {
+        for (; rem > 128; rem -= 128, dp += 128, sp += 128) {
+            v32_t a = load32(sp), b = load32(sp + 32), c = load32(sp + 64), e = load32(sp + 96);
+            stream32(dp, a); stream32(dp + 32, b); stream32(dp + 64, c); stream32(dp + 96, e);
+        }
+        stream_fence();
+    } else {
+        for (; rem > 128; rem -= 128, dp += 128, sp += 128) {
+            v32_t a = load32(sp), b = load32(sp + 32), c = load32(sp + 64), e = load32(sp + 96);
+            store32a(dp, a); store32a(dp + 32, b); store32a(dp + 64, c); store32a(dp + 96, e);
+        }
+    }
+
+    store32(d + n - 128, t0); store32(d + n - 96, t1);
+    store32(d + n - 64, t2); store32(d + n - 32, t3);
+    store32(d, head);
+}
+
+/**
+ * @brief AVX2 version of `copy_backward` for more than 128 bytes
+ */
+[[ gnu::target("avx2") ]]
+static
+void copy_backward_avx2(uint8_t* d, const uint8_t* s, size_t n) {
+    v32_t h0 = load32(s), h1 = load32(s + 32), h2 = load32(s + 64), h3 = load32(s + 96);
+    v32_t tail = load32(s + n - 32);
+
+    size_t skew = (uintptr_t) (d + n) & 31;
+    if (!skew)
+        skew = 32;
+    uint8_t* dp = d + n - skew;
+    const uint8_t* sp = s + n - skew;
+    size_t rem = n - skew;
+
+    for (; rem > 128; rem -= 128) {
+        dp -= 128; sp -= 128;
+        v32_t a = load32(sp), b = load32(sp + 32), c = load32(sp + 64), e = load32(sp + 96);
+        store32a(dp, a); store32a(dp + 32, b); store32a(dp + 64, c); store32a(dp + 96, e);
+    }
+
+    store32(d + n - 32, tail);
+    store32(d, h0); store32(d + 32, h1); store32(d + 64, h2); store32(d + 96, h3);
+}
+
+/**
+ * @brief AVX2 version of `fill_forward` for more than 128 bytes
+ */
+[[ gnu::target("avx2") ]]
+static
+void fill_forward_avx2(uint8_t* d, uint8_t value, size_t n, bool nontemporal) {
+    v32_t v = (v32_t) {} + value;
+    uint8_t* end = d + n;
+
+    store32(d, v);
+    uint8_t* dp = d + 32 - ((uintptr_t) d & 31);
+
+    if (nontemporal) {
+        for (; end - dp > 128; dp += 128) {
+            stream32(dp, v); stream32(dp + 32, v); stream32(dp + 64, v); stream32(dp + 96, v);
+        }
+        stream_fence();
+    } else {
+        for (; end - dp > 128; dp += 128) {
+            store32a(dp, v); store32a(dp + 32, v); store32a(dp + 64, v); store32a(dp + 96, v);
+        }
+    }
+
+    store32(end - 128, v); store32(end - 96, v);
+    store32(end - 64, v); store32(end - 32, v);
+}
+
+static inline
+void fill_erms(uint8_t* d, uint8_t value, size_t n) {
+    __asm__ volatile ("rep stosb" : "+D"(d), "+c"(n) : "a"(value) : "memory");
+}
+
+static inline
+void copy_erms(uint8_t* d, const uint8_t* s, size_t n) {
+    __asm__ volatile ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) :: "memory");
+}
+
+static inline
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    __asm__ volatile ("cpuid"
+        : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+        : "a"(leaf), "c"(subleaf));
+}
+
+static inline
+uint64_t xgetbv(uint32_t index) {
+    uint32_t lo, hi;
+    __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return (uint64_t) hi << 32 | lo;
+}
+#endif /* __x86_64__ */
+
+#ifdef __aarch64__
+/* DZP set means DC ZVA is prohibited, BS is log2 of the block size in words */
+static inline
+size_t zva_block_size() {
+    uint64_t dczid;
+    __asm__ volatile ("mrs %0, dczid_el0" : "=r"(dczid));
+    size_t size = UINT64_C(4) << (dczid & 0xf);
+    if ((dczid & (1 << 4)) || size < 64 || size > MEM_ZVA_THRESHOLD / 2)
+        return 0;
+    return size;
+}
+#endif
+
+uint32_t mem_cpu_features(void) {
+    uint32_t features = 0;
+#if defined(__x86_64__)
+    uint32_t regs[4];
+    features |= MEM_FEATURE_NONTEMPORAL;
+
+    cpuid(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+
+    /* AVX state has to be enabled by the firmware (OSXSAVE + XCR0) */
+    cpuid(1, 0, regs);
+    bool avx = (regs[2] & (1u << 27)) && (regs[2] & (1u << 28))
+        && (xgetbv(0) & 0x6) == 0x6;
+
+    if (max_leaf >= 7) {
+        cpuid(7, 0, regs);
+        if (avx && (regs[1] & (1u << 5)))
+            features |= MEM_FEATURE_AVX2;
+        if (regs[1] & (1u << 9))
+            features |= MEM_FEATURE_ERMS;
+    }
+#elif defined(__aarch64__)
+    /* NEON is mandatory, STNP is part of the base instruction set */
+    features |= MEM_FEATURE_NONTEMPORAL;
+
+    /* all processors have to agree on the block size */
+    size_t size = zva_block_size();
+    if (size && (!zva_size || size == zva_size))
+        features |= MEM_FEATURE_DCZVA;
+#endif
+    return features;
+}
+
+uint32_t mem_detect_features(void) {
+#ifdef __aarch64__
+    zva_size = zva_block_size();
+#endif
+    mem_features = mem_cpu_features();
+    return mem_features;
+}
+
+/**
+ * @brief copy more than 64 bytes in ascending order
+ *
+ * @param overlap
+ *  the regions overlap (d < s), streaming stores and `rep movsb` are
+ *  only used for disjoint regions
+ */
+static inline
+void copy_large_forward(uint8_t* d, const uint8_t* s, size_t n, bool overlap) {
+    bool nontemporal = !overlap && n >= mem_nontemporal_threshold
+        && (mem_features & MEM_FEATURE_NONTEMPORAL);
+#ifdef __x86_64__
+    if (!overlap && !nontemporal && n >= MEM_ERMS_THRESHOLD && (mem_features & MEM_FEATURE_ERMS)) {
+        copy_erms(d, s, n);
+        return;
+    }
+    if (n > 128 && (mem_features & MEM_FEATURE_AVX2)) {
+        copy_forward_avx2(d, s, n, nontemporal);
+        return;
+    }
+#endif
+    copy_forward(d, s, n, nontemporal);
+}
+
+void* mem_copy(
+    void* dst,
+    const void* src,
+    size_t size
+) {
+    if (size <= 64)
+        copy_small(dst, src, size);
+    else
+        copy_large_forward(dst, src, size, false);
+    return dst;
+}
+
+void* mem_move(
+    void* dst,
+    const void* src,
+    size_t size
+) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+
+    if (d == s)
+        return dst;
+
+    if (size <= 64) {
+        copy_small(d, s, size);
+    } else if ((uintptr_t) d - (uintptr_t) s >= size) {
+        /* destination is below source or behind its end */
+        copy_large_forward(d, s, size, (uintptr_t) s - (uintptr_t) d < size);
+    } else {
+#ifdef __x86_64__
+        if (size > 128 && (mem_features & MEM_FEATURE_AVX2)) {
+            copy_backward_avx2(d, s, size);
+            return dst;
+        }
+#endif
+        copy_backward(d, s, size);
+    }
+    return dst;
+}
+
+int mem_compare(
+    const void* a,
+    const void* b,
+    size_t size
+) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        v2u64_t diff = (v2u64_t) (load16(x + i) ^ load16(y + i));
+        if (diff[0] | diff[1]) {
+            /* first differing byte, UEFI is always little endian */
+            i += diff[0] ? (size_t) __builtin_ctzll(diff[0]) / 8
+                : 8 + (size_t) __builtin_ctzll(diff[1]) / 8;
+            return x[i] < y[i] ? -1 : 1;
+        }
+    }
+
+    for (; i < size; i++) {
+        if (x[i] != y[i])
+            return x[i] < y[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+void* mem_set(
+    void* dst,
+    uint8_t value,
+    size_t size
+) {
+    uint8_t* d = dst;
+
+    if (size <= 64) {
+        fill_small(d, value, size);
+        return dst;
+    }
+
+    bool nontemporal = size >= mem_nontemporal_threshold
+        && (mem_features & MEM_FEATURE_NONTEMPORAL);
+#ifdef __x86_64__
+    if (!nontemporal && size >= MEM_ERMS_THRESHOLD && (mem_features & MEM_FEATURE_ERMS)) {
+        fill_erms(d, value, size);
+        return dst;
+    }
+    if (size > 128 && (mem_features & MEM_FEATURE_AVX2)) {
+        fill_forward_avx2(d, value, size, nontemporal);
+        return dst;
+    }
+#endif
+    fill_forward(d, value, size, nontemporal);
+    return dst;
+}
+
+void* mem_zero(
+    void* dst,
+    size_t size
+) {
+#ifdef __aarch64__
+    if (size >= MEM_ZVA_THRESHOLD && (mem_features & MEM_FEATURE_DCZVA)) {
+        zero_zva(dst, size);
+        return dst;
+    }
+#endif
+    return mem_set(dst, 0, size);
+}
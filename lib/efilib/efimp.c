@@ -0,0 +1,269 @@
+#include <efi.h>
+#include <efilib.h>
+
+#include <minmax.h>
+
+/* how long the APs may take to answer the feature probe */
+#define MP_PROBE_TIMEOUT_USEC 100000
+
+/* starting the APs costs about as much as copying this on one processor */
+#define MP_BULK_THRESHOLD   (UINT64_C(4) << 20)
+#define MP_BULK_CHUNK_MIN   (UINT64_C(256) << 10)
+/* chunks per processor, leaves something to steal */
+#define MP_BULK_CHUNKS      4
+
+static efi_mp_services_protocol_t mp_services = NULL;
+static size_t mp_processors = 0;
+
+/**
+ * @brief drop memory engine paths an AP can't execute
+ */
+efi_api static
+void mp_probe(void* argument) {
+    uint32_t* features = argument;
+    __atomic_fetch_and(features, mem_cpu_features(), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief locate the MP services protocol and check that the APs respond
+ */
+static
+void mp_initialize() {
+    mp_processors = 1;
+
+#if EFILIB_USE_EFI_COPY_MEM || EFILIB_USE_EFI_SET_MEM
+    /* memcpy and memset would call boot services on the APs */
+    return;
+#endif
+
+    efi_mp_services_protocol_t mp;
+    efi_status_t err = BS->locate_protocol(&efi_mp_services_protocol_guid, NULL, (void**) &mp);
+    if (EFI_ERROR(err)) {
+        EFILIB_DBG_PRINTF("MpServices not available: %r", err);
+        return;
+    }
+
+    efi_size_t total = 0, enabled = 0;
+    err = mp->get_number_of_processors(mp, &total, &enabled);
+    if (EFI_ERROR(err) || enabled < 2) {
+        EFILIB_DBG_PRINTF("MpServices %zu/%zu processors enabled: %r", enabled, total, err);
+        return;
+    }
+
+    uint32_t features = mem_features;
+    err = mp->startup_all_aps(mp, mp_probe, false, NULL, MP_PROBE_TIMEOUT_USEC, &features, NULL);
+    if (EFI_ERROR(err)) {
+        EFILIB_DBG_PRINTF("MpServices APs don't respond: %r", err);
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (features != mem_features) {
+        EFILIB_DBG_PRINTF("memory features %X on APs, %X on BSP", features, mem_features);
+        mem_features = features;
+    }
+
+    EFILIB_DBG_PRINTF("MpServices %zu/%zu processors enabled", enabled, total);
+    mp_services = mp;
+    mp_processors = enabled;
+}
+
+static inline
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile ("pause" ::: "memory");
+#elif defined(__aarch64__)
+    __asm__ volatile ("yield" ::: "memory");
+#else
+    __asm__ volatile ("" ::: "memory");
+#endif
+}
+
+size_t mp_processor_count(void) {
+    if (!mp_processors)
+        mp_initialize();
+    return mp_processors;
+}
+
+size_t mp_run(
+    efi_ap_procedure_t procedure,
+    void* argument
+) {
+    efi_event_t event = NULL;
+    size_t processors = 1;
+
+    if (mp_processor_count() > 1) {
+        efi_status_t err = BS->create_event(0, 0, NULL, NULL, &event);
+        if (!EFI_ERROR(err)) {
+            /* non-blocking, the event is signaled when all APs returned */
+            err = mp_services->startup_all_aps(mp_services, procedure, false, event, 0, argument, NULL);
+            if (EFI_ERROR(err)) {
+                EFILIB_DBG_PRINTF("StartupAllAPs: %r", err);
+                BS->close_event(event);
+                event = NULL;
+            } else {
+                processors = mp_processors;
+            }
+        }
+    }
+
+    procedure(argument);
+
+    /* completion barrier, WaitForEvent would sleep until the next timer tick */
+    if (event) {
+        while (BS->check_event(event) == EFI_NOT_READY)
+            cpu_relax();
+        BS->close_event(event);
+    }
+
+    /* make the results of the APs visible */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return processors;
+}
+
+/**
+ * @brief chunks owned by one processor
+ *
+ * @details
+ *  The owner takes chunks from the front, thieves from the back. Both ends
+ *  are updated together, so there is no race for the last chunk.
+ */
+struct mp_queue {
+    alignas(64) uint64_t range;     ///< next chunk (low 32 bit) and end (high 32 bit)
+};
+
+struct mp_for_ctx {
+    mp_for_body_t body;
+    void* argument;
+    size_t size;
+    size_t chunk_size;
+    uint32_t count;                 ///< number of queues
+    uint32_t workers;               ///< processors that joined (atomic)
+    struct mp_queue* queues;
+};
+
+static inline
+bool queue_take(struct mp_queue* queue, bool back, uint32_t* chunk) {
+    uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_RELAXED);
+    uint64_t next_range;
+    do {
+        uint32_t next = range, end = range >> 32;
+        if (next >= end)
+            return false;
+        if (back) {
+            *chunk = end - 1;
+            next_range = (uint64_t) (end - 1) << 32 | next;
+        } else {
+            *chunk = next;
+            next_range = (uint64_t) end << 32 | (next + 1);
+        }
+    } while (!__atomic_compare_exchange_n(&queue->range, &range, next_range, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return true;
+}
+
+efi_api static
+void mp_for_worker(void* argument) {
+    struct mp_for_ctx* ctx = argument;
+    uint32_t id = __atomic_fetch_add(&ctx->workers, 1, __ATOMIC_RELAXED);
+    if (id >= ctx->count)
+        return;
+
+    for (;;) {
+        uint32_t chunk;
+        bool found = queue_take(&ctx->queues[id], false, &chunk);
+        for (uint32_t i = 1; !found && i < ctx->count; i++)
+            found = queue_take(&ctx->queues[(id + i) % ctx->count], true, &chunk);
+        if (!found)
+            break;
+
+        size_t begin = chunk * ctx->chunk_size;
+        ctx->body(begin, MIN(begin + ctx->chunk_size, ctx->size), ctx->argument);
+    }
+}
+
+size_t mp_for(
+    size_t size,
+    size_t chunk_size,
+    mp_for_body_t body,
+    void* argument
+) {
+    EFILIB_ASSERT(chunk_size);
+
+    size_t chunks = (size + chunk_size - 1) / chunk_size;
+    EFILIB_ASSERT(chunks <= UINT32_MAX);
+    size_t processors = MIN(mp_processor_count(), chunks);
+
+    void* memory = NULL;
+    if (processors > 1)
+        memory = malloc(processors * sizeof(struct mp_queue) + alignof(struct mp_queue));
+    if (!memory) {
+        for (size_t begin = 0; begin < size; begin += chunk_size)
+            body(begin, MIN(begin + chunk_size, size), argument);
+        return 1;
+    }
+
+    struct mp_for_ctx ctx = {
+        .body = body,
+        .argument = argument,
+        .size = size,
+        .chunk_size = chunk_size,
+        .count = processors,
+        .queues = (struct mp_queue*) (((uintptr_t) memory + alignof(struct mp_queue) - 1) & ~(uintptr_t) (alignof(struct mp_queue) - 1)),
+    };
+
+    /* equal shares of consecutive chunks */
+    for (size_t i = 0; i < processors; i++) {
+        uint64_t begin = chunks * i / processors, end = chunks * (i + 1) / processors;
+        ctx.queues[i].range = end << 32 | begin;
+    }
+
+    processors = mp_run(mp_for_worker, &ctx);
+    free(memory);
+    return processors;
+}
+
+static inline
+size_t bulk_chunk_size(size_t size) {
+    size_t chunk_size = (size / (mp_processor_count() * MP_BULK_CHUNKS) + 4095) & ~(size_t) 4095;
+    return MAX(chunk_size, (size_t) MP_BULK_CHUNK_MIN);
+}
+
+struct mp_copy_args {
+    uint8_t* dst;
+    const uint8_t* src;
+};
+
+static
+void mp_copy_body(size_t begin, size_t end, void* argument) {
+    struct mp_copy_args* args = argument;
+    mem_copy(args->dst + begin, args->src + begin, end - begin);
+}
+
+void* mp_copy(
+    void* dst,
+    const void* src,
+    size_t size
+) {
+    if (size < MP_BULK_THRESHOLD || mp_processor_count() < 2)
+        return memcpy(dst, src, size);
+
+    struct mp_copy_args args = { dst, src };
+    mp_for(size, bulk_chunk_size(size), mp_copy_body, &args);
+    return dst;
+}
+
+static
+void mp_zero_body(size_t begin, size_t end, void* argument) {
+    mem_zero((uint8_t*) argument + begin, end - begin);
+}
+
+void* mp_zero(
+    void* dst,
+    size_t size
+) {
+    if (size < MP_BULK_THRESHOLD || mp_processor_count() < 2)
+        return memzero(dst, size);
+
+    mp_for(size, bulk_chunk_size(size), mp_zero_body, dst);
+    return dst;
+}
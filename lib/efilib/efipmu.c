@@ -0,0 +1,205 @@
+/**
+ * @file efipmu.c
+ * @author Max Resch
+ * @brief hardware performance counters
+ * @version 0.1
+ * @date 2021-09-25
+ *
+ * @copyright Copyright (c) 2021
+ */
+#include <efi.h>
+#include <efilib.h>
+
+static struct {
+    bool initialized;
+    uint32_t valid;
+    uint8_t counter[_PMU_EVENT_MAX];    ///< hardware counter of each event
+    uint64_t mask[_PMU_EVENT_MAX];      ///< width of the counter
+} pmu = { 0 };
+
+#if defined(__aarch64__)
+#define read_sysreg(reg) ({ \
+    uint64_t __val; \
+    __asm__ volatile ("mrs %0, " #reg : "=r"(__val)); \
+    __val; })
+#define write_sysreg(reg, val) \
+    __asm__ volatile ("msr " #reg ", %0" :: "r"((uint64_t) (val)))
+#define isb() __asm__ volatile ("isb" ::: "memory")
+
+#define PMCR_E              (1 << 0)    ///< enable
+#define PMCR_D              (1 << 3)    ///< cycle counter counts every 64th cycle
+#define PMCR_LC             (1 << 6)    ///< 64 bit cycle counter overflow
+#define PMU_FILTER_NSH      (1 << 27)   ///< count at EL2 too
+#define PMU_CYCLE_COUNTER   31
+
+/* common architectural and microarchitectural event numbers */
+static const uint8_t pmu_event_numbers[_PMU_EVENT_MAX] = {
+    [PMU_CYCLES]        = 0x11,     /* CPU_CYCLES */
+    [PMU_INSTRUCTIONS]  = 0x08,     /* INST_RETIRED */
+    [PMU_L1D_MISSES]    = 0x03,     /* L1D_CACHE_REFILL */
+    [PMU_LLC_MISSES]    = 0x17,     /* L2D_CACHE_REFILL */
+    [PMU_BRANCH_MISSES] = 0x10,     /* BR_MIS_PRED */
+};
+
+static
+void pmu_setup() {
+    /* 0 is no PMU, 0xF an IMPLEMENTATION DEFINED one */
+    uint64_t version = (read_sysreg(id_aa64dfr0_el1) >> 8) & 0xF;
+    if (version == 0 || version == 0xF)
+        return;
+
+    uint64_t pmcr = read_sysreg(pmcr_el0);
+    unsigned counters = (pmcr >> 11) & 0x1F;
+    uint64_t implemented = read_sysreg(pmceid0_el0);
+    uint64_t enable = 0;
+
+    unsigned next = 0;
+    for (unsigned e = 0; e < _PMU_EVENT_MAX; e++) {
+        if (e == PMU_CYCLES) {
+            /* the cycle counter always exists */
+            write_sysreg(pmccfiltr_el0, PMU_FILTER_NSH);
+            pmu.counter[e] = PMU_CYCLE_COUNTER;
+            pmu.mask[e] = UINT64_MAX;
+        } else {
+            if (!(implemented & (UINT64_C(1) << pmu_event_numbers[e])) || next >= counters)
+                continue;
+            write_sysreg(pmselr_el0, next);
+            isb();
+            write_sysreg(pmxevtyper_el0, PMU_FILTER_NSH | pmu_event_numbers[e]);
+            pmu.counter[e] = next++;
+            pmu.mask[e] = UINT32_MAX;
+        }
+        enable |= UINT64_C(1) << pmu.counter[e];
+        pmu.valid |= 1u << e;
+    }
+
+    write_sysreg(pmcntenset_el0, enable);
+    write_sysreg(pmcr_el0, (pmcr & ~PMCR_D) | PMCR_E | PMCR_LC);
+    isb();
+}
+
+static inline
+uint64_t pmu_read_counter(unsigned counter) {
+    if (counter == PMU_CYCLE_COUNTER)
+        return read_sysreg(pmccntr_el0);
+    write_sysreg(pmselr_el0, counter);
+    isb();
+    return read_sysreg(pmxevcntr_el0);
+}
+
+#elif defined(__x86_64__)
+#define MSR_IA32_PERFEVTSEL0        0x186
+#define MSR_IA32_PERF_GLOBAL_CTRL   0x38F
+#define PERFEVTSEL_USR              (1 << 16)
+#define PERFEVTSEL_OS               (1 << 17)
+#define PERFEVTSEL_EN               (1 << 22)
+
+/* umask << 8 | event */
+static const uint16_t pmu_event_numbers[_PMU_EVENT_MAX] = {
+    [PMU_CYCLES]        = 0x003C,   /* UnHalted Core Cycles */
+    [PMU_INSTRUCTIONS]  = 0x00C0,   /* Instructions Retired */
+    [PMU_L1D_MISSES]    = 0x0151,   /* L1D.REPLACEMENT, model specific */
+    [PMU_LLC_MISSES]    = 0x412E,   /* LLC Misses */
+    [PMU_BRANCH_MISSES] = 0x00C5,   /* Branch Misses Retired */
+};
+
+/* bit in CPUID.0AH:EBX that marks an architectural event as unavailable */
+static const int8_t pmu_unavailable_bits[_PMU_EVENT_MAX] = {
+    [PMU_CYCLES]        = 0,
+    [PMU_INSTRUCTIONS]  = 1,
+    [PMU_L1D_MISSES]    = -1,
+    [PMU_LLC_MISSES]    = 4,
+    [PMU_BRANCH_MISSES] = 6,
+};
+
+static inline
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    __asm__ volatile ("cpuid"
+        : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+        : "a"(leaf), "c"(subleaf));
+}
+
+static inline
+uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return (uint64_t) hi << 32 | lo;
+}
+
+static inline
+void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile ("wrmsr" :: "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+static
+void pmu_setup() {
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    if (regs[0] < 0xA)
+        return;
+
+    /* AMD and most hypervisors report version 0 */
+    cpuid(0xA, 0, regs);
+    unsigned version = regs[0] & 0xFF;
+    unsigned counters = (regs[0] >> 8) & 0xFF;
+    unsigned width = (regs[0] >> 16) & 0xFF;
+    unsigned known = (regs[0] >> 24) & 0xFF;
+    uint32_t unavailable = regs[1];
+    if (version == 0 || counters == 0 || width == 0 || width > 64)
+        return;
+
+    unsigned next = 0;
+    for (unsigned e = 0; e < _PMU_EVENT_MAX && next < counters; e++) {
+        int bit = pmu_unavailable_bits[e];
+        if (bit < 0 ? version < 3 : (unsigned) bit >= known || (unavailable & (1u << bit)))
+            continue;
+        wrmsr(MSR_IA32_PERFEVTSEL0 + next, PERFEVTSEL_EN | PERFEVTSEL_OS | PERFEVTSEL_USR | pmu_event_numbers[e]);
+        pmu.counter[e] = next++;
+        pmu.mask[e] = width == 64 ? UINT64_MAX : (UINT64_C(1) << width) - 1;
+        pmu.valid |= 1u << e;
+    }
+
+    /* the counters are also gated globally since version 2 */
+    if (version >= 2)
+        wrmsr(MSR_IA32_PERF_GLOBAL_CTRL, rdmsr(MSR_IA32_PERF_GLOBAL_CTRL) | ((UINT64_C(1) << next) - 1));
+}
+
+static inline
+uint64_t pmu_read_counter(unsigned counter) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return (uint64_t) hi << 32 | lo;
+}
+
+#else
+static inline
+void pmu_setup() { }
+
+static inline
+uint64_t pmu_read_counter(unsigned) {
+    return 0;
+}
+#endif
+
+void pmu_start(
+    struct pmu_sample* sample
+) {
+    if (!pmu.initialized) {
+        pmu.initialized = true;
+        pmu_setup();
+        EFILIB_DBG_PRINTF("PMU events: %X", pmu.valid);
+    }
+
+    sample->valid = pmu.valid;
+    for (unsigned e = 0; e < _PMU_EVENT_MAX; e++)
+        sample->count[e] = pmu_valid(sample, e) ? pmu_read_counter(pmu.counter[e]) : 0;
+}
+
+void pmu_stop(
+    struct pmu_sample* sample
+) {
+    for (unsigned e = 0; e < _PMU_EVENT_MAX; e++) {
+        if (pmu_valid(sample, e))
+            sample->count[e] = (pmu_read_counter(pmu.counter[e]) - sample->count[e]) & pmu.mask[e];
+    }
+}
@@ -71,6 +71,7 @@ struct print_state {
     /* Input */
     struct ptr fmt;
     va_list args;
+    const uint64_t* words;  ///< arguments of a log record instead of args
 
     /* Output */
     char16_t* buffer;
@@ -347,8 +348,11 @@ void ptr_putc(
         ptr_putc(ps, u'\r');
     }
 
-    *ps->pos = c;
-    ps->pos++;
+    /* a string has no output to flush to, drop what doesn't fit */
+    if (ps->pos < ps->end) {
+        *ps->pos = c;
+        ps->pos++;
+    }
     ps->len++;
 
     /* if at the end of the buffer, flush it */
@@ -422,6 +426,21 @@ void ptr_item(
     }
 }
 
+/* log records store every argument in a 64 bit word */
+#define print_arg(ps, type) \
+    ((ps)->words ? (type) *(ps)->words++ : va_arg((ps)->args, type))
+
+static inline
+double print_arg_double(
+    struct print_state* ps
+) {
+    if (!ps->words)
+        return va_arg(ps->args, double);
+    double value;
+    memcpy(&value, ps->words++, sizeof(value));
+    return value;
+}
+
 efi_size_t _print(
     struct print_state* ps
 ) {
@@ -475,7 +494,7 @@ efi_size_t _print(
                     break;
 
                 case '*':
-                    *item.width_parse = va_arg(ps->args, efi_size_t);
+                    *item.width_parse = print_arg(ps, efi_size_t);
                     break;
 
                 case '1':
@@ -497,12 +516,12 @@ efi_size_t _print(
 
                 case 's':
                     if (item.is_long) { 
-                        item.fmt.pu = va_arg(ps->args, char16_t*);
+                        item.fmt.pu = print_arg(ps, char16_t*);
                         if (!item.fmt.pu) {
                             item.fmt.pu = u"(null)";
                         }
                     } else {
-                        item.fmt.pb = va_arg(ps->args, char8_t*);
+                        item.fmt.pb = print_arg(ps, char8_t*);
                         item.fmt.is_ascii = true;
                         if (!item.fmt.pb) {
                             item.fmt.pb = (char8_t*) "(null)";
@@ -512,7 +531,7 @@ efi_size_t _print(
 
                 case 'c':
                     /* should work for 8bit chars too */ 
-                    item.scratch[0] = (char16_t) va_arg(ps->args, efi_size_t);
+                    item.scratch[0] = (char16_t) print_arg(ps, efi_size_t);
                     item.scratch[1] = 0;
                     item.fmt.pu = item.scratch;
                     break;
@@ -542,25 +561,25 @@ efi_size_t _print(
                     if (item.is_short) {
                         value_to_hex_string(
                             item.scratch,
-                            (uint16_t) va_arg(ps->args, uint32_t)
+                            (uint16_t) print_arg(ps, uint32_t)
                         );
                     } else {
                         value_to_hex_string(
                             item.scratch,
                             item.is_long ?
-                                va_arg(ps->args, uint64_t) :
-                                va_arg(ps->args, uint32_t));
+                                print_arg(ps, uint64_t) :
+                                print_arg(ps, uint32_t));
                     }
                     item.fmt.pu = item.scratch;
                     break;
 
                 case 'D':
-                    device_path_to_string(item.scratch, va_arg(ps->args, efi_device_path_t));
+                    device_path_to_string(item.scratch, print_arg(ps, efi_device_path_t));
                     item.fmt.pu = item.scratch;
                     break;
 
                 case 'g':
-                    guid_to_string(item.scratch, va_arg(ps->args, efi_guid_t));
+                    guid_to_string(item.scratch, print_arg(ps, efi_guid_t));
                     item.fmt.pu = item.scratch;
                     break;
 
@@ -568,14 +587,14 @@ efi_size_t _print(
                     if (item.is_short) {
                         value_to_string(
                             item.scratch,
-                            (uint16_t) va_arg(ps->args, int)
+                            (uint16_t) print_arg(ps, int)
                         );
                     } else {
                         value_to_string (
                             item.scratch,
                             item.is_long ?
-                                va_arg(ps->args, uint64_t) :
-                                va_arg(ps->args, uint32_t));
+                                print_arg(ps, uint64_t) :
+                                print_arg(ps, uint32_t));
                     }
                     item.fmt.pu = item.scratch;
                     break;
@@ -585,14 +604,14 @@ efi_size_t _print(
                 if (item.is_short) {
                         value_to_string (
                             item.scratch,
-                            (uint16_t) va_arg(ps->args, int)
+                            (uint16_t) print_arg(ps, int)
                         );
                     } else {
                         value_to_string (
                             item.scratch,
                             item.is_long ?
-                                va_arg(ps->args, uint64_t) :
-                                va_arg(ps->args, uint32_t));
+                                print_arg(ps, uint64_t) :
+                                print_arg(ps, uint32_t));
                     }
                     item.fmt.pu = item.scratch;
                     break;
@@ -601,18 +620,18 @@ efi_size_t _print(
                 case 'f':
                     float_to_string (
                         item.scratch,
-                        va_arg(ps->args, double));
+                        print_arg_double(ps));
                     item.fmt.pu = item.scratch;
                     break;
 #endif
 
                 case 't':
-                    time_to_string(item.scratch, va_arg(ps->args, efi_time_t));
+                    time_to_string(item.scratch, print_arg(ps, efi_time_t));
                     item.fmt.pu = item.scratch;
                     break;
 
                 case 'r':
-                    status_to_string(item.scratch, va_arg(ps->args, efi_status_t));
+                    status_to_string(item.scratch, print_arg(ps, efi_status_t));
                     item.fmt.pu = item.scratch;
                     break;
 
@@ -629,11 +648,11 @@ efi_size_t _print(
                     break;
                 
                 case 'T':
-                    attr = (va_arg(ps->args, uint32_t) & 0xf) | (ps->attr & 0xf0);
+                    attr = (print_arg(ps, uint32_t) & 0xf) | (ps->attr & 0xf0);
                     break;
                 
                 case 'A':
-                    attr = va_arg(ps->args, uint32_t);
+                    attr = print_arg(ps, uint32_t);
                     break;
 
                 case 'N':
@@ -678,6 +697,30 @@ efi_size_t _print(
     return ps->len;
 }
 
+static inline
+void console_state(
+    struct print_state* ps,
+    efi_simple_text_output_t out,
+    char16_t* buffer
+) {
+    ps->context = out;
+    ps->output = (output_string) out->output_string;
+    ps->set_attr = (output_setattr) out->set_attribute;
+    ps->add_cr = true;
+    ps->buffer = buffer;
+    ps->pos = buffer;
+    ps->end = buffer + _PRINT_STRING_LEN - 1;
+
+    /* some UEFI implementation do not store/provide console attributes */
+    ps->attr = out->mode->attribute
+        ? out->mode->attribute
+        : EFILIB_PRINT_NORMAL_COLOR | EFI_BACKGROUND_BLACK;
+
+    ps->attr_norm = ps->attr & 0xff;
+    ps->attr_highlight = EFILIB_PRINT_HIGHLIGHT_COLOR | (ps->attr & 0xf0);
+    ps->attr_error = EFILIB_PRINT_ERROR_COLOR | (ps->attr & 0xf0);
+}
+
 efi_size_t _iprint(
     efi_size_t column,
     efi_size_t row,
@@ -690,24 +733,8 @@ efi_size_t _iprint(
     
     char16_t buffer[_PRINT_STRING_LEN];
     struct print_state ps = { 0 };
+    console_state(&ps, out, buffer);
 
-    ps.context = out;
-    ps.output = (output_string) out->output_string;
-    ps.set_attr = (output_setattr) out->set_attribute;
-    ps.add_cr = true;
-    ps.buffer = buffer;
-    ps.pos = buffer;
-    ps.end = buffer + _PRINT_STRING_LEN - 1;
-
-    /* some UEFI implementation do not store/provide console attributes */
-    ps.attr = out->mode->attribute
-        ? out->mode->attribute
-        : EFILIB_PRINT_NORMAL_COLOR | EFI_BACKGROUND_BLACK;
-
-    ps.attr_norm = ps.attr & 0xff;
-    ps.attr_highlight = EFILIB_PRINT_HIGHLIGHT_COLOR | (ps.attr & 0xf0);
-    ps.attr_error = EFILIB_PRINT_ERROR_COLOR | (ps.attr & 0xf0);
-    
     if (fmt) {
         ps.fmt.pu = fmt;
     } else if (fmta) {
@@ -745,3 +772,38 @@ efi_size_t vswprintf(
     va_end(ps.args);
     return ret;
 }
+
+efi_size_t _iprint_words(
+    efi_simple_text_output_t out,
+    const char16_t* fmt,
+    const uint64_t* words
+) {
+    EFILIB_ASSERT(out != NULL);
+
+    char16_t buffer[_PRINT_STRING_LEN];
+    struct print_state ps = { 0 };
+    console_state(&ps, out, buffer);
+    ps.fmt.pu = fmt;
+    ps.words = words;
+    return _print(&ps);
+}
+
+efi_size_t swprint_words(
+    char16_t* restrict str,
+    size_t maxlen,
+    const char16_t* restrict fmt,
+    const uint64_t* words
+) {
+    EFILIB_ASSERT(str != NULL);
+
+    struct print_state ps = { 0 };
+    ps.buffer = str;
+    ps.pos = str;
+    ps.end = str + maxlen - 1;
+    ps.fmt.pu = fmt;
+    ps.words = words;
+
+    efi_size_t ret = _print(&ps);
+    *ps.pos = '\0';
+    return ret;
+}
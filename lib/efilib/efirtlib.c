@@ -10,41 +10,12 @@
  * @details
  *  Defines support funtions required by compiler builtins,
  *  some funtions are defined weak, so that they can be
- *  replaced by more efficient ones.
+ *  replaced by more efficient ones. malloc and free are in
+ *  efialloc.c
  */
 #include <efi.h>
 #include <efilib.h>
 
-void* malloc(efi_size_t size) {
-    EFILIB_ASSERT(BS);
-    efi_status_t err;
-    void* ptr;
-    err = BS->allocate_pool(_EFI_POOL_ALLOCATION, size, &ptr);
-    if (EFI_ERROR(err)) {
-        EFILIB_DBG_MESSAGE("Could not allocate pool memory");
-        return NULL;
-    }
-    return ptr;
-}
-
-void* calloc(efi_size_t num, efi_size_t size) {
-    EFILIB_ASSERT(BS);
-    efi_status_t err;
-    void* ptr;
-    err = BS->allocate_pool(_EFI_POOL_ALLOCATION, num * size, &ptr);
-    if (EFI_ERROR(err)) {
-        EFILIB_DBG_MESSAGE("Could not allocate pool memory");
-        return NULL;
-    }
-    memset(ptr, 0, num * size);
-    return ptr;
-}
-
-void free(void* p) {
-    EFILIB_ASSERT(BS);
-    BS->free_pool(p);
-}
-
 __weak__
 inline
 void* memset (
@@ -56,10 +27,24 @@ void* memset (
     EFILIB_ASSERT(BS);
     BS->set_mem(buffer, size, value);
 #else
-    uint8_t* ptr = buffer;
-    while (size--) {
-        *(ptr++) = value;
-    }
+    if (value == 0)
+        mem_zero(buffer, size);
+    else
+        mem_set(buffer, value, size);
+#endif
+    return buffer;
+}
+
+__weak__
+void* memzero (
+    void* buffer,
+    efi_size_t size
+) {
+#if EFILIB_USE_EFI_SET_MEM
+    EFILIB_ASSERT(BS);
+    BS->set_mem(buffer, size, 0);
+#else
+    mem_zero(buffer, size);
 #endif
     return buffer;
 }
@@ -78,17 +63,7 @@ void* memmove (
     BS->copy_mem(dst, src, size);
     return dst;
 #else
-    if ((void*)((uint8_t*) dst + size) < src || (void*)((uint8_t*) src + size) < dst)
-        return memcpy(dst, src, size);
-    else {
-        void* tmp = malloc(size);
-        EFILIB_ASSERT(tmp); // OOM
-
-        memcpy(tmp, src, size);
-        memcpy(dst, tmp, size);
-        free(tmp);
-        return dst;
-    }
+    return mem_move(dst, src, size);
 #endif
 }
 
@@ -105,11 +80,7 @@ void* memcpy (
     EFILIB_ASSERT(BS);
     BS->copy_mem(dst, src, size);
 #else
-    uint8_t* d = dst;
-    const uint8_t* s = src;
-    while (size--) {
-        *(d++) = *(s++);
-    }
+    mem_copy(dst, src, size);
 #endif
     return dst;
 }
@@ -123,13 +94,5 @@ int memcmp (
     const void* b,
     efi_size_t size   
 ) {
-    const uint8_t* x = a;
-    const uint8_t* y = b;
-    
-    while (size--) {
-        int ret;
-        if ((ret = *(x++) - *(y++)))
-            return (ret > 0) - (ret < 0);
-    }
-    return 0;
+    return mem_compare(a, b, size);
 }
@@ -0,0 +1,71 @@
+/**
+ * @file efitrace.c
+ * @author Max Resch
+ * @brief tracepoints for the boot timeline
+ * @version 0.1
+ * @date 2021-09-24
+ *
+ * @copyright Copyright (c) 2021
+ */
+#include <efi.h>
+#include <efilib.h>
+
+#include <minmax.h>
+
+#ifdef EFILIB_TRACE
+
+static struct {
+    struct trace_buffer header;
+    struct trace_event events[TRACE_BUFFER_CAPACITY];
+} trace_ring = {
+    .header = {
+        .signature = TRACE_BUFFER_SIGNATURE,
+        .version = TRACE_BUFFER_VERSION,
+        .event_size = sizeof(struct trace_event),
+        .capacity = TRACE_BUFFER_CAPACITY,
+    },
+};
+
+static_assert(sizeof(trace_ring) == TRACE_BUFFER_SIZE(TRACE_BUFFER_CAPACITY), "trace ring has padding");
+
+void trace_event_at(
+    uint64_t ticks,
+    enum trace_id id,
+    enum trace_phase phase,
+    uint8_t cpu,
+    uint32_t arg
+) {
+    /* the APs record events too */
+    uint32_t slot = __atomic_fetch_add(&trace_ring.header.count, 1, __ATOMIC_RELAXED);
+    trace_ring.events[slot % TRACE_BUFFER_CAPACITY] = (struct trace_event) {
+        .ticks = ticks,
+        .id = id,
+        .phase = phase,
+        .cpu = cpu,
+        .arg = arg,
+    };
+}
+
+efi_status_t trace_publish(
+    const efi_guid_t guid
+) {
+    EFILIB_ASSERT(RT);
+
+    trace_ring.header.ticks_per_second = ticks_frequency();
+    uint32_t count = MIN(trace_ring.header.count, (uint32_t) TRACE_BUFFER_CAPACITY);
+
+    /* not efi_var_set, that would record another event */
+    return RT->set_variable(_u(TRACE_BUFFER_VARIABLE), guid,
+        EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+        TRACE_BUFFER_SIZE(count), &trace_ring);
+}
+
+#else
+
+void trace_event_at(uint64_t, enum trace_id, enum trace_phase, uint8_t, uint32_t) { }
+
+efi_status_t trace_publish(const efi_guid_t) {
+    return EFI_UNSUPPORTED;
+}
+
+#endif /* EFILIB_TRACE */
@@ -0,0 +1,662 @@
+/**
+ * @file efiuart.c
+ * @author Max Resch
+ * @brief console on the UART registers
+ * @version 0.1
+ * @date 2021-09-27
+ *
+ * @copyright Copyright (c) 2021
+ */
+#include <efi.h>
+#include <efilib.h>
+
+/* give up on a UART that never gets ready instead of hanging */
+#define UART_TX_TIMEOUT     100000
+
+#define UART_16550_THR      0           ///< transmit holding register
+#define UART_16550_SCR      7           ///< scratch register
+#define UART_16550_LSR      5           ///< line status register
+#define UART_16550_LSR_THRE (1 << 5)    ///< transmit holding register empty
+
+#define UART_PL011_DR       0x00        ///< data register
+#define UART_PL011_FR       0x18        ///< flag register
+#define UART_PL011_FR_TXFF  (1 << 5)    ///< transmit FIFO full
+
+#define UART_COM1           0x3f8
+
+/*==========================================================================*
+ *  Register access
+ *==========================================================================*/
+#ifdef __x86_64__
+static inline
+uint8_t inb(uint16_t port) {
+    uint8_t value;
+    __asm__ volatile ("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline
+void outb(uint16_t port, uint8_t value) {
+    __asm__ volatile ("outb %0, %1" :: "a"(value), "Nd"(port));
+}
+#else
+static inline
+uint8_t inb(uint16_t) {
+    return 0;
+}
+
+static inline
+void outb(uint16_t, uint8_t) { }
+#endif
+
+static
+uint32_t uart_read(
+    const struct uart* uart,
+    unsigned reg
+) {
+    uintptr_t address = uart->base + (reg << uart->shift);
+    if (uart->io_port)
+        return inb(address);
+    if (uart->width == 4)
+        return *(volatile uint32_t*) address;
+    return *(volatile uint8_t*) address;
+}
+
+static
+void uart_write(
+    const struct uart* uart,
+    unsigned reg,
+    uint32_t value
+) {
+    uintptr_t address = uart->base + (reg << uart->shift);
+    if (uart->io_port)
+        outb(address, value);
+    else if (uart->width == 4)
+        *(volatile uint32_t*) address = value;
+    else
+        *(volatile uint8_t*) address = value;
+}
+
+static
+void uart_putc(
+    const struct uart* uart,
+    char8_t c
+) {
+    unsigned status, ready, data;
+    if (uart->type == UART_PL011) {
+        status = UART_PL011_FR;
+        data = UART_PL011_DR;
+    } else {
+        status = UART_16550_LSR;
+        data = UART_16550_THR;
+    }
+
+    for (unsigned i = 0; i < UART_TX_TIMEOUT; i++) {
+        uint32_t value = uart_read(uart, status);
+        ready = uart->type == UART_PL011
+            ? !(value & UART_PL011_FR_TXFF)
+            : value & UART_16550_LSR_THRE;
+        if (ready)
+            break;
+    }
+    uart_write(uart, data, c);
+}
+
+/*==========================================================================*
+ *  Flattened devicetree
+ *==========================================================================*/
+#define FDT_MAGIC           0xd00dfeed
+#define FDT_BEGIN_NODE      1
+#define FDT_END_NODE        2
+#define FDT_PROP            3
+#define FDT_NOP             4
+#define FDT_END             9
+
+struct fdt_header {
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+struct fdt {
+    const uint8_t* structs;
+    uint32_t struct_size;
+    const char* strings;
+    uint32_t strings_size;
+};
+
+static inline
+uint32_t fdt32(const void* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return __builtin_bswap32(value);
+}
+
+static inline
+uint32_t fdt_align(uint32_t offset) {
+    return (offset + 3) & ~UINT32_C(3);
+}
+
+static
+bool fdt_open(
+    const void* blob,
+    struct fdt* fdt
+) {
+    const struct fdt_header* header = blob;
+    if (fdt32(&header->magic) != FDT_MAGIC || fdt32(&header->version) < 17)
+        return false;
+
+    uint32_t size = fdt32(&header->totalsize);
+    fdt->structs = (const uint8_t*) blob + fdt32(&header->off_dt_struct);
+    fdt->struct_size = fdt32(&header->size_dt_struct);
+    fdt->strings = (const char*) blob + fdt32(&header->off_dt_strings);
+    fdt->strings_size = fdt32(&header->size_dt_strings);
+    return fdt32(&header->off_dt_struct) + fdt->struct_size <= size
+        && fdt32(&header->off_dt_strings) + fdt->strings_size <= size;
+}
+
+/* node names in a path may leave out the unit address */
+static
+bool fdt_name_matches(
+    const char* name,
+    const char* component,
+    efi_size_t length
+) {
+    if (strncmp(name, component, length) != 0)
+        return false;
+    if (name[length] == '\0')
+        return true;
+    if (name[length] != '@')
+        return false;
+    for (efi_size_t i = 0; i < length; i++) {
+        if (component[i] == '@')
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief offset of the first property of the node at path
+ *
+ * @param[out] address_cells #address-cells of the parent node
+ * @return 0 if the path doesn't exist
+ */
+static
+uint32_t fdt_find_node(
+    const struct fdt* fdt,
+    const char* path,
+    uint32_t* address_cells
+) {
+    uint32_t depth = 0, matched = 0;
+    uint32_t cells = 2, parent_cells = 2;
+
+    if (*path != '/')
+        return 0;
+    path++;
+
+    for (uint32_t offset = 0; offset + 4 <= fdt->struct_size;) {
+        uint32_t token = fdt32(fdt->structs + offset);
+        offset += 4;
+
+        switch (token) {
+            case FDT_BEGIN_NODE: {
+                const char* name = (const char*) fdt->structs + offset;
+                offset = fdt_align(offset + strlen(name) + 1);
+
+                if (depth++ != matched)
+                    break;
+                if (depth == 1) {
+                    /* the root node */
+                    matched = 1;
+                } else {
+                    efi_size_t length = 0;
+                    while (path[length] && path[length] != '/')
+                        length++;
+                    if (!fdt_name_matches(name, path, length))
+                        break;
+                    matched++;
+                    path += path[length] ? length + 1 : length;
+                    parent_cells = cells;
+                    cells = 2;
+                }
+                if (!*path) {
+                    *address_cells = parent_cells;
+                    return offset;
+                }
+                break;
+            }
+
+            case FDT_END_NODE:
+                if (depth-- == matched)
+                    return 0;
+                break;
+
+            case FDT_PROP: {
+                uint32_t length = fdt32(fdt->structs + offset);
+                uint32_t name = fdt32(fdt->structs + offset + 4);
+                if (depth == matched && name < fdt->strings_size
+                    && !strcmp(fdt->strings + name, "#address-cells") && length == 4)
+                    cells = fdt32(fdt->structs + offset + 8);
+                offset = fdt_align(offset + 8 + length);
+                break;
+            }
+
+            case FDT_NOP:
+                break;
+
+            default:
+                return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief value of a property of the node at offset
+ */
+static
+const void* fdt_property(
+    const struct fdt* fdt,
+    uint32_t offset,
+    const char* name,
+    uint32_t* length
+) {
+    while (offset + 4 <= fdt->struct_size) {
+        uint32_t token = fdt32(fdt->structs + offset);
+        offset += 4;
+
+        if (token == FDT_NOP)
+            continue;
+        /* properties come before the subnodes */
+        if (token != FDT_PROP)
+            return NULL;
+
+        uint32_t size = fdt32(fdt->structs + offset);
+        uint32_t name_offset = fdt32(fdt->structs + offset + 4);
+        if (offset + 8 + size > fdt->struct_size)
+            return NULL;
+        if (name_offset < fdt->strings_size && !strcmp(fdt->strings + name_offset, name)) {
+            *length = size;
+            return fdt->structs + offset + 8;
+        }
+        offset = fdt_align(offset + 8 + size);
+    }
+    return NULL;
+}
+
+static
+bool fdt_compatible(
+    const char* list,
+    uint32_t length,
+    const char* compatible
+) {
+    for (uint32_t i = 0; i < length; i += strlen(list + i) + 1) {
+        if (!strcmp(list + i, compatible))
+            return true;
+    }
+    return false;
+}
+
+static
+uint32_t fdt_u32(
+    const struct fdt* fdt,
+    uint32_t node,
+    const char* name,
+    uint32_t fallback
+) {
+    uint32_t length;
+    const void* value = fdt_property(fdt, node, name, &length);
+    return value && length == 4 ? fdt32(value) : fallback;
+}
+
+bool uart_from_fdt(
+    const void* blob,
+    struct uart* uart
+) {
+    struct fdt fdt;
+    uint32_t length, cells;
+    if (!blob || !fdt_open(blob, &fdt))
+        return false;
+
+    uint32_t chosen = fdt_find_node(&fdt, "/chosen", &cells);
+    if (!chosen)
+        return false;
+    const char* stdout_path = fdt_property(&fdt, chosen, "stdout-path", &length);
+    if (!stdout_path)
+        stdout_path = fdt_property(&fdt, chosen, "linux,stdout-path", &length);
+    if (!stdout_path || !length)
+        return false;
+
+    /* cut the options ("serial0:115200n8") */
+    char path[128];
+    efi_size_t i = 0;
+    for (; i < sizeof(path) - 1 && i < length && stdout_path[i] && stdout_path[i] != ':'; i++)
+        path[i] = stdout_path[i];
+    path[i] = '\0';
+
+    if (path[0] != '/') {
+        uint32_t aliases = fdt_find_node(&fdt, "/aliases", &cells);
+        const char* alias = aliases ? fdt_property(&fdt, aliases, path, &length) : NULL;
+        if (!alias || !length || length > sizeof(path))
+            return false;
+        memcpy(path, alias, length);
+        path[length - 1] = '\0';
+    }
+
+    uint32_t node = fdt_find_node(&fdt, path, &cells);
+    if (!node || cells < 1 || cells > 2)
+        return false;
+
+    const char* compatible = fdt_property(&fdt, node, "compatible", &length);
+    if (!compatible)
+        return false;
+    if (fdt_compatible(compatible, length, "arm,pl011") || fdt_compatible(compatible, length, "arm,sbsa-uart")) {
+        *uart = (struct uart) { .type = UART_PL011, .width = 4 };
+    } else if (fdt_compatible(compatible, length, "ns16550a") || fdt_compatible(compatible, length, "ns16550")
+        || fdt_compatible(compatible, length, "ns8250") || fdt_compatible(compatible, length, "snps,dw-apb-uart")) {
+        *uart = (struct uart) {
+            .type = UART_16550,
+            .shift = fdt_u32(&fdt, node, "reg-shift", 0),
+            .width = fdt_u32(&fdt, node, "reg-io-width", 1),
+        };
+    } else {
+        return false;
+    }
+
+    /* the address as seen by the parent, `ranges` are expected to be 1:1 */
+    const uint8_t* reg = fdt_property(&fdt, node, "reg", &length);
+    if (!reg || length < cells * 4)
+        return false;
+    uart->base = cells == 2 ? (uint64_t) fdt32(reg) << 32 | fdt32(reg + 4) : fdt32(reg);
+    return uart->base != 0;
+}
+
+/*==========================================================================*
+ *  ACPI Serial Port Console Redirection table
+ *==========================================================================*/
+struct __packed acpi_rsdp {
+    char8_t signature[8];
+    uint8_t checksum;
+    char8_t oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+};
+
+struct __packed acpi_header {
+    char8_t signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char8_t oem_id[6];
+    char8_t oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
+struct __packed acpi_generic_address {
+    uint8_t space_id;
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+};
+
+#define ACPI_SPACE_MEMORY   0
+#define ACPI_SPACE_IO       1
+
+struct __packed acpi_spcr {
+    struct acpi_header header;
+    uint8_t interface_type;
+    uint8_t reserved[3];
+    struct acpi_generic_address base;
+};
+
+/* interface types of the DBG2 table */
+#define SPCR_16550          0x00
+#define SPCR_16450          0x01
+#define SPCR_PL011          0x03
+#define SPCR_SBSA_32BIT     0x0d
+#define SPCR_SBSA           0x0e
+#define SPCR_16550_GAS      0x12
+
+bool uart_from_spcr(
+    struct uart* uart
+) {
+    const struct acpi_rsdp* rsdp = lib_get_configuration_table(&efi_acpi_20_table_guid);
+    if (!rsdp || memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || rsdp->revision < 2 || !rsdp->xsdt_address)
+        return false;
+
+    const struct acpi_header* xsdt = (const struct acpi_header*) (uintptr_t) rsdp->xsdt_address;
+    const uint8_t* entries = (const uint8_t*) (xsdt + 1);
+    efi_size_t count = (xsdt->length - sizeof(*xsdt)) / sizeof(uint64_t);
+
+    for (efi_size_t i = 0; i < count; i++) {
+        uint64_t address;
+        memcpy(&address, entries + i * sizeof(address), sizeof(address));
+        const struct acpi_spcr* spcr = (const struct acpi_spcr*) (uintptr_t) address;
+        if (!spcr || memcmp(spcr->header.signature, "SPCR", 4) != 0 || spcr->header.length < sizeof(*spcr))
+            continue;
+
+        /* an address of 0 means console redirection is disabled */
+        if (!spcr->base.address)
+            return false;
+
+        switch (spcr->interface_type) {
+            case SPCR_16550:
+            case SPCR_16450:
+            case SPCR_16550_GAS:
+                *uart = (struct uart) {
+                    .type = UART_16550,
+                    .io_port = spcr->base.space_id == ACPI_SPACE_IO,
+                    .width = spcr->base.bit_width == 32 || spcr->base.access_size == 3 ? 4 : 1,
+                };
+                uart->shift = uart->width == 4 ? 2 : 0;
+                break;
+
+            case SPCR_PL011:
+            case SPCR_SBSA_32BIT:
+            case SPCR_SBSA:
+                *uart = (struct uart) { .type = UART_PL011, .width = 4 };
+                break;
+
+            default:
+                return false;
+        }
+        if (spcr->base.space_id != ACPI_SPACE_MEMORY && !(uart->io_port && uart->type == UART_16550))
+            return false;
+        uart->base = spcr->base.address;
+        return true;
+    }
+    return false;
+}
+
+/*==========================================================================*
+ *  Text output protocol
+ *==========================================================================*/
+static struct uart console_uart = { 0 };
+
+static struct efi_simple_text_output_mode uart_mode = {
+    .max_mode = 1,
+    .attribute = EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK),
+};
+
+static
+void uart_puts(
+    const char8_t* string
+) {
+    while (*string)
+        uart_putc(&console_uart, *string++);
+}
+
+static
+void uart_putu(
+    efi_size_t value
+) {
+    char8_t buffer[24], *p = buffer + sizeof(buffer) - 1;
+    *p = '\0';
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    uart_puts(p);
+}
+
+static
+efi_status_t efi_api uart_reset(
+    efi_simple_text_output_t,
+    bool
+) {
+    return EFI_SUCCESS;
+}
+
+static
+efi_status_t efi_api uart_output_string(
+    efi_simple_text_output_t,
+    const char16_t* string
+) {
+    for (; *string; string++)
+        uart_putc(&console_uart, *string < 0x80 ? (char8_t) *string : '?');
+    return EFI_SUCCESS;
+}
+
+static
+efi_status_t efi_api uart_test_string(
+    efi_simple_text_output_t,
+    const char16_t*
+) {
+    return EFI_SUCCESS;
+}
+
+static
+efi_status_t efi_api uart_query_mode(
+    efi_simple_text_output_t,
+    efi_size_t mode,
+    efi_size_t* columns,
+    efi_size_t* rows
+) {
+    if (mode != 0)
+        return EFI_UNSUPPORTED;
+    *columns = 80;
+    *rows = 25;
+    return EFI_SUCCESS;
+}
+
+static
+efi_status_t efi_api uart_set_mode(
+    efi_simple_text_output_t,
+    efi_size_t mode
+) {
+    return mode == 0 ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+/* EFI colors have red and blue swapped compared to ANSI */
+static const char8_t ansi_colors[] = { '0', '4', '2', '6', '1', '5', '3', '7' };
+
+static
+efi_status_t efi_api uart_set_attribute(
+    efi_simple_text_output_t,
+    efi_size_t attribute
+) {
+    char8_t sequence[] = "\x1b[0;30;40m";
+    sequence[2] = attribute & EFI_BRIGHT ? '1' : '0';
+    sequence[5] = ansi_colors[attribute & 0x7];
+    sequence[8] = ansi_colors[(attribute >> 4) & 0x7];
+    uart_puts(sequence);
+    uart_mode.attribute = attribute;
+    return EFI_SUCCESS;
+}
+
+static
+efi_status_t efi_api uart_clear_screen(
+    efi_simple_text_output_t
+) {
+    uart_puts((const char8_t*) "\x1b[2J\x1b[H");
+    uart_mode.cursor_column = uart_mode.cursor_row = 0;
+    return EFI_SUCCESS;
+}
+
+static
+efi_status_t efi_api uart_set_cursor_position(
+    efi_simple_text_output_t,
+    efi_size_t column,
+    efi_size_t row
+) {
+    uart_puts((const char8_t*) "\x1b[");
+    uart_putu(row + 1);
+    uart_putc(&console_uart, ';');
+    uart_putu(column + 1);
+    uart_putc(&console_uart, 'H');
+    uart_mode.cursor_column = column;
+    uart_mode.cursor_row = row;
+    return EFI_SUCCESS;
+}
+
+static
+efi_status_t efi_api uart_enable_cursor(
+    efi_simple_text_output_t,
+    bool visible
+) {
+    uart_puts((const char8_t*) (visible ? "\x1b[?25h" : "\x1b[?25l"));
+    uart_mode.cursor_visible = visible;
+    return EFI_SUCCESS;
+}
+
+static struct efi_simple_text_output_protocol uart_out = {
+    .reset = uart_reset,
+    .output_string = uart_output_string,
+    .test_string = uart_test_string,
+    .query_mode = uart_query_mode,
+    .set_mode = uart_set_mode,
+    .set_attribute = uart_set_attribute,
+    .clear_screen = uart_clear_screen,
+    .set_cursor_position = uart_set_cursor_position,
+    .enable_cursor = uart_enable_cursor,
+    .mode = &uart_mode,
+};
+
+#ifdef __x86_64__
+/* the legacy COM1 port has a scratch register that keeps what is written */
+static
+bool uart_from_com1(
+    struct uart* uart
+) {
+    *uart = (struct uart) { .type = UART_16550, .base = UART_COM1, .width = 1, .io_port = true };
+    uart_write(uart, UART_16550_SCR, 0x5a);
+    if (uart_read(uart, UART_16550_SCR) != 0x5a)
+        return false;
+    uart_write(uart, UART_16550_SCR, 0xa5);
+    return uart_read(uart, UART_16550_SCR) == 0xa5;
+}
+#endif
+
+efi_status_t uart_console(
+    const void* fdt
+) {
+    struct uart uart = { 0 };
+    if (!uart_from_fdt(fdt, &uart)
+        && !uart_from_fdt(lib_get_configuration_table(&efi_fdt_guid), &uart)
+        && !uart_from_spcr(&uart)
+#ifdef __x86_64__
+        && !uart_from_com1(&uart)
+#endif
+    )
+        return EFI_NOT_FOUND;
+
+    console_uart = uart;
+    CON_OUT = &uart_out;
+    EFILIB_DBG_PRINTF("UART console: type %u at %lx (shift %hu, width %hu%s)", uart.type, (uint64_t) uart.base,
+        uart.shift, uart.width, uart.io_port ? " I/O port" : "");
+    return EFI_SUCCESS;
+}
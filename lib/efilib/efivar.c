@@ -2,6 +2,185 @@
 #include <efilib.h>
 
 #include <stdarg.h>
+#include <minmax.h>
+
+enum var_state {
+    VAR_UNKNOWN,
+    VAR_ABSENT,
+    VAR_PRESENT,        ///< data is only valid if size <= EFI_VAR_CACHE_DATA_SIZE
+};
+
+struct var_entry {
+    struct efi_guid guid;
+    char16_t name[EFI_VAR_CACHE_NAME_LEN];
+    enum var_state state;
+    bool pending;                   ///< value not written yet
+    uint32_t attributes;
+    efi_size_t size;
+    efi_device_path_t device_path;  ///< pending text, formatted by var_write_entry
+    uint8_t data[EFI_VAR_CACHE_DATA_SIZE];
+};
+
+static struct {
+    uint32_t used;
+    struct var_entry entries[EFI_VAR_CACHE_ENTRIES];
+} var_cache = { 0 };
+
+static
+struct var_entry* var_find(
+    const efi_guid_t guid,
+    const char16_t* name
+) {
+    efi_size_t len = wcslen(name);
+    if (len >= EFI_VAR_CACHE_NAME_LEN)
+        return NULL;
+
+    for (uint32_t i = 0; i < var_cache.used; i++) {
+        struct var_entry* entry = &var_cache.entries[i];
+        if (!memcmp(&entry->guid, guid, sizeof(struct efi_guid)) && !wcscmp(entry->name, name))
+            return entry;
+    }
+
+    if (var_cache.used == EFI_VAR_CACHE_ENTRIES)
+        return NULL;
+
+    struct var_entry* entry = &var_cache.entries[var_cache.used++];
+    memset(entry, 0, sizeof(struct var_entry));
+    entry->guid = *guid;
+    memcpy(entry->name, name, (len + 1) * sizeof(char16_t));
+    return entry;
+}
+
+static
+void var_store(
+    struct var_entry* entry,
+    uint32_t attributes,
+    efi_size_t size,
+    const void* data
+) {
+    entry->state = size ? VAR_PRESENT : VAR_ABSENT;
+    entry->attributes = attributes;
+    entry->size = size;
+    if (size <= EFI_VAR_CACHE_DATA_SIZE)
+        memcpy(entry->data, data, size);
+}
+
+static
+efi_status_t var_set_variable(
+    const efi_guid_t guid,
+    const char16_t* name,
+    uint32_t attributes,
+    efi_size_t size,
+    const void* data
+) {
+    EFILIB_ASSERT(RT);
+
+    trace_begin(VARIABLE_WRITE, size);
+    efi_status_t err = RT->set_variable(name, guid, attributes, size, data);
+    trace_end(VARIABLE_WRITE, size);
+    if (EFI_ERROR(err))
+        EFILIB_DBG_PRINTF("SetVariable {%g} %ls %r", guid, name, err);
+    return err;
+}
+
+/* reads the value into the entry if it fits, the attributes and size otherwise */
+static
+efi_status_t var_read(
+    struct var_entry* entry
+) {
+    EFILIB_ASSERT(RT);
+
+    efi_size_t size = EFI_VAR_CACHE_DATA_SIZE;
+    uint32_t attributes = 0;
+    efi_status_t err = RT->get_variable(entry->name, &entry->guid, &attributes, &size, entry->data);
+    switch (err) {
+        case EFI_SUCCESS:
+        case EFI_BUFFER_TOO_SMALL:
+            entry->state = VAR_PRESENT;
+            entry->attributes = attributes;
+            entry->size = size;
+            return EFI_SUCCESS;
+        case EFI_NOT_FOUND:
+            entry->state = VAR_ABSENT;
+            break;
+        default:
+            break;
+    }
+    EFILIB_DBG_PRINTF("GetVariable {%g} %ls %r", &entry->guid, entry->name, err);
+    return err;
+}
+
+static
+efi_status_t var_write_entry(
+    struct var_entry* entry
+) {
+    char16_t text[_PRINT_STRING_LEN];
+    efi_size_t size = entry->size;
+    const void* data = entry->data;
+
+    if (entry->device_path) {
+        efi_size_t len = wsprintf(text, _PRINT_STRING_LEN, u"%D", entry->device_path);
+        size = (MIN(len, _PRINT_STRING_LEN - 1) + 1) * sizeof(char16_t);
+        data = text;
+        entry->device_path = NULL;
+    }
+
+    entry->pending = false;
+    efi_status_t err = var_set_variable(&entry->guid, entry->name, entry->attributes, size, data);
+    if (EFI_ERROR(err))
+        entry->state = VAR_UNKNOWN;
+    else if (data == text)
+        var_store(entry, entry->attributes, size, text);
+    return err;
+}
+
+/* the value of entry as the firmware would report it, NULL if not cached */
+static
+struct var_entry* var_lookup(
+    const efi_guid_t guid,
+    const char16_t* name
+) {
+    struct var_entry* entry = var_find(guid, name);
+    if (!entry)
+        return NULL;
+    if (entry->device_path)
+        var_write_entry(entry);
+    if (entry->state == VAR_UNKNOWN)
+        var_read(entry);
+    if (entry->state == VAR_UNKNOWN || (entry->state == VAR_PRESENT && entry->size > EFI_VAR_CACHE_DATA_SIZE))
+        return NULL;
+    return entry;
+}
+
+efi_status_t efi_var_get(
+    const efi_guid_t guid,
+    const char16_t* name,
+    uint32_t* attributes,
+    efi_size_t* size,
+    void* data
+) {
+    EFILIB_ASSERT(RT);
+
+    struct var_entry* entry = var_lookup(guid, name);
+    if (!entry) {
+        efi_status_t err = RT->get_variable(name, guid, attributes, size, data);
+        if (EFI_ERROR(err))
+            EFILIB_DBG_PRINTF("GetVariable {%g} %ls %r", guid, name, err);
+        return err;
+    }
+
+    if (entry->state == VAR_ABSENT)
+        return EFI_NOT_FOUND;
+    if (attributes)
+        *attributes = entry->attributes;
+    if (*size < entry->size) {
+        *size = entry->size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    memcpy(data, entry->data, entry->size);
+    *size = entry->size;
+    return EFI_SUCCESS;
+}
 
 void* efi_var_get_pool(
     const efi_guid_t guid,
@@ -9,6 +188,23 @@ void* efi_var_get_pool(
     uint32_t* attributes,
     efi_size_t* buffer_size
 ) {
+    ALLOC_TAG_SCOPE(VARS);
+
+    struct var_entry* entry = var_lookup(guid, name);
+    if (entry) {
+        if (entry->state == VAR_ABSENT)
+            return NULL;
+        void* buffer = malloc(entry->size);
+        if (!buffer)
+            return NULL;
+        memcpy(buffer, entry->data, entry->size);
+        if (attributes)
+            *attributes = entry->attributes;
+        if (buffer_size)
+            *buffer_size = entry->size;
+        return buffer;
+    }
+
     efi_size_t size = 0;
     efi_status_t err = RT->get_variable(name, guid, attributes, &size, NULL);
     if (err != EFI_BUFFER_TOO_SMALL) {
@@ -30,6 +226,65 @@ void* efi_var_get_pool(
     return buffer;
 }
 
+efi_status_t efi_var_set(
+    const efi_guid_t guid,
+    const char16_t* name,
+    uint32_t attributes,
+    efi_size_t size,
+    const void* data
+) {
+    efi_status_t err = var_set_variable(guid, name, attributes, size, data);
+
+    /* enrolling keys changes SecureBoot, SetupMode and friends */
+    if (attributes & (EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS
+            | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS
+            | EFI_VARIABLE_ENHANCED_AUTHENTICATED_ACCESS
+            | EFI_VARIABLE_APPEND_WRITE)) {
+        for (uint32_t i = 0; i < var_cache.used; i++) {
+            if (!var_cache.entries[i].pending)
+                var_cache.entries[i].state = VAR_UNKNOWN;
+        }
+    }
+
+    struct var_entry* entry = var_find(guid, name);
+    if (entry) {
+        entry->pending = false;
+        entry->device_path = NULL;
+        if (EFI_ERROR(err) || (attributes & EFI_VARIABLE_APPEND_WRITE))
+            entry->state = VAR_UNKNOWN;
+        else if (!(attributes & ~(EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS)))
+            var_store(entry, attributes, size, data);
+        else
+            entry->state = VAR_UNKNOWN;
+    }
+    return err;
+}
+
+static
+efi_status_t var_queue(
+    const efi_guid_t guid,
+    const char16_t* name,
+    uint32_t attributes,
+    efi_size_t size,
+    const void* data
+) {
+    struct var_entry* entry = var_find(guid, name);
+    if (!entry || size > EFI_VAR_CACHE_DATA_SIZE)
+        return efi_var_set(guid, name, attributes, size, data);
+
+    if (!entry->device_path && entry->state == VAR_PRESENT
+        && entry->attributes == attributes && entry->size == size
+        && !memcmp(entry->data, data, size))
+        return EFI_SUCCESS;
+    if (!entry->device_path && entry->state == VAR_ABSENT && !size)
+        return EFI_SUCCESS;
+
+    var_store(entry, attributes, size, data);
+    entry->device_path = NULL;
+    entry->pending = true;
+    return EFI_SUCCESS;
+}
+
 #define PRINTF_MAXLEN 100
 
 efi_size_t efi_var_set_printf(
@@ -44,5 +299,56 @@ efi_size_t efi_var_set_printf(
     efi_size_t len = vswprintf(buff, PRINTF_MAXLEN, fmt, args) + 1;
     len *= sizeof(char16_t);
     va_end(args);
-    return efi_var_set(guid, name, attributes, len, buff);
+    return var_queue(guid, name, attributes, len, buff);
+}
+
+efi_status_t efi_var_set_device_path(
+    const efi_guid_t guid,
+    const char16_t* name,
+    uint32_t attributes,
+    efi_device_path_t dp
+) {
+    struct var_entry* entry = var_find(guid, name);
+    if (!entry)
+        return efi_var_set_printf(guid, name, attributes, u"%D", dp);
+
+    entry->state = VAR_PRESENT;
+    entry->attributes = attributes;
+    entry->size = 0;
+    entry->device_path = dp;
+    entry->pending = true;
+    return EFI_SUCCESS;
+}
+
+efi_status_t efi_var_flush(void) {
+    efi_status_t status = EFI_SUCCESS;
+    for (uint32_t i = 0; i < var_cache.used; i++) {
+        if (!var_cache.entries[i].pending)
+            continue;
+        efi_status_t err = var_write_entry(&var_cache.entries[i]);
+        if (EFI_ERROR(err) && !EFI_ERROR(status))
+            status = err;
+    }
+    return status;
+}
+
+uint32_t efi_var_attributes(
+    const efi_guid_t guid,
+    const char16_t* name
+) {
+    struct var_entry* entry = var_find(guid, name);
+    if (entry) {
+        if (entry->state == VAR_UNKNOWN)
+            var_read(entry);
+        return entry->state == VAR_PRESENT ? entry->attributes : 0;
+    }
+
+    efi_size_t size = 0;
+    uint32_t attributes = 0;
+    efi_status_t err = RT->get_variable(name, guid, &attributes, &size, NULL);
+    if (err == EFI_BUFFER_TOO_SMALL)
+        return attributes;
+    else
+        EFILIB_DBG_PRINTF("GetVariable {%g} %ls %r", guid, name, err);
+    return 0;
 }
@@ -19,3 +19,13 @@ struct efi_guid efi_global_variable_guid = {{ EFI_GLOBAL_VARIABLE_GUID }};
 struct efi_guid efi_device_path_utilities_guid = {{ EFI_DEVICE_PATH_UTILITIES_PROTOCOL_GUID }};
 
 struct efi_guid efi_device_path_to_text_guid = {{ EFI_DEVICE_PATH_TO_TEXT_PROTOCOL_GUID }};
+
+struct efi_guid efi_mp_services_protocol_guid = {{ EFI_MP_SERVICES_PROTOCOL_GUID }};
+
+struct efi_guid efi_acpi_20_table_guid = {{ EFI_ACPI_20_TABLE_GUID }};
+
+struct efi_guid efi_fdt_guid = {{ EFI_FDT_GUID }};
+
+struct efi_guid efi_timestamp_protocol_guid = {{ EFI_TIMESTAMP_PROTOCOL_GUID }};
+
+struct efi_guid efilib_vendor_guid = {{ EFILIB_VENDOR_GUID }};
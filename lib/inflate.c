@@ -0,0 +1,940 @@
+/**
+ * @file inflate.c
+ * @author Max Resch
+ * @brief table driven deflate decoder (RFC 1951) with gzip framing (RFC 1952)
+ * @version 0.1
+ * @date 2021-10-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  The input is read through a 64 bit bit buffer, which is refilled
+ *  branchless with one unaligned load: afterwards it holds at least 56 bits,
+ *  enough for a length with its extra bits and the following distance.
+ *
+ *  Huffman codes are decoded with a single lookup in most cases. Every
+ *  table entry carries the decoded value, the bits to consume and the
+ *  number of extra bits, see ENTRY(). Literal entries are merged with the
+ *  literal following them if both codes fit into the first lookup, so runs
+ *  of literals decode two bytes per lookup.
+ *
+ *  The fast loop runs while there are enough input bytes for an unchecked
+ *  refill and enough output space for the longest match plus the overrun
+ *  of the chunked copy. The remaining symbols are decoded with checked
+ *  refills and exact copies, which can stop in the middle of a match when
+ *  the output space is exhausted.
+ */
+#include <inflate.h>
+#include <string.h>
+
+enum inflate_mode {
+    MODE_HEADER,                ///< block header (or the end of the stream)
+    MODE_STORED,
+    MODE_HUFFMAN,
+    MODE_DONE,
+};
+
+enum entry_kind {
+    KIND_LITERAL,               ///< value is the byte
+    KIND_LITERAL2,              ///< value holds two bytes, extra the bits of the first code
+    KIND_BASE,                  ///< length or distance: value plus extra bits
+    KIND_END,                   ///< end of block
+    KIND_SUBTABLE,              ///< value is the offset, bits the index width
+    KIND_INVALID,
+};
+
+enum table_type {
+    TABLE_LITLEN,
+    TABLE_DIST,
+    TABLE_PRECODE,
+};
+
+/*
+ * [7:0]   bits to consume for the code
+ * [11:8]  extra bits behind the code
+ * [15:12] enum entry_kind
+ * [31:16] value
+ */
+#define ENTRY(kind, value, extra) \
+    ((uint32_t) (value) << 16 | (uint32_t) (kind) << 12 | (uint32_t) (extra) << 8)
+#define ENTRY_BITS(e)   ((e) & 0xFF)
+#define ENTRY_EXTRA(e)  (((e) >> 8) & 0xF)
+#define ENTRY_KIND(e)   (((e) >> 12) & 0xF)
+#define ENTRY_VALUE(e)  ((e) >> 16)
+
+#define ENTRY_INVALID   ENTRY(KIND_INVALID, 0, 0)
+
+#define BITMASK(n)      ((UINT64_C(1) << (n)) - 1)
+
+#define PRECODE_BITS    7
+#define MAX_CODE_LENGTH 15
+
+/* the unchecked refill loads 8 bytes */
+#define FASTLOOP_IN_MARGIN  8
+/* a match copied in 16 byte chunks */
+#define FASTLOOP_OUT_MARGIN (INFLATE_MAX_MATCH + 16)
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const uint8_t precode_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static inline
+uint64_t load_le64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline
+uint32_t load_le32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* the bit reader works on local copies in inflate_run */
+#define LOAD_STATE() \
+    const uint8_t* in = s->in; \
+    const uint8_t* in_end = s->in_end; \
+    uint64_t bitbuf = s->bitbuf; \
+    uint32_t bitcnt = s->bitcnt; \
+    uint32_t overrun = s->overrun
+
+#define SAVE_STATE() do { \
+    s->in = in; \
+    s->bitbuf = bitbuf; \
+    s->bitcnt = bitcnt; \
+    s->overrun = overrun; \
+} while (0)
+
+#define RELOAD_STATE() do { \
+    in = s->in; \
+    bitbuf = s->bitbuf; \
+    bitcnt = s->bitcnt; \
+    overrun = s->overrun; \
+} while (0)
+
+/*
+ * Loads whole bytes until at least 56 bits are valid. The bits above
+ * bitcnt are the beginning of the bytes at in, the next refill ORs the same
+ * bits again.
+ */
+#define REFILL_FAST() do { \
+    bitbuf |= load_le64(in) << bitcnt; \
+    in += (63 - bitcnt) >> 3; \
+    bitcnt |= 56; \
+} while (0)
+
+/* behind the input zeros are loaded, TRUNCATED() tells if they were used */
+#define REFILL_SAFE() do { \
+    while (bitcnt < 56) { \
+        if (in < in_end) \
+            bitbuf |= (uint64_t) *(in++) << bitcnt; \
+        else \
+            overrun++; \
+        bitcnt += 8; \
+    } \
+} while (0)
+
+#define TRUNCATED() (bitcnt < overrun * 8)
+
+#define CONSUME(n) do { \
+    bitbuf >>= (n); \
+    bitcnt -= (n); \
+} while (0)
+
+static inline
+uint32_t reverse_bits(
+    uint32_t code,
+    unsigned length
+) {
+    uint32_t r = 0;
+    for (unsigned i = 0; i < length; i++) {
+        r = (r << 1) | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+static inline
+uint32_t symbol_entry(
+    enum table_type type,
+    unsigned symbol
+) {
+    switch (type) {
+        case TABLE_LITLEN:
+            if (symbol < 256)
+                return ENTRY(KIND_LITERAL, symbol, 0);
+            if (symbol == 256)
+                return ENTRY(KIND_END, 0, 0);
+            if (symbol < 286)
+                return ENTRY(KIND_BASE, length_base[symbol - 257], length_extra[symbol - 257]);
+            return ENTRY_INVALID;
+        case TABLE_DIST:
+            if (symbol < 30)
+                return ENTRY(KIND_BASE, dist_base[symbol], dist_extra[symbol]);
+            return ENTRY_INVALID;
+        default:
+            return ENTRY(KIND_LITERAL, symbol, 0);
+    }
+}
+
+/**
+ * @brief build the lookup table of a canonical Huffman code
+ *
+ * @details
+ *  Codes up to table_bits long fill every entry whose low bits are the
+ *  (reversed) code. Longer codes share a subtable per first table_bits bits,
+ *  all subtables of a table have the size of the longest code.
+ *
+ * @param[in] capacity
+ *  entries available at table
+ * @param[in] lengths
+ *  code length per symbol, 0 for unused symbols
+ */
+static
+bool build_table(
+    uint32_t* table,
+    unsigned table_bits,
+    size_t capacity,
+    const uint8_t* lengths,
+    unsigned count,
+    enum table_type type
+) {
+    uint16_t counts[MAX_CODE_LENGTH + 1] = { 0 };
+    uint16_t offsets[MAX_CODE_LENGTH + 1];
+    uint16_t sorted[288];
+
+    for (unsigned i = 0; i < count; i++)
+        counts[lengths[i]]++;
+    counts[0] = 0;
+
+    int32_t left = 1;
+    unsigned max_length = 0;
+    for (unsigned len = 1; len <= MAX_CODE_LENGTH; len++) {
+        left = (left << 1) - counts[len];
+        if (left < 0)
+            return false;
+        if (counts[len])
+            max_length = len;
+    }
+    /* only a single code of one bit may leave codes unused */
+    if (left > 0 && (max_length > 1 || type == TABLE_PRECODE))
+        return false;
+
+    offsets[1] = 0;
+    for (unsigned len = 1; len < MAX_CODE_LENGTH; len++)
+        offsets[len + 1] = offsets[len] + counts[len];
+    for (unsigned i = 0; i < count; i++) {
+        if (lengths[i])
+            sorted[offsets[lengths[i]]++] = i;
+    }
+
+    size_t size = (size_t) 1 << table_bits;
+    for (size_t i = 0; i < size; i++)
+        table[i] = ENTRY_INVALID;
+
+    unsigned sub_bits = max_length > table_bits ? max_length - table_bits : 0;
+    size_t next = size, sub = 0;
+    uint32_t prefix = UINT32_MAX;
+    uint32_t code = 0;
+    unsigned k = 0;
+    for (unsigned len = 1; len <= max_length; len++, code <<= 1) {
+        for (unsigned n = 0; n < counts[len]; n++, k++, code++) {
+            uint32_t entry = symbol_entry(type, sorted[k]);
+            uint32_t rev = reverse_bits(code, len);
+            if (len <= table_bits) {
+                for (size_t i = rev; i < size; i += (size_t) 1 << len)
+                    table[i] = entry | len;
+                continue;
+            }
+
+            /* canonical codes with the same first bits are adjacent */
+            if ((rev & (size - 1)) != prefix) {
+                prefix = rev & (size - 1);
+                sub = next;
+                next += (size_t) 1 << sub_bits;
+                if (next > capacity)
+                    return false;
+                for (size_t i = sub; i < next; i++)
+                    table[i] = ENTRY_INVALID;
+                table[prefix] = ENTRY(KIND_SUBTABLE, sub, 0) | sub_bits;
+            }
+            unsigned sub_len = len - table_bits;
+            for (size_t i = rev >> table_bits; i < ((size_t) 1 << sub_bits); i += (size_t) 1 << sub_len)
+                table[sub + i] = entry | sub_len;
+        }
+    }
+
+    if (type != TABLE_LITLEN)
+        return true;
+
+    /*
+     * The bits behind a literal code are the beginning of the next code. If
+     * the entry they index is a literal that is short enough to be decided
+     * by them alone, both can be decoded at once. Going backwards only reads
+     * entries that were not merged yet.
+     */
+    for (size_t i = size; i-- > 0;) {
+        uint32_t first = table[i];
+        if (ENTRY_KIND(first) != KIND_LITERAL)
+            continue;
+        unsigned len = ENTRY_BITS(first);
+        uint32_t second = table[i >> len];
+        if (ENTRY_KIND(second) != KIND_LITERAL || len + ENTRY_BITS(second) > table_bits)
+            continue;
+        table[i] = ENTRY(KIND_LITERAL2, ENTRY_VALUE(first) | ENTRY_VALUE(second) << 8, len)
+            | (len + ENTRY_BITS(second));
+    }
+    return true;
+}
+
+static
+bool build_fixed_tables(
+    struct inflate_state* s
+) {
+    uint8_t lengths[288 + 32];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    memset(lengths + 288, 5, 32);
+
+    s->fixed = build_table(s->litlen, INFLATE_LITLEN_BITS, INFLATE_LITLEN_ENTRIES, lengths, 288, TABLE_LITLEN)
+        && build_table(s->dist, INFLATE_DIST_BITS, INFLATE_DIST_ENTRIES, lengths + 288, 32, TABLE_DIST);
+    return s->fixed;
+}
+
+/**
+ * @brief read the code lengths of a dynamic block and build its tables
+ */
+static
+enum inflate_status read_dynamic_tables(
+    struct inflate_state* s
+) {
+    LOAD_STATE();
+    uint8_t lengths[286 + 30];
+    uint8_t precode_lengths[19] = { 0 };
+    uint32_t precode[1 << PRECODE_BITS];
+
+    s->fixed = false;
+    REFILL_SAFE();
+    unsigned hlit = (bitbuf & BITMASK(5)) + 257;
+    unsigned hdist = ((bitbuf >> 5) & BITMASK(5)) + 1;
+    unsigned hclen = ((bitbuf >> 10) & BITMASK(4)) + 4;
+    CONSUME(14);
+    if (hlit > 286 || hdist > 30)
+        return INFLATE_CORRUPT;
+
+    for (unsigned i = 0; i < hclen; i++) {
+        REFILL_SAFE();
+        precode_lengths[precode_order[i]] = bitbuf & BITMASK(3);
+        CONSUME(3);
+    }
+    if (TRUNCATED())
+        return INFLATE_TRUNCATED;
+    if (!build_table(precode, PRECODE_BITS, 1 << PRECODE_BITS, precode_lengths, 19, TABLE_PRECODE))
+        return INFLATE_CORRUPT;
+
+    for (unsigned i = 0; i < hlit + hdist;) {
+        REFILL_SAFE();
+        uint32_t entry = precode[bitbuf & BITMASK(PRECODE_BITS)];
+        CONSUME(ENTRY_BITS(entry));
+        unsigned symbol = ENTRY_VALUE(entry);
+
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+
+        unsigned repeat;
+        uint8_t value = 0;
+        if (symbol == 16) {
+            if (i == 0)
+                return INFLATE_CORRUPT;
+            value = lengths[i - 1];
+            repeat = 3 + (bitbuf & BITMASK(2));
+            CONSUME(2);
+        } else if (symbol == 17) {
+            repeat = 3 + (bitbuf & BITMASK(3));
+            CONSUME(3);
+        } else {
+            repeat = 11 + (bitbuf & BITMASK(7));
+            CONSUME(7);
+        }
+        if (repeat > hlit + hdist - i)
+            return INFLATE_CORRUPT;
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+    if (TRUNCATED())
+        return INFLATE_TRUNCATED;
+
+    /* without an end of block code the block never ends */
+    if (lengths[256] == 0)
+        return INFLATE_CORRUPT;
+    if (!build_table(s->litlen, INFLATE_LITLEN_BITS, INFLATE_LITLEN_ENTRIES, lengths, hlit, TABLE_LITLEN)
+        || !build_table(s->dist, INFLATE_DIST_BITS, INFLATE_DIST_ENTRIES, lengths + hlit, hdist, TABLE_DIST))
+        return INFLATE_CORRUPT;
+
+    SAVE_STATE();
+    return INFLATE_DONE;
+}
+
+/**
+ * @brief copy length bytes from distance bytes back, may write up to 15
+ *  bytes more for distances of at least 8
+ */
+static inline
+void copy_match(
+    uint8_t* out,
+    uint32_t distance,
+    uint32_t length
+) {
+    const uint8_t* src = out - distance;
+    uint8_t* end = out + length;
+    if (distance >= 16) {
+        do {
+            uint64_t a = load_le64(src), b = load_le64(src + 8);
+            memcpy(out, &a, sizeof(a));
+            memcpy(out + 8, &b, sizeof(b));
+            src += 16;
+            out += 16;
+        } while (out < end);
+    } else if (distance >= 8) {
+        do {
+            uint64_t a = load_le64(src);
+            memcpy(out, &a, sizeof(a));
+            src += 8;
+            out += 8;
+        } while (out < end);
+    } else if (distance == 1) {
+        uint64_t v = src[0] * UINT64_C(0x0101010101010101);
+        do {
+            memcpy(out, &v, sizeof(v));
+            out += 8;
+        } while (out < end);
+    } else {
+        while (out < end)
+            *(out++) = *(src++);
+    }
+}
+
+void inflate_init(
+    struct inflate_state* s,
+    const void* in,
+    size_t in_size
+) {
+    s->in = in;
+    s->in_end = (const uint8_t*) in + in_size;
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+    s->overrun = 0;
+    s->mode = MODE_HEADER;
+    s->final = false;
+    s->fixed = false;
+    s->stored = 0;
+    s->match_length = 0;
+    s->match_distance = 0;
+}
+
+enum inflate_status inflate_run(
+    struct inflate_state* s,
+    uint8_t* window,
+    uint8_t** out_p,
+    uint8_t* out_end
+) {
+    enum inflate_status status = INFLATE_DONE;
+    const uint32_t* litlen = s->litlen;
+    const uint32_t* dist = s->dist;
+    uint8_t* out = *out_p;
+    LOAD_STATE();
+
+    for (;;) {
+        switch (s->mode) {
+            case MODE_HEADER: {
+                if (s->final) {
+                    s->mode = MODE_DONE;
+                    continue;
+                }
+
+                REFILL_SAFE();
+                s->final = bitbuf & 1;
+                unsigned type = (bitbuf >> 1) & BITMASK(2);
+                CONSUME(3);
+                if (TRUNCATED()) {
+                    status = INFLATE_TRUNCATED;
+                    goto end;
+                }
+
+                if (type == 0) {
+                    /* LEN and NLEN start at the next byte */
+                    CONSUME(bitcnt & 7);
+                    if (bitcnt / 8 < overrun) {
+                        status = INFLATE_TRUNCATED;
+                        goto end;
+                    }
+                    in -= bitcnt / 8 - overrun;
+                    bitbuf = bitcnt = overrun = 0;
+                    if (in_end - in < 4) {
+                        status = INFLATE_TRUNCATED;
+                        goto end;
+                    }
+                    uint32_t header = load_le32(in);
+                    if ((header & 0xFFFF) != (~header >> 16)) {
+                        status = INFLATE_CORRUPT;
+                        goto end;
+                    }
+                    in += 4;
+                    s->stored = header & 0xFFFF;
+                    s->mode = MODE_STORED;
+                } else if (type == 1) {
+                    if (!s->fixed && !build_fixed_tables(s)) {
+                        status = INFLATE_CORRUPT;
+                        goto end;
+                    }
+                    s->mode = MODE_HUFFMAN;
+                } else if (type == 2) {
+                    SAVE_STATE();
+                    status = read_dynamic_tables(s);
+                    if (status != INFLATE_DONE)
+                        goto end;
+                    RELOAD_STATE();
+                    s->mode = MODE_HUFFMAN;
+                } else {
+                    status = INFLATE_CORRUPT;
+                    goto end;
+                }
+                continue;
+            }
+
+            case MODE_STORED: {
+                size_t n = s->stored;
+                if (n > (size_t) (out_end - out))
+                    n = out_end - out;
+                if (n > (size_t) (in_end - in))
+                    n = in_end - in;
+                memcpy(out, in, n);
+                in += n;
+                out += n;
+                s->stored -= n;
+
+                if (s->stored == 0) {
+                    s->mode = MODE_HEADER;
+                    continue;
+                }
+                status = out == out_end ? INFLATE_OUTPUT_FULL : INFLATE_TRUNCATED;
+                goto end;
+            }
+
+            case MODE_HUFFMAN:
+                break;
+
+            default:
+                /* return the whole bytes left in the bit buffer */
+                CONSUME(bitcnt & 7);
+                if (bitcnt / 8 < overrun) {
+                    status = INFLATE_TRUNCATED;
+                    goto end;
+                }
+                in -= bitcnt / 8 - overrun;
+                bitbuf = bitcnt = overrun = 0;
+                status = INFLATE_DONE;
+                goto end;
+        }
+
+        /* continue a match that didn't fit */
+        if (s->match_length) {
+            uint32_t n = s->match_length;
+            if (n > (size_t) (out_end - out))
+                n = out_end - out;
+            for (uint32_t i = 0; i < n; i++, out++)
+                *out = *(out - s->match_distance);
+            s->match_length -= n;
+            if (s->match_length) {
+                status = INFLATE_OUTPUT_FULL;
+                goto end;
+            }
+        }
+
+        while (in_end - in >= FASTLOOP_IN_MARGIN && out_end - out >= FASTLOOP_OUT_MARGIN) {
+            REFILL_FAST();
+            uint32_t entry = litlen[bitbuf & BITMASK(INFLATE_LITLEN_BITS)];
+            if (ENTRY_KIND(entry) == KIND_LITERAL2) {
+                uint16_t v = ENTRY_VALUE(entry);
+                CONSUME(ENTRY_BITS(entry));
+                memcpy(out, &v, sizeof(v));
+                out += 2;
+                continue;
+            }
+            if (ENTRY_KIND(entry) == KIND_SUBTABLE) {
+                CONSUME(INFLATE_LITLEN_BITS);
+                entry = litlen[ENTRY_VALUE(entry) + (bitbuf & BITMASK(ENTRY_BITS(entry)))];
+            }
+            if (ENTRY_KIND(entry) == KIND_LITERAL) {
+                CONSUME(ENTRY_BITS(entry));
+                *(out++) = ENTRY_VALUE(entry);
+                continue;
+            }
+            if (ENTRY_KIND(entry) != KIND_BASE) {
+                if (ENTRY_KIND(entry) != KIND_END) {
+                    status = INFLATE_CORRUPT;
+                    goto end;
+                }
+                CONSUME(ENTRY_BITS(entry));
+                s->mode = MODE_HEADER;
+                goto next_block;
+            }
+
+            /* at most 20 bits so far, the distance needs at most 28 */
+            uint32_t length = ENTRY_VALUE(entry) + ((bitbuf >> ENTRY_BITS(entry)) & BITMASK(ENTRY_EXTRA(entry)));
+            CONSUME(ENTRY_BITS(entry) + ENTRY_EXTRA(entry));
+
+            entry = dist[bitbuf & BITMASK(INFLATE_DIST_BITS)];
+            if (ENTRY_KIND(entry) == KIND_SUBTABLE) {
+                CONSUME(INFLATE_DIST_BITS);
+                entry = dist[ENTRY_VALUE(entry) + (bitbuf & BITMASK(ENTRY_BITS(entry)))];
+            }
+            if (ENTRY_KIND(entry) != KIND_BASE) {
+                status = INFLATE_CORRUPT;
+                goto end;
+            }
+            uint32_t distance = ENTRY_VALUE(entry) + ((bitbuf >> ENTRY_BITS(entry)) & BITMASK(ENTRY_EXTRA(entry)));
+            CONSUME(ENTRY_BITS(entry) + ENTRY_EXTRA(entry));
+            if (distance > (size_t) (out - window)) {
+                status = INFLATE_CORRUPT;
+                goto end;
+            }
+
+            copy_match(out, distance, length);
+            out += length;
+        }
+
+        /*
+         * Near the end of the input or the output. Symbols are only consumed
+         * once it is clear that they fit, a block may end on a full buffer.
+         */
+        for (;;) {
+            REFILL_SAFE();
+            unsigned skip = 0;
+            uint32_t entry = litlen[bitbuf & BITMASK(INFLATE_LITLEN_BITS)];
+            if (ENTRY_KIND(entry) == KIND_SUBTABLE) {
+                skip = INFLATE_LITLEN_BITS;
+                entry = litlen[ENTRY_VALUE(entry) + ((bitbuf >> skip) & BITMASK(ENTRY_BITS(entry)))];
+            }
+            /* decode only the first literal if the second doesn't fit */
+            if (ENTRY_KIND(entry) == KIND_LITERAL2 && out_end - out < 2)
+                entry = ENTRY(KIND_LITERAL, ENTRY_VALUE(entry) & 0xFF, 0) | ENTRY_EXTRA(entry);
+
+            if (ENTRY_KIND(entry) == KIND_INVALID) {
+                status = INFLATE_CORRUPT;
+                goto end;
+            }
+            if (ENTRY_KIND(entry) != KIND_END && out == out_end) {
+                status = INFLATE_OUTPUT_FULL;
+                goto end;
+            }
+
+            if (ENTRY_KIND(entry) != KIND_BASE) {
+                CONSUME(skip + ENTRY_BITS(entry));
+                if (TRUNCATED()) {
+                    status = INFLATE_TRUNCATED;
+                    goto end;
+                }
+                if (ENTRY_KIND(entry) == KIND_END) {
+                    s->mode = MODE_HEADER;
+                    goto next_block;
+                }
+                *(out++) = ENTRY_VALUE(entry) & 0xFF;
+                if (ENTRY_KIND(entry) == KIND_LITERAL2)
+                    *(out++) = ENTRY_VALUE(entry) >> 8;
+                continue;
+            }
+
+            uint32_t length = ENTRY_VALUE(entry) + ((bitbuf >> (skip + ENTRY_BITS(entry))) & BITMASK(ENTRY_EXTRA(entry)));
+            CONSUME(skip + ENTRY_BITS(entry) + ENTRY_EXTRA(entry));
+            REFILL_SAFE();
+
+            entry = dist[bitbuf & BITMASK(INFLATE_DIST_BITS)];
+            if (ENTRY_KIND(entry) == KIND_SUBTABLE) {
+                CONSUME(INFLATE_DIST_BITS);
+                entry = dist[ENTRY_VALUE(entry) + (bitbuf & BITMASK(ENTRY_BITS(entry)))];
+            }
+            if (ENTRY_KIND(entry) != KIND_BASE) {
+                status = INFLATE_CORRUPT;
+                goto end;
+            }
+            uint32_t distance = ENTRY_VALUE(entry) + ((bitbuf >> ENTRY_BITS(entry)) & BITMASK(ENTRY_EXTRA(entry)));
+            CONSUME(ENTRY_BITS(entry) + ENTRY_EXTRA(entry));
+            if (TRUNCATED()) {
+                status = INFLATE_TRUNCATED;
+                goto end;
+            }
+            if (distance > (size_t) (out - window)) {
+                status = INFLATE_CORRUPT;
+                goto end;
+            }
+
+            uint32_t n = length;
+            if (n > (size_t) (out_end - out))
+                n = out_end - out;
+            for (uint32_t i = 0; i < n; i++, out++)
+                *out = *(out - distance);
+            if (n < length) {
+                s->match_length = length - n;
+                s->match_distance = distance;
+                status = INFLATE_OUTPUT_FULL;
+                goto end;
+            }
+        }
+
+next_block:
+        continue;
+    }
+
+end:
+    SAVE_STATE();
+    *out_p = out;
+    return status;
+}
+
+static uint32_t crc32_table[8][256];
+static bool crc32_initialized = false;
+
+static
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (unsigned k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ UINT32_C(0xEDB88320) : c >> 1;
+        crc32_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (unsigned t = 1; t < 8; t++)
+            crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^ crc32_table[0][crc32_table[t - 1][i] & 0xFF];
+    }
+    crc32_initialized = true;
+}
+
+uint32_t gzip_crc32(
+    uint32_t crc,
+    const void* data,
+    size_t length
+) {
+    const uint8_t* p = data;
+    if (!crc32_initialized)
+        crc32_init();
+
+    /* slicing by 8 */
+    crc = ~crc;
+    for (; length >= 8; length -= 8, p += 8) {
+        uint64_t v = load_le64(p) ^ crc;
+        crc = crc32_table[7][v & 0xFF] ^ crc32_table[6][(v >> 8) & 0xFF]
+            ^ crc32_table[5][(v >> 16) & 0xFF] ^ crc32_table[4][(v >> 24) & 0xFF]
+            ^ crc32_table[3][(v >> 32) & 0xFF] ^ crc32_table[2][(v >> 40) & 0xFF]
+            ^ crc32_table[1][(v >> 48) & 0xFF] ^ crc32_table[0][v >> 56];
+    }
+    while (length--)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *(p++)) & 0xFF];
+    return ~crc;
+}
+
+/* gzip header flags */
+#define GZIP_FHCRC      0x02
+#define GZIP_FEXTRA     0x04
+#define GZIP_FNAME      0x08
+#define GZIP_FCOMMENT   0x10
+#define GZIP_FRESERVED  0xE0
+
+enum inflate_status gzip_header(
+    const uint8_t* in,
+    size_t in_size,
+    size_t* header_size
+) {
+    /* magic, CM, FLG, MTIME, XFL and OS */
+    if (in_size < 10)
+        return INFLATE_TRUNCATED;
+    if ((load_le32(in) & GZIP_MAGIC_MASK) != GZIP_MAGIC || (in[3] & GZIP_FRESERVED))
+        return INFLATE_UNSUPPORTED;
+
+    uint8_t flags = in[3];
+    size_t pos = 10;
+    if (flags & GZIP_FEXTRA) {
+        if (in_size - pos < 2)
+            return INFLATE_TRUNCATED;
+        pos += 2 + (in[pos] | in[pos + 1] << 8);
+    }
+    for (uint8_t string = GZIP_FNAME; string <= GZIP_FCOMMENT; string <<= 1) {
+        if (!(flags & string))
+            continue;
+        while (pos < in_size && in[pos])
+            pos++;
+        pos++;
+    }
+    if (flags & GZIP_FHCRC)
+        pos += 2;
+    if (pos > in_size)
+        return INFLATE_TRUNCATED;
+
+    *header_size = pos;
+    return INFLATE_DONE;
+}
+
+enum inflate_status gzip_trailer(
+    struct inflate_state* s,
+    uint32_t crc,
+    size_t size,
+    bool verify
+) {
+    if (s->in_end - s->in < GZIP_TRAILER_SIZE)
+        return INFLATE_TRUNCATED;
+    if (verify && load_le32(s->in) != crc)
+        return INFLATE_CHECKSUM;
+    /* ISIZE is the size modulo 4 GiB */
+    if (load_le32(s->in + 4) != (uint32_t) size)
+        return INFLATE_CHECKSUM;
+    s->in += GZIP_TRAILER_SIZE;
+    return INFLATE_DONE;
+}
+
+/* a header, an empty fixed block and the trailer */
+#define GZIP_MIN_MEMBER_SIZE    20
+/* operating systems defined by RFC 1952 and "unknown" */
+#define GZIP_OS_MAX             13
+#define GZIP_OS_UNKNOWN         255
+
+bool gzip_multi_member(
+    const uint8_t* in,
+    size_t in_size
+) {
+    if (in_size < 2 * GZIP_MIN_MEMBER_SIZE)
+        return false;
+
+    const uint64_t ones = UINT64_C(0x0101010101010101);
+    const uint8_t* p = in + GZIP_MIN_MEMBER_SIZE;
+    const uint8_t* last = in + in_size - GZIP_MIN_MEMBER_SIZE;
+    while (p <= last) {
+        /* skip words without the first magic byte */
+        if (last - p >= 8) {
+            uint64_t v = load_le64(p) ^ (ones * 0x1f);
+            if (!((v - ones) & ~v & (ones << 7))) {
+                p += 8;
+                continue;
+            }
+        }
+        if ((load_le32(p) & GZIP_MAGIC_MASK) == GZIP_MAGIC && !(p[3] & GZIP_FRESERVED)
+                && (p[9] <= GZIP_OS_MAX || p[9] == GZIP_OS_UNKNOWN))
+            return true;
+        p++;
+    }
+    return false;
+}
+
+enum inflate_status gzip_members(
+    struct inflate_state* s,
+    const uint8_t* in,
+    size_t in_size,
+    uint8_t* buffer,
+    size_t buffer_size,
+    size_t* size
+) {
+    if (buffer_size <= INFLATE_WINDOW_SIZE)
+        return INFLATE_OUTPUT_FULL;
+
+    const uint8_t* next = in;
+    const uint8_t* end = in + in_size;
+    size_t total = 0;
+    do {
+        size_t header_size;
+        enum inflate_status status = gzip_header(next, end - next, &header_size);
+        if (status != INFLATE_DONE)
+            return status;
+
+        /* only the window is kept */
+        inflate_init(s, next + header_size, end - next - header_size);
+        size_t length = 0, member = 0;
+        status = INFLATE_OUTPUT_FULL;
+        while (status == INFLATE_OUTPUT_FULL) {
+            if (length == buffer_size) {
+                memmove(buffer, buffer + length - INFLATE_WINDOW_SIZE, INFLATE_WINDOW_SIZE);
+                length = INFLATE_WINDOW_SIZE;
+            }
+            uint8_t* out = buffer + length;
+            status = inflate_run(s, buffer, &out, buffer + buffer_size);
+            member += out - (buffer + length);
+            length = out - buffer;
+        }
+        if (status == INFLATE_DONE)
+            status = gzip_trailer(s, 0, member, false);
+        if (status != INFLATE_DONE)
+            return status;
+
+        total += member;
+        next = inflate_input(s);
+    } while (next < end);
+
+    *size = total;
+    return INFLATE_DONE;
+}
+
+enum inflate_status gzip_decompress(
+    struct inflate_state* s,
+    const uint8_t* in,
+    size_t in_size,
+    uint8_t* out,
+    size_t length,
+    size_t capacity,
+    bool verify,
+    size_t* consumed
+) {
+    const uint8_t* next = in;
+    const uint8_t* end = in + in_size;
+    uint8_t* pos = out;
+    do {
+        size_t header_size;
+        enum inflate_status status = gzip_header(next, end - next, &header_size);
+        if (status != INFLATE_DONE)
+            return status;
+
+        inflate_init(s, next + header_size, end - next - header_size);
+        uint8_t* member = pos;
+        status = inflate_run(s, member, &pos, out + capacity);
+        if (status == INFLATE_OUTPUT_FULL)
+            return INFLATE_CORRUPT;
+        if (status != INFLATE_DONE)
+            return status;
+        if ((size_t) (pos - out) > length)
+            return INFLATE_CHECKSUM;
+
+        size_t size = pos - member;
+        status = gzip_trailer(s, verify ? gzip_crc32(0, member, size) : 0, size, verify);
+        if (status != INFLATE_DONE)
+            return status;
+        next = inflate_input(s);
+    } while (next < end);
+
+    if ((size_t) (pos - out) != length)
+        return INFLATE_CHECKSUM;
+    *consumed = next - in;
+    return INFLATE_DONE;
+}
@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "zstd_deps.h"
 
 #if __has_c_attribute(maybe_unused) && __has_c_attribute(gnu::always_inline)
@@ -49,7 +50,7 @@ typedef uintptr_t uPtrDiff;
 MEM_STATIC bool ZSTD_32bits(void) { return sizeof(size_t) == 4; }
 MEM_STATIC bool ZSTD_64bits(void) { return sizeof(size_t) == 8; }
 
-MEM_STATIC bool ZSTD_isLittleEndian(void) { return __LITTLE_ENDIAN__; }
+MEM_STATIC bool ZSTD_isLittleEndian(void) { return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__; }
 
 typedef struct { U16 v; } __attribute__((packed)) unalign16;
 typedef struct { U32 v; } __attribute__((packed)) unalign32;
@@ -207,20 +208,6 @@ MEM_STATIC void ZSTD_writeBEST(void *memPtr, size_t val)
 		ZSTD_writeBE64(memPtr, (U64) val);
 }
 
-/* function safe only for comparisons */
-MEM_STATIC U32 ZSTD_readMINMATCH(const void *memPtr, U32 length)
-{
-	switch (length) {
-		default:
-		case 4: return ZSTD_read32(memPtr);
-		case 3:
-			if (ZSTD_isLittleEndian())
-				return ZSTD_read32(memPtr) << 8;
-			else
-				return ZSTD_read32(memPtr) >> 8;
-	}
-}
-
 #define MEM_isLittleEndian  ZSTD_isLittleEndian
 #define MEM_32bits          ZSTD_32bits
 #define MEM_64bits          ZSTD_64bits
@@ -233,11 +220,13 @@ MEM_STATIC U32 ZSTD_readMINMATCH(const void *memPtr, U32 length)
 #define MEM_readLE32        ZSTD_readLE32
 #define MEM_readLE64        ZSTD_readLE64
 #define MEM_readLEST        ZSTD_readLEST
+#define MEM_readST          ZSTD_readST
 
 #define MEM_write16         ZSTD_write16
 #define MEM_write32         ZSTD_write32
 #define MEM_write64         ZSTD_write64
 #define MEM_writeLE16       ZSTD_writeLE16
+#define MEM_writeLE24       ZSTD_writeLE24
 #define MEM_writeLE32       ZSTD_writeLE32
 #define MEM_writeLE64       ZSTD_writeLE64
 #define MEM_writeLEST       ZSTD_writeLEST
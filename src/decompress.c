@@ -10,12 +10,21 @@
 #include "util.h"
 #include "pe.h"
 
+#include <frame_table.h>
+#include <bcj.h>
+
 #ifdef USE_LZ4
 # include <lz4.h>
 # include <lz4frame.h>
+# include <xxhash.h>
+#endif
+
+#ifdef USE_GZIP
+# include <inflate.h>
 #endif
 
 #ifdef USE_ZSTD
+# define ZSTD_STATIC_LINKING_ONLY
 # include <zstd.h>
 # include <zstd_errors.h>
 
@@ -37,171 +46,1556 @@ static_assert(
 );
 #endif
 
+/* size of the scratch buffer used to discard data */
+#define DECOMPRESS_SKIP_BUFFER_SIZE 4096
+
+static inline
+uint32_t read_le32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline
+uint64_t read_le64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
 #ifdef USE_LZ4
+/* LZ4 frame descriptor flags */
+#define LZ4_FLG_VERSION_MASK        0xC0
+#define LZ4_FLG_VERSION             0x40
+#define LZ4_FLG_BLOCK_INDEPENDENT   0x20
+#define LZ4_FLG_BLOCK_CHECKSUM      0x10
+#define LZ4_FLG_CONTENT_SIZE        0x08
+#define LZ4_FLG_CONTENT_CHECKSUM    0x04
+#define LZ4_FLG_RESERVED            0x02
+#define LZ4_FLG_DICT_ID             0x01
+#define LZ4_BD_RESERVED             0x8F
+
+/* highest bit of the block size marks uncompressed blocks */
+#define LZ4_BLOCK_UNCOMPRESSED      UINT32_C(0x80000000)
+
+/* linked blocks can reference up to 64 KiB of previous output */
+#define LZ4_WINDOW_SIZE             0x10000
+
+/* legacy format: magic, then independent blocks of 8 MiB without end mark */
+#define LZ4_LEGACY_MAGIC            UINT32_C(0x184C2102)
+#define LZ4_LEGACY_BLOCK_SIZE       (UINT32_C(8) << 20)
+
+struct lz4_frame {
+    uint8_t flags;
+    size_t block_max_size;
+    uint64_t content_size;
+    size_t header_size;
+};
+
+/**
+ * @brief parse and verify a LZ4 frame header
+ *
+ * @param[in] p
+ *  begin of the frame (magic number)
+ * @param[in] length
+ *  bytes available at p
+ * @param[out] frame
+ */
 static inline
-efi_status_t decompress_lz4(
-    simple_buffer_t in,
-    simple_buffer_t out
+efi_status_t lz4_frame_header(
+    const uint8_t* p,
+    size_t length,
+    struct lz4_frame* frame
+) {
+    /* magic, FLG, BD and HC */
+    if (length < 7)
+        return EFI_END_OF_FILE;
+
+    uint8_t flg = p[4], bd = p[5];
+    if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION || (flg & LZ4_FLG_RESERVED) || (bd & LZ4_BD_RESERVED))
+        return EFI_UNSUPPORTED;
+
+    size_t size = 6;
+    if (flg & LZ4_FLG_CONTENT_SIZE)
+        size += sizeof(uint64_t);
+    if (flg & LZ4_FLG_DICT_ID)
+        size += sizeof(uint32_t);
+    if (length < size + 1)
+        return EFI_END_OF_FILE;
+
+    if (((xxh32(p + 4, size - 4, 0) >> 8) & 0xFF) != p[size])
+        return EFI_COMPROMISED_DATA;
+
+    /* 64 KiB to 4 MiB */
+    unsigned block_size_id = (bd >> 4) & 0x7;
+    if (block_size_id < 4)
+        return EFI_UNSUPPORTED;
+
+    *frame = (struct lz4_frame) {
+        .flags = flg,
+        .block_max_size = (size_t) 1 << (2 * block_size_id + 8),
+        .content_size = flg & LZ4_FLG_CONTENT_SIZE ? read_le64(p + 6) : 0,
+        .header_size = size + 1,
+    };
+    return EFI_SUCCESS;
+}
+
+static inline
+efi_status_t open_lz4(
+    decompress_stream_t stream
 ) {
     efi_status_t err;
 
-    LZ4F_dctx* ctx;
-    err = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
-    if (LZ4F_isError(err)) {
-        _ERROR("LZ4 (%zu): %s", -err, LZ4F_getErrorName(err));
-        return EFI_OUT_OF_RESOURCES;
+    /* retrieve uncompressed size
+     * NOTE: This only works if lz4 was invoked with --content-size */
+    struct lz4_frame frame;
+    err = lz4_frame_header(buffer_pos(&stream->in), buffer_len(&stream->in), &frame);
+    if (EFI_ERROR(err)) {
+        _ERROR("LZ4 can't read frame header: %r", err);
+        return err;
     }
 
-    {
-        /* retrieve uncompressed size
-         * NOTE: This only works if lz4 was invoked with --content-size */
-        LZ4F_frameInfo_t frame_info = { 0 };
-        size_t in_pos = in->length;
-        err = LZ4F_getFrameInfo(ctx, &frame_info, buffer_pos(in), &in_pos);
-        if (LZ4F_isError(err)) {
-            _ERROR("LZ4 (%zu): %s", -err, LZ4F_getErrorName(err));
-            err = EFI_UNSUPPORTED;
-            goto end;
+    /* the frame decoder is only created for partial reads */
+    stream->content_size = frame.content_size;
+    return EFI_SUCCESS;
+}
+
+static inline
+efi_status_t read_lz4(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t length
+) {
+    if (!stream->ctx) {
+        LZ4F_dctx* ctx;
+        size_t result = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+        if (LZ4F_isError(result)) {
+            _ERROR("LZ4 (%zu): %s", -result, LZ4F_getErrorName(result));
+            return EFI_OUT_OF_RESOURCES;
         }
+        stream->ctx = ctx;
+    }
 
-        in->pos = in_pos;
+    size_t done = 0;
+    while (done < length) {
+        if (stream->in.pos >= stream->in.length) {
+            _ERROR("EOF before end of stream: %zu", length - done);
+            return EFI_END_OF_FILE;
+        }
 
-        if (!frame_info.contentSize) {
-            _ERROR("LZ4 does not contain uncompressed size");
-            err = EFI_UNSUPPORTED;
-            goto end;
+        size_t out_size = length - done;
+        size_t in_size = buffer_len(&stream->in);
+        size_t result = LZ4F_decompress(stream->ctx, buffer + done, &out_size, buffer_pos(&stream->in), &in_size, NULL);
+        if (LZ4F_isError(result)) {
+            _ERROR("LZ4 (%zu): %s", -result, LZ4F_getErrorName(result));
+            return EFI_UNSUPPORTED;
         }
+        stream->in.pos += in_size;
+        done += out_size;
 
-        if (!allocate_simple_buffer(frame_info.contentSize, out)) {
-            err = EFI_OUT_OF_RESOURCES;
-            goto end;
+        /* the decoder continues with the next frame of a frame table */
+        if (result == 0 && done < length && !stream->frames) {
+            _ERROR("EOF before end of stream: %zu", length - done);
+            return EFI_END_OF_FILE;
         }
     }
 
-    size_t result = 0;
-    while (in->pos < in->length) {
-        size_t out_end = out->allocated - out->pos;
-        size_t in_end = buffer_len(in);
-        result = LZ4F_decompress(ctx, buffer_pos((simple_buffer_t) out), &out_end, buffer_pos(in), &in_end, NULL);
-        if (LZ4F_isError(result)) {
-            _ERROR("LZ4 (%zu): %s", -result, LZ4F_getErrorName(result));
-            err = EFI_UNSUPPORTED;
-            goto end;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief decode a whole frame block by block into buffer
+ *
+ * @details
+ *  Unlike LZ4F this needs no intermediate buffers: linked blocks use the
+ *  previous output as prefix, and the slack behind the content lets the
+ *  block decoder run its wild copies up to the last block.
+ *
+ *  Does not use any boot services, so it can run on an AP.
+ *
+ * @param[in] length
+ *  size of the decompressed frame
+ * @param[in] capacity
+ *  size of buffer, at least length
+ * @param[out] consumed
+ *  size of the compressed frame
+ *
+ * @returns EFI_UNSUPPORTED
+ *  for frames with a dictionary
+ */
+static inline
+efi_status_t decode_frame_lz4(
+    const uint8_t* in,
+    size_t in_size,
+    uint8_t* buffer,
+    size_t length,
+    size_t capacity,
+    bool verify,
+    size_t* consumed
+) {
+    efi_status_t err;
+    struct lz4_frame frame;
+    const uint8_t* begin = in;
+    const uint8_t* end = in + in_size;
+
+    err = lz4_frame_header(in, in_size, &frame);
+    if (EFI_ERROR(err))
+        return err;
+    if (frame.flags & LZ4_FLG_DICT_ID)
+        return EFI_UNSUPPORTED;
+
+    in += frame.header_size;
+    size_t checksum_size = frame.flags & LZ4_FLG_BLOCK_CHECKSUM ? sizeof(uint32_t) : 0;
+    size_t done = 0;
+    for (;;) {
+        if ((size_t) (end - in) < sizeof(uint32_t))
+            return EFI_END_OF_FILE;
+
+        uint32_t block = read_le32(in);
+        in += sizeof(uint32_t);
+        if (block == 0)
+            break;
+
+        size_t size = block & ~LZ4_BLOCK_UNCOMPRESSED;
+        if (size > frame.block_max_size)
+            return EFI_COMPROMISED_DATA;
+        if ((size_t) (end - in) < size + checksum_size)
+            return EFI_END_OF_FILE;
+
+        if (checksum_size && verify && xxh32(in, size, 0) != read_le32(in + size))
+            return EFI_CRC_ERROR;
+
+        if (block & LZ4_BLOCK_UNCOMPRESSED) {
+            if (size > length - done)
+                return EFI_COMPROMISED_DATA;
+            memcpy(buffer + done, in, size);
+            done += size;
+        } else {
+            size_t prefix = frame.flags & LZ4_FLG_BLOCK_INDEPENDENT ? 0 : MIN(done, (size_t) LZ4_WINDOW_SIZE);
+            int result = LZ4_decompress_safe_usingDict(
+                (const char*) in, (char*) buffer + done, size,
+                MIN(capacity - done, (size_t) INT32_MAX),
+                (const char*) buffer + done - prefix, prefix);
+            if (result < 0 || (size_t) result > frame.block_max_size || (size_t) result > length - done)
+                return EFI_COMPROMISED_DATA;
+            done += result;
         }
-        in->pos += in_end;
-        out->length = out->pos += out_end;
+
+        in += size + checksum_size;
     }
-    
-    if (result)
-        _ERROR("EOF before end of stream: %zu", result);
-    
-    _MESSAGE("in = %zu out = %zu", in->pos, out->pos);
-    err = EFI_SUCCESS;
-end:
-    LZ4F_freeDecompressionContext(ctx);
 
+    if (done != length)
+        return EFI_COMPROMISED_DATA;
+
+    if (frame.flags & LZ4_FLG_CONTENT_CHECKSUM) {
+        if ((size_t) (end - in) < sizeof(uint32_t))
+            return EFI_END_OF_FILE;
+        if (verify && xxh32(buffer, length, 0) != read_le32(in))
+            return EFI_CRC_ERROR;
+        in += sizeof(uint32_t);
+    }
+
+    *consumed = in - begin;
+    return EFI_SUCCESS;
+}
+
+static inline
+efi_status_t read_all_lz4(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t capacity
+) {
+    size_t consumed = 0;
+    efi_status_t err = decode_frame_lz4(buffer_pos(&stream->in), buffer_len(&stream->in),
+        buffer, stream->content_size, capacity, !(stream->flags & DECOMPRESS_NO_CHECKSUM), &consumed);
+
+    /* dictionaries are only known to LZ4F */
+    if (err == EFI_UNSUPPORTED)
+        return read_lz4(stream, buffer, stream->content_size);
     if (EFI_ERROR(err)) {
-        out->free(out);
-        out->allocated = 0;
-        out->buffer = NULL;
-    } else {
-        out->pos = 0;
+        _ERROR("LZ4 frame corrupt: %r", err);
+        return err;
     }
 
-    return err;
+    stream->in.pos += consumed;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief find the next block of a legacy LZ4 stream
+ *
+ * @param[in,out] pos
+ *  offset of the block size in `in`, set to the compressed data
+ * @returns size of the compressed block, 0 at the end of the stream
+ */
+static inline
+size_t lz4_legacy_block(
+    const uint8_t* in,
+    size_t length,
+    size_t* pos
+) {
+    for (;;) {
+        if (length - *pos < sizeof(uint32_t))
+            return 0;
+        uint32_t size = read_le32(in + *pos);
+        /* concatenated streams repeat the magic */
+        if (size == LZ4_LEGACY_MAGIC) {
+            *pos += sizeof(uint32_t);
+            continue;
+        }
+        /* the section may be padded with zeros */
+        if (size == 0 || size > (uint32_t) LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCK_SIZE)
+            || size > length - *pos - sizeof(uint32_t))
+            return 0;
+        *pos += sizeof(uint32_t);
+        return size;
+    }
+}
+
+/**
+ * @brief decode a single legacy block, does not use any boot services
+ */
+static inline
+efi_status_t decode_block_lz4_legacy(
+    const uint8_t* in,
+    size_t in_size,
+    uint8_t* buffer,
+    size_t length,
+    size_t capacity
+) {
+    int result = LZ4_decompress_safe((const char*) in, (char*) buffer, in_size, MIN(capacity, (size_t) INT32_MAX));
+    if (result < 0 || (size_t) result != length)
+        return EFI_COMPROMISED_DATA;
+    return EFI_SUCCESS;
+}
+
+static inline
+efi_status_t open_lz4_legacy(
+    decompress_stream_t stream
+) {
+    /* the size is only known from a trailer, e.g. in zboot images */
+    stream->in.pos += sizeof(uint32_t);
+    return EFI_SUCCESS;
+}
+
+struct lz4_legacy_ctx {
+    size_t length;              ///< decoded bytes in block
+    size_t pos;                 ///< bytes of block already read
+    uint8_t block[LZ4_LEGACY_BLOCK_SIZE];
+};
+
+static inline
+efi_status_t read_lz4_legacy(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t length
+) {
+    if (!stream->ctx) {
+        if (!allocate_aligned_buffer(sizeof(struct lz4_legacy_ctx), EFI_LOADER_DATA, &stream->workspace))
+            return EFI_OUT_OF_RESOURCES;
+        struct lz4_legacy_ctx* ctx = stream->workspace.buffer;
+        ctx->length = ctx->pos = 0;
+        stream->ctx = ctx;
+    }
+
+    struct lz4_legacy_ctx* ctx = stream->ctx;
+    size_t done = 0;
+    while (done < length) {
+        if (ctx->pos == ctx->length) {
+            size_t pos = 0;
+            size_t size = lz4_legacy_block(buffer_pos(&stream->in), buffer_len(&stream->in), &pos);
+            if (!size) {
+                _ERROR("EOF before end of stream: %zu", length - done);
+                return EFI_END_OF_FILE;
+            }
+
+            /* whole blocks go straight to the caller */
+            bool direct = length - done >= LZ4_LEGACY_BLOCK_SIZE;
+            uint8_t* out = direct ? buffer + done : ctx->block;
+            int result = LZ4_decompress_safe((const char*) buffer_pos(&stream->in) + pos, (char*) out, size, LZ4_LEGACY_BLOCK_SIZE);
+            if (result <= 0) {
+                _ERROR("LZ4 block corrupt");
+                return EFI_COMPROMISED_DATA;
+            }
+            stream->in.pos += pos + size;
+            if (direct) {
+                done += result;
+                continue;
+            }
+            ctx->length = result;
+            ctx->pos = 0;
+        }
+
+        size_t n = MIN(length - done, ctx->length - ctx->pos);
+        memcpy(buffer + done, ctx->block + ctx->pos, n);
+        ctx->pos += n;
+        done += n;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static inline
+void close_lz4(
+    decompress_stream_t stream
+) {
+    LZ4F_freeDecompressionContext(stream->ctx);
 }
 #endif /* USE_LZ4 */
 
 #ifdef USE_ZSTD
 static inline
-efi_status_t decompress_zstd(
-    simple_buffer_t in,
-    simple_buffer_t out
+efi_status_t open_zstd(
+    decompress_stream_t stream
 ) {
-    efi_status_t err;
-
     /* retrieve uncompressed size */
-    out->allocated = ZSTD_getFrameContentSize(buffer_pos(in), buffer_len(in));
-    if (out->allocated == ZSTD_CONTENTSIZE_ERROR || out->allocated == ZSTD_CONTENTSIZE_UNKNOWN) {
-        _ERROR("ZSTD can't determine content size: %zu", -out->allocated);
-        out->allocated = 0;
+    unsigned long long content_size = ZSTD_getFrameContentSize(buffer_pos(&stream->in), buffer_len(&stream->in));
+    if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+        _ERROR("ZSTD can't read frame header");
         return EFI_UNSUPPORTED;
     }
 
-    if (!allocate_simple_buffer(out->allocated, out)) {
-        return EFI_OUT_OF_RESOURCES;
+    /* only decode the frame, the section may be padded */
+    size_t frame_size = ZSTD_findFrameCompressedSize(buffer_pos(&stream->in), buffer_len(&stream->in));
+    if (ZSTD_isError(frame_size)) {
+        _ERROR("ZSTD (%zu): %s", ZSTD_getErrorCode(frame_size), ZSTD_getErrorName(frame_size));
+        return EFI_UNSUPPORTED;
     }
+    stream->in.length = stream->in.pos + frame_size;
 
-    ZSTD_DStream* zstream = ZSTD_createDStream();
-    if (!zstream) {
-        free(out->buffer);
+    /* the decoder is set up by the first read */
+    stream->content_size = content_size == ZSTD_CONTENTSIZE_UNKNOWN ? 0 : content_size;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief create a static decoder context in a single page allocation
+ *
+ * @param single_shot
+ *  the whole frame is decoded at once, which needs no window buffer
+ */
+static inline
+efi_status_t init_zstd(
+    decompress_stream_t stream,
+    bool single_shot
+) {
+    size_t size = single_shot ? ZSTD_estimateDCtxSize()
+        : ZSTD_estimateDStreamSize_fromFrame(buffer_pos(&stream->in), buffer_len(&stream->in));
+    if (ZSTD_isError(size)) {
+        _ERROR("ZSTD (%zu): %s", ZSTD_getErrorCode(size), ZSTD_getErrorName(size));
+        return EFI_UNSUPPORTED;
+    }
+
+    if (!allocate_aligned_buffer(size, EFI_LOADER_DATA, &stream->workspace))
+        return EFI_OUT_OF_RESOURCES;
+
+    ZSTD_DCtx* dctx = ZSTD_initStaticDCtx(stream->workspace.buffer, stream->workspace.allocated);
+    if (!dctx)
         return EFI_OUT_OF_RESOURCES;
+
+    if (stream->flags & DECOMPRESS_NO_CHECKSUM)
+        ZSTD_DCtx_setParameter(dctx, ZSTD_d_forceIgnoreChecksum, ZSTD_d_ignoreChecksum);
+
+    _MESSAGE("ZSTD %s context: %zu KiB", single_shot ? "single shot" : "stream", size / 1024);
+    stream->ctx = dctx;
+    return EFI_SUCCESS;
+}
+
+static inline
+efi_status_t read_zstd(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t length
+) {
+    efi_status_t err;
+
+    if (!stream->ctx) {
+        bool single_shot = stream->pos == 0 && length == stream->content_size;
+        err = init_zstd(stream, single_shot);
+        if (EFI_ERROR(err))
+            return err;
+
+        if (single_shot) {
+            size_t result = ZSTD_decompressDCtx(stream->ctx, buffer, length, buffer_pos(&stream->in), buffer_len(&stream->in));
+            if (ZSTD_isError(result)) {
+                _ERROR("ZSTD (%zu): %s", ZSTD_getErrorCode(result), ZSTD_getErrorName(result));
+                return EFI_COMPROMISED_DATA;
+            }
+            stream->in.pos = stream->in.length;
+            if (result != length) {
+                _ERROR("EOF before end of stream: %zu", length - result);
+                return EFI_END_OF_FILE;
+            }
+            return EFI_SUCCESS;
+        }
     }
 
-    size_t result = 0;
-    out->length = out->allocated;
-    while (in->pos < in->length) {
-        result = ZSTD_decompressStream(zstream, (ZSTD_outBuffer*) out, (ZSTD_inBuffer*) in);
+    ZSTD_outBuffer out = { .dst = buffer, .size = length, .pos = 0 };
+    while (out.pos < out.size) {
+        if (stream->in.pos >= stream->in.length) {
+            _ERROR("EOF before end of stream: %zu", out.size - out.pos);
+            return EFI_END_OF_FILE;
+        }
+
+        size_t result = ZSTD_decompressStream(stream->ctx, &out, (ZSTD_inBuffer*) &stream->in);
         if (ZSTD_isError(result)) {
             _ERROR("ZSTD (%zu): %s", ZSTD_getErrorCode(result), ZSTD_getErrorName(result));
-            err = EFI_COMPROMISED_DATA;
-            goto end;
+            return EFI_COMPROMISED_DATA;
+        }
+
+        /* the context starts the next frame of a frame table on its own */
+        if (result == 0 && out.pos < out.size && !stream->frames) {
+            _ERROR("EOF before end of stream: %zu", out.size - out.pos);
+            return EFI_END_OF_FILE;
         }
     }
 
-    if (result)
-        _ERROR("EOF before end of stream: %zu", result);
-    
-    _MESSAGE("in = %zu out = %zu", in->pos, out->pos);
-    err = EFI_SUCCESS;
-end:
-    ZSTD_freeDStream(zstream);
+    return EFI_SUCCESS;
+}
 
-    if (EFI_ERROR(err)) {
-        out->free(out);
-        out->allocated = 0;
-        out->buffer = NULL;
+/**
+ * @brief decode a single frame, does not use any boot services
+ */
+static inline
+efi_status_t decode_frame_zstd(
+    ZSTD_DCtx* dctx,
+    const uint8_t* in,
+    size_t in_size,
+    uint8_t* buffer,
+    size_t length
+) {
+    size_t result = ZSTD_decompressDCtx(dctx, buffer, length, in, in_size);
+    if (ZSTD_isError(result))
+        return ZSTD_getErrorCode(result) == ZSTD_error_checksum_wrong ? EFI_CRC_ERROR : EFI_COMPROMISED_DATA;
+    if (result != length)
+        return EFI_COMPROMISED_DATA;
+    return EFI_SUCCESS;
+}
+#endif /* USE_ZSTD */
+
+#ifdef USE_GZIP
+/* decoded data buffered behind the window of a stream */
+#define GZIP_STREAM_BUFFER_SIZE     (256 << 10)
+
+static inline
+efi_status_t inflate_error(
+    enum inflate_status status
+) {
+    switch (status) {
+        case INFLATE_TRUNCATED:
+            return EFI_END_OF_FILE;
+        case INFLATE_CHECKSUM:
+            return EFI_CRC_ERROR;
+        case INFLATE_UNSUPPORTED:
+            return EFI_UNSUPPORTED;
+        default:
+            return EFI_COMPROMISED_DATA;
+    }
+}
+
+/**
+ * @brief decoder of a partially read stream
+ *
+ * @details
+ *  The decoder fills buffer and stops when it is full. Before it continues
+ *  the last INFLATE_WINDOW_SIZE bytes are moved to the front for the
+ *  matches that reach back into data that was already read.
+ */
+struct gzip_ctx {
+    size_t pos;                 ///< bytes of buffer already read
+    size_t length;              ///< bytes decoded into buffer
+    size_t member;              ///< bytes decoded from the current member
+    uint32_t crc;               ///< of the current member
+    bool done;
+    struct inflate_state state;
+    uint8_t buffer[INFLATE_WINDOW_SIZE + GZIP_STREAM_BUFFER_SIZE];
+};
+
+/**
+ * @details
+ *  The size of a single member is in its trailer. Several members (e.g.
+ *  concatenated initrds) are decoded once to add up their sizes, the
+ *  decoders continue with the next member until the input ends.
+ */
+static inline
+efi_status_t open_gzip(
+    decompress_stream_t stream
+) {
+    size_t header_size;
+    enum inflate_status status = gzip_header(buffer_pos(&stream->in), buffer_len(&stream->in), &header_size);
+    if (status != INFLATE_DONE || buffer_len(&stream->in) < header_size + GZIP_TRAILER_SIZE) {
+        _ERROR("gzip can't read member header");
+        return EFI_UNSUPPORTED;
+    }
+
+    /* ISIZE ends the member, sections are not padded */
+    stream->content_size = read_le32(buffer_pos(&stream->in) + buffer_len(&stream->in) - sizeof(uint32_t));
+    if (!gzip_multi_member(buffer_pos(&stream->in), buffer_len(&stream->in)))
+        return EFI_SUCCESS;
+
+    _cleanup_buffer struct aligned_buffer workspace = { 0 };
+    if (!allocate_aligned_buffer(sizeof(struct gzip_ctx), EFI_LOADER_DATA, &workspace))
+        return EFI_OUT_OF_RESOURCES;
+    struct gzip_ctx* ctx = workspace.buffer;
+    status = gzip_members(&ctx->state, buffer_pos(&stream->in), buffer_len(&stream->in),
+        ctx->buffer, sizeof(ctx->buffer), &stream->content_size);
+    if (status != INFLATE_DONE) {
+        _MESSAGE("gzip members don't cover the data: %r", inflate_error(status));
+        return EFI_UNSUPPORTED;
+    }
+    _MESSAGE("gzip data with several members");
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief start decoding the member at the input position
+ */
+static inline
+enum inflate_status gzip_member(
+    decompress_stream_t stream,
+    struct gzip_ctx* ctx
+) {
+    size_t header_size;
+    enum inflate_status status = gzip_header(buffer_pos(&stream->in), buffer_len(&stream->in), &header_size);
+    if (status != INFLATE_DONE)
+        return status;
+
+    inflate_init(&ctx->state, buffer_pos(&stream->in) + header_size, buffer_len(&stream->in) - header_size);
+    ctx->member = 0;
+    ctx->crc = 0;
+    return INFLATE_DONE;
+}
+
+static inline
+efi_status_t read_gzip(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t length
+) {
+    bool verify = !(stream->flags & DECOMPRESS_NO_CHECKSUM);
+
+    if (!stream->ctx) {
+        if (!allocate_aligned_buffer(sizeof(struct gzip_ctx), EFI_LOADER_DATA, &stream->workspace))
+            return EFI_OUT_OF_RESOURCES;
+        struct gzip_ctx* ctx = stream->workspace.buffer;
+        ctx->pos = ctx->length = 0;
+        ctx->done = false;
+        enum inflate_status status = gzip_member(stream, ctx);
+        if (status != INFLATE_DONE)
+            return inflate_error(status);
+        stream->ctx = ctx;
+    }
+
+    struct gzip_ctx* ctx = stream->ctx;
+    size_t done = 0;
+    while (done < length) {
+        if (ctx->pos == ctx->length) {
+            if (ctx->done) {
+                _ERROR("EOF before end of stream: %zu", length - done);
+                return EFI_END_OF_FILE;
+            }
+
+            if (ctx->length == sizeof(ctx->buffer)) {
+                memmove(ctx->buffer, ctx->buffer + ctx->length - INFLATE_WINDOW_SIZE, INFLATE_WINDOW_SIZE);
+                ctx->pos = ctx->length = INFLATE_WINDOW_SIZE;
+            }
+
+            uint8_t* out = ctx->buffer + ctx->length;
+            enum inflate_status status = inflate_run(&ctx->state, ctx->buffer, &out, ctx->buffer + sizeof(ctx->buffer));
+            size_t decoded = out - (ctx->buffer + ctx->length);
+            if (verify)
+                ctx->crc = gzip_crc32(ctx->crc, ctx->buffer + ctx->length, decoded);
+            ctx->length += decoded;
+            ctx->member += decoded;
+
+            if (status == INFLATE_DONE) {
+                status = gzip_trailer(&ctx->state, ctx->crc, ctx->member, verify);
+                stream->in.pos = inflate_input(&ctx->state) - (const uint8_t*) stream->in.buffer;
+                if (status == INFLATE_DONE && buffer_len(&stream->in))
+                    status = gzip_member(stream, ctx);
+                else
+                    ctx->done = true;
+            }
+            if (status != INFLATE_DONE && status != INFLATE_OUTPUT_FULL) {
+                _ERROR("gzip stream corrupt: %r", inflate_error(status));
+                return inflate_error(status);
+            }
+            continue;
+        }
+
+        size_t n = MIN(length - done, ctx->length - ctx->pos);
+        memcpy(buffer + done, ctx->buffer + ctx->pos, n);
+        ctx->pos += n;
+        done += n;
+    }
+
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief decode all members into buffer without a window
+ */
+static inline
+efi_status_t read_all_gzip(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t capacity
+) {
+    if (!allocate_aligned_buffer(sizeof(struct inflate_state), EFI_LOADER_DATA, &stream->workspace))
+        return EFI_OUT_OF_RESOURCES;
+    struct inflate_state* state = stream->workspace.buffer;
+
+    bool verify = !(stream->flags & DECOMPRESS_NO_CHECKSUM);
+    size_t consumed;
+    enum inflate_status status = gzip_decompress(state, buffer_pos(&stream->in), buffer_len(&stream->in),
+        buffer, stream->content_size, capacity, verify, &consumed);
+    if (status != INFLATE_DONE) {
+        _ERROR("gzip stream corrupt: %r", inflate_error(status));
+        return inflate_error(status);
+    }
+
+    stream->in.pos += consumed;
+    return EFI_SUCCESS;
+}
+#endif /* USE_GZIP */
+
+/**
+ * @brief use a frame table in front of the data
+ *
+ * @details
+ *  Without a (valid) table the data is decoded as a single stream, a
+ *  damaged table is not fatal as long as the frames are intact.
+ */
+static inline
+void open_frame_table(
+    decompress_stream_t stream
+) {
+    const struct frame_table* table = (const struct frame_table*) buffer_pos(&stream->in);
+    size_t length = buffer_len(&stream->in);
+
+    if (length < sizeof(*table) || table->magic != FRAME_TABLE_MAGIC)
+        return;
+    if (table->signature != FRAME_TABLE_SIGNATURE || !table->count
+        || table->size != FRAME_TABLE_SIZE(table->count) - offsetof(struct frame_table, signature)
+        || length <= FRAME_TABLE_SIZE(table->count)
+    ) {
+        _MESSAGE("ignoring invalid frame table");
+        return;
+    }
+
+    /* frames have to be in order, none of them may be empty */
+    length -= FRAME_TABLE_SIZE(table->count);
+    for (uint32_t i = 0; i < table->count; i++) {
+        const struct frame_table_entry* entry = &table->entries[i];
+        uint64_t end = i + 1 < table->count ? entry[1].offset : length;
+        uint64_t content_end = i + 1 < table->count ? entry[1].content_offset : table->content_size;
+        if ((i == 0 && entry->offset != 0) || entry->offset >= end
+            || entry->content_offset >= content_end
+        ) {
+            _MESSAGE("ignoring invalid frame table");
+            return;
+        }
+    }
+
+    _MESSAGE("frame table with %u frames", table->count);
+    stream->frames = table;
+    stream->in.pos += FRAME_TABLE_SIZE(table->count);
+}
+
+/**
+ * @brief skip the header of a branch conversion filter in front of the data
+ *
+ * @returns the header, it is checked once the content size is known
+ */
+static inline
+const struct bcj_header* open_bcj(
+    decompress_stream_t stream
+) {
+    const struct bcj_header* header = (const struct bcj_header*) buffer_pos(&stream->in);
+    if (buffer_len(&stream->in) < sizeof(*header) || header->magic != BCJ_HEADER_MAGIC)
+        return NULL;
+    stream->in.pos += sizeof(*header);
+    return header;
+}
+
+#ifdef USE_BCJ
+static inline
+efi_status_t init_bcj(
+    decompress_stream_t stream,
+    const struct bcj_header* header
+) {
+    /* the filter only makes sense with the content size */
+    if (stream->format == DECOMPRESS_FORMAT_NONE || !bcj_header_valid(header, stream->content_size)) {
+        _ERROR("Invalid branch filter header");
+        return EFI_UNSUPPORTED;
+    }
+
+    _MESSAGE("%s branch filter from %lu to %lu",
+        header->filter == BCJ_FILTER_ARM64 ? "ARM64" : "x86", header->start, header->end);
+    bcj_init(&stream->filter, header->filter, header->start, header->end);
+    return EFI_SUCCESS;
+}
+
+/* ARM64 instructions convert independently, chunks keep them aligned */
+#define BCJ_CHUNK_SIZE (UINT64_C(1) << 20)
+
+struct bcj_chunks {
+    const struct bcj_state* filter;
+    uint8_t* buffer;
+};
+
+static
+void bcj_chunk(
+    size_t begin,
+    size_t end,
+    void* argument
+) {
+    struct bcj_chunks* chunks = argument;
+    struct bcj_state state;
+    bcj_init(&state, chunks->filter->filter,
+        MAX((uint64_t) begin, chunks->filter->start), MIN((uint64_t) end, chunks->filter->end));
+    bcj_convert(&state, chunks->buffer + begin, begin, end - begin, false);
+}
+
+/**
+ * @brief reverse the branch conversion of the whole content in buffer
+ */
+static
+void reverse_bcj(
+    decompress_stream_t stream,
+    uint8_t* buffer
+) {
+    if (stream->filter.filter == BCJ_FILTER_ARM64) {
+        struct bcj_chunks chunks = { .filter = &stream->filter, .buffer = buffer };
+        mp_for(stream->content_size, BCJ_CHUNK_SIZE, bcj_chunk, &chunks);
+        stream->filter.pos = stream->filter.end;
     } else {
-        out->pos = 0;
+        bcj_convert(&stream->filter, buffer, 0, stream->content_size, false);
     }
+}
+#endif /* USE_BCJ */
 
-    return err;
+struct frame_job {
+    const uint8_t* in;
+    size_t in_size;
+    uint8_t* out;
+    size_t length;
+    size_t capacity;
+    efi_status_t status;
+};
+
+struct frame_jobs {
+    enum decompress_format format;
+    bool verify;
+    uint32_t count;
+    uint32_t next;              ///< next job to take (atomic)
+    uint32_t workers;           ///< processors that joined (atomic)
+    uint32_t max_workers;       ///< number of contexts
+    struct frame_job* jobs;
+    void** contexts;            ///< decoder context per worker
+};
+
+/**
+ * @brief processor entry, take frames until all are done
+ */
+efi_api static
+void decode_frames(
+    void* argument
+) {
+    struct frame_jobs* jobs = argument;
+    uint32_t worker = __atomic_fetch_add(&jobs->workers, 1, __ATOMIC_RELAXED);
+    if (worker >= jobs->max_workers)
+        return;
+
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count) {
+        struct frame_job* job = &jobs->jobs[i];
+        trace_event(TRACE_DECOMPRESS_FRAME, TRACE_BEGIN, worker, i);
+        switch (jobs->format) {
+#ifdef USE_LZ4
+            case DECOMPRESS_FORMAT_LZ4: {
+                size_t consumed;
+                job->status = decode_frame_lz4(job->in, job->in_size, job->out, job->length, job->capacity, jobs->verify, &consumed);
+                break;
+            }
+            case DECOMPRESS_FORMAT_LZ4_LEGACY:
+                job->status = decode_block_lz4_legacy(job->in, job->in_size, job->out, job->length, job->capacity);
+                break;
+#endif
+#ifdef USE_ZSTD
+            case DECOMPRESS_FORMAT_ZSTD:
+                job->status = decode_frame_zstd(jobs->contexts[worker], job->in, job->in_size, job->out, job->length);
+                break;
+#endif
+            default:
+                job->status = EFI_UNSUPPORTED;
+                break;
+        }
+        trace_event(TRACE_DECOMPRESS_FRAME, TRACE_END, worker, i);
+    }
 }
-#endif /* USE_ZSTD */
 
-efi_status_t decompress(
+/**
+ * @brief decode the jobs on all processors
+ */
+static
+efi_status_t run_frame_jobs(
+    decompress_stream_t stream,
+    struct frame_job* job_list,
+    uint32_t count
+) {
+    _cleanup_pool void** contexts = malloc(mp_processor_count() * sizeof(void*));
+    if (!contexts)
+        return EFI_OUT_OF_RESOURCES;
+
+    struct frame_jobs jobs = {
+        .format = stream->format,
+        .verify = !(stream->flags & DECOMPRESS_NO_CHECKSUM),
+        .count = count,
+        .max_workers = mp_processor_count(),
+        .jobs = job_list,
+        .contexts = contexts,
+    };
+
+#ifdef USE_ZSTD
+    /* APs can't allocate, every processor gets its own context */
+    if (stream->format == DECOMPRESS_FORMAT_ZSTD) {
+        size_t size = ALIGN_VALUE(ZSTD_estimateDCtxSize(), 64);
+        if (!allocate_aligned_buffer(size * jobs.max_workers, EFI_LOADER_DATA, &stream->workspace))
+            return EFI_OUT_OF_RESOURCES;
+
+        for (uint32_t i = 0; i < jobs.max_workers; i++) {
+            ZSTD_DCtx* dctx = ZSTD_initStaticDCtx((uint8_t*) stream->workspace.buffer + i * size, size);
+            if (!dctx)
+                return EFI_OUT_OF_RESOURCES;
+            if (!jobs.verify)
+                ZSTD_DCtx_setParameter(dctx, ZSTD_d_forceIgnoreChecksum, ZSTD_d_ignoreChecksum);
+            contexts[i] = dctx;
+        }
+
+        /* the last frame may be followed by padding */
+        struct frame_job* job = &job_list[count - 1];
+        size_t frame_size = ZSTD_findFrameCompressedSize(job->in, job->in_size);
+        if (!ZSTD_isError(frame_size))
+            job->in_size = frame_size;
+    }
+#endif
+
+    size_t processors = mp_run(decode_frames, &jobs);
+    _MESSAGE("decoded %u frames on %zu processors", count, processors);
+    stream->processors = MIN(processors, (size_t) count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (EFI_ERROR(job_list[i].status)) {
+            _ERROR("Frame %u: %r", i, job_list[i].status);
+            return job_list[i].status;
+        }
+    }
+
+    stream->in.pos = stream->in.length;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief decode all frames of a frame table in parallel
+ *
+ * @details
+ *  Every frame is decoded into its own range of buffer. The ranges are
+ *  disjoint, so only the last frame may use the slack behind the content.
+ */
+static inline
+efi_status_t read_all_frames(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t capacity
+) {
+    const struct frame_table* table = stream->frames;
+    const uint8_t* in = buffer_pos(&stream->in);
+    size_t in_size = buffer_len(&stream->in);
+
+    _cleanup_pool struct frame_job* job_list = malloc(table->count * sizeof(struct frame_job));
+    if (!job_list)
+        return EFI_OUT_OF_RESOURCES;
+
+    for (uint32_t i = 0; i < table->count; i++) {
+        const struct frame_table_entry* entry = &table->entries[i];
+        bool last = i + 1 == table->count;
+        size_t content_end = last ? table->content_size : entry[1].content_offset;
+        job_list[i] = (struct frame_job) {
+            .in = in + entry->offset,
+            .in_size = (last ? in_size : entry[1].offset) - entry->offset,
+            .out = buffer + entry->content_offset,
+            .length = content_end - entry->content_offset,
+            .capacity = (last ? capacity : content_end) - entry->content_offset,
+            .status = EFI_NOT_STARTED,
+        };
+    }
+
+    return run_frame_jobs(stream, job_list, table->count);
+}
+
+#ifdef USE_LZ4
+/**
+ * @brief decode the independent blocks of a legacy LZ4 stream in parallel
+ */
+static inline
+efi_status_t read_all_lz4_legacy(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t capacity
+) {
+    const uint8_t* in = buffer_pos(&stream->in);
+    size_t in_size = buffer_len(&stream->in);
+    uint32_t count = (stream->content_size + LZ4_LEGACY_BLOCK_SIZE - 1) / LZ4_LEGACY_BLOCK_SIZE;
+
+    _cleanup_pool struct frame_job* job_list = malloc(count * sizeof(struct frame_job));
+    if (!job_list)
+        return EFI_OUT_OF_RESOURCES;
+
+    size_t pos = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t size = lz4_legacy_block(in, in_size, &pos);
+        if (!size) {
+            _ERROR("EOF before end of stream: block %u", i);
+            return EFI_END_OF_FILE;
+        }
+
+        bool last = i + 1 == count;
+        size_t offset = (size_t) i * LZ4_LEGACY_BLOCK_SIZE;
+        size_t length = last ? stream->content_size - offset : LZ4_LEGACY_BLOCK_SIZE;
+        job_list[i] = (struct frame_job) {
+            .in = in + pos,
+            .in_size = size,
+            .out = buffer + offset,
+            .length = length,
+            .capacity = last ? capacity - offset : length,
+            .status = EFI_NOT_STARTED,
+        };
+        pos += size;
+    }
+
+    return run_frame_jobs(stream, job_list, count);
+}
+#endif /* USE_LZ4 */
+
+bool decompress_stream_parallel(
+    decompress_stream_t stream
+) {
+#ifdef USE_LZ4
+    if (stream->format == DECOMPRESS_FORMAT_LZ4_LEGACY)
+        return stream->content_size > LZ4_LEGACY_BLOCK_SIZE && mp_processor_count() > 1;
+#endif
+    return stream->frames && stream->frames->count > 1
+        && stream->format != DECOMPRESS_FORMAT_NONE
+        && mp_processor_count() > 1;
+}
+
+/**
+ * @brief header of a Linux EFI zboot image (CONFIG_EFI_ZBOOT)
+ *
+ * @details
+ *  The image is a small PE decompressor with the compressed `Image` as
+ *  payload. Except for gzip the payload is followed by the decompressed
+ *  size (32 bit little endian).
+ *
+ * @see https://github.com/torvalds/linux/blob/v6.1/drivers/firmware/efi/libstub/zboot-header.S
+ */
+struct zboot_header {
+    uint16_t mz_magic;
+    uint16_t reserved0;
+    uint32_t image_type;        ///< ZBOOT_IMAGE_TYPE
+    uint32_t payload_offset;
+    uint32_t payload_size;      ///< without the size
+    uint32_t reserved1[2];
+    char8_t comp_type[32];      ///< e.g. "gzip", "lz4" or "zstd22"
+    uint32_t linux_pe_magic;
+    uint32_t pe_header_offset;
+};
+
+#define ZBOOT_IMAGE_TYPE    UINT32_C(0x676d697a)   /* zimg */
+#define ZBOOT_SIZE_LENGTH   sizeof(uint32_t)
+
+static inline
+bool zboot_payload_supported(
+    uint32_t magic
+) {
+#ifdef USE_ZSTD
+    if (magic == ZSTD_MAGICNUMBER)
+        return true;
+#endif
+#ifdef USE_LZ4
+    if (magic == LZ4_MAGICNUMBER || magic == LZ4_LEGACY_MAGIC)
+        return true;
+#endif
+#ifdef USE_GZIP
+    if ((magic & GZIP_MAGIC_MASK) == GZIP_MAGIC)
+        return true;
+#endif
+    return false;
+}
+
+/**
+ * @brief narrow the input to the payload of a zboot image
+ *
+ * @param[out] content_size
+ *  the size behind the payload, 0 if there is none
+ * @returns false if the input is no zboot image or the payload can't be
+ *  decoded here, the image then decompresses itself when it is started
+ */
+static inline
+bool open_zboot(
+    decompress_stream_t stream,
+    size_t* content_size
+) {
+    const struct zboot_header* hdr = (const struct zboot_header*) buffer_pos(&stream->in);
+    size_t length = buffer_len(&stream->in);
+    *content_size = 0;
+
+    if (length < sizeof(*hdr) || hdr->mz_magic != MZ_DOS_SIGNATURE || hdr->image_type != ZBOOT_IMAGE_TYPE)
+        return false;
+    if (hdr->payload_offset >= length || hdr->payload_size > length - hdr->payload_offset
+        || hdr->payload_size < sizeof(uint32_t)) {
+        _MESSAGE("zboot payload is outside of the image");
+        return false;
+    }
+
+    const uint8_t* payload = buffer_pos(&stream->in) + hdr->payload_offset;
+    uint32_t magic = read_le32(payload);
+    if (!zboot_payload_supported(magic)) {
+        _MESSAGE("zboot image with %.32s payload decompresses itself", hdr->comp_type);
+        return false;
+    }
+
+    /* gzip has the size in its trailer */
+    bool sized = true;
+#ifdef USE_GZIP
+    sized = (magic & GZIP_MAGIC_MASK) != GZIP_MAGIC;
+#endif
+    if (sized && length - hdr->payload_offset - hdr->payload_size >= ZBOOT_SIZE_LENGTH)
+        *content_size = read_le32(payload + hdr->payload_size);
+
+    _MESSAGE("detected zboot image with %.32s payload", hdr->comp_type);
+    stream->in.pos += hdr->payload_offset;
+    stream->in.length = stream->in.pos + hdr->payload_size;
+    return true;
+}
+
+efi_status_t decompress_stream_open(
     simple_buffer_t in,
-    simple_buffer_t out
+    uint32_t flags,
+    decompress_stream_t stream
 ) {
-    if (!in || !out)
+    if (!in || !stream)
         return EFI_INVALID_PARAMETER;
-    if (!in->buffer || !in->length)
+    if (!in->buffer || !in->length || in->pos >= in->length)
         return EFI_INVALID_PARAMETER;
-    if (out->buffer || out->length)
-        return EFI_INVALID_PARAMETER;
-    
+
+    ALLOC_TAG_SCOPE(DECOMPRESS);
+    *stream = (struct decompress_stream) {
+        .in = {
+            .buffer = in->buffer,
+            .length = in->length,
+            .pos = in->pos,
+            .allocated = in->allocated ? in->allocated : in->length,
+            .free = NULL
+        },
+        .flags = flags,
+    };
+
+    const struct bcj_header* filter = open_bcj(stream);
+    open_frame_table(stream);
+
+    /* decode the payload of a compressed Linux directly */
+    size_t zboot_size;
+    open_zboot(stream, &zboot_size);
+
+    if (buffer_len(&stream->in) < sizeof(uint32_t)) {
+        _MESSAGE("unsupported file format");
+        return EFI_UNSUPPORTED;
+    }
+
+    efi_status_t err;
+    uint32_t magic = read_le32(buffer_pos(&stream->in));
 #ifdef USE_ZSTD
-    if ((*(uint32_t*) buffer_pos(in)) == ZSTD_MAGICNUMBER) {
+    if (magic == ZSTD_MAGICNUMBER) {
         _MESSAGE("detected ZSTD compressed data");
-        return decompress_zstd(in, out);
+        stream->format = DECOMPRESS_FORMAT_ZSTD;
+        err = open_zstd(stream);
     } else
 #endif
 #ifdef USE_LZ4
-    if ((*(uint32_t*) buffer_pos(in)) == LZ4_MAGICNUMBER) {
+    if (magic == LZ4_MAGICNUMBER) {
         _MESSAGE("detected LZ4 compressed data");
-        return decompress_lz4(in, out);
+        stream->format = DECOMPRESS_FORMAT_LZ4;
+        err = open_lz4(stream);
+    } else if (magic == LZ4_LEGACY_MAGIC) {
+        _MESSAGE("detected legacy LZ4 compressed data");
+        stream->format = DECOMPRESS_FORMAT_LZ4_LEGACY;
+        err = open_lz4_legacy(stream);
     } else
 #endif
-    /* directly pass on an uncompressed executable */
-    if (PE_header(in) > 0) {
+#ifdef USE_GZIP
+    if ((magic & GZIP_MAGIC_MASK) == GZIP_MAGIC) {
+        _MESSAGE("detected gzip compressed data");
+        stream->format = DECOMPRESS_FORMAT_GZIP;
+        err = open_gzip(stream);
+        /* handed on as before, e.g. to the kernel's own initramfs unpacker */
+        if (err == EFI_UNSUPPORTED && (flags & DECOMPRESS_PASS_THROUGH)) {
+            stream->format = DECOMPRESS_FORMAT_NONE;
+            stream->content_size = buffer_len(&stream->in);
+            stream->frames = NULL;
+            err = EFI_SUCCESS;
+        }
+    } else
+#endif
+    if (PE_header(&stream->in) > 0) {
         _MESSAGE("detected EFI executable");
+        stream->format = DECOMPRESS_FORMAT_NONE;
+        stream->content_size = buffer_len(&stream->in);
+        stream->frames = NULL;
+        err = EFI_SUCCESS;
+    } else if (flags & DECOMPRESS_PASS_THROUGH) {
+        stream->format = DECOMPRESS_FORMAT_NONE;
+        stream->content_size = buffer_len(&stream->in);
+        stream->frames = NULL;
+        err = EFI_SUCCESS;
+    } else {
+        _MESSAGE("unsupported file format: %X", magic);
+        return EFI_UNSUPPORTED;
+    }
+
+    /* the first frame header only describes itself */
+    if (!EFI_ERROR(err) && stream->frames) {
+        stream->in.length = in->length;
+        stream->content_size = stream->frames->content_size;
+    }
+    /* Linux doesn't store the size in the frame (zstd reads from a pipe) */
+    if (!EFI_ERROR(err) && !stream->content_size)
+        stream->content_size = zboot_size;
+
+    if (!EFI_ERROR(err) && filter) {
+#ifdef USE_BCJ
+        err = init_bcj(stream, filter);
+#else
+        _ERROR("Branch filters are not supported");
+        err = EFI_UNSUPPORTED;
+#endif
+    }
+    return err;
+}
+
+/**
+ * @brief decode the next length bytes behind the ones already decoded
+ */
+static
+efi_status_t read_content(
+    decompress_stream_t stream,
+    void* buffer,
+    size_t length
+) {
+    efi_status_t err;
+
+    if (!length)
+        return EFI_SUCCESS;
+
+    switch (stream->format) {
+#ifdef USE_LZ4
+        case DECOMPRESS_FORMAT_LZ4:
+            err = read_lz4(stream, buffer, length);
+            break;
+        case DECOMPRESS_FORMAT_LZ4_LEGACY:
+            err = read_lz4_legacy(stream, buffer, length);
+            break;
+#endif
+#ifdef USE_ZSTD
+        case DECOMPRESS_FORMAT_ZSTD:
+            err = read_zstd(stream, buffer, length);
+            break;
+#endif
+#ifdef USE_GZIP
+        case DECOMPRESS_FORMAT_GZIP:
+            err = read_gzip(stream, buffer, length);
+            break;
+#endif
+        case DECOMPRESS_FORMAT_NONE:
+            memcpy(buffer, buffer_pos(&stream->in), length);
+            stream->in.pos += length;
+            err = EFI_SUCCESS;
+            break;
+        default:
+            return EFI_UNSUPPORTED;
+    }
+
+    return err;
+}
+
+#ifdef USE_BCJ
+/**
+ * @brief decode and reverse the branch conversion
+ *
+ * @details
+ *  An instruction at the end of the buffer may continue behind it, the
+ *  bytes following it are decoded into the lookahead then and handed out
+ *  with the next read.
+ */
+static
+efi_status_t read_filtered(
+    decompress_stream_t stream,
+    uint8_t* buffer,
+    size_t length
+) {
+    size_t n = MIN(length, stream->lookahead_len);
+    memcpy(buffer, stream->lookahead, n);
+    memmove(stream->lookahead, stream->lookahead + n, stream->lookahead_len - n);
+    stream->lookahead_len -= n;
+
+    efi_status_t err = read_content(stream, buffer + n, length - n);
+    if (EFI_ERROR(err))
+        return err;
+
+    uint64_t end = stream->pos + length;
+    uint64_t done = bcj_convert(&stream->filter, buffer, stream->pos, length, false);
+    if (done >= end || done == stream->filter.end)
+        return EFI_SUCCESS;
+
+    /* the range ends within the content, so there are enough bytes behind */
+    uint8_t window[2 * BCJ_LOOKAHEAD];
+    size_t tail = end - done;
+    size_t ahead = MAX(stream->lookahead_len, MIN((size_t) BCJ_LOOKAHEAD, (size_t) (stream->content_size - end)));
+    assert(tail <= BCJ_LOOKAHEAD);
+    memcpy(window, buffer + length - tail, tail);
+    memcpy(window + tail, stream->lookahead, stream->lookahead_len);
+    err = read_content(stream, window + tail + stream->lookahead_len, ahead - stream->lookahead_len);
+    if (EFI_ERROR(err))
+        return err;
+
+    bcj_convert(&stream->filter, window, done, tail + ahead, false);
+    memcpy(buffer + length - tail, window, tail);
+    memcpy(stream->lookahead, window + tail, ahead);
+    stream->lookahead_len = ahead;
+    return EFI_SUCCESS;
+}
+#endif /* USE_BCJ */
+
+efi_status_t decompress_stream_read(
+    decompress_stream_t stream,
+    void* buffer,
+    size_t length
+) {
+    efi_status_t err;
+
+    if (!stream || (!buffer && length))
+        return EFI_INVALID_PARAMETER;
+    if (!length)
+        return EFI_SUCCESS;
+    if (stream->content_size && length > stream->content_size - stream->pos)
+        return EFI_END_OF_FILE;
+
+    ALLOC_TAG_SCOPE(DECOMPRESS);
+#ifdef USE_BCJ
+    if (stream->filter.filter != BCJ_FILTER_NONE)
+        err = read_filtered(stream, buffer, length);
+    else
+#endif
+        err = read_content(stream, buffer, length);
+
+    if (!EFI_ERROR(err))
+        stream->pos += length;
+    return err;
+}
+
+static
+const char* format_name(
+    enum decompress_format format
+) {
+    switch (format) {
+        case DECOMPRESS_FORMAT_LZ4:
+        case DECOMPRESS_FORMAT_LZ4_LEGACY:
+            return "lz4";
+        case DECOMPRESS_FORMAT_ZSTD:
+            return "zstd";
+        case DECOMPRESS_FORMAT_GZIP:
+            return "gzip";
+        default:
+            return "copy";
+    }
+}
+
+/**
+ * @brief print the throughput per processor in the syntax of the target
+ *  profiles of `build_image --optimize-for=boot-time`
+ */
+static inline
+void profile_message(
+    const char* name,
+    size_t length,
+    uint64_t usec,
+    size_t processors
+) {
+    if (!usec || !processors)
+        return;
+    _MESSAGE("decode profile: %s=%lu processors=%zu",
+        name, (length * UINT64_C(1000000)) / (usec * processors * 1024 * 1024), processors);
+}
+
+efi_status_t decompress_stream_read_all(
+    decompress_stream_t stream,
+    void* buffer,
+    size_t capacity
+) {
+    efi_status_t err;
+
+    if (!stream || !buffer)
+        return EFI_INVALID_PARAMETER;
+    if (stream->pos != 0 || !stream->content_size)
+        return EFI_INVALID_PARAMETER;
+    if (capacity < stream->content_size)
+        return EFI_BUFFER_TOO_SMALL;
+
+    ALLOC_TAG_SCOPE(DECOMPRESS);
+    uint64_t time = monotonic_time_usec();
+    [[ maybe_unused ]] bool converted = false;
+    stream->processors = 1;
+    if (stream->frames && stream->frames->count > 1 && stream->format != DECOMPRESS_FORMAT_NONE) {
+        err = read_all_frames(stream, buffer, capacity);
+    } else switch (stream->format) {
+#ifdef USE_LZ4
+        case DECOMPRESS_FORMAT_LZ4:
+            err = read_all_lz4(stream, buffer, capacity);
+            break;
+        case DECOMPRESS_FORMAT_LZ4_LEGACY:
+            err = read_all_lz4_legacy(stream, buffer, capacity);
+            break;
+#endif
+#ifdef USE_GZIP
+        case DECOMPRESS_FORMAT_GZIP:
+            err = read_all_gzip(stream, buffer, capacity);
+            break;
+#endif
+        default:
+            /* all other decoders work in one shot when reading everything
+             * and convert the branches on the way */
+            err = decompress_stream_read(stream, buffer, stream->content_size);
+            converted = true;
+            break;
+    }
+
+    if (EFI_ERROR(err))
+        return err;
+    time = monotonic_time_usec() - time;
+    profile_message(format_name(stream->format), stream->content_size, time, stream->processors);
+
+#ifdef USE_BCJ
+    if (stream->filter.filter != BCJ_FILTER_NONE && !converted) {
+        time = monotonic_time_usec();
+        reverse_bcj(stream, buffer);
+        time = monotonic_time_usec() - time;
+        profile_message("bcj", stream->filter.end - stream->filter.start, time,
+            stream->filter.filter == BCJ_FILTER_ARM64 ? mp_processor_count() : 1);
+    }
+#endif
+    stream->pos = stream->content_size;
+    return EFI_SUCCESS;
+}
+
+efi_status_t decompress_stream_skip(
+    decompress_stream_t stream,
+    size_t length
+) {
+    if (!stream)
+        return EFI_INVALID_PARAMETER;
+    if (stream->content_size && length > stream->content_size - stream->pos)
+        return EFI_END_OF_FILE;
+
+    if (stream->format == DECOMPRESS_FORMAT_NONE) {
+        stream->in.pos += length;
+        stream->pos += length;
+        return EFI_SUCCESS;
+    }
+
+    uint8_t scratch[DECOMPRESS_SKIP_BUFFER_SIZE];
+    while (length) {
+        size_t n = MIN(length, sizeof(scratch));
+        efi_status_t err = decompress_stream_read(stream, scratch, n);
+        if (EFI_ERROR(err))
+            return err;
+        length -= n;
+    }
+
+    return EFI_SUCCESS;
+}
+
+void decompress_stream_close(
+    decompress_stream_t stream
+) {
+    if (!stream)
+        return;
+
+    switch (stream->format) {
+#ifdef USE_LZ4
+        case DECOMPRESS_FORMAT_LZ4:
+            if (stream->ctx)
+                close_lz4(stream);
+            break;
+#endif
+        default:
+            break;
+    }
+    stream->ctx = NULL;
+
+    /* static decoder contexts live in the workspace */
+    free_buffer(&stream->workspace);
+    stream->workspace.pages = 0;
+}
+
+efi_status_t decompress(
+    simple_buffer_t in,
+    uint32_t flags,
+    simple_buffer_t out
+) {
+    efi_status_t err;
+
+    if (!in || !out)
+        return EFI_INVALID_PARAMETER;
+    if (!in->buffer || !in->length)
+        return EFI_INVALID_PARAMETER;
+    if (out->buffer || out->length)
+        return EFI_INVALID_PARAMETER;
+
+    /* the decompressed image is accounted here as well */
+    ALLOC_TAG_SCOPE(DECOMPRESS);
+    _cleanup_stream struct decompress_stream stream = { 0 };
+    err = decompress_stream_open(in, flags, &stream);
+    if (EFI_ERROR(err))
+        return err;
+
+    /* directly pass on an uncompressed executable */
+    if (stream.format == DECOMPRESS_FORMAT_NONE) {
         out->buffer = in->buffer;
         out->allocated = out->length = in->length;
         out->pos = in->pos;
         out->free = NULL;
         return EFI_SUCCESS;
-    } else {
-        _MESSAGE("unsupported file format: %X", (*(uint32_t*) buffer_pos(in)));
+    }
+
+    if (!stream.content_size) {
+        _ERROR("Compressed data does not contain uncompressed size");
         return EFI_UNSUPPORTED;
     }
+
+    if (!allocate_simple_buffer(stream.content_size + DECOMPRESS_OUTPUT_SLACK, out))
+        return EFI_OUT_OF_RESOURCES;
+
+    err = decompress_stream_read_all(&stream, out->buffer, out->allocated);
+    if (EFI_ERROR(err)) {
+        out->free(out);
+        out->allocated = 0;
+        out->buffer = NULL;
+        return err;
+    }
+
+    out->length = stream.content_size;
+    out->pos = 0;
+    _MESSAGE("in = %zu out = %zu", stream.in.pos, out->length);
+    return EFI_SUCCESS;
 }
@@ -1,9 +1,162 @@
 #pragma once
 
 #include <efi.h>
+#include <bcj.h>
 #include "util.h"
 
+/**
+ * @brief formats recognized by the decompressor
+ */
+enum decompress_format {
+    DECOMPRESS_FORMAT_NONE,     ///< uncompressed data
+    DECOMPRESS_FORMAT_LZ4,      ///< LZ4 frame
+    DECOMPRESS_FORMAT_ZSTD,     ///< ZSTD frame
+    DECOMPRESS_FORMAT_LZ4_LEGACY, ///< LZ4 legacy format (`lz4 -l`, used by Linux)
+    DECOMPRESS_FORMAT_GZIP,     ///< gzip member
+};
+
+/**
+ * @brief options for opening a stream
+ */
+enum decompress_flags {
+    /** don't verify content checksums, for data that was already
+     *  authenticated (e.g. by SecureBoot) */
+    DECOMPRESS_NO_CHECKSUM = 1 << 0,
+    /** open data in an unknown format as uncompressed instead of failing */
+    DECOMPRESS_PASS_THROUGH = 1 << 1,
+};
+
+/**
+ * @brief extra bytes behind the content in buffers for
+ *  `decompress_stream_read_all`
+ *
+ * @details
+ *  Block decoders copy in fixed size chunks and have to fall back to slow
+ *  bounds checked copies near the end of the output buffer, the slack keeps
+ *  them on the fast path until the last byte.
+ */
+#define DECOMPRESS_OUTPUT_SLACK 64
+
+typedef struct decompress_stream* decompress_stream_t;
+
+struct frame_table;
+
+/**
+ * @brief sequential reader for (compressed) data
+ *
+ * @details
+ *  The stream decodes its input on demand directly into the buffers passed
+ *  to `decompress_stream_read`, so the consumer decides where every byte of
+ *  the decompressed data ends up and no intermediate copy of the whole
+ *  content is necessary.
+ *
+ *  Reading the whole content with a single call allows the decoder to
+ *  decompress in one shot without any window or intermediate buffers.
+ *  Data split into frames with a frame table (see build_image) is then
+ *  decoded on all processors.
+ *
+ *  Branch conversions applied by build_image are reversed on the decoded
+ *  data. Partial reads may end in the middle of an instruction, the stream
+ *  then decodes a few bytes ahead to complete it.
+ */
+struct decompress_stream {
+    struct simple_buffer in;    ///< compressed input, pos is the read cursor
+    size_t content_size;        ///< size of the decompressed data (0 if unknown)
+    size_t pos;                 ///< number of decompressed bytes already read
+    enum decompress_format format;
+    uint32_t flags;             ///< `enum decompress_flags`
+    void* ctx;                  ///< decoder context
+    const struct frame_table* frames; ///< seek table of independent frames (if any)
+    struct bcj_state filter;    ///< branch conversion of the content (if any)
+    uint8_t lookahead[BCJ_LOOKAHEAD]; ///< decoded content behind pos
+    size_t lookahead_len;
+    struct aligned_buffer workspace; ///< memory backing ctx (if static)
+    size_t processors;          ///< processors that decoded the content in `decompress_stream_read_all`
+};
+
+/**
+ * @brief decompress the whole buffer in into a newly allocated buffer
+ *
+ * @param[in] in
+ *  compressed data
+ * @param[in] flags
+ *  `enum decompress_flags`
+ * @param[out] out
+ *  decompressed data, uncompressed data is passed on without a copy
+ */
 efi_status_t decompress(
     simple_buffer_t in,
+    uint32_t flags,
     simple_buffer_t out
 );
+
+/**
+ * @brief detect the format of in and prepare a stream for reading
+ *
+ * @param[in] in
+ *  compressed data, has to stay valid until the stream is closed
+ * @param[in] flags
+ *  `enum decompress_flags`
+ * @param[out] stream
+ */
+efi_status_t decompress_stream_open(
+    simple_buffer_t in,
+    uint32_t flags,
+    decompress_stream_t stream
+);
+
+/**
+ * @brief read exactly length decompressed bytes into buffer
+ *
+ * @returns EFI_END_OF_FILE
+ *  if the stream ended before length bytes were decompressed
+ */
+efi_status_t decompress_stream_read(
+    decompress_stream_t stream,
+    void* buffer,
+    size_t length
+);
+
+/**
+ * @brief read the whole content at once
+ *
+ * @details
+ *  The stream must not have been read before and the content size has to
+ *  be known. Decoders can skip their intermediate buffers in this case.
+ *
+ * @param[in] capacity
+ *  size of buffer, at least `content_size`, should include
+ *  DECOMPRESS_OUTPUT_SLACK
+ */
+efi_status_t decompress_stream_read_all(
+    decompress_stream_t stream,
+    void* buffer,
+    size_t capacity
+);
+
+/**
+ * @brief whether `decompress_stream_read_all` decodes on several processors
+ */
+bool decompress_stream_parallel(
+    decompress_stream_t stream
+);
+
+/**
+ * @brief discard the next length decompressed bytes
+ */
+efi_status_t decompress_stream_skip(
+    decompress_stream_t stream,
+    size_t length
+);
+
+void decompress_stream_close(
+    decompress_stream_t stream
+);
+
+static inline
+void decompress_stream_close_p(decompress_stream_t stream) {
+    if (stream->ctx || stream->workspace.pages)
+        decompress_stream_close(stream);
+}
+
+#define _cleanup_stream _cleanup(decompress_stream_close_p)
@@ -1,5 +1,3 @@
 #include "fdt_fixup.h"
 
 struct efi_guid efi_dt_fixup_protocol_guid = {{ EFI_DT_FIXUP_PROTOCOL_GUID }};
-
-struct efi_guid efi_fdt_guid = {{ EFI_FDT_GUID }};
@@ -17,9 +17,6 @@
 #define EFI_DT_FIXUP_PROTOCOL_GUID \
 	{ 0xe617d64c, 0xfe08, 0x46da, {0xf4, 0xdc, 0xbb, 0xd5, 0x87, 0x0c, 0x73, 0x00} }
 
-#define EFI_FDT_GUID \
-    { 0xb1b621d5, 0xf19c, 0x41a5, {0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa, 0xe0} }
-
 #define EFI_DT_FIXUP_PROTOCOL_REVISION 0x00010000
 
 /* Add nodes and update properties */
@@ -43,6 +40,4 @@ struct efi_dt_fixup_protocol {
         uint32_t flags);
 };
 
-extern struct efi_guid efi_fdt_guid;
-
 extern struct efi_guid efi_dt_fixup_protocol_guid;
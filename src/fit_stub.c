@@ -36,6 +36,7 @@ efi_status_t run_image_from_file(
         loaded_image->load_options_size = options_length;
     }
 
+    efi_var_flush();
     err = BS->start_image(image, NULL, NULL);
     if (EFI_ERROR(err)) {
         _MESSAGE("StartImage %D: %r", dp, err);
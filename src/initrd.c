@@ -17,6 +17,8 @@
 #include <assert.h>
 #include <efilib.h>
 #include "util.h"
+#include "decompress.h"
+#include "systemd.h"
 
 /**
  * @brief static device path for initrd
@@ -47,7 +49,46 @@ static const struct efi_load_file_protocol load_file2_protocol = {
     .load_file = fl2_load_file
 };
 
-static struct simple_buffer initrd = { 0 };
+/**
+ * @brief a registered segment with its size in the initrd
+ */
+static struct initrd_part {
+    struct initrd_segment segment;
+    size_t size;            ///< size of the (decompressed) segment
+    bool compressed;
+} initrd_parts[INITRD_MAX_SEGMENTS];
+static size_t initrd_count = 0;
+static size_t initrd_size = 0;      ///< size of the concatenated initrd
+static uint32_t initrd_flags = 0;
+
+static
+efi_status_t load_part(
+    struct initrd_part* part,
+    uint8_t* buffer,
+    size_t capacity
+) {
+    efi_status_t err;
+    if (part->compressed) {
+        /* decode straight into the buffer of the kernel */
+        _cleanup_stream struct decompress_stream stream = { 0 };
+        err = decompress_stream_open(&part->segment.data, initrd_flags, &stream);
+        if (!EFI_ERROR(err))
+            err = decompress_stream_read_all(&stream, buffer, capacity);
+        return err;
+    } else if (part->segment.file) {
+        efi_file_handle_t file = part->segment.file;
+        efi_size_t size = part->size;
+        err = file->set_position(file, 0);
+        if (!EFI_ERROR(err))
+            err = file->read(file, &size, buffer);
+        if (!EFI_ERROR(err) && size != part->size)
+            err = EFI_END_OF_FILE;
+        return err;
+    } else {
+        mp_copy(buffer, buffer_pos(&part->segment.data), part->size);
+        return EFI_SUCCESS;
+    }
+}
 
 efi_status_t fl2_load_file(
     efi_load_file_protocol_t this,
@@ -68,20 +109,44 @@ efi_status_t fl2_load_file(
         return EFI_UNSUPPORTED;
     }
 
-    if (!initrd.buffer || buffer_len(&initrd) == 0) {
+    if (initrd_count == 0 || initrd_size == 0) {
         _MESSAGE("Empty initrd");
         return EFI_NOT_FOUND;
     }
 
-    if (!buffer || *buffer_size < buffer_len(&initrd)) {
-        *buffer_size = buffer_len(&initrd);
+    if (!buffer || *buffer_size < initrd_size) {
+        *buffer_size = initrd_size;
         return EFI_BUFFER_TOO_SMALL;
     }
 
-    _MESSAGE("Copy initrd to buffer");
+    /* one pass over all segments, each directly to its final place */
+    trace_begin(INITRD_LOAD, initrd_count);
+    [[ maybe_unused ]] struct pmu_sample pmu;
+    _PMU_START(&pmu);
+    size_t offset = 0;
+    for (size_t i = 0; i < initrd_count; i++) {
+        struct initrd_part* part = &initrd_parts[i];
+        _MESSAGE("Load initrd segment %zu to buffer: size: %zu", i, part->size);
+
+        /* later segments overwrite what decoders leave in the slack */
+        efi_status_t err = load_part(part, (uint8_t*) buffer + offset, *buffer_size - offset);
+        if (EFI_ERROR(err)) {
+            _ERROR("Failed to load initrd segment %zu: %r", i, err);
+            trace_end(INITRD_LOAD, initrd_count);
+            return err;
+        }
 
-    memcpy(buffer, buffer_pos(&initrd), buffer_len(&initrd));
-    *buffer_size = buffer_len(&initrd);
+        size_t padded = ALIGN_VALUE(part->size, 4);
+        memset((uint8_t*) buffer + offset + part->size, 0, padded - part->size);
+        offset += padded;
+    }
+    trace_end(INITRD_LOAD, initrd_count);
+    _PMU_MESSAGE("initrd load", &pmu);
+
+    /* the kernel loads the initrd after the handoff */
+    trace_publish(&loader_guid);
+
+    *buffer_size = initrd_size;
     return EFI_SUCCESS;
 }
 
@@ -100,14 +165,48 @@ efi_status_t locate_device_path(efi_guid_t guid, efi_device_path_t* dp, efi_hand
 #endif
 
 efi_status_t initrd_register(
-    simple_buffer_t _initrd
+    const struct initrd_segment* segments,
+    size_t count,
+    uint32_t flags
 ) {
-    assert(_initrd);
+    assert(segments || count == 0);
     assert(BS);
     
     efi_status_t err;
     
-    if (!_initrd->buffer || _initrd->length == 0) /* don't install initrd if empty */
+    if (count > INITRD_MAX_SEGMENTS)
+        return EFI_INVALID_PARAMETER;
+
+    ALLOC_TAG_SCOPE(INITRD);
+
+    /* only the sizes are needed now, fl2_load_file reads the data */
+    initrd_count = count;
+    initrd_size = 0;
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct initrd_part* part = &initrd_parts[i];
+        *part = (struct initrd_part) { .segment = segments[i] };
+
+        if (part->segment.file) {
+            part->size = part->segment.file_size;
+        } else if (buffer_len(&part->segment.data) < sizeof(uint32_t)) {
+            part->size = buffer_len(&part->segment.data);
+        } else {
+            _cleanup_stream struct decompress_stream stream = { 0 };
+            err = decompress_stream_open(&part->segment.data, flags | DECOMPRESS_PASS_THROUGH, &stream);
+            if (EFI_ERROR(err))
+                return err;
+
+            part->compressed = stream.format != DECOMPRESS_FORMAT_NONE && stream.content_size;
+            part->size = part->compressed ? stream.content_size : buffer_len(&part->segment.data);
+            if (stream.format != DECOMPRESS_FORMAT_NONE && !part->compressed)
+                _MESSAGE("initrd without content size, passing it on compressed");
+        }
+
+        size += ALIGN_VALUE(part->size, 4);
+    }
+
+    if (size == 0) /* don't install initrd if empty */
         return EFI_SUCCESS;
 
     /* check if a previous stage already registered an initrd */
@@ -123,7 +222,8 @@ efi_status_t initrd_register(
     BS->locate_device_path = locate_device_path;
 #endif
     
-    memcpy(&initrd, _initrd, sizeof(struct simple_buffer));
+    initrd_size = size;
+    initrd_flags = flags;
     err = BS->install_multiple_protocol_interfaces(
         &initrd_handle,
         &efi_device_path_protocol_guid, &efi_initrd_device_path,// initrd media device path
@@ -132,7 +232,117 @@ efi_status_t initrd_register(
     return err;
 }
 
+bool initrd_is_bootconfig(
+    const struct initrd_segment* segment
+) {
+    const struct simple_buffer* data = &segment->data;
+    return data->buffer && data->length >= BOOTCONFIG_MAGIC_LEN
+        && memcmp(data->buffer + data->length - BOOTCONFIG_MAGIC_LEN, BOOTCONFIG_MAGIC, BOOTCONFIG_MAGIC_LEN) == 0;
+}
+
+static inline
+bool has_suffix(const char16_t* str, const char16_t* suffix) {
+    size_t len = wcslen(str), suffix_len = wcslen(suffix);
+    return len >= suffix_len && wcscmp(str + len - suffix_len, suffix) == 0;
+}
+
+size_t initrd_find_files(
+    struct initrd_segment* segments,
+    size_t max
+) {
+    assert(segments);
+    assert(EFI_LOADED_IMAGE);
+
+    ALLOC_TAG_SCOPE(INITRD);
+
+    efi_device_path_t filepath = EFI_LOADED_IMAGE->file_path;
+    if (!filepath || !IsDevicePathNode(filepath, MEDIA_DEVICE_PATH, MEDIA_FILEPATH_DP))
+        return 0;
+
+    /* the first use of EFI_ROOT opens the volume */
+    efi_file_handle_t root = EFI_ROOT;
+    if (!root)
+        return 0;
+
+    /* systemd-stub's convention: \EFI\Linux\linux.efi.extra.d\*.cpio */
+    static const char16_t extra_suffix[] = u".extra.d";
+    const char16_t* image_path = ((efi_filepath_t) filepath)->pathname;
+    size_t length = wcslen(image_path);
+    _cleanup_pool char16_t* path = malloc((length + 1) * sizeof(char16_t) + sizeof(extra_suffix));
+    if (!path)
+        return 0;
+    memcpy(path, image_path, length * sizeof(char16_t));
+    memcpy(path + length, extra_suffix, sizeof(extra_suffix));
+
+    _cleanup_file_handle efi_file_handle_t dir = NULL;
+    efi_status_t err = root->open(root, &dir, path, EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(err))
+        return 0;
+
+    efi_size_t info_size = sizeof(struct efi_file_info) + 256 * sizeof(char16_t);
+    _cleanup_pool efi_file_info_t info = malloc(info_size);
+    char16_t* names[INITRD_MAX_SEGMENTS];
+    size_t count = 0;
+    while (info && count < max) {
+        efi_size_t size = info_size;
+        err = dir->read(dir, &size, info);
+        if (err == EFI_BUFFER_TOO_SMALL) {
+            free(info);
+            info = malloc(size);
+            info_size = size;
+            continue;
+        }
+        /* size 0 marks the end of the directory */
+        if (EFI_ERROR(err) || size == 0)
+            break;
+
+        if (info->attribute & EFI_FILE_DIRECTORY || info->file_size == 0 || !has_suffix(info->filename, u".cpio"))
+            continue;
+
+        efi_file_handle_t file;
+        err = dir->open(dir, &file, info->filename, EFI_FILE_MODE_READ, 0);
+        if (EFI_ERROR(err)) {
+            _ERROR("Failed to open %ls\\%ls: %r", path, info->filename, err);
+            continue;
+        }
+
+        char16_t* name = malloc((wcslen(info->filename) + 1) * sizeof(char16_t));
+        if (!name) {
+            file->close(file);
+            break;
+        }
+        *wcscpy(name, info->filename) = u'\0';
+
+        /* keep them sorted by name, the firmware returns them in any order */
+        size_t pos = count++;
+        for (; pos > 0 && wcscmp(names[pos - 1], name) > 0; pos--) {
+            names[pos] = names[pos - 1];
+            segments[pos] = segments[pos - 1];
+        }
+        names[pos] = name;
+        segments[pos] = (struct initrd_segment) {
+            .file = file,
+            .file_size = info->file_size,
+        };
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        _MESSAGE("initrd found: %ls\\%ls size: %zu", path, names[i], segments[i].file_size);
+        free(names[i]);
+    }
+
+    return count;
+}
+
 efi_status_t initrd_deregister() {
+    for (size_t i = 0; i < initrd_count; i++) {
+        efi_file_handle_t file = initrd_parts[i].segment.file;
+        if (file)
+            file->close(file);
+    }
+    initrd_count = 0;
+    initrd_size = 0;
+
     if (initrd_handle) {
         /* uninstall all protocol thus destroying the handle */
         efi_status_t err = BS->uninstall_multiple_protocol_interfaces(
@@ -23,8 +23,77 @@
 #define LINUX_INITRD_MEDIA_GUID \
     { 0x5568e427, 0x68fc, 0x4f3d, {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68} }
 
+/**
+ * @brief maximum number of parts an initrd is assembled from
+ */
+#define INITRD_MAX_SEGMENTS 32
+
+/**
+ * @brief end of a bootconfig appended to the initrd (by `bootconfig -a`)
+ *
+ * @see https://github.com/torvalds/linux/blob/v5.15/include/linux/bootconfig.h
+ */
+#define BOOTCONFIG_MAGIC        "#BOOTCONFIG\n"
+#define BOOTCONFIG_MAGIC_LEN    12
+
+/**
+ * @brief part of the initrd
+ *
+ * @details
+ *  The kernel gets the concatenation of all segments, each padded with
+ *  zeros to a multiple of 4 bytes like cpio archives that are appended to
+ *  each other.
+ */
+struct initrd_segment {
+    struct simple_buffer data;  ///< data in memory (e.g. an image section)
+    efi_file_handle_t file;     ///< or a file that is read on demand
+    size_t file_size;
+};
+
+/**
+ * @brief install a LoadFile2 handler for the initrd
+ *
+ * @details
+ *  The segments are written one after the other directly into the buffer
+ *  of the kernel when it loads the initrd. LZ4 or ZSTD compressed segments
+ *  in memory (with content size) are decompressed on the way.
+ *
+ * @param[in] segments
+ *  the data has to stay valid until `initrd_deregister`, which also closes
+ *  the files
+ * @param[in] flags
+ *  `enum decompress_flags`
+ */
 efi_status_t initrd_register(
-    simple_buffer_t initrd
+    const struct initrd_segment* segments,
+    size_t count,
+    uint32_t flags
+);
+
+/**
+ * @brief open the cpio archives in the directory `<image>.extra.d` next to
+ *  the loaded image
+ *
+ * @param[out] segments
+ *  the files are added in the order of their names
+ * @param[in] max
+ *  number of entries available in segments
+ * @returns number of added segments
+ */
+size_t initrd_find_files(
+    struct initrd_segment* segments,
+    size_t max
+);
+
+/**
+ * @brief check if the segment ends with a bootconfig
+ *
+ * @details
+ *  The kernel looks for the bootconfig only at the end of the initrd, such
+ *  a segment has to stay the last one. Compressed segments are not checked.
+ */
+bool initrd_is_bootconfig(
+    const struct initrd_segment* segment
 );
 
 efi_status_t initrd_deregister();
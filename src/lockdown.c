@@ -95,8 +95,13 @@ efi_status_t efi_main(efi_handle_t image, efi_system_table_t systable) {
         return EFI_OUT_OF_RESOURCES;
     
     _MESSAGE("Using %ls as Working Directoy", path);
+    efi_file_handle_t root = EFI_ROOT;
+    if (!root) {
+        _ERROR("Image was not loaded from a file system");
+        return EFI_UNSUPPORTED;
+    }
     efi_file_handle_t cwd;
-    err = EFI_ROOT->open(EFI_ROOT, &cwd, path, EFI_FILE_MODE_READ, 0);
+    err = root->open(root, &cwd, path, EFI_FILE_MODE_READ, 0);
     if (EFI_ERROR(err)) {
         _ERROR("Could not set Working Directory: %ls", path);
         return err;
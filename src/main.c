@@ -8,6 +8,54 @@
 #include "systemd.h"
 #include "fdt_fixup.h"
 
+#include <load_plan.h>
+
+static inline
+void print_alloc_stats() {
+#ifdef PRINT_MESSAGES
+    struct alloc_stats stats;
+    alloc_get_stats(&stats);
+    /* every malloc and free used to be a pool call */
+    _MESSAGE("allocations: %u allocs %u frees, %u firmware calls (were %u), arena peak %zu KiB",
+        stats.allocs, stats.frees, stats.firmware_calls, stats.allocs + stats.frees, stats.arena_peak >> 10);
+
+    static const char8_t* names[_ALLOC_TAG_MAX] = {
+#define ALLOC_TAG_NAME(id, name) [ALLOC_TAG_##id] = name,
+        TRACE_MEMORY_SERIES(ALLOC_TAG_NAME)
+#undef ALLOC_TAG_NAME
+    };
+    for (unsigned tag = 0; tag < _ALLOC_TAG_MAX; tag++) {
+        struct alloc_usage* usage = &stats.tags[tag];
+        if (usage->peak)
+            _MESSAGE("memory %s: peak %zu KiB (%zu KiB pool, %zu pages), held %zu KiB %zu pages",
+                names[tag], usage->peak >> 10, usage->peak_bytes >> 10, usage->peak_pages,
+                usage->bytes >> 10, usage->pages);
+    }
+    _MESSAGE("memory peak: %zu KiB, image %zu KiB",
+        stats.total.peak >> 10, EFI_LOADED_IMAGE->image_size >> 10);
+#endif
+}
+
+/**
+ * @brief publish the boot timeline, nothing is recorded after this
+ */
+static inline
+void trace_handoff() {
+    efi_status_t err = efi_var_flush();
+    if (EFI_ERROR(err))
+        _ERROR("Could not write loader variables: %r", err);
+    alloc_trace_usage();
+    trace_instant(HANDOFF, 0);
+    err = trace_publish(&loader_guid);
+    if (EFI_ERROR(err) && err != EFI_UNSUPPORTED)
+        _ERROR("Could not publish boot trace: %r", err);
+#ifdef DEFERRED_MESSAGES
+    err = log_publish(&loader_guid);
+    if (EFI_ERROR(err))
+        _ERROR("Could not publish messages: %r", err);
+#endif
+}
+
 #if USE_EFI_LOAD_IMAGE
 static inline
 efi_status_t image_start(efi_handle_t* image, simple_buffer_t options) {
@@ -31,7 +79,9 @@ efi_status_t image_start(efi_handle_t* image, simple_buffer_t options) {
         efi_var_set_printf(&loader_guid, u"LoaderTimeExecUSec",
             EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
             u"%lu", monotonic_time_usec());
+    print_alloc_stats();
     _MESSAGE("StartImage: %D after %b.3f ms", loaded_image->file_path, (monotonic_time_usec() - BOOT_TIME_USECS) / 1000.0);
+    trace_handoff();
     err = BS->start_image(image, NULL, NULL);
     if (EFI_ERROR(err)) {
         _ERROR("Unable to start image: %r", err);
@@ -41,10 +91,44 @@ efi_status_t image_start(efi_handle_t* image, simple_buffer_t options) {
 
     return err;
 }
+#else
+/**
+ * @brief run an image prepared by the internal PE loader and unload it
+ *  when it returns
+ */
+static inline
+efi_status_t start_loaded_image(
+    efi_handle_t image,
+    efi_loaded_image_t loaded_image,
+    efi_entry_point_t entry_point,
+    simple_buffer_t options
+) {
+    efi_status_t err;
+
+    if (options && buffer_len(options) > 0) {
+        loaded_image->load_options = buffer_pos(options);
+        loaded_image->load_options_size = buffer_len(options);
+    }
+    // ST->out->reset(ST->out, false);
+    if (BOOT_TIME_USECS)
+        efi_var_set_printf(&loader_guid, u"LoaderTimeExecUSec",
+            EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+            u"%lu", monotonic_time_usec());
+    print_alloc_stats();
+    _MESSAGE("StartImage: %D after %b.3f ms", loaded_image->file_path, (monotonic_time_usec() - BOOT_TIME_USECS) / 1000.0);
+    trace_handoff();
+    err = entry_point(image, ST);
+    if (EFI_ERROR(err))
+        _ERROR("Image returned with: %r", err);
+    loaded_image->unload(image);
+
+    return err;
+}
 #endif
 
 efi_status_t execute_image_from_memory(
     simple_buffer_t buffer,
+    [[ maybe_unused ]] simple_buffer_t plan,
     simple_buffer_t options
 ) {
     efi_status_t err;
@@ -71,34 +155,31 @@ efi_status_t execute_image_from_memory(
     efi_entry_point_t entry_point;
     efi_handle_t image;
     efi_loaded_image_t loaded_image;
-    err = PE_handle_image(buffer, &image, &loaded_image, &entry_point);
+    trace_begin(PE_LOAD, 0);
+    err = PE_handle_image(buffer, plan, &image, &loaded_image, &entry_point);
+    trace_end(PE_LOAD, 0);
 
-    if (!EFI_ERROR(err))  {
-        if (options && buffer_len(options) > 0) {
-            loaded_image->load_options = buffer_pos(options);
-            loaded_image->load_options_size = buffer_len(options);
-        }
-        // ST->out->reset(ST->out, false);
-        if (BOOT_TIME_USECS)
-            efi_var_set_printf(&loader_guid, u"LoaderTimeExecUSec",
-                EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
-                u"%lu", monotonic_time_usec());
-        _MESSAGE("StartImage: %D after %b.3f ms", loaded_image->file_path, (monotonic_time_usec() - BOOT_TIME_USECS) / 1000.0);
-        err = entry_point(image, ST);
-        if (EFI_ERROR(err))
-            _ERROR("Image returned with: %r", err);
-        loaded_image->unload(image);
-    }
+    if (!EFI_ERROR(err))
+        err = start_loaded_image(image, loaded_image, entry_point, options);
 
 #endif
     return err;
 }
 
 #ifdef USE_EFI_DT_FIXUP
+static inline
+void free_fdt_buffer(simple_buffer_t buffer) {
+    if (buffer->allocated) {
+        alloc_account(ALLOC_TAG_DTB, -(int64_t) buffer->allocated, 0);
+        BS->free_pool(buffer->buffer);
+    }
+}
+
 static inline
 efi_status_t do_devicetree_fixup(
     simple_buffer_t fdt
 ) {
+    ALLOC_TAG_SCOPE(DTB);
     efi_dt_fixup_protocol_t fixup;
     efi_status_t err = BS->locate_protocol(&efi_dt_fixup_protocol_guid, NULL, (void**) &fixup);
     if (EFI_ERROR(err))
@@ -118,9 +199,10 @@ efi_status_t do_devicetree_fixup(
     /* ACPI Reclaim Memory according to EBBR 2.0 specs */
     if (EFI_SUCCESS != BS->allocate_pool(EFI_ACPI_RECLAIM_MEMORY, size, &buffer))
         return EFI_OUT_OF_RESOURCES;
+    alloc_account(ALLOC_TAG_DTB, size, 0);
     memcpy(buffer, buffer_pos(fdt), buffer_len(fdt));
     free_buffer(fdt);
-    fdt->free = free_simple_buffer;
+    fdt->free = free_fdt_buffer;
     fdt->buffer = buffer;
     fdt->length = fdt->allocated = size;
     fdt->pos = 0;
@@ -147,6 +229,7 @@ efi_status_t do_devicetree_fixup(
 
 static inline
 void set_systemd_variables() {
+    ALLOC_TAG_SCOPE(VARS);
     efi_var_set_printf(&loader_guid, u"StubInfo",
         EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
         u"%s %s", LOADER_NAME, LOADER_VERSION);
@@ -166,9 +249,9 @@ void set_systemd_variables() {
         u"UEFI %hu.%02hu", ST->hdr.revision >> 16, ST->hdr.revision);
 
     if (!efi_var_attributes(&loader_guid, u"LoaderImageIdentifier")) {
-        efi_var_set_printf(&loader_guid, u"LoaderImageIdentifier",
+        efi_var_set_device_path(&loader_guid, u"LoaderImageIdentifier",
             EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
-            u"%D", EFI_LOADED_IMAGE->file_path);
+            EFI_LOADED_IMAGE->file_path);
     }
 
     efi_device_path_protocol_t dp;
@@ -204,6 +287,13 @@ efi_status_t efi_main(
     if (secure_boot)
         _MESSAGE("Running in %TSECURE%N mode", EFI_GREEN);
 
+    /* the embedded sections are covered by the image signature */
+    uint32_t decompress_flags = 0;
+#ifdef SKIP_CHECKSUM_ON_SECURE_BOOT
+    if (secure_boot)
+        decompress_flags |= DECOMPRESS_NO_CHECKSUM;
+#endif
+
     set_systemd_variables();
 
     /* get the relevant sections from the image */
@@ -211,20 +301,59 @@ efi_status_t efi_main(
         { .name = ".osrel"   },
         { .name = ".cmdline" },
         { .name = ".linux"   },
-        { .name = ".initrd"  },
         { .name = ".dtb"     },
+        { .name = ".initrd"  },
+        { .name = ".initrd1" },
+        { .name = ".initrd2" },
+        { .name = ".initrd3" },
+        { .name = ".initrd4" },
+        { .name = ".initrd5" },
+        { .name = ".initrd6" },
+        { .name = ".initrd7" },
+        { .name = ".initrd8" },
+        { .name = ".initrd9" },
+        { .name = LOAD_PLAN_SECTION },
         { }
     };
 
     enum {
-        SECTION_OSREL, SECTION_CMDLINE, SECTION_LINUX, SECTION_INITRD, SECTION_FDT
+        SECTION_OSREL, SECTION_CMDLINE, SECTION_LINUX, SECTION_FDT,
+        SECTION_INITRD, SECTION_INITRD_LAST = SECTION_INITRD + 9,
+        SECTION_PLAN
     };
 
-    if (!PE_locate_sections(sections)) {
+    trace_begin(LOCATE_SECTIONS, 0);
+    bool located = PE_locate_sections(sections);
+    trace_end(LOCATE_SECTIONS, 0);
+    if (!located) {
         _ERROR("Could not read section table");
         exit(EFI_UNSUPPORTED);
     }
 
+#if defined(UART_CONSOLE) || defined(USE_EFI_DT_FIXUP)
+    /* build_image may have compressed the DeviceTree, a plain one is used
+     * in place */
+    _cleanup_buffer struct simple_buffer fdt = { };
+    if (sections[SECTION_FDT].load_address && sections[SECTION_FDT].size) {
+        struct simple_buffer section = {
+            .buffer = (uint8_t*) EFI_LOADED_IMAGE->image_base + sections[SECTION_FDT].load_address,
+            .length = sections[SECTION_FDT].size,
+            .allocated = sections[SECTION_FDT].size,
+        };
+        err = decompress(&section, decompress_flags | DECOMPRESS_PASS_THROUGH, &fdt);
+        if (EFI_ERROR(err)) {
+            _ERROR("Failed to decompress DeviceTree: %r", err);
+            fdt = (struct simple_buffer) { };
+        }
+    }
+#endif
+
+#ifdef UART_CONSOLE
+    /* the embedded DeviceTree knows the console of the board best */
+    if (EFI_SUCCESS == uart_console(fdt.buffer ? buffer_pos(&fdt) : NULL))
+        _MESSAGE("Console on UART");
+#endif
+
     if (!sections[SECTION_LINUX].load_address || !sections[SECTION_LINUX].size) {
         _ERROR("No kernel embedded");
         exit(EFI_UNSUPPORTED);
@@ -244,32 +373,50 @@ efi_status_t efi_main(
         _MESSAGE("embedded cmdline found: %.*ls", length, (char16_t*) options.buffer);
     }
 
-    if (sections[SECTION_INITRD].load_address) {
-        struct simple_buffer initrd = {
-            .buffer = (uint8_t*) EFI_LOADED_IMAGE->image_base + sections[SECTION_INITRD].load_address,
-            .length = sections[SECTION_INITRD].size,
-            0
-        };
+    /* the initrd is the concatenation of the embedded archives and the
+     * ones next to the image */
+    struct initrd_segment initrds[INITRD_MAX_SEGMENTS] = { };
+    size_t initrd_count = 0;
+    for (int i = SECTION_INITRD; i <= SECTION_INITRD_LAST; i++) {
+        if (!sections[i].load_address || !sections[i].size)
+            continue;
+
+        simple_buffer_t initrd = &initrds[initrd_count++].data;
+        initrd->buffer = (uint8_t*) EFI_LOADED_IMAGE->image_base + sections[i].load_address;
+        initrd->length = sections[i].size;
 
-        _MESSAGE("embedded initrd found: size: %zu", buffer_len(&initrd));
-        _MESSAGE("initrd hash %blX", buffer_xxh64(&initrd));
+        _MESSAGE("embedded initrd %d found: size: %zu", i - SECTION_INITRD, buffer_len(initrd));
+        _MESSAGE("initrd hash %blX", buffer_xxh64(initrd));
+    }
+
+#ifdef INITRD_EXTRA_FILES
+    /* files on the ESP are not covered by the image signature, they go in
+     * front of an embedded bootconfig, which has to stay at the end */
+    if (!secure_boot) {
+        struct initrd_segment bootconfig = { };
+        if (initrd_count && initrd_is_bootconfig(&initrds[initrd_count - 1]))
+            bootconfig = initrds[--initrd_count];
+        initrd_count += initrd_find_files(initrds + initrd_count, INITRD_MAX_SEGMENTS - initrd_count - (bootconfig.data.buffer != NULL));
+        if (bootconfig.data.buffer)
+            initrds[initrd_count++] = bootconfig;
+    }
+#endif
 
-        err = initrd_register(&initrd);
+    if (initrd_count) {
+        err = initrd_register(initrds, initrd_count, decompress_flags);
         if (EFI_ERROR(err)) {
             _ERROR("Failed to register initrd handler");
         }
     }
 
 #ifdef USE_EFI_DT_FIXUP
-    _cleanup_buffer struct simple_buffer fdt = { };
-    if (sections[SECTION_FDT].load_address) {
-        fdt.buffer = (uint8_t*) EFI_LOADED_IMAGE->image_base + sections[SECTION_FDT].load_address;
-        fdt.length = sections[SECTION_FDT].size;
-
+    if (fdt.buffer) {
         _MESSAGE("embedded DeviceTree found: size: %zu", buffer_len(&fdt));
         _MESSAGE("DeviceTree hash %blX", buffer_xxh64(&fdt));
 
+        trace_begin(DTB_FIXUP, 0);
         err = do_devicetree_fixup(&fdt);
+        trace_end(DTB_FIXUP, 0);
         if (EFI_ERROR(err)) {
             _ERROR("Failed to install DeviceTree: %r", err);
         }
@@ -283,9 +430,100 @@ efi_status_t efi_main(
         0
     };
 
+    struct simple_buffer plan_section = {
+        .buffer = sections[SECTION_PLAN].load_address
+            ? (uint8_t*) EFI_LOADED_IMAGE->image_base + sections[SECTION_PLAN].load_address
+            : NULL,
+        .length = sections[SECTION_PLAN].size,
+        .allocated = sections[SECTION_PLAN].size,
+        0
+    };
+
+#ifdef USE_STREAM_LOADER
+    /* decompress the kernel directly into its final memory layout */
+    efi_entry_point_t entry_point;
+    efi_handle_t kernel_image;
+    efi_loaded_image_t loaded_image;
+    [[ maybe_unused ]] struct pmu_sample pmu;
+    _PMU_START(&pmu);
+    uint64_t time = monotonic_time_usec();
+    {
+        _cleanup_stream struct decompress_stream stream = { 0 };
+        err = decompress_stream_open(&linux_section, decompress_flags, &stream);
+        if (EFI_ERROR(err)) {
+            _ERROR("Decompress Error: %r", err);
+            goto end;
+        }
+
+        /* decoding all frames at once on every processor beats streaming */
+        bool parallel = decompress_stream_parallel(&stream);
+        err = EFI_UNSUPPORTED;
+        if (parallel) {
+            /* a second stream reads the headers, the frames go straight into the image */
+            _cleanup_stream struct decompress_stream headers = { 0 };
+            err = decompress_stream_open(&linux_section, decompress_flags, &headers);
+            if (!EFI_ERROR(err)) {
+                trace_begin(PE_LOAD, 0);
+                err = PE_handle_image_frames(&headers, &stream, &plan_section, &kernel_image, &loaded_image, &entry_point);
+                trace_end(PE_LOAD, 0);
+            }
+        }
+        if (err == EFI_UNSUPPORTED && parallel) {
+            /*
+             * Without a plan that keeps the file offsets the decoded file is
+             * staged and copied into the image, which needs memory for both.
+             */
+            ALLOC_TAG_SCOPE(DECOMPRESS);
+            _cleanup_buffer struct simple_buffer kernel = { 0 };
+            if (!allocate_simple_buffer(stream.content_size + DECOMPRESS_OUTPUT_SLACK, &kernel)) {
+                err = EFI_OUT_OF_RESOURCES;
+                goto end;
+            }
+
+            trace_begin(DECOMPRESS, 0);
+            err = decompress_stream_read_all(&stream, kernel.buffer, kernel.allocated);
+            trace_end(DECOMPRESS, 0);
+            if (EFI_ERROR(err)) {
+                _ERROR("Decompress Error: %r", err);
+                goto end;
+            }
+            kernel.length = stream.content_size;
+
+            trace_begin(PE_LOAD, 0);
+            err = PE_handle_image(&kernel, &plan_section, &kernel_image, &loaded_image, &entry_point);
+            trace_end(PE_LOAD, 0);
+        } else if (err == EFI_UNSUPPORTED) {
+            /* includes the decompression of everything behind the headers */
+            trace_begin(PE_LOAD, 0);
+            err = PE_handle_image_stream(&stream, &plan_section, &kernel_image, &loaded_image, &entry_point);
+            trace_end(PE_LOAD, 0);
+        }
+        if (EFI_ERROR(err)) {
+            _ERROR("ImageLoad Error: %r", err);
+            goto end;
+        }
+
+        time = monotonic_time_usec() - time;
+        assert(time > 0);
+
+        _MESSAGE(
+            "decompress and load took %b.3f ms %b.3f MiB/s",
+            time / 1000.0,
+            stream.pos / (1024.0 * 1024.0) / (time / 1000000.0));
+        _PMU_MESSAGE("decompress and load", &pmu);
+    }
+
+    err = start_loaded_image(kernel_image, loaded_image, entry_point, &options);
+    if (EFI_ERROR(err))
+        goto end;
+#else
     _cleanup_buffer struct simple_buffer decompressed_kernel = { 0 };
+    [[ maybe_unused ]] struct pmu_sample pmu;
+    _PMU_START(&pmu);
     uint64_t time = monotonic_time_usec();
-    err = decompress(&linux_section, &decompressed_kernel);
+    trace_begin(DECOMPRESS, 0);
+    err = decompress(&linux_section, decompress_flags, &decompressed_kernel);
+    trace_end(DECOMPRESS, 0);
     if (EFI_ERROR(err)) {
         _ERROR("Decompress Error: %r", err);
         goto end;
@@ -297,14 +535,16 @@ efi_status_t efi_main(
     _MESSAGE(
         "decompress took %b.3f ms %b.3f MiB/s",
         time / 1000.0,
-        (decompressed_kernel.length * 1024 * 1024) / (time / 1000000.0));
+        decompressed_kernel.length / (1024.0 * 1024.0) / (time / 1000000.0));
+    _PMU_MESSAGE("decompress", &pmu);
     _MESSAGE("kernel hash %blX", buffer_xxh64(&decompressed_kernel));
 
-    err = execute_image_from_memory(&decompressed_kernel, &options);
+    err = execute_image_from_memory(&decompressed_kernel, &plan_section, &options);
     if (EFI_ERROR(err)) {
         _ERROR("ImageLoad Error: %r", err);
         goto end;
     }
+#endif
 end:
     initrd_deregister();
     exit(err);
@@ -18,6 +18,7 @@
 
 #include <efi/pe.h>
 #include "util.h"
+#include "decompress.h"
 
 #ifndef USE_EFI_LOAD_IMAGE
 /**
@@ -25,6 +26,9 @@
  * 
  * @param[in] data
  *  buffer containing PE image
+ * @param[in] plan
+ *  `.zlplan` section for the image or NULL, the image is parsed if the plan
+ *  doesn't match
  * @param[out] image
  *  Handle for the new image
  * @param[out] loaded_image
@@ -35,10 +39,73 @@
  */
 efi_status_t PE_handle_image(
     simple_buffer_t data,
+    simple_buffer_t plan,
     efi_handle_t* image,
     efi_loaded_image_t* loaded_image,
     efi_entry_point_t* entry_point
 );
+
+#ifdef USE_STREAM_LOADER
+/**
+ * @brief load PE file while it is decompressed and prepare for execution
+ *
+ * @details
+ *  The headers are read first to allocate the image, afterwards the raw data
+ *  of every section is decompressed directly to its virtual address and the
+ *  remaining parts of the image are zero filled. The decompressed file is
+ *  never held in memory as a whole.
+ *
+ * @param[in] stream
+ *  stream positioned at the beginning of the PE image
+ * @param[in] plan
+ *  `.zlplan` section for the image or NULL, its operations replace the
+ *  section headers if it matches
+ * @param[out] image
+ *  Handle for the new image
+ * @param[out] loaded_image
+ *  LoadedImage protocol registerd for image handle
+ * @param[out] entry_point
+ *  pointer to the `efi_main` function of the image, can be called, when
+ *  this function returned `EFI_SUCCESS`
+ */
+efi_status_t PE_handle_image_stream(
+    decompress_stream_t stream,
+    simple_buffer_t plan,
+    efi_handle_t* image,
+    efi_loaded_image_t* loaded_image,
+    efi_entry_point_t* entry_point
+);
+
+/**
+ * @brief decode all frames of the kernel at once straight into the image
+ *
+ * @details
+ *  The headers are read from stream, which only decodes the beginning of
+ *  the first frame, to allocate the image. frames is then decoded in
+ *  parallel into the allocation, neither the decompressed file nor a copy
+ *  of it is held in memory.
+ *
+ *  This requires a matching load plan whose copies keep their file offsets.
+ *
+ * @param[in] stream
+ *  stream positioned at the beginning of the PE image
+ * @param[in] frames
+ *  another, unread stream of the same data
+ * @param[in] plan
+ *  `.zlplan` section for the image or NULL
+ *
+ * @returns EFI_UNSUPPORTED
+ *  if the layout doesn't allow it, frames is not read in this case
+ */
+efi_status_t PE_handle_image_frames(
+    decompress_stream_t stream,
+    decompress_stream_t frames,
+    simple_buffer_t plan,
+    efi_handle_t* image,
+    efi_loaded_image_t* loaded_image,
+    efi_entry_point_t* entry_point
+);
+#endif
 #endif
 
 /**
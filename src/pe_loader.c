@@ -54,8 +54,12 @@
 #include <string.h>
 #include <assert.h>
 
+#include <load_plan.h>
+#include <xxhash.h>
+
 #include "minmax.h"
 #include "config.h"
+#include "util.h"
 
 struct pe_loader_ctx {
     efi_physical_address_t image_address;
@@ -98,8 +102,6 @@ bool allow_64bit() {
 #  define __join(a,b) a ## b
 #endif
 
-#define ALIGN_VALUE(v, a) ((v) + (((a) - (v)) & ((a) - 1)))
-
 /**
  * @brief transform image address to absolute address
  *  and perform bound checks
@@ -360,7 +362,7 @@ efi_status_t relocate_sections(
         }
 
         if (sec->characteristics & PE_SECTION_CNT_UNINITIALIZED_DATA) {
-            memset(base, 0, sec->virtual_size);
+            mp_zero(base, sec->virtual_size);
        } else {
             if (sec->pointer_to_raw_data < ctx->size_of_headers) {
                _MESSAGE("Section %.*s is inside image headers", PE_SECTION_SIZE_OF_SHORT_NAME, sec->name);
@@ -372,7 +374,7 @@ efi_status_t relocate_sections(
                     memcpy(base, ctx->base + sec->pointer_to_raw_data, sec->size_of_raw_data);
             }
             if (sec->size_of_raw_data < sec->virtual_size)
-                memset(base + sec->size_of_raw_data, 0, sec->virtual_size - sec->size_of_raw_data);
+                mp_zero(base + sec->size_of_raw_data, sec->virtual_size - sec->size_of_raw_data);
         }
 
         if (sec->virtual_address < ctx->entry_point && ctx->entry_point < sec->virtual_address + sec->virtual_size) {
@@ -388,29 +390,97 @@ efi_status_t relocate_sections(
 }
 
 /**
- * @brief
+ * @brief number of bytes a fixup changes
+ */
+__pure
+static inline
+size_t fixup_size(
+    uint16_t fixup
+) {
+    switch (fixup & PE_RELOC_BASED_TYPE_MASK) {
+        case PE_RELOC_BASED_HIGH:
+        case PE_RELOC_BASED_LOW:
+            return sizeof(uint16_t);
+        case PE_RELOC_BASED_HIGHLOW:
+            return sizeof(uint32_t);
+        case PE_RELOC_BASED_DIR64:
+            return sizeof(uint64_t);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief apply the fixups of one relocation block
+ *
+ * @param[in] fixup_base
+ *  address of the page the block applies to
+ * @param[in] limit
+ *  bytes of the image from fixup_base on, no fixup may write beyond
+ * @param[in] fixups
+ * @param[in] count
+ *  number of fixups
+ * @param[in] adjust
+ *  difference between the load address and the linked address
+ */
+static inline
+efi_status_t apply_fixups(
+    uint8_t* fixup_base,
+    size_t limit,
+    const uint16_t* fixups,
+    uint32_t count,
+    efi_size_t adjust
+) {
+    for (uint32_t i = 0; i < count; i++) {
+        size_t offset = fixups[i] & PE_RELOC_BASED_FIXUP_MASK;
+        uint8_t* fixup = fixup_base + offset;
+        if (offset + fixup_size(fixups[i]) > limit) {
+            _MESSAGE("Fixup at %zX is outside of the image", offset);
+            return EFI_LOAD_ERROR;
+        }
+        switch(fixups[i] & PE_RELOC_BASED_TYPE_MASK) {
+            case PE_RELOC_BASED_ABSOLUTE:
+                break;
+            case PE_RELOC_BASED_HIGH: /* add upper WORD of the 32bit address */
+                *((uint16_t*) fixup) = (*((uint16_t*) fixup) + (uint16_t) ((uint32_t) adjust >> 16));
+                break;
+            case PE_RELOC_BASED_LOW: /* add lower WORD of 32bit address */
+                *((uint16_t*) fixup) = (*((uint16_t*) fixup) + (uint16_t) adjust);
+                break;
+            case PE_RELOC_BASED_HIGHLOW: /* add WORD */
+                *((uint32_t*) fixup) = (*((uint32_t*) fixup) + (uint32_t) adjust);
+                break;
+            case PE_RELOC_BASED_DIR64:
+                *((uint64_t*) fixup) = (*((uint64_t*) fixup) + (uint64_t) adjust);
+                break;
+            default:
+                _MESSAGE("Unknown relocation %u", fixups[i] >> 12);
+                return EFI_UNSUPPORTED;
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief apply base relocations to the loaded image
  *
  * @param[in] buffer
  *  pointer to the base of the virtual memory segment
  * @param[in] ctx
- * @param[in] reloc_section
- *  pointer to .reloc section header
+ * @param[in] reloc_base
+ *  pointer to the first relocation block
+ * @param[in] reloc_end
+ *  pointer past the last relocation block
  */
 efi_status_t relocation_fixup(
     const uint8_t* buffer,
     pe_loader_ctx_t ctx,
-    PE_section_t reloc_section
+    uint8_t* reloc_base,
+    uint8_t* reloc_end
 ) {
     assert(buffer);
     assert(ctx);
-    assert(ctx->base);
     assert(ctx->reloc_directory);
-    assert(reloc_section);
-
-    uint8_t* reloc_base = image_address(ctx->base, ctx->size_of_image,
-        reloc_section->pointer_to_raw_data);
-    uint8_t* reloc_end  = image_address(ctx->base, ctx->size_of_image,
-        reloc_section->pointer_to_raw_data + reloc_section->virtual_size);
 
     if (!reloc_base && !reloc_end)
         return EFI_SUCCESS;
@@ -428,43 +498,28 @@ efi_status_t relocation_fixup(
     for (
         PE_base_relocation_t reloc = (PE_base_relocation_t) reloc_base;
         (uint8_t*) reloc < reloc_end;
-        reloc = (PE_base_relocation_t) ((uint8_t*) reloc) + reloc->size_of_block + sizeof(struct PE_base_relocation)
+        reloc = (PE_base_relocation_t) (((uint8_t*) reloc) + reloc->size_of_block)
     ) {
-        if (reloc->size_of_block == 0) {
-            _MESSAGE("Reloc %u block size 0 is invalid", n);
+        if (reloc->size_of_block < sizeof(struct PE_base_relocation)) {
+            _MESSAGE("Reloc %u block size %u is invalid", n, reloc->size_of_block);
             return EFI_UNSUPPORTED;
         } else if (reloc->size_of_block > ctx->reloc_directory->size) {
             _MESSAGE("Reloc %u block size %hu greater than reloc dir size %hu", n, reloc->size_of_block, ctx->reloc_directory->size);
             return EFI_UNSUPPORTED;
         }
 
-        uint8_t* fixup_base = image_address(ctx->base, ctx->size_of_image, reloc->virtual_address);
+        uint8_t* fixup_base = image_address(buffer, ctx->size_of_image, reloc->virtual_address);
         if (!fixup_base) {
             _MESSAGE("Reloc %u invalid virtual address", n);
             return EFI_UNSUPPORTED;
         }
 
-        for (uint32_t i = 0; i < reloc->size_of_block / sizeof(uint16_t); i++) {
-            uint8_t* fixup = fixup_base + (reloc->fixup[i] & PE_RELOC_BASED_FIXUP_MASK);
-            switch(reloc->fixup[i] & PE_RELOC_BASED_TYPE_MASK) {
-                case PE_RELOC_BASED_ABSOLUTE:
-                    break;
-                case PE_RELOC_BASED_HIGH: /* add upper WORD of the 32bit address */
-                    *((uint16_t*) fixup) = (*((uint16_t*) fixup) + (uint16_t) ((uint32_t) adjust >> 16));
-                    break;
-                case PE_RELOC_BASED_LOW: /* add lower WORD of 32bit address */
-                    *((uint16_t*) fixup) = (*((uint16_t*) fixup) + (uint16_t) adjust);
-                    break;
-                case PE_RELOC_BASED_HIGHLOW: /* add WORD */
-                    *((uint32_t*) fixup) = (*((uint32_t*) fixup) + (uint32_t) adjust);
-                    break;
-                case PE_RELOC_BASED_DIR64:
-                    *((uint64_t*) fixup) = (*((uint64_t*) fixup) + (uint64_t) adjust);
-                    break;
-                default:
-                    _MESSAGE("Reloc %u Unknown relocation %u", n, reloc->fixup[i] >> 12);
-                    return EFI_UNSUPPORTED;
-            }
+        uint32_t count = (reloc->size_of_block - sizeof(struct PE_base_relocation)) / sizeof(uint16_t);
+        efi_status_t err = apply_fixups(fixup_base, ctx->size_of_image - reloc->virtual_address,
+            (const uint16_t*) ((uint8_t*) reloc + sizeof(struct PE_base_relocation)), count, adjust);
+        if (EFI_ERROR(err)) {
+            _MESSAGE("Reloc %u failed", n);
+            return err;
         }
         n++;
     }
@@ -491,7 +546,9 @@ efi_status_t __unload_pe_file(
 
     /* free memory pages and device path node */
     if(IsDevicePathNode(&dp->hdr, HARDWARE_DEVICE_PATH, HW_MEMMAP_DP)) {
-        BS->free_pages(dp->start, (dp->start - dp->end) / PAGE_SIZE);
+        size_t pages = (dp->end - dp->start) / PAGE_SIZE;
+        alloc_account(ALLOC_TAG_PE_LOADER, 0, -(int64_t) pages);
+        BS->free_pages(dp->start, pages);
     } else {
         /* No MEMMAP devicepath, not our handle? */
         BS->close_protocol(image, &efi_loaded_image_device_path_guid, EFI_IMAGE, NULL);
@@ -527,8 +584,441 @@ efi_status_t __unload_pe_file(
     return err;
 }
 
+/**
+ * @brief register the loaded image with the firmware
+ *
+ * @details
+ *  creates the memory mapped device path and the loaded image protocol for
+ *  the image in data and installs both on a new handle. On success the
+ *  ownership of data is transferred to the image handle.
+ *
+ * @param[in] data
+ *  memory allocation holding the relocated image
+ * @param[in] ctx
+ * @param[out] image
+ * @param[out] loaded_image
+ */
+static inline
+efi_status_t register_image(
+    aligned_buffer_t data,
+    pe_loader_ctx_t ctx,
+    efi_handle_t* image,
+    efi_loaded_image_t* loaded_image
+) {
+    efi_status_t err;
+
+    /* create device path for memory mapped file */
+    efi_device_path_t dp = create_memory_mapped_device_path(
+        (efi_physical_address_t) data->raw, data->pages * PAGE_SIZE, EFI_LOADER_DATA);
+
+    if (!dp) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    *loaded_image = malloc(sizeof(struct efi_loaded_image_protocol));
+    if (!*loaded_image) {
+        free(dp);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    /* setup loaded image */
+    struct efi_loaded_image_protocol _lp = {
+        .revision = EFI_LOADED_IMAGE_PROTOCOL_REVISION,
+        .parent_handle = EFI_IMAGE,
+        .system_table = ST,
+        .device_handle = EFI_LOADED_IMAGE->device_handle,
+        .file_path = dp,
+        .reserved = NULL,
+        .image_base = data->buffer,
+        .image_size = ctx->size_of_image,
+        .image_code_type = EFI_LOADER_DATA,
+        .image_data_type = EFI_LOADER_DATA, /* everything is located in the same memory allocation*/
+        .unload = __unload_pe_file
+    };
+    **loaded_image = _lp;
+
+    /* create a new handle with the required protocols */
+    *image = NULL;
+    err = BS->install_multiple_protocol_interfaces(
+        image,
+        &efi_loaded_image_protocol_guid, (void*) *loaded_image,
+        &efi_loaded_image_device_path_guid, (void*) dp,
+        NULL
+    );
+    if (EFI_ERROR(err)) {
+        _MESSAGE("Creating image handle failed");
+        free(dp);
+        free(*loaded_image);
+        return err;
+    }
+
+    /* don't free allocated buffer on exit */
+    data->free = NULL;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief arm64 Image header in front of the PE header
+ *
+ * @see https://github.com/torvalds/linux/blob/v5.13/Documentation/arm64/booting.rst
+ */
+struct __packed arm64_image_header {
+    uint32_t code0;
+    uint32_t code1;
+    uint64_t text_offset;   ///< image load offset from a 2 MiB aligned base
+    uint64_t image_size;    ///< effective image size including BSS (0 before 3.17)
+    uint64_t flags;
+    uint64_t res2;
+    uint64_t res3;
+    uint64_t res4;
+    uint32_t magic;
+    uint32_t res5;
+};
+
+#define ARM64_IMAGE_MAGIC           0x644d5241  ///< "ARM\x64"
+#define ARM64_IMAGE_FLAG_ANYWHERE   (1 << 3)    ///< base may be anywhere in physical memory
+#define ARM64_MIN_KIMG_ALIGN        (UINT32_C(2) << 20)
+
+/**
+ * @brief fields of the x86 setup header (boot protocol 2.10+)
+ *
+ * @see https://github.com/torvalds/linux/blob/v5.13/Documentation/x86/boot.rst
+ */
+#define X86_SETUP_HEADER_MAGIC      0x53726448  ///< "HdrS"
+#define X86_OFFSET_HEADER           0x202
+#define X86_OFFSET_VERSION          0x206
+#define X86_OFFSET_KERNEL_ALIGNMENT 0x230
+#define X86_OFFSET_PREF_ADDRESS     0x258
+#define X86_OFFSET_INIT_SIZE        0x260
+#define X86_SETUP_HEADER_END        0x264
+
+/* highest address the x86_64 stub accepts without relocating (4-level paging) */
+#define X86_64_MAX_ADDRESS          (UINT64_C(1) << 46)
+
+/**
+ * @brief where the image has to be placed so Linux runs where it was loaded
+ */
+struct kernel_placement {
+    size_t size;            ///< memory used from the image base
+    size_t alignment;       ///< alignment of the image base
+    efi_physical_address_t preferred;   ///< address to try first (0 for any)
+    efi_physical_address_t max_address; ///< highest usable address
+    bool low;               ///< place as close to the beginning of RAM as possible
+};
+
+/**
+ * @brief get the placement requirements of a Linux kernel image
+ *
+ * @details
+ *  The EFI stub of Linux copies the whole kernel to a new allocation if the
+ *  image is not aligned for the kernel, or the memory behind the image is
+ *  too small for the BSS (arm64) or the in place decompression (x86). Other
+ *  images just need their section alignment.
+ *
+ * @param[in] headers
+ *  the beginning of the image file
+ * @returns whether the image is a Linux kernel that can run in place
+ */
+static
+bool kernel_placement(
+    simple_buffer_t headers,
+    pe_loader_ctx_t ctx,
+    struct kernel_placement* placement
+) {
+    const uint8_t* base = buffer_pos(headers);
+    size_t length = buffer_len(headers);
+
+    *placement = (struct kernel_placement) {
+        .size = ctx->size_of_image,
+        .alignment = ctx->section_alignment,
+        .max_address = UINTPTR_MAX,
+    };
+
+#if defined(__aarch64__)
+    const struct arm64_image_header* hdr = (const struct arm64_image_header*) base;
+    if (length < sizeof(*hdr) || hdr->magic != ARM64_IMAGE_MAGIC)
+        return false;
+
+    /* kernels before 5.10 are linked at an offset from the 2 MiB boundary */
+    if (hdr->text_offset) {
+        _MESSAGE("Linux image with text offset %lX is relocated by its EFI stub", hdr->text_offset);
+        return false;
+    }
+
+    /* without KASLR the stub runs in place at MIN_KIMG_ALIGN (nokaslr only
+     * needs 64 KiB), with an RNG protocol it picks a random address anyway */
+    placement->alignment = MAX(placement->alignment, ARM64_MIN_KIMG_ALIGN);
+    placement->size = MAX(placement->size, hdr->image_size);
+    placement->low = !(hdr->flags & ARM64_IMAGE_FLAG_ANYWHERE);
+    _MESSAGE("arm64 Linux image: size %lu flags %lX", hdr->image_size, hdr->flags);
+    return true;
+#elif defined(__x86_64__) || defined(__i386__)
+    if (length < X86_SETUP_HEADER_END
+        || *(const uint32_t*) (base + X86_OFFSET_HEADER) != X86_SETUP_HEADER_MAGIC
+        || *(const uint16_t*) (base + X86_OFFSET_VERSION) < 0x20a)
+        return false;
+
+    uint32_t kernel_alignment = *(const uint32_t*) (base + X86_OFFSET_KERNEL_ALIGNMENT);
+    uint64_t pref_address = *(const uint64_t*) (base + X86_OFFSET_PREF_ADDRESS);
+    uint32_t init_size = *(const uint32_t*) (base + X86_OFFSET_INIT_SIZE);
+
+    /* the decompressor uses init_size bytes from the aligned image base,
+     * which has to be above LOAD_PHYSICAL_ADDR (pref_address) */
+    if (kernel_alignment && (kernel_alignment & (kernel_alignment - 1)) == 0)
+        placement->alignment = MAX(placement->alignment, kernel_alignment);
+    placement->size = MAX(placement->size, init_size);
+    placement->preferred = pref_address;
+#  if defined(__x86_64__)
+    placement->max_address = X86_64_MAX_ADDRESS - 1;
+#  endif
+    _MESSAGE("x86 Linux image: init size %u alignment %X preferred address %lX", init_size, kernel_alignment, pref_address);
+    return true;
+#else
+    (void) base;
+    (void) length;
+    return false;
+#endif
+}
+
+/**
+ * @brief find the lowest free memory for placement
+ *
+ * @returns 0 if there is none
+ */
+static
+efi_physical_address_t lowest_free_address(
+    const struct kernel_placement* placement
+) {
+    efi_size_t map_size = 0, map_key, descriptor_size;
+    uint32_t descriptor_version;
+    /* scratch memory doesn't change the memory map */
+    _cleanup(scratch_release_p) scratch_mark_t mark = scratch_mark();
+    _cleanup_pool uint8_t* map = NULL;
+
+    efi_status_t err;
+    do {
+        free(map);
+        scratch_release(mark);
+        map_size += 4 * sizeof(struct efi_memory_descriptor);
+        map = scratch_alloc(map_size);
+        if (!map)
+            return 0;
+        err = BS->get_memory_map(&map_size, (efi_memory_descriptor_t) map, &map_key, &descriptor_size, &descriptor_version);
+    } while (err == EFI_BUFFER_TOO_SMALL);
+    if (EFI_ERROR(err))
+        return 0;
+
+    efi_physical_address_t lowest = 0;
+    for (size_t offset = 0; offset + descriptor_size <= map_size; offset += descriptor_size) {
+        efi_memory_descriptor_t desc = (efi_memory_descriptor_t) (map + offset);
+        if (desc->type != EFI_CONVENTIONAL_MEMORY)
+            continue;
+
+        /* skip page 0, it looks like a failed allocation */
+        efi_physical_address_t start = desc->physical_start ? desc->physical_start : PAGE_SIZE;
+        efi_physical_address_t end = desc->physical_start + desc->number_of_pages * PAGE_SIZE;
+        start = ALIGN_VALUE(start, placement->alignment);
+        if (start >= end || end - start < placement->size || start + placement->size - 1 > placement->max_address)
+            continue;
+        if (!lowest || start < lowest)
+            lowest = start;
+    }
+
+    return lowest;
+}
+
+/**
+ * @brief allocate the memory for the image as the kernel wants it
+ */
+static
+bool allocate_kernel_buffer(
+    const struct kernel_placement* placement,
+    aligned_buffer_t buffer
+) {
+    *buffer = (struct aligned_buffer) {
+        .free = free_aligned_buffer,
+        .tag = ALLOC_TAG_PE_LOADER,
+    };
+
+    efi_physical_address_t address = placement->preferred;
+    if (!address && placement->low)
+        address = lowest_free_address(placement);
+
+    /* exactly at the wanted address */
+    size_t pages = ALIGN_VALUE(placement->size, PAGE_SIZE) / PAGE_SIZE;
+    if (address && address % placement->alignment == 0
+        && EFI_SUCCESS == BS->allocate_pages(EFI_ALLOCATE_ADDRESS, EFI_LOADER_DATA, pages, &address)
+    ) {
+        buffer->raw = buffer->buffer = (void*) address;
+        buffer->pages = pages;
+        buffer->allocated = pages * PAGE_SIZE;
+        alloc_account(buffer->tag, 0, pages);
+        return true;
+    }
+
+    /* anywhere below the limit with room for the alignment */
+    pages = ALIGN_VALUE(placement->size + placement->alignment, PAGE_SIZE) / PAGE_SIZE;
+    address = placement->max_address;
+    efi_allocate_t type = placement->max_address == UINTPTR_MAX ? EFI_ALLOCATE_ANY_PAGES : EFI_ALLOCATE_MAX_ADDRESS;
+    if (EFI_SUCCESS != BS->allocate_pages(type, EFI_LOADER_DATA, pages, &address))
+        return false;
+
+    buffer->raw = (void*) address;
+    buffer->pages = pages;
+    buffer->buffer = (void*) ALIGN_VALUE(address, placement->alignment);
+    buffer->allocated = pages * PAGE_SIZE - ((uint8_t*) buffer->buffer - (uint8_t*) buffer->raw);
+    alloc_account(buffer->tag, 0, pages);
+    return true;
+}
+
+/**
+ * @brief allocate the image memory and check the placement
+ */
+static
+efi_status_t allocate_image(
+    simple_buffer_t headers,
+    pe_loader_ctx_t ctx,
+    aligned_buffer_t buffer
+) {
+    struct kernel_placement placement;
+    bool in_place = kernel_placement(headers, ctx, &placement);
+
+    if (!allocate_kernel_buffer(&placement, buffer))
+        return EFI_OUT_OF_RESOURCES;
+
+    efi_physical_address_t base = (efi_physical_address_t) buffer->buffer;
+    if (in_place && base < placement.preferred)
+        _MESSAGE("Image at %p is below %lX, Linux will relocate itself", buffer->buffer, placement.preferred);
+    else if (in_place)
+        _MESSAGE("Image at %p (%zu KiB aligned, %zu bytes), by its header Linux can run in place",
+            buffer->buffer, placement.alignment >> 10, placement.size);
+
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief check that the load plan was made for the image
+ *
+ * @returns the plan or NULL if the image has to be parsed
+ */
+static
+const struct load_plan* load_plan_for_image(
+    simple_buffer_t image_data,
+    simple_buffer_t plan_data,
+    pe_loader_ctx_t ctx
+) {
+    if (!plan_data || !plan_data->buffer || buffer_len(plan_data) < sizeof(struct load_plan))
+        return NULL;
+
+    const struct load_plan* plan = (const struct load_plan*) buffer_pos(plan_data);
+    if (plan->signature != LOAD_PLAN_SIGNATURE || plan->version != LOAD_PLAN_VERSION
+        || plan->machine != PE_HEADER_MACHINE_NATIVE) {
+        _MESSAGE("Unsupported load plan");
+        return NULL;
+    }
+
+    uint64_t size = LOAD_PLAN_SIZE(plan->op_count, plan->reloc_count);
+    if (size > buffer_len(plan_data) || plan->size_of_headers > buffer_len(image_data)
+        || plan->size_of_headers > plan->size_of_image) {
+        _MESSAGE("Load plan is invalid");
+        return NULL;
+    }
+
+    uint64_t hash = xxh64(&plan->image_base, size - offsetof(struct load_plan, image_base),
+        xxh64(buffer_pos(image_data), plan->size_of_headers, 0));
+    if (hash != plan->hash) {
+        _MESSAGE("Load plan doesn't match the image, hash %lX != %lX", hash, plan->hash);
+        return NULL;
+    }
+
+    ctx->image_address = plan->image_base;
+    ctx->size_of_image = plan->size_of_image;
+    ctx->size_of_headers = plan->size_of_headers;
+    ctx->section_alignment = plan->section_alignment;
+    ctx->entry_point = plan->entry_point;
+    ctx->base = buffer_pos(image_data);
+    return plan;
+}
+
+/**
+ * @brief apply the relocation blocks of the plan
+ *
+ * @param[in] source
+ *  the file data from source_offset on, the blocks are read from there
+ * @param[in] source_size
+ *  bytes available at source
+ */
+static
+efi_status_t load_plan_relocate(
+    uint8_t* buffer,
+    const struct load_plan* plan,
+    pe_loader_ctx_t ctx,
+    const uint8_t* source,
+    size_t source_offset,
+    size_t source_size
+) {
+    efi_size_t adjust = (efi_physical_address_t) buffer - ctx->image_address;
+    if (!adjust) {
+        _MESSAGE("No relocation fixup necessary");
+        return EFI_SUCCESS;
+    }
+
+    efi_status_t err = EFI_SUCCESS;
+    trace_begin(PE_RELOCATE, 0);
+    const struct load_plan_reloc* relocs = load_plan_relocs(plan);
+    for (uint32_t i = 0; i < plan->reloc_count; i++) {
+        if (relocs[i].rva >= ctx->size_of_image || relocs[i].offset < source_offset
+            || relocs[i].offset - source_offset + relocs[i].count * sizeof(uint16_t) > source_size) {
+            _MESSAGE("Load plan relocation %u out of bounds", i);
+            err = EFI_LOAD_ERROR;
+            break;
+        }
+        err = apply_fixups(buffer + relocs[i].rva, ctx->size_of_image - relocs[i].rva,
+            (const uint16_t*) (source + relocs[i].offset - source_offset), relocs[i].count, adjust);
+        if (EFI_ERROR(err)) {
+            _MESSAGE("Relocation failed: %r", err);
+            break;
+        }
+    }
+    trace_end(PE_RELOCATE, 0);
+
+    return err;
+}
+
+/**
+ * @brief copy, zero and relocate the image as the load plan says
+ *
+ * @details
+ *  The plan was checked by build_image, only the bounds are checked here.
+ */
+static
+efi_status_t load_plan_execute(
+    uint8_t* buffer,
+    simple_buffer_t image_data,
+    const struct load_plan* plan,
+    pe_loader_ctx_t ctx
+) {
+    efi_size_t file_size = buffer_len(image_data);
+
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        const struct load_plan_op* op = &plan->ops[i];
+        if ((uint64_t) op->rva + op->copy_length + op->zero_length > ctx->size_of_image
+            || (uint64_t) op->offset + op->copy_length > file_size) {
+            _MESSAGE("Load plan operation %u out of bounds", i);
+            return EFI_LOAD_ERROR;
+        }
+        if (op->copy_length)
+            memcpy(buffer + op->rva, ctx->base + op->offset, op->copy_length);
+        if (op->zero_length)
+            mp_zero(buffer + op->rva + op->copy_length, op->zero_length);
+    }
+
+    return load_plan_relocate(buffer, plan, ctx, ctx->base, 0, file_size);
+}
+
 efi_status_t PE_handle_image(
     simple_buffer_t image_data,
+    simple_buffer_t plan_data,
     efi_handle_t* image,
     efi_loaded_image_t* loaded_image,
     efi_entry_point_t* entry_point
@@ -543,8 +1033,32 @@ efi_status_t PE_handle_image(
     if (!image_data->buffer || buffer_len(image_data) == 0 )
         return EFI_INVALID_PARAMETER;
 
+    ALLOC_TAG_SCOPE(PE_LOADER);
     struct pe_loader_ctx ctx = { 0 };
 
+    /* build_image knows the image layout already */
+    const struct load_plan* plan = load_plan_for_image(image_data, plan_data, &ctx);
+    if (plan) {
+        _cleanup_buffer struct aligned_buffer buf = { 0 };
+        err = allocate_image(image_data, &ctx, &buf);
+        if (EFI_ERROR(err))
+            return err;
+
+        [[ maybe_unused ]] struct pmu_sample pmu;
+        _PMU_START(&pmu);
+        err = load_plan_execute(buf.buffer, image_data, plan, &ctx);
+        _PMU_MESSAGE("load plan", &pmu);
+        if (EFI_ERROR(err))
+            return err;
+
+        *entry_point = (efi_entry_point_t) image_address(buf.buffer, ctx.size_of_image, ctx.entry_point);
+        if (!*entry_point) {
+            _ERROR("Entry point is invalid");
+            return EFI_LOAD_ERROR;
+        }
+        return register_image(&buf, &ctx, image, loaded_image);
+    }
+
     /* get required header fields and directory pointers */
     err = read_headers(image_data, &ctx);
     if (EFI_ERROR(err)) {
@@ -552,10 +1066,12 @@ efi_status_t PE_handle_image(
         return err;
     }
 
-    /* allocate alligned pages for PE image and data */
+    /* allocate alligned pages for PE image and data, where Linux wants them */
     _cleanup_buffer struct aligned_buffer buf = { 0 };
     aligned_buffer_t data = &buf;
-    allocate_aligned_buffer_ext(ctx.size_of_image, EFI_LOADER_DATA, ctx.section_alignment, &buf);
+    err = allocate_image(image_data, &ctx, &buf);
+    if (EFI_ERROR(err))
+        return err;
     memcpy(data->buffer, ctx.base, ctx.size_of_headers);
 
     *entry_point = (efi_entry_point_t) image_address(data->buffer, ctx.size_of_image, ctx.entry_point);
@@ -569,7 +1085,10 @@ efi_status_t PE_handle_image(
         _MESSAGE("Image has no relocation directory entry");
     } else {
         PE_section_t reloc_section = NULL;
+        [[ maybe_unused ]] struct pmu_sample pmu;
+        _PMU_START(&pmu);
         err = relocate_sections(data->buffer, &ctx, &reloc_section);
+        _PMU_MESSAGE("relocate sections", &pmu);
         if (EFI_ERROR(err)) {
             return EFI_LOAD_ERROR;
         }
@@ -577,7 +1096,14 @@ efi_status_t PE_handle_image(
         /* relocate section found need to apply fixups */
         if (reloc_section) {
             if (ctx.reloc_directory->size) {
-                err = relocation_fixup(data->buffer, &ctx, reloc_section);
+                /* .reloc is usually discardable, so the blocks are read from the file */
+                uint8_t* reloc_base = image_address(ctx.base, buffer_len(image_data),
+                    reloc_section->pointer_to_raw_data);
+                uint8_t* reloc_end  = image_address(ctx.base, buffer_len(image_data),
+                    (uint64_t) reloc_section->pointer_to_raw_data + reloc_section->virtual_size);
+                trace_begin(PE_RELOCATE, 0);
+                err = relocation_fixup(data->buffer, &ctx, reloc_base, reloc_end);
+                trace_end(PE_RELOCATE, 0);
                 if (EFI_ERROR(err)) {
                     _MESSAGE("Relocation failed: %r", err);
                     return err;
@@ -588,52 +1114,590 @@ efi_status_t PE_handle_image(
         }
     }
 
-    /* create device path for memory mapped file */
-    efi_device_path_t dp = create_memory_mapped_device_path(
-        (efi_physical_address_t) data->raw, data->pages * PAGE_SIZE, EFI_LOADER_DATA);
+    return register_image(data, &ctx, image, loaded_image);
+}
 
-    if (!dp) {
+#ifdef USE_STREAM_LOADER
+/* upper bound for the offset of the PE header in a streamed image */
+#define PE_STREAM_MAX_HEADER_OFFSET 0x400
+
+/**
+ * @brief number of bytes of a section which are initialized from the file
+ */
+__pure
+static inline
+uint32_t section_load_size(
+    PE_section_t sec
+) {
+    if (sec->characteristics & PE_SECTION_CNT_UNINITIALIZED_DATA)
+        return 0;
+    return MIN(sec->size_of_raw_data, sec->virtual_size);
+}
+
+/**
+ * @brief read the image headers from the stream
+ *
+ * @details
+ *  The DOS and PE headers are staged on the stack to learn the size of all
+ *  headers, which are then read to a temporary buffer that backs the
+ *  pointers in ctx.
+ *
+ * @param[in] stream
+ *  stream positioned at the beginning of the image
+ * @param[out] headers
+ *  allocated buffer with the first `size_of_headers` bytes of the image, or
+ *  more to cover the x86 setup header
+ * @param[out] ctx
+ */
+static inline
+efi_status_t stream_read_headers(
+    decompress_stream_t stream,
+    simple_buffer_t headers,
+    pe_loader_ctx_t ctx
+) {
+    efi_status_t err;
+    uint8_t peek[PE_STREAM_MAX_HEADER_OFFSET + sizeof(struct PE_image_headers)];
+    size_t peek_len = DOS_PE_OFFSET_LOCATION + sizeof(uint32_t);
+
+    err = decompress_stream_read(stream, peek, peek_len);
+    if (EFI_ERROR(err))
+        return err;
+
+    if (*(uint16_t*) peek != MZ_DOS_SIGNATURE) {
+        _MESSAGE("Invalid PE image");
+        return EFI_LOAD_ERROR;
+    }
+
+    uint32_t pe_offset = *(uint32_t*) (peek + DOS_PE_OFFSET_LOCATION);
+    if (pe_offset < peek_len || pe_offset > PE_STREAM_MAX_HEADER_OFFSET) {
+        _MESSAGE("PE header offset %X not supported", pe_offset);
+        return EFI_LOAD_ERROR;
+    }
+
+    err = decompress_stream_read(stream, peek + peek_len, pe_offset + sizeof(struct PE_image_headers) - peek_len);
+    if (EFI_ERROR(err))
+        return err;
+    peek_len = pe_offset + sizeof(struct PE_image_headers);
+
+    PE_image_headers_t pe = (PE_image_headers_t) (peek + pe_offset);
+    if (pe->file_header.signature != PE_HEADER_SIGNATURE) {
+        _MESSAGE("Invalid PE image");
+        return EFI_LOAD_ERROR;
+    }
+
+    size_t size_of_headers = pe->optional_header.size_of_headers;
+    if (size_of_headers <= peek_len || size_of_headers > pe->optional_header.size_of_image) {
+        _MESSAGE("Invalid header size %zu", size_of_headers);
+        return EFI_LOAD_ERROR;
+    }
+
+    /* include the x86 setup header, which may be behind the PE headers */
+    size_t read_ahead = MAX(size_of_headers, (size_t) X86_SETUP_HEADER_END);
+    if (!allocate_simple_buffer(read_ahead, headers))
         return EFI_OUT_OF_RESOURCES;
+
+    memcpy(headers->buffer, peek, peek_len);
+    err = decompress_stream_read(stream, (uint8_t*) headers->buffer + peek_len, read_ahead - peek_len);
+    if (EFI_ERROR(err))
+        return err;
+    headers->length = read_ahead;
+
+    return read_headers(headers, ctx);
+}
+
+/**
+ * @brief copy length bytes at offset of the file to dst
+ *
+ * @details
+ *  Data inside the headers comes from the buffer they were read to, the
+ *  rest from the stream, which can only move forward.
+ */
+static inline
+efi_status_t stream_copy(
+    decompress_stream_t stream,
+    simple_buffer_t headers,
+    size_t offset,
+    uint8_t* dst,
+    size_t length
+) {
+    if (offset < headers->length) {
+        size_t copied = MIN(length, headers->length - offset);
+        memcpy(dst, (uint8_t*) headers->buffer + offset, copied);
+        offset += copied;
+        dst += copied;
+        length -= copied;
+        if (!length)
+            return EFI_SUCCESS;
     }
 
-    *loaded_image = malloc(sizeof(struct efi_loaded_image_protocol));
-    if (!*loaded_image) {
-        free(dp);
+    if (offset < stream->pos)
+        return EFI_UNSUPPORTED;
+
+    efi_status_t err = decompress_stream_skip(stream, offset - stream->pos);
+    if (EFI_ERROR(err))
+        return err;
+    return decompress_stream_read(stream, dst, length);
+}
+
+/**
+ * @brief decompress the sections to their virtual addresses
+ *
+ * @details
+ *  The stream can only move forward, so sections are read in the order of
+ *  their file offset. Discardable sections with a valid VMA are loaded too,
+ *  this keeps .reloc available for the fixups. Everything in the image which
+ *  is not initialized from the file is zeroed afterwards.
+ *
+ * @param[in] stream
+ *  stream positioned after the image headers
+ * @param[in] headers
+ *  the data read with the headers, sections may begin in there
+ * @param[in] buffer
+ *  pointer to the base of the virtual memory segment
+ * @param[in] ctx
+ */
+static inline
+efi_status_t stream_sections(
+    decompress_stream_t stream,
+    simple_buffer_t headers,
+    uint8_t* buffer,
+    pe_loader_ctx_t ctx
+) {
+    efi_status_t err;
+    PE_section_t sections[PE_HEADER_MAX_NUMBER_OF_SECTIONS];
+    uint16_t n = 0;
+    bool found_entry_point = false;
+
+    if (ctx->number_of_sections > PE_HEADER_MAX_NUMBER_OF_SECTIONS) {
+        _MESSAGE("Image has too many sections %hu", ctx->number_of_sections);
+        return EFI_UNSUPPORTED;
+    }
+
+    /* collect the sections occupying memory, ordered by file offset */
+    PE_section_t sec = ctx->first_section;
+    for (uint16_t i = ctx->number_of_sections; i--; sec++) {
+        if (sec->virtual_size == 0)
+            continue;
+
+        uint8_t* base = image_address(buffer, ctx->size_of_image,
+            sec->virtual_address);
+        uint8_t* end =  image_address(buffer, ctx->size_of_image,
+            (uint64_t) sec->virtual_address + sec->virtual_size);
+
+        if (!base || !end) {
+            /* discardable sections are not needed at runtime */
+            if (sec->characteristics & PE_SECTION_MEM_DISCARDABLE)
+                continue;
+            _ERROR("Section %.*s has illegal VMA", PE_SECTION_SIZE_OF_SHORT_NAME, sec->name);
+            return EFI_LOAD_ERROR;
+        }
+
+        if (section_load_size(sec) && sec->pointer_to_raw_data < ctx->size_of_headers) {
+            _MESSAGE("Section %.*s is inside image headers", PE_SECTION_SIZE_OF_SHORT_NAME, sec->name);
+            return EFI_LOAD_ERROR;
+        }
+
+        if (sec->virtual_address < ctx->entry_point && ctx->entry_point < sec->virtual_address + sec->virtual_size) {
+            found_entry_point = true;
+            _MESSAGE("Found entrypoint in section %.*s", PE_SECTION_SIZE_OF_SHORT_NAME, sec->name);
+        }
+
+        uint16_t j = n++;
+        for (; j > 0 && sections[j - 1]->pointer_to_raw_data > sec->pointer_to_raw_data; j--)
+            sections[j] = sections[j - 1];
+        sections[j] = sec;
+    }
+
+    if (!found_entry_point)
+        _MESSAGE("No section contains entrypoint %X", ctx->entry_point);
+
+    for (uint16_t i = 0; i < n; i++) {
+        sec = sections[i];
+        uint32_t size = section_load_size(sec);
+        if (!size)
+            continue;
+
+        err = stream_copy(stream, headers, sec->pointer_to_raw_data, buffer + sec->virtual_address, size);
+        if (err == EFI_UNSUPPORTED)
+            _MESSAGE("Section %.*s overlaps previous section", PE_SECTION_SIZE_OF_SHORT_NAME, sec->name);
+        if (EFI_ERROR(err))
+            return err;
+    }
+
+    /* zero everything between and behind the initialized data */
+    for (uint16_t i = 1; i < n; i++) {
+        sec = sections[i];
+        uint16_t j = i;
+        for (; j > 0 && sections[j - 1]->virtual_address > sec->virtual_address; j--)
+            sections[j] = sections[j - 1];
+        sections[j] = sec;
+    }
+
+    size_t cursor = ctx->size_of_headers;
+    for (uint16_t i = 0; i < n; i++) {
+        sec = sections[i];
+        size_t start = sec->virtual_address;
+        size_t end = start + sec->virtual_size;
+
+        if (start > cursor)
+            memzero(buffer + cursor, start - cursor);
+
+        /* BSS */
+        start = MAX(start + section_load_size(sec), cursor);
+        if (end > start)
+            mp_zero(buffer + start, end - start);
+
+        cursor = MAX(cursor, end);
+    }
+
+    if (cursor < ctx->size_of_image)
+        memzero(buffer + cursor, ctx->size_of_image - cursor);
+
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief file range of the relocation blocks of a load plan
+ */
+struct plan_relocs {
+    size_t offset;
+    size_t length;                      ///< 0 without relocations
+    const struct load_plan_op* loaded;  ///< copy that contains the blocks or NULL to stage them
+};
+
+/**
+ * @brief check that the load plan can be executed while the image is streamed
+ *
+ * @details
+ *  The copies are read in the order of their file offset and must not
+ *  overlap. The relocation blocks are either part of a copy or read to a
+ *  separate buffer when the stream passes them (.reloc is discardable).
+ *
+ * @param[out] ops
+ *  the operations ordered by file offset
+ * @param[out] relocs
+ */
+static
+bool load_plan_streamable(
+    const struct load_plan* plan,
+    pe_loader_ctx_t ctx,
+    const struct load_plan_op** ops,
+    struct plan_relocs* relocs
+) {
+    if (plan->op_count > PE_HEADER_MAX_NUMBER_OF_SECTIONS + 1)
+        return false;
+
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        const struct load_plan_op* op = &plan->ops[i];
+        if ((uint64_t) op->rva + op->copy_length + op->zero_length > ctx->size_of_image)
+            return false;
+
+        uint32_t j = i;
+        for (; j > 0 && ops[j - 1]->offset > op->offset; j--)
+            ops[j] = ops[j - 1];
+        ops[j] = op;
+    }
+
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        if (!ops[i]->copy_length)
+            continue;
+        if (ops[i]->offset < end)
+            return false;
+        end = (uint64_t) ops[i]->offset + ops[i]->copy_length;
+    }
+
+    *relocs = (struct plan_relocs) { 0 };
+    const struct load_plan_reloc* blocks = load_plan_relocs(plan);
+    if (!plan->reloc_count)
+        return true;
+
+    uint64_t first = UINT64_MAX, last = 0;
+    for (uint32_t i = 0; i < plan->reloc_count; i++) {
+        first = MIN(first, (uint64_t) blocks[i].offset);
+        last = MAX(last, (uint64_t) blocks[i].offset + blocks[i].count * sizeof(uint16_t));
+    }
+    relocs->offset = first;
+    relocs->length = last - first;
+
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        const struct load_plan_op* op = ops[i];
+        uint64_t op_end = (uint64_t) op->offset + op->copy_length;
+        if (!op->copy_length || op_end <= first || op->offset >= last)
+            continue;
+        /* partly loaded blocks can't be staged anymore */
+        if (op->offset > first || op_end < last)
+            return false;
+        relocs->loaded = op;
+    }
+    return true;
+}
+
+/**
+ * @brief zero what the operations leave uninitialized
+ *
+ * @details
+ *  Zeroes the end of every operation and everything between and behind
+ *  them, like stream_sections does for the sections.
+ */
+static
+void load_plan_zero(
+    uint8_t* buffer,
+    const struct load_plan* plan,
+    pe_loader_ctx_t ctx
+) {
+    const struct load_plan_op* ops[PE_HEADER_MAX_NUMBER_OF_SECTIONS + 1];
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        const struct load_plan_op* op = &plan->ops[i];
+        if (op->zero_length)
+            mp_zero(buffer + op->rva + op->copy_length, op->zero_length);
+
+        uint32_t j = i;
+        for (; j > 0 && ops[j - 1]->rva > op->rva; j--)
+            ops[j] = ops[j - 1];
+        ops[j] = op;
+    }
+
+    size_t cursor = 0;
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        if (ops[i]->rva > cursor)
+            memzero(buffer + cursor, ops[i]->rva - cursor);
+        cursor = MAX(cursor, (size_t) ops[i]->rva + ops[i]->copy_length + ops[i]->zero_length);
+    }
+    if (cursor < ctx->size_of_image)
+        memzero(buffer + cursor, ctx->size_of_image - cursor);
+}
+
+/**
+ * @brief copy, zero and relocate the streamed image as the load plan says
+ *
+ * @param[in] ops
+ *  operations ordered by file offset, see load_plan_streamable
+ */
+static
+efi_status_t load_plan_stream(
+    decompress_stream_t stream,
+    simple_buffer_t headers,
+    uint8_t* buffer,
+    const struct load_plan* plan,
+    const struct load_plan_op** ops,
+    const struct plan_relocs* relocs,
+    pe_loader_ctx_t ctx
+) {
+    efi_status_t err;
+    _cleanup_buffer struct simple_buffer staged = { 0 };
+    if (relocs->length && !relocs->loaded && !allocate_simple_buffer(relocs->length, &staged))
         return EFI_OUT_OF_RESOURCES;
+
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        const struct load_plan_op* op = ops[i];
+        if (op->copy_length && staged.buffer && !staged.length && op->offset > relocs->offset) {
+            err = stream_copy(stream, headers, relocs->offset, staged.buffer, relocs->length);
+            if (EFI_ERROR(err))
+                return err;
+            staged.length = relocs->length;
+        }
+
+        if (op->copy_length) {
+            err = stream_copy(stream, headers, op->offset, buffer + op->rva, op->copy_length);
+            if (EFI_ERROR(err))
+                return err;
+        }
+    }
+    if (staged.buffer && !staged.length) {
+        err = stream_copy(stream, headers, relocs->offset, staged.buffer, relocs->length);
+        if (EFI_ERROR(err))
+            return err;
+        staged.length = relocs->length;
     }
 
-    /* setup loaded image */
-    struct efi_loaded_image_protocol _lp = {
-        .revision = EFI_LOADED_IMAGE_PROTOCOL_REVISION,
-        .parent_handle = EFI_IMAGE,
-        .system_table = ST,
-        .device_handle = EFI_LOADED_IMAGE->device_handle,
-        .file_path = dp,
-        .reserved = NULL,
-        .image_base = data->buffer,
-        .image_size = ctx.size_of_image,
-        .image_code_type = EFI_LOADER_DATA,
-        .image_data_type = EFI_LOADER_DATA, /* everything is located in the same memory allocation*/
-        .unload = __unload_pe_file
-    };
-    **loaded_image = _lp;
+    load_plan_zero(buffer, plan, ctx);
 
-    /* create a new handle with the required protocols */
-    *image = NULL;
-    err = BS->install_multiple_protocol_interfaces(
-        image,
-        &efi_loaded_image_protocol_guid, (void*) *loaded_image,
-        &efi_loaded_image_device_path_guid, (void*) dp,
-        NULL
-    );
+    if (relocs->loaded)
+        return load_plan_relocate(buffer, plan, ctx, buffer + relocs->loaded->rva,
+            relocs->loaded->offset, relocs->loaded->copy_length);
+    return load_plan_relocate(buffer, plan, ctx, staged.buffer, relocs->offset, staged.length);
+}
+
+/**
+ * @brief check that the frames can be decoded straight into the image
+ *
+ * @details
+ *  Every copy has to keep its file offset as RVA (e.g. the arm64 Image),
+ *  then the decoded file is the image apart from what load_plan_zero
+ *  clears afterwards.
+ */
+static
+bool load_plan_in_place(
+    const struct load_plan* plan,
+    pe_loader_ctx_t ctx
+) {
+    if (plan->op_count > PE_HEADER_MAX_NUMBER_OF_SECTIONS + 1)
+        return false;
+
+    for (uint32_t i = 0; i < plan->op_count; i++) {
+        const struct load_plan_op* op = &plan->ops[i];
+        if ((uint64_t) op->rva + op->copy_length + op->zero_length > ctx->size_of_image)
+            return false;
+        if (op->copy_length && op->offset != op->rva)
+            return false;
+    }
+    return true;
+}
+
+efi_status_t PE_handle_image_frames(
+    decompress_stream_t stream,
+    decompress_stream_t frames,
+    simple_buffer_t plan_data,
+    efi_handle_t* image,
+    efi_loaded_image_t* loaded_image,
+    efi_entry_point_t* entry_point
+) {
+    efi_status_t err;
+
+    assert(EFI_IMAGE);
+    assert(EFI_LOADED_IMAGE);
+
+    if (!stream || !frames || !image || !loaded_image || !entry_point)
+        return EFI_INVALID_PARAMETER;
+    if (stream->pos != 0 || frames->pos != 0)
+        return EFI_INVALID_PARAMETER;
+
+    ALLOC_TAG_SCOPE(PE_LOADER);
+    struct pe_loader_ctx ctx = { 0 };
+
+    _cleanup_buffer struct simple_buffer headers = { 0 };
+    err = stream_read_headers(stream, &headers, &ctx);
     if (EFI_ERROR(err)) {
-        _MESSAGE("Creating image handle failed");
-        free(dp);
-        free(*loaded_image);
+        _ERROR("Failed to read PE header: %r", err);
+        return EFI_LOAD_ERROR;
+    }
+
+    const struct load_plan* plan = load_plan_for_image(&headers, plan_data, &ctx);
+    if (!plan || !load_plan_in_place(plan, &ctx)) {
+        _MESSAGE("Frames can't be decoded into the image");
+        return EFI_UNSUPPORTED;
+    }
+
+    _cleanup_buffer struct aligned_buffer buf = { 0 };
+    err = allocate_image(&headers, &ctx, &buf);
+    if (EFI_ERROR(err))
         return err;
+    if (frames->content_size + DECOMPRESS_OUTPUT_SLACK > buf.allocated) {
+        _MESSAGE("Frames don't fit into the image");
+        return EFI_UNSUPPORTED;
     }
 
-    /* don't free allocated buffer on exit */
-    data->free = NULL;
-    return EFI_SUCCESS;
+    *entry_point = (efi_entry_point_t) image_address(buf.buffer, ctx.size_of_image, ctx.entry_point);
+    if (!*entry_point) {
+        _ERROR("Entry point is invalid");
+        return EFI_LOAD_ERROR;
+    }
+
+    trace_begin(DECOMPRESS, 0);
+    err = decompress_stream_read_all(frames, buf.buffer, buf.allocated);
+    trace_end(DECOMPRESS, 0);
+    if (EFI_ERROR(err)) {
+        _ERROR("Decompress Error: %r", err);
+        return EFI_LOAD_ERROR;
+    }
+
+    /* the blocks may be in a discardable part of the file that is zeroed */
+    err = load_plan_relocate(buf.buffer, plan, &ctx, buf.buffer, 0, frames->content_size);
+    if (EFI_ERROR(err))
+        return EFI_LOAD_ERROR;
+    load_plan_zero(buf.buffer, plan, &ctx);
+
+    return register_image(&buf, &ctx, image, loaded_image);
+}
+
+efi_status_t PE_handle_image_stream(
+    decompress_stream_t stream,
+    simple_buffer_t plan_data,
+    efi_handle_t* image,
+    efi_loaded_image_t* loaded_image,
+    efi_entry_point_t* entry_point
+) {
+    efi_status_t err;
+
+    assert(EFI_IMAGE);
+    assert(EFI_LOADED_IMAGE);
+
+    if (!stream || !image || !loaded_image || !entry_point)
+        return EFI_INVALID_PARAMETER;
+    if (stream->pos != 0)
+        return EFI_INVALID_PARAMETER;
+
+    ALLOC_TAG_SCOPE(PE_LOADER);
+    struct pe_loader_ctx ctx = { 0 };
+
+    /* get required header fields and directory pointers */
+    _cleanup_buffer struct simple_buffer headers = { 0 };
+    err = stream_read_headers(stream, &headers, &ctx);
+    if (EFI_ERROR(err)) {
+        _ERROR("Failed to read PE header: %r", err);
+        return err;
+    }
+
+    /* build_image knows the image layout already */
+    const struct load_plan_op* ops[PE_HEADER_MAX_NUMBER_OF_SECTIONS + 1];
+    struct plan_relocs relocs;
+    const struct load_plan* plan = load_plan_for_image(&headers, plan_data, &ctx);
+    if (plan && !load_plan_streamable(plan, &ctx, ops, &relocs)) {
+        _MESSAGE("Load plan can't be executed while streaming");
+        plan = NULL;
+    }
+
+    /* allocate alligned pages for PE image and data, where Linux wants them */
+    _cleanup_buffer struct aligned_buffer buf = { 0 };
+    aligned_buffer_t data = &buf;
+    err = allocate_image(&headers, &ctx, &buf);
+    if (EFI_ERROR(err))
+        return err;
+    memcpy(data->buffer, ctx.base, ctx.size_of_headers);
+
+    *entry_point = (efi_entry_point_t) image_address(data->buffer, ctx.size_of_image, ctx.entry_point);
+    if (!*entry_point) {
+        _ERROR("Entry point is invalid");
+        return EFI_LOAD_ERROR;
+    }
+
+    if (plan) {
+        [[ maybe_unused ]] struct pmu_sample pmu;
+        _PMU_START(&pmu);
+        err = load_plan_stream(stream, &headers, data->buffer, plan, ops, &relocs, &ctx);
+        _PMU_MESSAGE("load plan", &pmu);
+        if (EFI_ERROR(err)) {
+            _ERROR("Failed to load sections: %r", err);
+            return EFI_LOAD_ERROR;
+        }
+        return register_image(data, &ctx, image, loaded_image);
+    }
+
+    err = stream_sections(stream, &headers, data->buffer, &ctx);
+    if (EFI_ERROR(err)) {
+        _ERROR("Failed to load sections: %r", err);
+        return EFI_LOAD_ERROR;
+    }
+
+    /* data directory is to short to contain basereloc directory */
+    if (ctx.number_of_RVA_and_sizes <= PE_HEADER_DIRECTORY_ENTRY_BASERELOC) {
+        _MESSAGE("Image has no relocation directory entry");
+    } else if (ctx.reloc_directory->size) {
+        /* relocation blocks were loaded with the sections */
+        uint8_t* reloc_base = image_address(data->buffer, ctx.size_of_image,
+            ctx.reloc_directory->virtual_address);
+        uint8_t* reloc_end  = image_address(data->buffer, ctx.size_of_image,
+            (uint64_t) ctx.reloc_directory->virtual_address + ctx.reloc_directory->size);
+        trace_begin(PE_RELOCATE, 0);
+        err = relocation_fixup(data->buffer, &ctx, reloc_base, reloc_end);
+        trace_end(PE_RELOCATE, 0);
+        if (EFI_ERROR(err)) {
+            _MESSAGE("Relocation failed: %r", err);
+            return err;
+        }
+    }
+
+    return register_image(data, &ctx, image, loaded_image);
 }
+#endif /* USE_STREAM_LOADER */
@@ -25,13 +25,40 @@ efi_status_t get_part_uuid_from_device_path(efi_device_path_t path, efi_guid_t g
 uint64_t buffer_xxh64(simple_buffer_t buffer) {
     if (!buffer || !buffer->buffer)
         return (uint64_t) -1;
-    struct xxh64_state xs = { 0 };
-    xxh64_reset(&xs, 0);
-    if (xxh64_update(&xs, buffer_pos(buffer), buffer_len(buffer))) {
-        return (uint64_t) -1;
-    } else {
-        return xxh64_digest(&xs);
+
+    /* the plain XXH64, so the debug messages can be compared with xxh64sum */
+    [[ maybe_unused ]] struct pmu_sample pmu;
+    _PMU_START(&pmu);
+    uint64_t hash = xxh64(buffer_pos(buffer), buffer_len(buffer), 0);
+    _PMU_MESSAGE("xxh64", &pmu);
+    return hash;
+}
+
+void pmu_message(const char16_t* what, struct pmu_sample* sample) {
+    pmu_stop(sample);
+    if (!sample->valid)
+        return;
+
+    static const char16_t* names[_PMU_EVENT_MAX] = {
+        [PMU_CYCLES] = u"cycles",
+        [PMU_INSTRUCTIONS] = u"instructions",
+        [PMU_L1D_MISSES] = u"L1D misses",
+        [PMU_LLC_MISSES] = u"LLC misses",
+        [PMU_BRANCH_MISSES] = u"branch misses",
+    };
+
+    /* one message, a deferred message is a single log record */
+    char16_t line[_PRINT_STRING_LEN];
+    efi_size_t len = 0;
+    for (unsigned e = 0; e < _PMU_EVENT_MAX && len < _PRINT_STRING_LEN; e++) {
+        if (pmu_valid(sample, e))
+            len += wsprintf(line + len, _PRINT_STRING_LEN - len, u" %lu %ls", sample->count[e], names[e]);
     }
+    if (pmu_valid(sample, PMU_CYCLES) && pmu_valid(sample, PMU_INSTRUCTIONS) && sample->count[PMU_CYCLES]
+        && len < _PRINT_STRING_LEN)
+        wsprintf(line + len, _PRINT_STRING_LEN - len, u" (IPC %.2f)",
+            sample->count[PMU_INSTRUCTIONS] / (double) sample->count[PMU_CYCLES]);
+    _MESSAGE("%ls:%ls", what, line);
 }
 
 /* struct to build device path */
@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <efilib/alloc.h>
+#include <efilib/pmu.h>
+#include <efilib/log.h>
 
 #include "config.h"
 #define ALIGN_VALUE(v, a) ((v) + (((a) - (v)) & ((a) - 1)))
@@ -33,13 +36,41 @@ void free_p(void* pointer) {
 
 #define _cleanup_pool _cleanup(free_p)
 
+/*
+ * deferred messages are recorded in the log ring (see efilib/log.h) and
+ * only printed on the first error or at exit
+ */
+#ifdef DEFERRED_MESSAGES
+#  define _PRINT(fmt, ...) log_write(fmt __VA_OPT__(, __VA_ARGS__))
+#else
+#  define _PRINT(fmt, ...) wprintf(fmt __VA_OPT__(, __VA_ARGS__))
+#endif
+
 #ifdef PRINT_MESSAGES
-#define _MESSAGE(msg, ...) wprintf(u"MSG: " _u(msg) u"\n" __VA_OPT__(, __VA_ARGS__))
+#define _MESSAGE(msg, ...) _PRINT(u"MSG: " _u(msg) u"\n" __VA_OPT__(, __VA_ARGS__))
 #else
 #define _MESSAGE(msg, ...)
 #endif
 
-#define _ERROR(msg, ...) wprintf(u"ERR: %E" _u(msg) u"%N\n" __VA_OPT__(, __VA_ARGS__))
+#ifdef DEFERRED_MESSAGES
+#define _ERROR(msg, ...) (_PRINT(u"ERR: %E" _u(msg) u"%N\n" __VA_OPT__(, __VA_ARGS__)), log_flush())
+#else
+#define _ERROR(msg, ...) _PRINT(u"ERR: %E" _u(msg) u"%N\n" __VA_OPT__(, __VA_ARGS__))
+#endif
+
+/* hardware counters of a phase, printed next to its timing */
+#ifdef PRINT_MESSAGES
+#define _PMU_START(sample) pmu_start(sample)
+#define _PMU_MESSAGE(what, sample) pmu_message(_u(what), sample)
+#else
+#define _PMU_START(sample)
+#define _PMU_MESSAGE(what, sample)
+#endif
+
+/**
+ * @brief stop sample and print the counted events (if there are any)
+ */
+void pmu_message(const char16_t* what, struct pmu_sample* sample);
 
 typedef struct simple_buffer* simple_buffer_t;
 
@@ -65,6 +96,7 @@ struct aligned_buffer {
     void (*free) (aligned_buffer_t);
     void* raw;          ///< actual beginning of allocated memory (non aligned)
     size_t pages;       ///< number of pages allocated
+    enum alloc_tag tag; ///< subsystem the pages are accounted to
 };
 
 static __always_inline inline
@@ -100,8 +132,10 @@ void free_simple_buffer(simple_buffer_t buffer) {
 
 static inline
 void free_aligned_buffer(aligned_buffer_t buffer) {
-    if (buffer->pages && buffer->raw)
+    if (buffer->pages && buffer->raw) {
+        alloc_account(buffer->tag, 0, -(int64_t) buffer->pages);
         BS->free_pages((efi_physical_address_t) buffer->raw, buffer->pages);
+    }
 }
 
 static __always_inline inline
@@ -131,6 +165,7 @@ bool allocate_aligned_buffer_ext(size_t length, efi_memory_t type, size_t alignm
     buffer->pages = (ALIGN_VALUE(length + alignment, alignment)) / PAGE_SIZE;
     buffer->pos = buffer->length = 0;
     buffer->free = free_aligned_buffer;
+    buffer->tag = alloc_tag_current();
 
     if (EFI_SUCCESS != BS->allocate_pages(EFI_ALLOCATE_ANY_PAGES, type,
         buffer->pages, (efi_physical_address_t*) &buffer->raw)
@@ -138,6 +173,7 @@ bool allocate_aligned_buffer_ext(size_t length, efi_memory_t type, size_t alignm
         buffer->pages = 0;
         return false;
     }
+    alloc_account(buffer->tag, 0, buffer->pages);
 
     buffer->buffer = (void*) ALIGN_VALUE((intptr_t) buffer->raw, alignment);
     buffer->allocated = (ALIGN_VALUE(length + alignment, alignment)) - (buffer->buffer - buffer->raw);
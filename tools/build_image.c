@@ -5,9 +5,19 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <string.h>
 #include "pe.h"
+#include "frame_table.h"
+#include "load_plan.h"
+#include "bcj.h"
+#include "xxhash.h"
+#include "zstd.h"
+#define LZ4_HC_STATIC_LINKING_ONLY
+#include "lz4hc.h"
 
 #include <assert.h>
 #include <unistd.h>
@@ -21,6 +31,7 @@
 #define PAGE_SIZE 0x1000
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define ALIGN_VALUE(v, a) ((v) + (((a) - (v)) & ((a) - 1)))
 
@@ -36,18 +47,33 @@ struct section_vma {
     uint32_t raw_address;
     uint32_t raw_size;
     uint32_t flags;
+    uint8_t* prefix;        ///< data written in front of the file
+    uint32_t prefix_size;
+    int tuned_fd;           ///< compressed file chosen by --optimize-for
 } section_data[] = {
     { .name = ".osrel",   .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
     { .name = ".cmdline", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
     { .name = ".dtb",     .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
     { .name = ".splash",  .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
     { .name = ".linux",   .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = LOAD_PLAN_SECTION, .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
     { .name = ".initrd",  .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    /* additional archives, the loader concatenates them in this order */
+    { .name = ".initrd1", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd2", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd3", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd4", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd5", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd6", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd7", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd8", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
+    { .name = ".initrd9", .target_vma = 0, .flags = PE_SECTION_CNT_INITIALIZED_DATA | PE_SECTION_MEM_READ },
     { }
 };
 
 enum section_data_id {
-    SECTION_OSREL, SECTION_CMDLINE, SECTION_DT, SECTION_SPLASH, SECTION_LINUX, SECTION_INITRD, _SECTION_MAX
+    SECTION_OSREL, SECTION_CMDLINE, SECTION_DT, SECTION_SPLASH, SECTION_LINUX, SECTION_PLAN, SECTION_INITRD,
+    SECTION_INITRD_LAST = SECTION_INITRD + 9, _SECTION_MAX
 };
 
 struct map {
@@ -118,6 +144,1115 @@ static bool inspect_pe(
     return true;
 }
 
+#define LZ4_MAGIC               UINT32_C(0x184D2204)
+#define ZSTD_MAGIC              UINT32_C(0xFD2FB528)
+#define SKIPPABLE_MAGIC         UINT32_C(0x184D2A50)
+#define SKIPPABLE_MAGIC_MASK    UINT32_C(0xFFFFFFF0)
+
+static inline
+uint64_t read_le(const uint8_t* p, size_t size) {
+    uint64_t v = 0;
+    while (size--)
+        v = v << 8 | p[size];
+    return v;
+}
+
+/**
+ * @brief size of the LZ4 or ZSTD frame at p
+ *
+ * @param[out] content_size
+ *  decompressed size from the frame header
+ * @returns 0 if there is no complete frame with content size at p
+ */
+static
+size_t frame_size(const uint8_t* p, size_t length, uint64_t* content_size) {
+    if (length < 8)
+        return 0;
+
+    uint32_t magic = read_le(p, 4);
+    size_t pos;
+    if (magic == LZ4_MAGIC) {
+        uint8_t flg = p[4];
+        /* requires lz4 --content-size */
+        if ((flg & 0xC0) != 0x40 || !(flg & 0x08))
+            return 0;
+        if (length < 14)
+            return 0;
+        *content_size = read_le(p + 6, 8);
+        pos = 6 + 8 + (flg & 0x01 ? 4 : 0) + 1;
+
+        /* blocks until EndMark */
+        for (;;) {
+            if (pos + 4 > length)
+                return 0;
+            uint32_t block = read_le(p + pos, 4);
+            pos += 4;
+            if (block == 0)
+                break;
+            pos += (block & 0x7FFFFFFF) + (flg & 0x10 ? 4 : 0);
+        }
+        if (flg & 0x04)
+            pos += 4;
+    } else if (magic == ZSTD_MAGIC) {
+        static const uint8_t dict_id_size[] = { 0, 1, 2, 4 };
+        static const uint8_t content_size_size[] = { 0, 2, 4, 8 };
+        uint8_t fhd = p[4];
+        bool single_segment = fhd & 0x20;
+        size_t fcs_size = content_size_size[fhd >> 6];
+        if (!fcs_size && single_segment)
+            fcs_size = 1;
+        if (!fcs_size)
+            return 0;
+
+        pos = 5 + (single_segment ? 0 : 1) + dict_id_size[fhd & 0x3];
+        if (pos + fcs_size > length)
+            return 0;
+        *content_size = read_le(p + pos, fcs_size) + (fcs_size == 2 ? 256 : 0);
+        pos += fcs_size;
+
+        /* blocks until the last block */
+        for (bool last = false; !last;) {
+            if (pos + 3 > length)
+                return 0;
+            uint32_t block = read_le(p + pos, 3);
+            pos += 3;
+            last = block & 0x1;
+            switch ((block >> 1) & 0x3) {
+                case 0: /* raw */
+                case 2: /* compressed */
+                    pos += block >> 3;
+                    break;
+                case 1: /* RLE */
+                    pos += 1;
+                    break;
+                default:
+                    return 0;
+            }
+        }
+        if (fhd & 0x04)
+            pos += 4;
+    } else {
+        return 0;
+    }
+
+    return pos <= length ? pos : 0;
+}
+
+/**
+ * @brief create a frame table if data consists of several frames
+ *
+ * @details
+ *  The loader decodes the frames in parallel, data that was compressed as a
+ *  single frame or without content sizes gets no table.
+ *
+ * @param[out] table
+ *  the table or NULL, to be freed by the caller
+ * @returns false on malformed input
+ */
+static
+bool build_frame_table(const uint8_t* data, size_t length, struct frame_table** table, size_t* table_size, bool silent) {
+    *table = NULL;
+    *table_size = 0;
+
+    uint32_t magic = length >= 4 ? read_le(data, 4) : 0;
+    if (magic != LZ4_MAGIC && magic != ZSTD_MAGIC)
+        return true;
+
+    struct frame_table* t = NULL;
+    uint32_t count = 0;
+    uint64_t content_size = 0;
+    size_t pos = 0;
+    while (pos < length) {
+        magic = read_le(data + pos, MIN(length - pos, 4));
+        /* section padding */
+        if (magic == 0)
+            break;
+
+        if ((magic & SKIPPABLE_MAGIC_MASK) == SKIPPABLE_MAGIC && length - pos >= 8) {
+            pos += 8 + read_le(data + pos + 4, 4);
+            continue;
+        }
+
+        uint64_t frame_content_size;
+        size_t size = frame_size(data + pos, length - pos, &frame_content_size);
+        if (!size && count == 0) {
+            /* not splittable, the loader decodes it as a single stream */
+            if (!silent)
+                printf("no frame table: first frame has no content size\n");
+            return true;
+        } else if (!size) {
+            fprintf(stderr, "Invalid frame at %zu (LZ4 requires --content-size)\n", pos);
+            free(t);
+            return false;
+        }
+
+        t = realloc(t, FRAME_TABLE_SIZE(count + 1));
+        if (!t) {
+            fprintf(stderr, "Out of memory\n");
+            return false;
+        }
+        t->entries[count++] = (struct frame_table_entry) {
+            .offset = pos,
+            .content_offset = content_size,
+        };
+        content_size += frame_content_size;
+        pos += size;
+    }
+
+    if (count < 2) {
+        free(t);
+        return true;
+    }
+
+    t->magic = FRAME_TABLE_MAGIC;
+    t->size = FRAME_TABLE_SIZE(count) - offsetof(struct frame_table, signature);
+    t->signature = FRAME_TABLE_SIGNATURE;
+    t->count = count;
+    t->content_size = content_size;
+
+    if (!silent)
+        printf("frame table: %u frames, %lu bytes decompressed\n", count, content_size);
+
+    *table = t;
+    *table_size = FRAME_TABLE_SIZE(count);
+    return true;
+}
+
+/**
+ * @brief derive the load plan of an uncompressed PE kernel
+ *
+ * @details
+ *  Does the same checks as the PE loader, an image it would reject gets
+ *  no plan and is parsed by the loader as before.
+ *
+ * @param[out] plan
+ *  the plan or NULL, to be freed by the caller
+ * @returns false if there is no plan
+ */
+static
+bool build_load_plan(const uint8_t* data, size_t length, struct load_plan** plan, size_t* plan_size, bool silent) {
+    *plan = NULL;
+    *plan_size = 0;
+
+    if (length < DOS_PE_OFFSET_LOCATION + sizeof(uint32_t))
+        return false;
+    uint32_t pe_offset = read_le(data + DOS_PE_OFFSET_LOCATION, 4);
+    if (pe_offset > length || length - pe_offset < sizeof(struct PE_image_headers))
+        return false;
+
+    const struct PE_image_headers* pe = (const struct PE_image_headers*) (data + pe_offset);
+    bool pe32 = pe->optional_header.magic == PE_HEADER_OPTIONAL_HDR32_MAGIC;
+    uint32_t file_alignment = pe->optional_header.file_alignment ? pe->optional_header.file_alignment : 0x200;
+    uint32_t section_alignment = pe->optional_header.section_alignment
+        ? pe->optional_header.section_alignment : MAX(file_alignment, PAGE_SIZE);
+    uint32_t size_of_image = pe->optional_header.size_of_image;
+    uint32_t size_of_headers = pe->optional_header.size_of_headers;
+    uint32_t number_of_RVA_and_sizes = pe32
+        ? pe->optional_header.number_of_RVA_and_sizes32
+        : pe->optional_header.number_of_RVA_and_sizes64;
+    const struct PE_data_directory* reloc_directory = pe32
+        ? &pe->optional_header.data_directory32[PE_HEADER_DIRECTORY_ENTRY_BASERELOC]
+        : &pe->optional_header.data_directory64[PE_HEADER_DIRECTORY_ENTRY_BASERELOC];
+
+    size_t section_offset = pe_offset + sizeof(struct PE_COFF_header) + pe->file_header.size_of_optional_header;
+    uint16_t number_of_sections = pe->file_header.number_of_sections;
+    if (size_of_headers > length || size_of_headers > size_of_image
+        || section_offset + number_of_sections * sizeof(struct PE_section_header) > size_of_headers) {
+        fprintf(stderr, "no load plan: invalid headers\n");
+        return false;
+    }
+
+    struct load_plan* p = calloc(1, LOAD_PLAN_SIZE(number_of_sections + 1, 0));
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    /* the headers are part of the image */
+    p->ops[p->op_count++] = (struct load_plan_op) { .rva = 0, .offset = 0, .copy_length = size_of_headers };
+
+    const struct PE_section_header* reloc_section = NULL;
+    const struct PE_section_header* sec = (const struct PE_section_header*) (data + section_offset);
+    for (uint16_t i = 0; i < number_of_sections; i++, sec++) {
+        if (reloc_directory->size && number_of_RVA_and_sizes > PE_HEADER_DIRECTORY_ENTRY_BASERELOC
+            && sec->virtual_address <= reloc_directory->virtual_address
+            && reloc_directory->virtual_address - sec->virtual_address < sec->size_of_raw_data)
+            reloc_section = sec;
+
+        if (sec->characteristics & PE_SECTION_MEM_DISCARDABLE)
+            continue;
+
+        uint32_t copy = sec->characteristics & PE_SECTION_CNT_UNINITIALIZED_DATA
+            ? 0 : MIN(sec->size_of_raw_data, sec->virtual_size);
+        if ((uint64_t) sec->virtual_address + sec->virtual_size > size_of_image
+            || (copy && (sec->pointer_to_raw_data < size_of_headers
+                || (uint64_t) sec->pointer_to_raw_data + copy > length))) {
+            fprintf(stderr, "no load plan: section %.8s is invalid\n", sec->name);
+            free(p);
+            return false;
+        }
+        p->ops[p->op_count++] = (struct load_plan_op) {
+            .rva = sec->virtual_address,
+            .offset = sec->pointer_to_raw_data,
+            .copy_length = copy,
+            .zero_length = sec->virtual_size - copy,
+        };
+    }
+
+    /* one entry for every block of the relocation directory */
+    size_t reloc_offset = 0, reloc_end = 0;
+    if (reloc_section) {
+        reloc_offset = reloc_section->pointer_to_raw_data + reloc_directory->virtual_address - reloc_section->virtual_address;
+        reloc_end = reloc_offset + MIN(reloc_directory->size,
+            reloc_section->size_of_raw_data - (reloc_directory->virtual_address - reloc_section->virtual_address));
+        if (reloc_end > length) {
+            fprintf(stderr, "no load plan: relocations outside of the file\n");
+            free(p);
+            return false;
+        }
+    }
+    for (size_t pos = reloc_offset; pos + sizeof(struct PE_base_relocation) <= reloc_end;) {
+        const struct PE_base_relocation* block = (const struct PE_base_relocation*) (data + pos);
+        if (block->size_of_block < sizeof(struct PE_base_relocation) || block->size_of_block > reloc_end - pos
+            || block->virtual_address >= size_of_image) {
+            fprintf(stderr, "no load plan: invalid relocation block at %zu\n", pos);
+            free(p);
+            return false;
+        }
+
+        uint32_t count = (block->size_of_block - sizeof(struct PE_base_relocation)) / sizeof(uint16_t);
+        for (uint32_t i = 0; i < count; i++) {
+            switch (block->fixup[i] & PE_RELOC_BASED_TYPE_MASK) {
+                case PE_RELOC_BASED_ABSOLUTE:
+                case PE_RELOC_BASED_HIGH:
+                case PE_RELOC_BASED_LOW:
+                case PE_RELOC_BASED_HIGHLOW:
+                case PE_RELOC_BASED_DIR64:
+                    break;
+                default:
+                    fprintf(stderr, "no load plan: unknown relocation %u\n", block->fixup[i] >> 12);
+                    free(p);
+                    return false;
+            }
+        }
+
+        if (count) {
+            struct load_plan* q = realloc(p, LOAD_PLAN_SIZE(p->op_count, p->reloc_count + 1));
+            if (!q) {
+                fprintf(stderr, "Out of memory\n");
+                free(p);
+                return false;
+            }
+            p = q;
+            ((struct load_plan_reloc*) load_plan_relocs(p))[p->reloc_count++] = (struct load_plan_reloc) {
+                .offset = pos + sizeof(struct PE_base_relocation),
+                .rva = block->virtual_address,
+                .count = count,
+            };
+        }
+        pos += block->size_of_block;
+    }
+
+    p->signature = LOAD_PLAN_SIGNATURE;
+    p->version = LOAD_PLAN_VERSION;
+    p->machine = pe->file_header.machine;
+    p->image_base = pe32 ? pe->optional_header.image_base32 : pe->optional_header.image_base64;
+    p->size_of_image = size_of_image;
+    p->size_of_headers = size_of_headers;
+    p->section_alignment = section_alignment;
+    p->entry_point = pe->optional_header.address_of_entry_point;
+
+    size_t size = LOAD_PLAN_SIZE(p->op_count, p->reloc_count);
+    p->hash = xxh64(&p->image_base, size - offsetof(struct load_plan, image_base),
+        xxh64(data, size_of_headers, 0));
+
+    if (!silent)
+        printf("load plan: %u operations, %u relocation blocks\n", p->op_count, p->reloc_count);
+
+    *plan = p;
+    *plan_size = size;
+    return true;
+}
+
+/**
+ * @brief put the load plan of the kernel in fd into an anonymous file for section
+ *
+ * @returns false on errors, true if there is a plan or the kernel gets none
+ */
+static
+bool add_load_plan(int fd, size_t size, struct section_vma* section, bool silent) {
+    [[ gnu::cleanup(unmap_p) ]]
+    struct map data = {
+        .p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0),
+        .size = size
+    };
+    if (data.p == MAP_FAILED) {
+        data.p = NULL;
+        fprintf(stderr, "mmap: '%s' %m\n", section_data[SECTION_LINUX].filename);
+        return false;
+    }
+
+    struct load_plan* plan;
+    size_t plan_size;
+    if (!build_load_plan(data.p, data.size, &plan, &plan_size, silent))
+        return true;
+
+    int plan_fd = memfd_create(LOAD_PLAN_SECTION, 0);
+    if (plan_fd < 0) {
+        fprintf(stderr, "memfd_create: %m\n");
+        free(plan);
+        return false;
+    }
+    ssize_t written = write(plan_fd, plan, plan_size);
+    free(plan);
+    if (written != (ssize_t) plan_size) {
+        fprintf(stderr, "write: load plan %m\n");
+        close(plan_fd);
+        return false;
+    }
+    lseek(plan_fd, 0, SEEK_SET);
+
+    section->fd = plan_fd;
+    section->filename = "load plan";
+    section->virtual_size = plan_size;
+    section->raw_size = plan_size;
+    return true;
+}
+
+/* the frames are decoded on all processors of the target, 4 MiB is also the
+ * largest LZ4 block, so every LZ4 frame is a single block */
+#define COMPRESS_FRAME_SIZE (4 << 20)
+
+#define GZIP_MAGIC              UINT16_C(0x8B1F)
+#define LZ4_LEGACY_MAGIC        UINT32_C(0x184C2102)
+/* as BOOTCONFIG_MAGIC in src/initrd.h */
+#define BOOTCONFIG_MAGIC        "#BOOTCONFIG\n"
+#define BOOTCONFIG_MAGIC_LEN    12
+
+enum codec {
+    CODEC_NONE,
+    CODEC_ZSTD,
+    CODEC_LZ4HC,
+};
+
+struct compression {
+    enum codec codec;
+    int level;
+};
+
+/**
+ * @brief parse `zstd[:LEVEL]`, `lz4hc[:LEVEL]` or `none`
+ *
+ * @details
+ *  `lz4` is accepted for `lz4hc` as well, a NULL spec means no compression.
+ */
+static
+bool parse_compression(const char* spec, struct compression* compression) {
+    const struct {
+        const char* name;
+        enum codec codec;
+        int level;
+        int max_level;
+    } codecs[] = {
+        { "none",   CODEC_NONE,  0,  0 },
+        { "zstd",   CODEC_ZSTD,  19, ZSTD_maxCLevel() },
+        { "lz4hc",  CODEC_LZ4HC, LZ4HC_CLEVEL_MAX, LZ4HC_CLEVEL_MAX },
+        { "lz4",    CODEC_LZ4HC, LZ4HC_CLEVEL_MAX, LZ4HC_CLEVEL_MAX },
+    };
+
+    *compression = (struct compression) { };
+    if (!spec)
+        return true;
+
+    const char* level = strchr(spec, ':');
+    size_t length = level ? (size_t) (level - spec) : strlen(spec);
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if (strlen(codecs[i].name) != length || strncmp(spec, codecs[i].name, length) != 0)
+            continue;
+
+        compression->codec = codecs[i].codec;
+        compression->level = codecs[i].level;
+        if (level) {
+            char* end;
+            long value = strtol(level + 1, &end, 10);
+            if (end == level + 1 || *end || value < 1 || value > codecs[i].max_level) {
+                fprintf(stderr, "Invalid level in '%s' (%s: 1 to %d)\n", spec, codecs[i].name, codecs[i].max_level);
+                return false;
+            }
+            compression->level = value;
+        }
+        return true;
+    }
+
+    fprintf(stderr, "Unknown compression '%s'\n", spec);
+    return false;
+}
+
+/**
+ * @returns whether the loader recognizes data as compressed
+ */
+static
+bool is_compressed(const uint8_t* data, size_t size) {
+    if (size < 4)
+        return false;
+    uint32_t magic = read_le(data, 4);
+    return magic == LZ4_MAGIC || magic == ZSTD_MAGIC || magic == LZ4_LEGACY_MAGIC
+        || (magic & SKIPPABLE_MAGIC_MASK) == SKIPPABLE_MAGIC
+        || read_le(data, 2) == GZIP_MAGIC;
+}
+
+struct frame_job {
+    const uint8_t* in;
+    size_t in_size;
+    uint8_t* out;
+    size_t out_capacity;
+    size_t out_size;        ///< 0 if the frame failed
+};
+
+struct frame_jobs {
+    struct compression compression;
+    struct frame_job* jobs;
+    size_t count;
+    atomic_size_t next;
+};
+
+static inline
+void write_le(uint8_t* p, uint64_t v, size_t size) {
+    for (size_t i = 0; i < size; i++, v >>= 8)
+        p[i] = (uint8_t) v;
+}
+
+/**
+ * @brief upper bound of an LZ4 frame with content size and checksum
+ *
+ * @details
+ *  Blocks that don't shrink are stored.
+ */
+static inline
+size_t lz4_frame_bound(size_t size) {
+    size_t blocks = size / COMPRESS_FRAME_SIZE + 1;
+    return 4 + 2 + 8 + 1 + blocks * 4 + size + 4 + 4;
+}
+
+/**
+ * @brief compress an LZ4 frame with independent 4 MiB blocks
+ *
+ * @details
+ *  Like `lz4 --content-size --favor-decSpeed`, the content size lets the
+ *  loader allocate the output up front.
+ */
+static
+size_t lz4_frame(LZ4_streamHC_t* state, int level, const struct frame_job* job) {
+    uint8_t* out = job->out;
+    write_le(out, LZ4_MAGIC, 4);
+    /* version 1, independent blocks, content size, content checksum */
+    out[4] = 0x40 | 0x20 | 0x08 | 0x04;
+    /* 4 MiB blocks */
+    out[5] = 7 << 4;
+    write_le(out + 6, job->in_size, 8);
+    out[14] = (uint8_t) (xxh32(out + 4, 10, 0) >> 8);
+    size_t pos = 15;
+
+    for (size_t i = 0; i < job->in_size; i += COMPRESS_FRAME_SIZE) {
+        int size = MIN(job->in_size - i, (size_t) COMPRESS_FRAME_SIZE);
+        LZ4_resetStreamHC_fast(state, level);
+        LZ4_favorDecompressionSpeed(state, 1);
+        /* the block is stored if it does not get smaller */
+        int compressed = LZ4_compress_HC_continue(state, (const char*) job->in + i,
+            (char*) out + pos + 4, size, size - 1);
+        if (compressed > 0) {
+            write_le(out + pos, compressed, 4);
+            pos += 4 + compressed;
+        } else {
+            write_le(out + pos, size | UINT32_C(0x80000000), 4);
+            memcpy(out + pos + 4, job->in + i, size);
+            pos += 4 + size;
+        }
+    }
+
+    write_le(out + pos, 0, 4);
+    write_le(out + pos + 4, xxh32(job->in, job->in_size, 0), 4);
+    return pos + 8;
+}
+
+static
+size_t zstd_frame(ZSTD_CCtx* cctx, const struct frame_job* job) {
+    size_t size = ZSTD_compress2(cctx, job->out, job->out_capacity, job->in, job->in_size);
+    if (ZSTD_isError(size)) {
+        fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(size));
+        return 0;
+    }
+    return size;
+}
+
+/**
+ * @brief compress frames until there are none left
+ */
+static
+void* compress_frames(void* arg) {
+    struct frame_jobs* jobs = arg;
+    int level = jobs->compression.level;
+
+    ZSTD_CCtx* cctx = NULL;
+    LZ4_streamHC_t* state = NULL;
+    if (jobs->compression.codec == CODEC_ZSTD) {
+        cctx = ZSTD_createCCtx();
+        /* the content size is written by default */
+        if (cctx && (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level))
+            || ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1)))) {
+            ZSTD_freeCCtx(cctx);
+            cctx = NULL;
+        }
+    } else {
+        state = malloc(sizeof(*state));
+        if (state)
+            LZ4_initStreamHC(state, sizeof(*state));
+    }
+
+    for (size_t i; (i = atomic_fetch_add(&jobs->next, 1)) < jobs->count;) {
+        struct frame_job* job = &jobs->jobs[i];
+        if (cctx)
+            job->out_size = zstd_frame(cctx, job);
+        else if (state)
+            job->out_size = lz4_frame(state, level, job);
+    }
+
+    ZSTD_freeCCtx(cctx);
+    free(state);
+    return NULL;
+}
+
+/**
+ * @brief compress data in independent frames on all processors of the host
+ *
+ * @details
+ *  Every frame has its content size, so build_frame_table puts a table in
+ *  front of them and the loader decodes them in parallel as well.
+ *
+ * @returns anonymous file with the concatenated frames or -1
+ */
+static
+int compress_data(const uint8_t* data, size_t size, const char* filename, const struct compression* compression, bool silent) {
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    struct frame_jobs jobs = {
+        .compression = *compression,
+        .count = MAX((size + COMPRESS_FRAME_SIZE - 1) / COMPRESS_FRAME_SIZE, 1),
+    };
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = MIN((size_t) MAX(processors, 1), jobs.count);
+
+    pthread_t* threads = calloc(thread_count, sizeof(*threads));
+    jobs.jobs = calloc(jobs.count, sizeof(*jobs.jobs));
+    if (!jobs.jobs || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        free(jobs.jobs);
+        free(threads);
+        return -1;
+    }
+
+    int fd = -1;
+    bool failed = false;
+    for (size_t i = 0; i < jobs.count && !failed; i++) {
+        struct frame_job* job = &jobs.jobs[i];
+        job->in = data + i * COMPRESS_FRAME_SIZE;
+        job->in_size = MIN(size - i * COMPRESS_FRAME_SIZE, (size_t) COMPRESS_FRAME_SIZE);
+        job->out_capacity = compression->codec == CODEC_ZSTD
+            ? ZSTD_compressBound(job->in_size) : lz4_frame_bound(job->in_size);
+        job->out = malloc(job->out_capacity);
+        failed = !job->out;
+    }
+    if (failed) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    /* this thread compresses as well */
+    size_t started = 0;
+    for (; started + 1 < thread_count; started++) {
+        if (pthread_create(&threads[started], NULL, compress_frames, &jobs) != 0)
+            break;
+    }
+    compress_frames(&jobs);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    fd = memfd_create(filename, 0);
+    if (fd < 0) {
+        fprintf(stderr, "memfd_create: %m\n");
+        goto out;
+    }
+
+    size_t compressed = 0;
+    for (size_t i = 0; i < jobs.count; i++) {
+        struct frame_job* job = &jobs.jobs[i];
+        if (!job->out_size || write(fd, job->out, job->out_size) != (ssize_t) job->out_size) {
+            fprintf(stderr, "Compressing '%s' failed\n", filename);
+            close(fd);
+            fd = -1;
+            goto out;
+        }
+        compressed += job->out_size;
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!silent) {
+        uint64_t ms = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000;
+        printf("compressed '%s': %s:%d, %zu frames on %zu threads, %zu -> %zu bytes in %lu ms\n",
+            filename, compression->codec == CODEC_ZSTD ? "zstd" : "lz4hc", compression->level,
+            jobs.count, started + 1, size, compressed, ms);
+    }
+
+out:
+    for (size_t i = 0; i < jobs.count; i++)
+        free(jobs.jobs[i].out);
+    free(jobs.jobs);
+    free(threads);
+    return fd;
+}
+
+/**
+ * @brief compress a section file unless it is compressed already
+ *
+ * @returns anonymous file with the compressed data, fd if it stays as it
+ *  is or -1
+ */
+static
+int compress_file(int fd, size_t size, const char* filename, const struct compression* compression, bool silent) {
+    if (compression->codec == CODEC_NONE || size == 0)
+        return fd;
+
+    [[ gnu::cleanup(unmap_p) ]]
+    struct map data = {
+        .p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0),
+        .size = size
+    };
+    if (data.p == MAP_FAILED) {
+        data.p = NULL;
+        fprintf(stderr, "mmap: '%s' %m\n", filename);
+        return -1;
+    }
+
+    if (is_compressed(data.p, data.size)) {
+        if (!silent)
+            printf("'%s' is compressed already\n", filename);
+        return fd;
+    }
+    /* the loader finds the trailer only in uncompressed data to keep it last */
+    if (data.size >= BOOTCONFIG_MAGIC_LEN
+        && memcmp(data.p + data.size - BOOTCONFIG_MAGIC_LEN, BOOTCONFIG_MAGIC, BOOTCONFIG_MAGIC_LEN) == 0) {
+        if (!silent)
+            printf("'%s' ends with a bootconfig, stored uncompressed\n", filename);
+        return fd;
+    }
+    return compress_data(data.p, data.size, filename, compression, silent);
+}
+
+/**
+ * @brief range of the file covered by the executable sections of a PE image
+ *
+ * @returns false if there are none
+ */
+static
+bool code_range(const uint8_t* data, size_t length, uint64_t* start, uint64_t* end) {
+    *start = UINT64_MAX;
+    *end = 0;
+
+    if (length < DOS_PE_OFFSET_LOCATION + sizeof(uint32_t))
+        return false;
+    uint32_t pe_offset = read_le(data + DOS_PE_OFFSET_LOCATION, 4);
+    if (pe_offset > length || length - pe_offset < sizeof(struct PE_image_headers))
+        return false;
+
+    const struct PE_image_headers* pe = (const struct PE_image_headers*) (data + pe_offset);
+    size_t section_offset = pe_offset + sizeof(struct PE_COFF_header) + pe->file_header.size_of_optional_header;
+    uint16_t number_of_sections = pe->file_header.number_of_sections;
+    if (section_offset + number_of_sections * sizeof(struct PE_section_header) > length)
+        return false;
+
+    const struct PE_section_header* sec = (const struct PE_section_header*) (data + section_offset);
+    for (uint16_t i = 0; i < number_of_sections; i++, sec++) {
+        if (!(sec->characteristics & (PE_SECTION_CNT_CODE | PE_SECTION_MEM_EXECUTE)) || !sec->size_of_raw_data)
+            continue;
+        *start = MIN(*start, sec->pointer_to_raw_data);
+        *end = MAX(*end, MIN((uint64_t) sec->pointer_to_raw_data + sec->size_of_raw_data, length));
+    }
+
+    /* ARM64 instructions are aligned */
+    *start &= ~UINT64_C(3);
+    return *start < *end;
+}
+
+/**
+ * @brief compress an uncompressed kernel, converting its branches first
+ *
+ * @param[in] machine
+ *  PE machine type of the kernel, 0 to compress it as it is
+ * @param[out] header
+ *  filter header for the section, all zero without conversion
+ * @returns anonymous file with the compressed kernel, fd if it stays as it
+ *  is or -1
+ */
+static
+int compress_kernel(int fd, size_t size, const char* filename, const struct compression* compression, uint16_t machine, struct bcj_header* header, bool silent) {
+    *header = (struct bcj_header) { };
+
+    enum bcj_filter filter;
+    switch (machine) {
+        case 0:
+            filter = BCJ_FILTER_NONE;
+            break;
+        case PE_HEADER_MACHINE_AMD64:
+        case PE_HEADER_MACHINE_I386:
+            filter = BCJ_FILTER_X86;
+            break;
+        case PE_HEADER_MACHINE_ARM64:
+            filter = BCJ_FILTER_ARM64;
+            break;
+        default:
+            fprintf(stderr, "No branch filter for machine %04hX\n", machine);
+            return -1;
+    }
+
+    /* private mapping, the conversion does not change the file */
+    [[ gnu::cleanup(unmap_p) ]]
+    struct map data = {
+        .p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0),
+        .size = size
+    };
+    if (data.p == MAP_FAILED) {
+        data.p = NULL;
+        fprintf(stderr, "mmap: '%s' %m\n", filename);
+        return -1;
+    }
+
+    /* the payload of a zboot image is compressed already, the loader
+     * decodes it itself */
+    if (data.size >= 8 && memcmp(data.p + 4, "zimg", 4) == 0) {
+        if (!silent)
+            printf("'%s' is a zboot image, it stays as it is\n", filename);
+        return fd;
+    }
+
+    uint64_t start = 0, end = 0;
+    if (filter != BCJ_FILTER_NONE) {
+        if (!code_range(data.p, data.size, &start, &end)) {
+            fprintf(stderr, "No executable sections in '%s'\n", filename);
+            return -1;
+        }
+
+        struct bcj_state state;
+        bcj_init(&state, filter, start, end);
+        bcj_convert(&state, data.p, 0, data.size, true);
+    }
+
+    int compressed = compress_data(data.p, data.size, filename, compression, silent);
+    if (compressed < 0 || filter == BCJ_FILTER_NONE)
+        return compressed;
+
+    *header = (struct bcj_header) {
+        .magic = BCJ_HEADER_MAGIC,
+        .size = sizeof(*header) - offsetof(struct bcj_header, signature),
+        .signature = BCJ_HEADER_SIGNATURE,
+        .filter = filter,
+        .start = start,
+        .end = end,
+    };
+    if (!silent)
+        printf("branch filter: %s from %lu to %lu\n", filter == BCJ_FILTER_ARM64 ? "ARM64" : "x86", start, end);
+    return compressed;
+}
+
+/**
+ * @brief throughputs of the target in MiB/s
+ *
+ * @details
+ *  The decoders are measured per processor, like the "decode profile"
+ *  messages of the loader.
+ */
+struct boot_profile {
+    double read;            ///< firmware loading the image from the boot medium
+    double zstd;
+    double lz4;
+    double bcj;             ///< reversing the branch filter
+    unsigned processors;    ///< processors decoding frames
+};
+
+/**
+ * @brief read `key=value` pairs of a target profile
+ *
+ * @details
+ *  Everything else is ignored, so the messages of the loader can be pasted
+ *  as they are. The largest processor count seen counts.
+ */
+static
+bool read_profile(const char* filename, struct boot_profile* profile) {
+    *profile = (struct boot_profile) { .processors = 1 };
+
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "open: '%s' %m\n", filename);
+        return false;
+    }
+
+    char* line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, f) > 0) {
+        if (line[0] == '#')
+            continue;
+
+        char* save;
+        for (char* token = strtok_r(line, " \t\r\n", &save); token; token = strtok_r(NULL, " \t\r\n", &save)) {
+            char* value = strchr(token, '=');
+            if (!value)
+                continue;
+            *value++ = '\0';
+
+            char* end;
+            double v = strtod(value, &end);
+            if (end == value || *end || v <= 0)
+                continue;
+
+            if (strcmp(token, "read") == 0)
+                profile->read = v;
+            else if (strcmp(token, "zstd") == 0)
+                profile->zstd = v;
+            else if (strcmp(token, "lz4") == 0)
+                profile->lz4 = v;
+            else if (strcmp(token, "bcj") == 0)
+                profile->bcj = v;
+            else if (strcmp(token, "processors") == 0)
+                profile->processors = MAX(profile->processors, (unsigned) v);
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (!profile->read || !profile->zstd || !profile->lz4) {
+        fprintf(stderr, "The profile '%s' requires read, zstd and lz4 throughputs\n", filename);
+        return false;
+    }
+    return true;
+}
+
+/* encodings tried for every section */
+static const struct compression tune_candidates[] = {
+    { CODEC_NONE },
+    { CODEC_LZ4HC, 9 },
+    { CODEC_LZ4HC, LZ4HC_CLEVEL_MAX },
+    { CODEC_ZSTD, 3 },
+    { CODEC_ZSTD, 9 },
+    { CODEC_ZSTD, 19 },
+};
+
+#define TUNE_MAX_CANDIDATES (2 * sizeof(tune_candidates) / sizeof(tune_candidates[0]))
+
+struct candidate {
+    struct compression compression;
+    struct bcj_header filter;
+    int fd;                 ///< compressed file, the section file without compression
+    size_t size;            ///< size in the image, with frame table and filter header
+    double read_ms;
+    double decode_ms;
+};
+
+struct tuned_section {
+    int id;                 ///< enum section_data_id
+    size_t content_size;
+    struct candidate candidates[TUNE_MAX_CANDIDATES];
+    size_t count;
+    size_t chosen;
+};
+
+#define MS_PER_MIB(size, throughput) ((size) / ((throughput) * 1024 * 1024) * 1000)
+
+/**
+ * @brief modeled time the loader spends on decoding a candidate
+ *
+ * @details
+ *  The frames of a section are decoded on all processors, every processor
+ *  takes one frame at a time. An ARM64 branch filter is reversed on all
+ *  processors, an x86 one on one.
+ */
+static
+double model_decode_ms(const struct boot_profile* profile, const struct candidate* c, size_t content_size) {
+    if (c->compression.codec == CODEC_NONE)
+        return 0;
+
+    double throughput = c->compression.codec == CODEC_ZSTD ? profile->zstd : profile->lz4;
+    size_t frames = MAX((content_size + COMPRESS_FRAME_SIZE - 1) / COMPRESS_FRAME_SIZE, 1);
+    size_t rounds = (frames + profile->processors - 1) / profile->processors;
+    double ms = rounds * MS_PER_MIB((double) MIN(content_size, (size_t) COMPRESS_FRAME_SIZE), throughput);
+
+    if (c->filter.magic) {
+        unsigned processors = c->filter.filter == BCJ_FILTER_ARM64 ? profile->processors : 1;
+        ms += MS_PER_MIB((double) (c->filter.end - c->filter.start), profile->bcj * processors);
+    }
+    return ms;
+}
+
+/**
+ * @brief compress a section with every candidate encoding
+ *
+ * @param[in] machine
+ *  PE machine type of an uncompressed kernel, 0 for other sections
+ * @returns false on errors, sections that are compressed already get a
+ *  single candidate
+ */
+static
+bool tune_section(struct tuned_section* t, const struct boot_profile* profile, uint16_t machine, bool branch_filter, bool silent) {
+    struct section_vma* section = &section_data[t->id];
+    int fd = openat(AT_FDCWD, section->filename, O_RDONLY);
+    struct statx st = { };
+    if (fd < 0 || 0 > statx(fd, "", AT_EMPTY_PATH, STATX_SIZE, &st)) {
+        fprintf(stderr, "open: '%s' as '%s' %m\n", section->filename, section->name);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    t->content_size = st.stx_size;
+    t->candidates[t->count++] = (struct candidate) { .fd = fd, .size = st.stx_size };
+
+    for (size_t i = 1; i < sizeof(tune_candidates) / sizeof(tune_candidates[0]); i++) {
+        for (int filtered = 0; filtered <= (machine && branch_filter); filtered++) {
+            struct candidate c = { .compression = tune_candidates[i] };
+            if (machine)
+                c.fd = compress_kernel(fd, st.stx_size, section->filename, &c.compression, filtered ? machine : 0, &c.filter, silent);
+            else
+                c.fd = compress_file(fd, st.stx_size, section->filename, &c.compression, silent);
+            if (c.fd < 0)
+                return false;
+            /* compressed already */
+            if (c.fd == fd)
+                goto model;
+
+            struct statx compressed = { };
+            if (0 > statx(c.fd, "", AT_EMPTY_PATH, STATX_SIZE, &compressed)) {
+                fprintf(stderr, "stat: '%s' %m\n", section->filename);
+                close(c.fd);
+                return false;
+            }
+            size_t frames = (st.stx_size + COMPRESS_FRAME_SIZE - 1) / COMPRESS_FRAME_SIZE;
+            c.size = compressed.stx_size + (frames > 1 ? FRAME_TABLE_SIZE(frames) : 0) + (c.filter.magic ? sizeof(c.filter) : 0);
+            t->candidates[t->count++] = c;
+        }
+    }
+
+model:
+    for (size_t i = 0; i < t->count; i++) {
+        struct candidate* c = &t->candidates[i];
+        c->read_ms = MS_PER_MIB((double) c->size, profile->read);
+        c->decode_ms = model_decode_ms(profile, c, t->content_size);
+        if (c->read_ms + c->decode_ms < t->candidates[t->chosen].read_ms + t->candidates[t->chosen].decode_ms)
+            t->chosen = i;
+    }
+    return true;
+}
+
+/**
+ * @brief choose the encodings of the kernel, the initrds and the DTB with
+ *  the shortest modeled read and decode time
+ *
+ * @details
+ *  Each section takes its fastest candidate. As long as they exceed
+ *  max_size together, the section that saves the most bytes per additional
+ *  millisecond switches to a smaller candidate.
+ *
+ * @param[out] filter
+ *  filter header of the chosen kernel
+ */
+static
+bool optimize_sections(const struct boot_profile* profile, uint64_t max_size, bool branch_filter, struct bcj_header* filter, bool silent) {
+    struct tuned_section sections[_SECTION_MAX] = { };
+    size_t count = 0;
+
+    for (int i = 0; i < _SECTION_MAX; i++) {
+        bool initrd = i >= SECTION_INITRD && i <= SECTION_INITRD_LAST;
+        if (!section_data[i].filename || !(initrd || i == SECTION_DT || i == SECTION_LINUX))
+            continue;
+
+        uint16_t machine = 0;
+        if (i == SECTION_LINUX) {
+            [[ gnu::cleanup(close_p) ]]
+            int fd = openat(AT_FDCWD, section_data[i].filename, O_RDONLY);
+            struct statx st = { };
+            /* only an uncompressed kernel gets compressed */
+            if (fd < 0 || 0 > statx(fd, "", AT_EMPTY_PATH, STATX_SIZE, &st)
+                || !inspect_pe(fd, st.stx_size, NULL, NULL, NULL, &machine))
+                continue;
+        }
+
+        sections[count].id = i;
+        if (!tune_section(&sections[count++], profile, machine, branch_filter, silent))
+            return false;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += sections[i].candidates[sections[i].chosen].size;
+
+    while (max_size && total > max_size) {
+        struct tuned_section* best = NULL;
+        size_t best_candidate = 0;
+        double best_ratio = 0;
+        for (size_t i = 0; i < count; i++) {
+            const struct candidate* chosen = &sections[i].candidates[sections[i].chosen];
+            for (size_t j = 0; j < sections[i].count; j++) {
+                const struct candidate* c = &sections[i].candidates[j];
+                if (c->size >= chosen->size)
+                    continue;
+                double slower = (c->read_ms + c->decode_ms) - (chosen->read_ms + chosen->decode_ms);
+                double ratio = (chosen->size - c->size) / MAX(slower, 1e-6);
+                if (ratio > best_ratio) {
+                    best = &sections[i];
+                    best_candidate = j;
+                    best_ratio = ratio;
+                }
+            }
+        }
+        if (!best) {
+            fprintf(stderr, "The sections do not fit in %lu bytes (smallest %zu bytes)\n", max_size, total);
+            return false;
+        }
+        total -= best->candidates[best->chosen].size - best->candidates[best_candidate].size;
+        best->chosen = best_candidate;
+    }
+
+    printf("boot-time model: read %.0f MiB/s, zstd %.0f MiB/s, lz4 %.0f MiB/s, bcj %.0f MiB/s on %u processors\n",
+        profile->read, profile->zstd, profile->lz4, profile->bcj, profile->processors);
+    printf("%-9s %-16s %10s %10s %10s %10s\n", "section", "encoding", "KiB", "read ms", "decode ms", "total ms");
+    double total_ms = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct tuned_section* t = &sections[i];
+        for (size_t j = 0; j < t->count; j++) {
+            const struct candidate* c = &t->candidates[j];
+            char encoding[32] = "none";
+            if (c->compression.codec != CODEC_NONE)
+                snprintf(encoding, sizeof(encoding), "%s:%d%s", c->compression.codec == CODEC_ZSTD ? "zstd" : "lz4hc",
+                    c->compression.level, c->filter.magic ? "+bcj" : "");
+            printf("%-9s %-16s %10zu %10.1f %10.1f %10.1f%s\n", section_data[t->id].name, encoding, c->size / 1024,
+                c->read_ms, c->decode_ms, c->read_ms + c->decode_ms, j == t->chosen ? " *" : "");
+        }
+        total_ms += t->candidates[t->chosen].read_ms + t->candidates[t->chosen].decode_ms;
+
+        /* the section file is opened again without a compressed one */
+        for (size_t j = 0; j < t->count; j++) {
+            struct candidate* c = &t->candidates[j];
+            if (j == t->chosen && c->compression.codec != CODEC_NONE) {
+                section_data[t->id].tuned_fd = c->fd;
+                if (t->id == SECTION_LINUX)
+                    *filter = c->filter;
+            } else {
+                close(c->fd);
+            }
+        }
+    }
+    printf("%-26s %10zu %32.1f\n", "total", total / 1024, total_ms);
+    return true;
+}
+
 static
 void usage() {
     printf("build_image [OPTIONS]\n"
@@ -128,7 +1263,25 @@ void usage() {
         "  -v, --verbose      Be more verbose\n"
         "  -s, --stub \x1b[3mPATH\x1b[0m    EFI stub\n"
         "  -l, --linux \x1b[3mPATH\x1b[0m   Linux kernel to embed\n"
-        "  -i, --initrd \x1b[3mPATH\x1b[0m  initrd to embed\n"
+        "  -i, --initrd \x1b[3mPATH\x1b[0m  initrd to embed, repeat to append up to 9 more archives\n"
+        "  -C, --compress \x1b[3mCODEC\x1b[0m\n"
+        "                     Compress the kernel, the initrds and the DTB with zstd[:LEVEL]\n"
+        "                     or lz4hc[:LEVEL] in frames the loader decodes in parallel\n"
+        "                     (compressed inputs stay as they are)\n"
+        "  -z, --compress-initrd \x1b[3mCODEC\x1b[0m\n"
+        "                     Compression of the initrds instead of --compress (or none)\n"
+        "  -Z, --compress-linux \x1b[3mCODEC\x1b[0m\n"
+        "                     Compression of an uncompressed kernel instead of --compress\n"
+        "  -B, --branch-filter Convert the branches of the kernel to absolute targets before\n"
+        "                     compressing it, it compresses better (loader converts them back)\n"
+        "  -t, --optimize-for \x1b[3mboot-time\x1b[0m\n"
+        "                     Choose the encodings of the kernel, the initrds and the DTB with\n"
+        "                     the shortest read and decode time on the target of --profile\n"
+        "  -p, --profile \x1b[3mPATH\x1b[0m\n"
+        "                     Target profile with read=, zstd=, lz4=, bcj= (MiB/s) and\n"
+        "                     processors=, e.g. the \"decode profile\" messages of the loader\n"
+        "  -m, --max-size \x1b[3mSIZE\x1b[0m\n"
+        "                     Largest size of these sections together (K, M and G suffixes)\n"
         "  -d, --dtb \x1b[3mPATH\x1b[0m     DTB devicetree to embed\n"
         "  -c, --cmdline \x1b[3mPATH\x1b[0m cmdline to embed (textfile with single line)\n"
         "  -O, --osrel \x1b[3mPATH\x1b[0m   os-release file to embed (defaults to /etc/os-release)\n");
@@ -136,8 +1289,10 @@ void usage() {
 
 int main(int argc, char* argv[]) {
     struct PE_version16 efi_version = { 1, 10 };
-    char* filename = NULL, *outfile = NULL;
-    bool silent = true, force = false, set_version = false;
+    char* filename = NULL, *outfile = NULL, *compression_spec = NULL, *initrd_spec = NULL, *linux_spec = NULL;
+    char* profile_filename = NULL;
+    bool silent = true, force = false, set_version = false, branch_filter = false, optimize = false;
+    uint64_t max_size = 0;
 
     const struct option long_opts[] = {
         { .name = "help",       .has_arg = no_argument,       .flag = NULL, .val = 'h' },
@@ -147,6 +1302,13 @@ int main(int argc, char* argv[]) {
         { .name = "outfile",    .has_arg = required_argument, .flag = NULL, .val = 'o' },
         { .name = "linux",      .has_arg = required_argument, .flag = NULL, .val = 'l' },
         { .name = "initrd",     .has_arg = required_argument, .flag = NULL, .val = 'i' },
+        { .name = "compress",   .has_arg = required_argument, .flag = NULL, .val = 'C' },
+        { .name = "compress-initrd", .has_arg = required_argument, .flag = NULL, .val = 'z' },
+        { .name = "compress-linux", .has_arg = required_argument, .flag = NULL, .val = 'Z' },
+        { .name = "branch-filter", .has_arg = no_argument,     .flag = NULL, .val = 'B' },
+        { .name = "optimize-for", .has_arg = required_argument, .flag = NULL, .val = 't' },
+        { .name = "profile",    .has_arg = required_argument, .flag = NULL, .val = 'p' },
+        { .name = "max-size",   .has_arg = required_argument, .flag = NULL, .val = 'm' },
         { .name = "dtb",        .has_arg = required_argument, .flag = NULL, .val = 'd' },
         { .name = "cmdline",    .has_arg = required_argument, .flag = NULL, .val = 'c' },
         { .name = "osrel",      .has_arg = required_argument, .flag = NULL, .val = 'O' },
@@ -155,7 +1317,7 @@ int main(int argc, char* argv[]) {
     };
     int c, opt_index = 0;
 
-    while(-1 != (c = getopt_long(argc, argv, "hfvs:o:l:i:d:c:O:V:", long_opts, &opt_index))) {
+    while(-1 != (c = getopt_long(argc, argv, "hfvs:o:l:i:C:z:Z:Bt:p:m:d:c:O:V:", long_opts, &opt_index))) {
         switch(c) {
             case 'f':
                 force = true;
@@ -182,7 +1344,56 @@ int main(int argc, char* argv[]) {
                 section_data[SECTION_LINUX].filename = optarg;
                 break;
             case 'i':
-                section_data[SECTION_INITRD].filename = optarg;
+                {
+                    int i = SECTION_INITRD;
+                    while (i <= SECTION_INITRD_LAST && section_data[i].filename)
+                        i++;
+                    if (i > SECTION_INITRD_LAST) {
+                        fprintf(stderr, "Too many initrds\n");
+                        return 1;
+                    }
+                    section_data[i].filename = optarg;
+                }
+                break;
+            case 'C':
+                compression_spec = optarg;
+                break;
+            case 'z':
+                initrd_spec = optarg;
+                break;
+            case 'Z':
+                linux_spec = optarg;
+                break;
+            case 'B':
+                branch_filter = true;
+                break;
+            case 't':
+                if (strcmp(optarg, "boot-time") != 0) {
+                    fprintf(stderr, "Unknown optimization target '%s'\n", optarg);
+                    usage();
+                    return 1;
+                }
+                optimize = true;
+                break;
+            case 'p':
+                profile_filename = optarg;
+                break;
+            case 'm':
+                {
+                    char* end;
+                    max_size = strtoull(optarg, &end, 10);
+                    static const char units[] = "KMG";
+                    const char* unit = *end ? strchr(units, *end) : NULL;
+                    if (unit) {
+                        max_size <<= 10 * (unit - units + 1);
+                        end++;
+                    }
+                    if (end == optarg || *end || !max_size) {
+                        fprintf(stderr, "Could not parse size\n");
+                        usage();
+                        return 1;
+                    }
+                }
                 break;
             case 'V':
                 {
@@ -229,6 +1440,44 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    struct compression compression, initrd_compression, linux_compression;
+    if (!parse_compression(compression_spec, &compression)
+        || !parse_compression(initrd_spec ?: compression_spec, &initrd_compression)
+        || !parse_compression(linux_spec ?: compression_spec, &linux_compression)) {
+        usage();
+        return 1;
+    }
+
+    struct boot_profile profile = { };
+    if (optimize) {
+        if (compression_spec || initrd_spec || linux_spec) {
+            fprintf(stderr, "--optimize-for chooses the compression itself\n");
+            usage();
+            return 1;
+        }
+        if (!profile_filename) {
+            fprintf(stderr, "--optimize-for requires --profile\n");
+            usage();
+            return 1;
+        }
+        if (!read_profile(profile_filename, &profile))
+            return 1;
+        if (branch_filter && !profile.bcj) {
+            fprintf(stderr, "The branch filter requires a bcj throughput in the profile\n");
+            return 1;
+        }
+    } else if (profile_filename || max_size) {
+        fprintf(stderr, "--profile and --max-size require --optimize-for\n");
+        usage();
+        return 1;
+    }
+
+    if (branch_filter && linux_compression.codec == CODEC_NONE && !optimize) {
+        fprintf(stderr, "The branch filter requires --compress or --compress-linux\n");
+        usage();
+        return 1;
+    }
+
     if (!section_data[SECTION_OSREL].filename) {
         section_data[SECTION_OSREL].filename = "/etc/os-release";
     }
@@ -265,8 +1514,13 @@ int main(int argc, char* argv[]) {
         file_alignment = 0x200;
 
     size_t filesize = orig_filesize;
+    struct bcj_header filter = { };
+    if (optimize && !optimize_sections(&profile, max_size, branch_filter, &filter, silent))
+        return 1;
+
     for (int i = 0; i < _SECTION_MAX; i++) {
-        if (!section_data[i].filename)
+        /* the load plan is created with the kernel */
+        if (!section_data[i].filename || section_data[i].fd > 0)
             continue;
         section_data[i].fd = openat(AT_FDCWD, section_data[i].filename, O_RDONLY);
         if (section_data[i].fd < 0) {
@@ -278,8 +1532,27 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "stat: '%s' %m\n", section_data[i].filename);
             return 1;
         }
+
+        /* the kernel is compressed after its load plan is derived */
+        bool initrd = i >= SECTION_INITRD && i <= SECTION_INITRD_LAST;
+        if (initrd || i == SECTION_DT) {
+            int compressed = section_data[i].tuned_fd ?: compress_file(section_data[i].fd, st.stx_size,
+                section_data[i].filename, initrd ? &initrd_compression : &compression, silent);
+            if (compressed < 0)
+                return 1;
+            if (compressed != section_data[i].fd) {
+                close(section_data[i].fd);
+                section_data[i].fd = compressed;
+                if (0 > statx(compressed, "", AT_EMPTY_PATH, STATX_SIZE, &st)) {
+                    fprintf(stderr, "stat: '%s' %m\n", section_data[i].filename);
+                    return 1;
+                }
+            }
+        }
         section_data[i].virtual_size = st.stx_size;
         section_data[i].raw_size = st.stx_size;
+        /* compressed data may be split into frames */
+        bool frames = initrd || i == SECTION_DT;
         if (i == SECTION_LINUX) {
             uint32_t image_size; uint32_t linux_alignment; uint16_t linux_architecture;
             if (inspect_pe(section_data[i].fd, st.stx_size, NULL, &linux_alignment, &image_size, &linux_architecture)) {
@@ -291,9 +1564,76 @@ int main(int argc, char* argv[]) {
                     fprintf(stderr, "Linux '%s' and stub '%s' have different architectures\n", section_data[i].filename, filename);
                     return 1;
                 }
+
+                if (!add_load_plan(section_data[i].fd, st.stx_size, &section_data[SECTION_PLAN], silent))
+                    return 1;
+                if (section_data[SECTION_PLAN].fd > 0)
+                    filesize += ALIGN_VALUE(section_data[SECTION_PLAN].raw_size, file_alignment);
+
+                int compressed = section_data[i].fd;
+                if (section_data[i].tuned_fd > 0)
+                    compressed = section_data[i].tuned_fd;
+                else if (linux_compression.codec != CODEC_NONE)
+                    compressed = compress_kernel(section_data[i].fd, st.stx_size, section_data[i].filename,
+                        &linux_compression, branch_filter ? linux_architecture : 0, &filter, silent);
+                if (compressed < 0)
+                    return 1;
+                if (compressed != section_data[i].fd) {
+                    close(section_data[i].fd);
+                    section_data[i].fd = compressed;
+
+                    if (0 > statx(compressed, "", AT_EMPTY_PATH, STATX_SIZE, &st)) {
+                        fprintf(stderr, "stat: '%s' %m\n", section_data[i].filename);
+                        return 1;
+                    }
+                    section_data[i].virtual_size = st.stx_size;
+                    section_data[i].raw_size = st.stx_size;
+                    frames = true;
+                }
+            } else {
+                frames = true;
+            }
+        }
+
+        if (frames && st.stx_size > 0) {
+            [[ gnu::cleanup(unmap_p) ]]
+            struct map data = {
+                .p = mmap(NULL, st.stx_size, PROT_READ, MAP_PRIVATE, section_data[i].fd, 0),
+                .size = st.stx_size
+            };
+            if (data.p == MAP_FAILED) {
+                data.p = NULL;
+                fprintf(stderr, "mmap: '%s' %m\n", section_data[i].filename);
+                return 1;
+            }
+
+            struct frame_table* table; size_t table_size;
+            if (!build_frame_table(data.p, data.size, &table, &table_size, silent))
+                return 1;
+
+            /* the filter header goes in front of the table */
+            size_t filter_size = i == SECTION_LINUX && filter.magic ? sizeof(filter) : 0;
+            if (filter_size) {
+                uint8_t* prefix = malloc(filter_size + table_size);
+                if (!prefix) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+                memcpy(prefix, &filter, filter_size);
+                if (table_size)
+                    memcpy(prefix + filter_size, table, table_size);
+                free(table);
+                table = (struct frame_table*) prefix;
+                table_size += filter_size;
+                filter = (struct bcj_header) { };
             }
+
+            section_data[i].prefix = (uint8_t*) table;
+            section_data[i].prefix_size = table_size;
+            section_data[i].virtual_size += table_size;
+            section_data[i].raw_size += table_size;
         }
-        filesize += ALIGN_VALUE(st.stx_size, file_alignment);
+        filesize += ALIGN_VALUE(section_data[i].raw_size, file_alignment);
     }
 
     [[ gnu::cleanup(close_p) ]]
@@ -308,7 +1648,7 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "sendfile: %m\n");
         return 1;
     }
-    if (ret != orig_filesize) {
+    if (ret != (ssize_t) orig_filesize) {
         fprintf(stderr, "sendfile: Data remaining: %zd != %zu\n", ret, orig_filesize);
         return 1;
     }
@@ -445,7 +1785,12 @@ int main(int argc, char* argv[]) {
 
         if (!silent)
             printf("put %8s at 0x%zx (%u)\n", section_data[i].name, largest_raw_address, section_data[i].virtual_size);
-        if (read(section_data[i].fd, base + largest_raw_address, section_data[i].raw_size) != section_data[i].raw_size) {
+        if (section_data[i].prefix_size) {
+            memcpy(base + largest_raw_address, section_data[i].prefix, section_data[i].prefix_size);
+            free(section_data[i].prefix);
+        }
+        size_t file_size = section_data[i].raw_size - section_data[i].prefix_size;
+        if (read(section_data[i].fd, base + largest_raw_address + section_data[i].prefix_size, file_size) != (ssize_t) file_size) {
             fprintf(stderr, "read: '%s': %m\n", section_data[i].filename);
             return 1;
         }
@@ -1,12 +1,17 @@
 #!/bin/sh
 
 KERNEL="/boot/Image"
-KERNEL_COMPRESSED="/boot/Image.zst"
 OSRELEASE="/etc/os-release"
 KEYS=""
 BOOTCFG="/etc/boot.bcfg"
 DT="/boot/armada-3720-espressobin.dtb"
 STUB="/boot/zloaderaa64.efi.stub"
+# build_image compresses the kernel, the initrd and the DT in frames that are
+# decompressed on all cores (zstd[:LEVEL] or lz4hc[:LEVEL])
+COMPRESSION="zstd:19"
+# embed the distribution's gzip compressed kernel (e.g. /boot/Image.gz) as is
+# instead of compressing ${KERNEL}, needs a stub built with LOADER_USE_GZIP
+KERNEL_GZIP=""
 
 function arch() {
 	case $(uname -m) in
@@ -21,37 +26,42 @@ function install() {
 	KERNEL_VERSION="$1"
 	EFI_OUT="/efi/EFI/Linux/${KERNEL_VERSION}.efi"
 
-	if [ "${KERNEL}" -nt "${KERNEL_COMPRESSED}" ]; then
-		echo "Compressing ${KERNEL} ($KERNEL_VERSION)"
-		zstd -f -19 "${KERNEL}" -o ${KERNEL_COMPRESSED} || exit 1
-	fi
+	# build_image leaves the compressed kernel as it is
+	KERNEL_IMAGE="${KERNEL_GZIP:-${KERNEL}}"
 
 	INITRD="/boot/initrd.img"
 
 	if [ "${KERNEL}" -nt "${INITRD}" ]; then
 		echo "Generating ${INITRD}"
-		dracut --quiet --force "${INITRD}" $KERNEL_VERSION || return 1
-	fi
-
-	if [ "${BOOTCFG}" -nt "${INITRD}" -o "${INITRD}" -nt "${EFI_OUT}" ]; then
-		bootconfig -a "${BOOTCFG}" "${INITRD}" || return 1
+		dracut --quiet --force --no-compress "${INITRD}" $KERNEL_VERSION || return 1
 	fi
 
 	if [ \
 		"${INITRD}" -nt "${EFI_OUT}" -o \
-		"${KERNEL_COMPRESSED}" -nt "${EFI_OUT}" -o \
+		"${BOOTCFG}" -nt "${EFI_OUT}" -o \
+		"${KERNEL_IMAGE}" -nt "${EFI_OUT}" -o \
 		"${DT}" -nt "${EFI_OUT}" -o \
 		"${STUB}" -nt "${EFI_OUT}" \
 	   ]; then
         	ARCH=$(arch)
 		echo "console=ttyMV0,115200 earlycon=ar3700_uart,0xd0012000 bootconfig" > /tmp/cmdline
 
+		# the loader appends the bootconfig to the initrd (as .initrd1, the last
+		# section, it stays behind the files of the .extra.d directory)
+		rm -f /tmp/bootconfig
+		if [ "${BOOTCFG}" ]; then
+			touch /tmp/bootconfig
+			bootconfig -a "${BOOTCFG}" /tmp/bootconfig || return 1
+		fi
+
 		echo "Creating ${KERNEL_VERSION}.efi from $ARCH.efi.stub"
 		build_image \
 			${OSRELEASE:+--osrel "${OSRELEASE}"} \
 			--cmdline "/tmp/cmdline" \
-			--linux "${KERNEL_COMPRESSED}" \
+			--linux "${KERNEL_IMAGE}" \
+			${COMPRESSION:+--compress "${COMPRESSION}"} \
 			${INITRD:+--initrd "${INITRD}"} \
+			${BOOTCFG:+--initrd /tmp/bootconfig} \
 			${DT:+--dtb "${DT}"} \
 			--stub "${STUB}" \
 			--outfile "/tmp/zloader.efi"
@@ -66,7 +76,7 @@ function install() {
 			mv "/tmp/zloader.efi" "${EFI_OUT}" || return 1
 		fi
 
-		rm -f "/tmp/cmdline"
+		rm -f "/tmp/cmdline" "/tmp/bootconfig"
 	fi
 }
 
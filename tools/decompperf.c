@@ -0,0 +1,543 @@
+/**
+ * @file decompperf.c
+ * @author Max Resch
+ * @brief throughput benchmark for the kernel decoders
+ * @version 0.1
+ * @date 2021-10-17
+ *
+ * @details
+ *  Builds the decoders of the loader for the host and decodes each file the
+ *  way `decompress_stream_read_all` does it for a single frame: gzip with
+ *  lib/inflate.c, LZ4 frames block by block with `LZ4_decompress_safe_usingDict`,
+ *  legacy LZ4 blocks with `LZ4_decompress_safe` and ZSTD with
+ *  `ZSTD_decompressDCtx`. Compress the same kernel in every format to
+ *  compare them, e.g.
+ *
+ *      gzip -9 -k Image
+ *      lz4 -9 --content-size Image Image.lz4
+ *      zstd -19 Image
+ *      decompperf Image.gz Image.lz4 Image.zst
+ *
+ *  The xxh64 of the output shows that all of them decoded the same data.
+ *
+ *  `--check` decodes gzip files a second time in random small pieces through
+ *  a window, like a stream read by the PE loader, and compares the result.
+ *  It also decodes the file concatenated with itself, which has to give the
+ *  content twice (e.g. `cat a.gz b.gz` initrds). ZSTD files are streamed
+ *  twice in a row in small pieces, which crosses at least one frame boundary.
+ *
+ *  Files starting with the header of a branch filter (the `.linux` section
+ *  of `build_image --branch-filter`) are converted back after decoding, the
+ *  conversion is part of the measured time.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <inflate.h>
+#include <bcj.h>
+#include <lz4.h>
+#include <xxhash.h>
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+
+/* as DECOMPRESS_OUTPUT_SLACK */
+#define OUTPUT_SLACK 64
+
+/* run every measurement at least this long */
+#define MIN_DURATION_NSEC UINT64_C(1000000000)
+
+#define LZ4_FRAME_MAGIC     UINT32_C(0x184D2204)
+#define LZ4_LEGACY_MAGIC    UINT32_C(0x184C2102)
+#define LZ4_LEGACY_BLOCK    (UINT32_C(8) << 20)
+
+struct input {
+    const char* name;
+    const uint8_t* data;
+    size_t size;
+    size_t content_size;
+    const char* format;
+    bool (*decode)(struct input* in, uint8_t* out, size_t capacity);
+    void* ctx;
+    struct bcj_header filter;   ///< magic is 0 without filter
+    char label[24];
+};
+
+static inline
+uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static inline
+uint32_t read_le32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline
+uint64_t read_le64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief add up the sizes of several members like the loader
+ */
+static
+bool gzip_size(struct input* in, const uint8_t* data, size_t size, size_t* content_size) {
+    size_t buffer_size = INFLATE_WINDOW_SIZE + (256 << 10);
+    uint8_t* buffer = malloc(buffer_size);
+    enum inflate_status status = gzip_members(in->ctx, data, size, buffer, buffer_size, content_size);
+    free(buffer);
+    return status == INFLATE_DONE;
+}
+
+static
+bool decode_gzip(struct input* in, uint8_t* out, size_t capacity) {
+    size_t consumed;
+    enum inflate_status status = gzip_decompress(in->ctx, in->data, in->size, out, in->content_size, capacity, true, &consumed);
+    if (status != INFLATE_DONE)
+        fprintf(stderr, "%s: inflate failed (%d)\n", in->name, status);
+    return status == INFLATE_DONE;
+}
+
+/* frame descriptor flags */
+#define LZ4_FLG_BLOCK_INDEPENDENT   0x20
+#define LZ4_FLG_BLOCK_CHECKSUM      0x10
+#define LZ4_FLG_CONTENT_SIZE        0x08
+#define LZ4_FLG_CONTENT_CHECKSUM    0x04
+#define LZ4_FLG_DICT_ID             0x01
+
+static
+bool decode_lz4(struct input* in, uint8_t* out, size_t capacity) {
+    const uint8_t* p = in->data;
+    const uint8_t* end = in->data + in->size;
+    uint8_t flg = p[4];
+    p += 7 + (flg & LZ4_FLG_CONTENT_SIZE ? 8 : 0) + (flg & LZ4_FLG_DICT_ID ? 4 : 0);
+
+    size_t checksum = flg & LZ4_FLG_BLOCK_CHECKSUM ? 4 : 0;
+    size_t done = 0;
+    while (end - p >= 4) {
+        uint32_t block = read_le32(p);
+        p += 4;
+        if (block == 0)
+            break;
+        size_t size = block & 0x7FFFFFFF;
+        if ((size_t) (end - p) < size + checksum)
+            return false;
+        if (block & 0x80000000) {
+            memcpy(out + done, p, size);
+            done += size;
+        } else {
+            size_t prefix = flg & LZ4_FLG_BLOCK_INDEPENDENT ? 0 : (done < 0x10000 ? done : 0x10000);
+            int result = LZ4_decompress_safe_usingDict((const char*) p, (char*) out + done, size,
+                capacity - done, (const char*) out + done - prefix, prefix);
+            if (result < 0)
+                return false;
+            done += result;
+        }
+        p += size + checksum;
+    }
+    return done == in->content_size;
+}
+
+static
+bool decode_lz4_legacy(struct input* in, uint8_t* out, size_t capacity) {
+    const uint8_t* p = in->data + 4;
+    const uint8_t* end = in->data + in->size;
+    size_t done = 0;
+    while (end - p >= 4 && done < in->content_size) {
+        uint32_t size = read_le32(p);
+        p += 4;
+        if (size == LZ4_LEGACY_MAGIC)
+            continue;
+        if (size == 0 || size > (size_t) (end - p))
+            break;
+        int result = LZ4_decompress_safe((const char*) p, (char*) out + done, size, capacity - done);
+        if (result < 0)
+            return false;
+        done += result;
+        p += size;
+    }
+    return done == in->content_size;
+}
+
+static
+bool decode_zstd(struct input* in, uint8_t* out, size_t capacity) {
+    size_t result = ZSTD_decompressDCtx(in->ctx, out, capacity, in->data, in->size);
+    if (ZSTD_isError(result)) {
+        fprintf(stderr, "%s: %s\n", in->name, ZSTD_getErrorName(result));
+        return false;
+    }
+    return result == in->content_size;
+}
+
+/**
+ * @brief size of the legacy stream, there is no header with it
+ */
+static
+size_t lz4_legacy_content_size(const uint8_t* data, size_t size) {
+    const uint8_t* p = data + 4;
+    const uint8_t* end = data + size;
+    size_t total = 0;
+    char* block = malloc(LZ4_LEGACY_BLOCK);
+    while (block && end - p >= 4) {
+        uint32_t length = read_le32(p);
+        p += 4;
+        if (length == LZ4_LEGACY_MAGIC)
+            continue;
+        if (length == 0 || length > (size_t) (end - p))
+            break;
+        int result = LZ4_decompress_safe((const char*) p, block, length, LZ4_LEGACY_BLOCK);
+        if (result < 0)
+            break;
+        total += result;
+        p += length;
+    }
+    free(block);
+    return total;
+}
+
+static
+bool open_input(struct input* in) {
+    int fd = open(in->name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || st.st_size < 8) {
+        fprintf(stderr, "%s: can't read file\n", in->name);
+        return false;
+    }
+    in->size = st.st_size;
+    in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (in->data == MAP_FAILED) {
+        fprintf(stderr, "%s: can't map file\n", in->name);
+        return false;
+    }
+
+    uint32_t magic = read_le32(in->data);
+    if (magic == BCJ_HEADER_MAGIC && in->size > sizeof(in->filter) + 8) {
+        memcpy(&in->filter, in->data, sizeof(in->filter));
+        in->data += sizeof(in->filter);
+        in->size -= sizeof(in->filter);
+        magic = read_le32(in->data);
+    }
+
+    if ((magic & GZIP_MAGIC_MASK) == GZIP_MAGIC) {
+        in->format = "gzip";
+        in->decode = decode_gzip;
+        in->content_size = read_le32(in->data + in->size - 4);
+        in->ctx = malloc(sizeof(struct inflate_state));
+        if (gzip_multi_member(in->data, in->size) && !gzip_size(in, in->data, in->size, &in->content_size)) {
+            fprintf(stderr, "%s: gzip members don't cover the file\n", in->name);
+            return false;
+        }
+    } else if (magic == LZ4_FRAME_MAGIC) {
+        in->format = "lz4";
+        in->decode = decode_lz4;
+        if (!(in->data[4] & LZ4_FLG_CONTENT_SIZE)) {
+            fprintf(stderr, "%s: compress with --content-size\n", in->name);
+            return false;
+        }
+        in->content_size = read_le64(in->data + 6);
+    } else if (magic == LZ4_LEGACY_MAGIC) {
+        in->format = "lz4 legacy";
+        in->decode = decode_lz4_legacy;
+        in->content_size = lz4_legacy_content_size(in->data, in->size);
+    } else if (magic == ZSTD_MAGICNUMBER) {
+        in->format = "zstd";
+        in->decode = decode_zstd;
+        /* all frames, e.g. of `cat a.zst b.zst` */
+        unsigned long long size = ZSTD_findDecompressedSize(in->data, in->size);
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+            fprintf(stderr, "%s: unknown content size\n", in->name);
+            return false;
+        }
+        in->content_size = size;
+        in->ctx = ZSTD_createDCtx();
+    } else {
+        fprintf(stderr, "%s: unsupported format\n", in->name);
+        return false;
+    }
+
+    if (!in->content_size) {
+        fprintf(stderr, "%s: empty\n", in->name);
+        return false;
+    }
+    if (in->filter.magic && !bcj_header_valid(&in->filter, in->content_size)) {
+        fprintf(stderr, "%s: invalid branch filter\n", in->name);
+        return false;
+    }
+    if (in->filter.magic) {
+        snprintf(in->label, sizeof(in->label), "%s+%s", in->format,
+            in->filter.filter == BCJ_FILTER_ARM64 ? "arm64" : "x86");
+        in->format = in->label;
+    }
+    return true;
+}
+
+static
+void reverse_filter(struct input* in, uint8_t* out) {
+    if (in->filter.magic) {
+        struct bcj_state state;
+        bcj_init(&state, in->filter.filter, in->filter.start, in->filter.end);
+        bcj_convert(&state, out, 0, in->content_size, false);
+    }
+}
+
+/**
+ * @brief decode and reverse the branch filter like the loader
+ */
+static
+bool decode_input(struct input* in, uint8_t* out, size_t capacity) {
+    if (!in->decode(in, out, capacity))
+        return false;
+    reverse_filter(in, out);
+    return true;
+}
+
+static uint32_t random_state = 0x5A4C;
+
+static inline
+uint32_t random32() {
+    /* xorshift32 */
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/**
+ * @brief decode through a window in small pieces and compare with ref
+ */
+static
+bool check_gzip_stream(struct input* in, const uint8_t* ref) {
+    /* a small buffer behind the window forces frequent stops */
+    size_t buffer_size = INFLATE_WINDOW_SIZE + 4096;
+    uint8_t* window = malloc(buffer_size);
+    struct inflate_state* s = in->ctx;
+
+    const uint8_t* next = in->data;
+    const uint8_t* end = in->data + in->size;
+    size_t length = 0, done = 0;
+    enum inflate_status status = INFLATE_DONE;
+    while (status == INFLATE_DONE && next < end) {
+        size_t header_size;
+        status = gzip_header(next, end - next, &header_size);
+        if (status != INFLATE_DONE)
+            break;
+        inflate_init(s, next + header_size, end - next - header_size);
+
+        size_t member = 0;
+        uint32_t crc = 0;
+        status = INFLATE_OUTPUT_FULL;
+        while (status == INFLATE_OUTPUT_FULL) {
+            if (length == buffer_size) {
+                memmove(window, window + length - INFLATE_WINDOW_SIZE, INFLATE_WINDOW_SIZE);
+                length = INFLATE_WINDOW_SIZE;
+            }
+            /* stop at random points, also in the middle of matches */
+            size_t space = buffer_size - length;
+            size_t limit = 1 + random32() % (random32() % 4 ? 300 : space);
+            if (limit > space)
+                limit = space;
+
+            uint8_t* out = window + length;
+            status = inflate_run(s, window, &out, out + limit);
+            size_t n = out - (window + length);
+            if (done + n > in->content_size || memcmp(window + length, ref + done, n)) {
+                fprintf(stderr, "%s: stream differs at %zu\n", in->name, done);
+                free(window);
+                return false;
+            }
+            crc = gzip_crc32(crc, window + length, n);
+            length += n;
+            member += n;
+            done += n;
+        }
+
+        if (status == INFLATE_DONE)
+            status = gzip_trailer(s, crc, member, true);
+        next = inflate_input(s);
+    }
+    free(window);
+
+    if (status != INFLATE_DONE || done != in->content_size) {
+        fprintf(stderr, "%s: stream failed (%d) after %zu bytes\n", in->name, status, done);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief decode the file twice in a row as members of one gzip file
+ */
+static
+bool check_gzip_members(struct input* in, const uint8_t* ref) {
+    size_t size = 2 * in->size;
+    uint8_t* twice = malloc(size);
+    memcpy(twice, in->data, in->size);
+    memcpy(twice + in->size, in->data, in->size);
+
+    const char* error = NULL;
+    size_t content_size = 0, consumed = 0;
+    uint8_t* out = NULL;
+    if (!gzip_multi_member(twice, size))
+        error = "second member not found";
+    else if (!gzip_size(in, twice, size, &content_size) || content_size != 2 * in->content_size)
+        error = "wrong size of both members";
+    else if (!(out = malloc(content_size + OUTPUT_SLACK))
+            || gzip_decompress(in->ctx, twice, size, out, content_size, content_size + OUTPUT_SLACK, true, &consumed) != INFLATE_DONE
+            || consumed != size)
+        error = "decoding both members failed";
+    else if (memcmp(out, ref, in->content_size) || memcmp(out + in->content_size, ref, in->content_size))
+        error = "members differ";
+    if (error)
+        fprintf(stderr, "%s: %s\n", in->name, error);
+
+    free(out);
+    free(twice);
+    return !error;
+}
+
+/**
+ * @brief stream the file twice in a row in small pieces like `read_zstd`
+ *
+ * @details
+ *  The decoder returns 0 at the end of each frame, the stream has to
+ *  continue with the next one until the output is complete.
+ */
+static
+bool check_zstd_stream(struct input* in, const uint8_t* ref) {
+    size_t size = 2 * in->size;
+    size_t content_size = 2 * in->content_size;
+    uint8_t* twice = malloc(size);
+    uint8_t* piece = malloc(4096);
+    memcpy(twice, in->data, in->size);
+    memcpy(twice + in->size, in->data, in->size);
+
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer input = { .src = twice, .size = size, .pos = 0 };
+    const char* error = NULL;
+    size_t done = 0;
+    while (!error && done < content_size) {
+        /* one read() of the PE loader */
+        ZSTD_outBuffer out = { .dst = piece, .size = 1 + random32() % 4096, .pos = 0 };
+        if (out.size > content_size - done)
+            out.size = content_size - done;
+        while (!error && out.pos < out.size) {
+            if (input.pos >= input.size) {
+                error = "EOF before end of stream";
+                break;
+            }
+            size_t result = ZSTD_decompressStream(dctx, &out, &input);
+            if (ZSTD_isError(result))
+                error = ZSTD_getErrorName(result);
+        }
+        for (size_t i = 0; !error && i < out.pos; i++)
+            if (piece[i] != ref[(done + i) % in->content_size])
+                error = "stream differs";
+        if (!error)
+            done += out.pos;
+    }
+    if (error)
+        fprintf(stderr, "%s: %s after %zu bytes\n", in->name, error, done);
+
+    ZSTD_freeDCtx(dctx);
+    free(piece);
+    free(twice);
+    return !error;
+}
+
+static
+void usage(const char* name) {
+    printf("Usage: %s [--check] FILE...\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    bool do_check = false;
+
+    static struct option long_options[] = {
+        { "check",  no_argument,    NULL, 'c' },
+        { "help",   no_argument,    NULL, 'h' },
+        { }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "ch", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'c':
+                do_check = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int result = EXIT_SUCCESS;
+    printf("%-24s %-10s %10s %10s %8s %16s\n", "file", "format", "in KiB", "out KiB", "MiB/s", "xxh64");
+    for (int i = optind; i < argc; i++) {
+        struct input in = { .name = argv[i] };
+        if (!open_input(&in)) {
+            result = EXIT_FAILURE;
+            continue;
+        }
+
+        size_t capacity = in.content_size + OUTPUT_SLACK;
+        uint8_t* out = malloc(capacity);
+        if (!out || !in.decode(&in, out, capacity)) {
+            fprintf(stderr, "%s: decoding failed\n", in.name);
+            result = EXIT_FAILURE;
+            continue;
+        }
+
+        if (do_check) {
+            /* compare the output of inflate before the filter is reversed */
+            if (in.decode == decode_gzip && (!check_gzip_stream(&in, out) || !check_gzip_members(&in, out)))
+                result = EXIT_FAILURE;
+            if (in.decode == decode_zstd && !check_zstd_stream(&in, out))
+                result = EXIT_FAILURE;
+            reverse_filter(&in, out);
+            printf("%-24s %-10s %10zu %10zu %8s %016llx\n", in.name, in.format, in.size >> 10,
+                in.content_size >> 10, "-", (unsigned long long) xxh64(out, in.content_size, 0));
+            free(out);
+            continue;
+        }
+
+        uint64_t iterations = 0, start = now_nsec(), elapsed;
+        do {
+            decode_input(&in, out, capacity);
+            iterations++;
+            elapsed = now_nsec() - start;
+        } while (elapsed < MIN_DURATION_NSEC);
+
+        double mibs = (double) in.content_size * iterations / (1024.0 * 1024.0) / (elapsed / 1e9);
+        printf("%-24s %-10s %10zu %10zu %8.0f %016llx\n", in.name, in.format, in.size >> 10,
+            in.content_size >> 10, mibs, (unsigned long long) xxh64(out, in.content_size, 0));
+        free(out);
+    }
+
+    return result;
+}
@@ -0,0 +1,12 @@
+/**
+ * @file efilib.h
+ * @brief host replacement for the loader's efilib.h
+ *
+ * @details
+ *  The vendored libraries get malloc, free and the mem* functions from
+ *  efilib.h in the loader, the host tools take them from libc.
+ */
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
@@ -0,0 +1,368 @@
+/**
+ * @file memperf.c
+ * @author Max Resch
+ * @brief throughput benchmark for the efilib memory engine
+ * @version 0.1
+ * @date 2021-09-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * @details
+ *  Builds lib/efilib/efimem.c for the host and compares every path of the
+ *  engine with the byte loop efilib used before, with the host libc and on
+ *  x86_64 with `rep movsq`, which is how EDK2's BaseMemoryLibRepStr
+ *  implements the BootServices CopyMem used by EFILIB_USE_EFI_COPY_MEM.
+ *  Other firmware implementations can only be measured on the target.
+ *
+ *  `--zero` measures zeroing (memzero) instead of copying, the firmware
+ *  reference is `rep stosq` like EDK2's ZeroMem.
+ *
+ *  `--check` verifies all paths against libc instead of measuring.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <efilib/mem.h>
+
+#define BUFFER_ALIGNMENT 64
+
+/* run every measurement at least this long */
+#define MIN_DURATION_NSEC UINT64_C(100000000)
+
+static
+void* copy_bytes(void* dst, const void* src, size_t size) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    while (size--) {
+        *(d++) = *(s++);
+        /* keep the compiler from replacing the loop with memcpy */
+        __asm__ volatile ("" ::: "memory");
+    }
+    return dst;
+}
+
+#ifdef __x86_64__
+static
+void* copy_rep_movsq(void* dst, const void* src, size_t size) {
+    void* d = dst;
+    size_t qwords = size / 8, bytes = size % 8;
+    __asm__ volatile ("rep movsq" : "+D"(d), "+S"(src), "+c"(qwords) :: "memory");
+    __asm__ volatile ("rep movsb" : "+D"(d), "+S"(src), "+c"(bytes) :: "memory");
+    return dst;
+}
+#endif
+
+static
+void* zero_bytes(void* dst, const void*, size_t size) {
+    uint8_t* d = dst;
+    while (size--) {
+        *(d++) = 0;
+        __asm__ volatile ("" ::: "memory");
+    }
+    return dst;
+}
+
+#ifdef __x86_64__
+static
+void* zero_rep_stosq(void* dst, const void*, size_t size) {
+    void* d = dst;
+    size_t qwords = size / 8, bytes = size % 8;
+    __asm__ volatile ("rep stosq" : "+D"(d), "+c"(qwords) : "a"(0) : "memory");
+    __asm__ volatile ("rep stosb" : "+D"(d), "+c"(bytes) : "a"(0) : "memory");
+    return dst;
+}
+#endif
+
+static
+void* zero_libc(void* dst, const void*, size_t size) {
+    return memset(dst, 0, size);
+}
+
+static
+void* zero_engine(void* dst, const void*, size_t size) {
+    return mem_zero(dst, size);
+}
+
+static
+void* copy_libc(void* dst, const void* src, size_t size) {
+    return memcpy(dst, src, size);
+}
+
+static
+void* copy_engine(void* dst, const void* src, size_t size) {
+    return mem_copy(dst, src, size);
+}
+
+struct variant {
+    const char* name;
+    void* (*copy)(void*, const void*, size_t);
+    uint32_t features;      ///< engine features to enable
+    bool engine;
+    bool slow;              ///< skip sizes above 16 MiB
+};
+
+static uint32_t detected = 0;
+
+static
+struct variant copy_variants[] = {
+    { "bytes",      copy_bytes,     0, false, true },
+#ifdef __x86_64__
+    { "movsq",      copy_rep_movsq, 0, false },
+#endif
+    { "libc",       copy_libc,      0, false },
+    { "base",       copy_engine,    0, true },
+    { "nt",         copy_engine,    MEM_FEATURE_NONTEMPORAL, true },
+#ifdef __x86_64__
+    { "erms",       copy_engine,    MEM_FEATURE_ERMS, true },
+    { "avx2",       copy_engine,    MEM_FEATURE_AVX2, true },
+#endif
+    { "engine",     copy_engine,    UINT32_MAX, true },
+    { }
+};
+
+static
+struct variant zero_variants[] = {
+    { "bytes",      zero_bytes,     0, false, true },
+#ifdef __x86_64__
+    { "stosq",      zero_rep_stosq, 0, false },
+#endif
+    { "libc",       zero_libc,      0, false },
+    { "base",       zero_engine,    0, true },
+    { "nt",         zero_engine,    MEM_FEATURE_NONTEMPORAL, true },
+#ifdef __x86_64__
+    { "erms",       zero_engine,    MEM_FEATURE_ERMS, true },
+    { "avx2",       zero_engine,    MEM_FEATURE_AVX2, true },
+#endif
+#ifdef __aarch64__
+    { "dczva",      zero_engine,    MEM_FEATURE_DCZVA, true },
+#endif
+    { "engine",     zero_engine,    UINT32_MAX, true },
+    { }
+};
+
+static inline
+uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static
+double measure(struct variant* v, uint8_t* dst, const uint8_t* src, size_t size) {
+    uint64_t iterations = 0, start = now_nsec(), elapsed;
+
+    mem_features = v->features & detected;
+    do {
+        for (int i = 0; i < 16; i++)
+            v->copy(dst, src, size);
+        iterations += 16;
+        elapsed = now_nsec() - start;
+    } while (elapsed < MIN_DURATION_NSEC);
+    mem_features = detected;
+
+    /* MiB/s */
+    return (double) size * iterations / (1024.0 * 1024.0) / (elapsed / 1e9);
+}
+
+static inline
+int sign(int v) {
+    return (v > 0) - (v < 0);
+}
+
+static uint32_t random_state = 0x5A4C;
+
+static inline
+uint32_t random32() {
+    /* xorshift32 */
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/**
+ * @brief compare all engine paths with libc for random sizes and offsets
+ */
+static
+int check(uint8_t* a, uint8_t* b, uint8_t* ref, size_t max_size) {
+    unsigned failed = 0;
+    size_t large = max_size / 2 < (256 << 10) ? max_size / 2 : (256 << 10);
+
+    for (uint32_t features = 0; features <= (MEM_FEATURE_AVX2 | MEM_FEATURE_ERMS | MEM_FEATURE_NONTEMPORAL | MEM_FEATURE_DCZVA); features++) {
+        if ((features & detected) != features)
+            continue;
+        mem_features = features;
+        /* exercise the streaming path with small sizes */
+        mem_nontemporal_threshold = features & MEM_FEATURE_NONTEMPORAL ? 4096 : SIZE_MAX;
+
+        for (unsigned round = 0; round < 20000; round++) {
+            size_t size = random32() % (round % 16 ? 1024 : large);
+            size_t so = random32() % 128, dof = random32() % 128;
+
+            for (size_t i = 0; i < size + 256; i++)
+                a[i] = random32();
+
+            /* copy */
+            memcpy(ref, a, size + 256);
+            memcpy(ref + dof, a + so, size);
+            memcpy(b, a, size + 256);
+            mem_copy(b + dof, a + so, size);
+            if (memcmp(b, ref, size + 256)) {
+                printf("mem_copy features=%X size=%zu src+%zu dst+%zu failed\n", features, size, so, dof);
+                failed++;
+            }
+
+            /* overlapping move in both directions */
+            memcpy(ref, a, size + 256);
+            memmove(ref + dof, ref + so, size);
+            memcpy(b, a, size + 256);
+            mem_move(b + dof, b + so, size);
+            if (memcmp(b, ref, size + 256)) {
+                printf("mem_move features=%X size=%zu src+%zu dst+%zu failed\n", features, size, so, dof);
+                failed++;
+            }
+
+            /* compare equal and with one differing byte */
+            memcpy(b, a, size + 256);
+            if (size) {
+                size_t pos = random32() % size;
+                b[pos] = random32();
+            }
+            if (sign(mem_compare(a, b, size)) != sign(memcmp(a, b, size))) {
+                printf("mem_compare features=%X size=%zu failed\n", features, size);
+                failed++;
+            }
+
+            /* fill and zero */
+            uint8_t value = random32();
+            memcpy(ref, a, size + 256);
+            memset(ref + dof, value, size);
+            memcpy(b, a, size + 256);
+            mem_set(b + dof, value, size);
+            if (memcmp(b, ref, size + 256)) {
+                printf("mem_set features=%X size=%zu dst+%zu failed\n", features, size, dof);
+                failed++;
+            }
+
+            memset(ref + dof, 0, size);
+            mem_zero(b + dof, size);
+            if (memcmp(b, ref, size + 256)) {
+                printf("mem_zero features=%X size=%zu dst+%zu failed\n", features, size, dof);
+                failed++;
+            }
+        }
+    }
+
+    mem_features = detected;
+    mem_nontemporal_threshold = SIZE_MAX;
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static
+void usage(const char* name) {
+    printf("Usage: %s [--check] [--zero] [--max-size MiB] [--nontemporal-threshold KiB]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    size_t max_size = 64 << 20;
+    bool do_check = false;
+    struct variant* variants = copy_variants;
+
+    static struct option long_options[] = {
+        { "check",                  no_argument,       NULL, 'c' },
+        { "zero",                   no_argument,       NULL, 'z' },
+        { "max-size",               required_argument, NULL, 'm' },
+        { "nontemporal-threshold",  required_argument, NULL, 'n' },
+        { "help",                   no_argument,       NULL, 'h' },
+        { }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "czm:n:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'c':
+                do_check = true;
+                break;
+            case 'z':
+                variants = zero_variants;
+                break;
+            case 'm':
+                max_size = strtoull(optarg, NULL, 0) << 20;
+                break;
+            case 'n':
+                mem_nontemporal_threshold = strtoull(optarg, NULL, 0) << 10;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (max_size < 4096) {
+        fprintf(stderr, "max size too small\n");
+        return EXIT_FAILURE;
+    }
+
+    detected = mem_detect_features();
+    printf("features:%s%s%s%s nontemporal threshold: %zu KiB\n",
+        detected & MEM_FEATURE_AVX2 ? " avx2" : "",
+        detected & MEM_FEATURE_ERMS ? " erms" : "",
+        detected & MEM_FEATURE_NONTEMPORAL ? " nontemporal" : "",
+        detected & MEM_FEATURE_DCZVA ? " dczva" : "",
+        mem_nontemporal_threshold >> 10);
+
+    size_t alloc = max_size + 4096;
+    uint8_t* src = aligned_alloc(BUFFER_ALIGNMENT, alloc);
+    uint8_t* dst = aligned_alloc(BUFFER_ALIGNMENT, alloc);
+    uint8_t* ref = aligned_alloc(BUFFER_ALIGNMENT, alloc);
+    if (!src || !dst || !ref) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(src, 0xA5, alloc);
+    memset(dst, 0x5A, alloc);
+
+    if (do_check)
+        return check(src, dst, ref, max_size);
+
+    /* MiB/s per size, unaligned source like most copies in the loader */
+    printf("%10s", "size");
+    for (struct variant* v = variants; v->name; v++) {
+        if (v->engine && (v->features & detected) != v->features && v->features != UINT32_MAX)
+            continue;
+        printf(" %10s", v->name);
+    }
+    printf("\n");
+
+    for (size_t size = 16; size <= max_size; size *= 4) {
+        printf("%10zu", size);
+        for (struct variant* v = variants; v->name; v++) {
+            if (v->engine && (v->features & detected) != v->features && v->features != UINT32_MAX)
+                continue;
+            /* the byte loop takes ages for large sizes */
+            if (v->slow && size > (16 << 20)) {
+                printf(" %10s", "-");
+                continue;
+            }
+            printf(" %10.0f", measure(v, dst, src + 3, size));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    free(src);
+    free(dst);
+    free(ref);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <string.h>
+#include "trace_buffer.h"
+
+#include <assert.h>
+#include <getopt.h>
+
+/* systemd's loader vendor GUID, see src/systemd.c */
+#define TRACE_VARIABLE_PATH "/sys/firmware/efi/efivars/" TRACE_BUFFER_VARIABLE "-4a67b082-0a4c-41cf-b6c7-440b29bb8c4f"
+
+/* efivarfs puts the variable attributes in front of the data */
+#define EFIVARFS_ATTRIBUTES_SIZE 4
+
+static const char* trace_names[] = {
+#define TRACE_NAME(id, name) [TRACE_##id] = name,
+    TRACE_IDS(TRACE_NAME)
+#undef TRACE_NAME
+};
+
+static const char* memory_series[] = {
+#define SERIES_NAME(id, name) name,
+    TRACE_MEMORY_SERIES(SERIES_NAME)
+#undef SERIES_NAME
+    "total"
+};
+
+static inline
+void close_p(FILE** f) {
+    if (*f)
+        fclose(*f);
+}
+
+static inline
+void free_p(void* p) {
+    free(*(void**) p);
+}
+
+static
+void usage() {
+    printf("trace_export [--raw] [<filename>]\n"
+        "\n"
+        "    <filename> is the boot trace written by the loader,\n"
+        "    " TRACE_VARIABLE_PATH " by default\n"
+        "    --raw the file has no efivarfs attributes in front\n"
+        "\n"
+        "    Writes the trace in the Chrome trace event format (chrome://tracing,\n"
+        "    ui.perfetto.dev) to stdout\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* filename = TRACE_VARIABLE_PATH;
+    bool raw = false;
+
+    const struct option long_opts[] = {
+        { .name = "raw",  .has_arg = no_argument, .flag = NULL, .val = 'r' },
+        { .name = "help", .has_arg = no_argument, .flag = NULL, .val = 'h' },
+        { }
+    };
+    int c, opt_index = 0;
+
+    while(-1 != (c = getopt_long(argc, argv, "rh", long_opts, &opt_index))) {
+        switch(c) {
+            case 'r':
+                raw = true;
+                break;
+            case 'h':
+                usage();
+                return 0;
+            case '?': /* unknown option */
+                usage();
+                return 1;
+            default:
+                assert(true);
+        }
+    }
+
+    if (optind < argc)
+        filename = argv[optind];
+
+    [[ gnu::cleanup(close_p) ]]
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "open '%s': %m\n", filename);
+        return 1;
+    }
+
+    /* efivarfs reports no useful size, read until the end */
+    size_t size = 0, allocated = TRACE_BUFFER_SIZE(TRACE_BUFFER_CAPACITY) + EFIVARFS_ATTRIBUTES_SIZE;
+    [[ gnu::cleanup(free_p) ]]
+    uint8_t* data = malloc(allocated);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size_t n;
+    while ((n = fread(data + size, 1, allocated - size, f)) > 0) {
+        size += n;
+        if (size == allocated) {
+            uint8_t* p = realloc(data, allocated * 2);
+            if (!p) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            data = p;
+            allocated *= 2;
+        }
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "read '%s': %m\n", filename);
+        return 1;
+    }
+
+    const uint8_t* p = data;
+    if (!raw) {
+        if (size < EFIVARFS_ATTRIBUTES_SIZE) {
+            fprintf(stderr, "file too small\n");
+            return 1;
+        }
+        p += EFIVARFS_ATTRIBUTES_SIZE;
+        size -= EFIVARFS_ATTRIBUTES_SIZE;
+    }
+
+    struct trace_buffer header;
+    if (size < sizeof(header)) {
+        fprintf(stderr, "file too small\n");
+        return 1;
+    }
+    memcpy(&header, p, sizeof(header));
+
+    if (header.signature != TRACE_BUFFER_SIGNATURE) {
+        fprintf(stderr, "missing trace signature\n");
+        return 1;
+    }
+    if (header.version != TRACE_BUFFER_VERSION || header.event_size != sizeof(struct trace_event)) {
+        fprintf(stderr, "unsupported trace version %hu\n", header.version);
+        return 1;
+    }
+    if (header.capacity == 0) {
+        fprintf(stderr, "trace has no events\n");
+        return 1;
+    }
+
+    /* the loader only writes the used part of the ring */
+    uint32_t events = header.count < header.capacity ? header.count : header.capacity;
+    if (size < sizeof(header) + (size_t) events * sizeof(struct trace_event)) {
+        fprintf(stderr, "file truncated\n");
+        return 1;
+    }
+    if (header.count > header.capacity)
+        fprintf(stderr, "%u of %u events were overwritten\n", header.count - header.capacity, header.count);
+    if (!header.ticks_per_second)
+        fprintf(stderr, "counter frequency unknown, timestamps are in ticks\n");
+
+    /* after a wrap the oldest event is the one written next */
+    uint32_t first = header.count > header.capacity ? header.count % header.capacity : 0;
+    const struct trace_event* ring = (const struct trace_event*) (p + sizeof(header));
+
+    printf("[\n");
+    for (uint32_t i = 0; i < events; i++) {
+        struct trace_event e;
+        memcpy(&e, &ring[(first + i) % header.capacity], sizeof(e));
+
+        double ts = header.ticks_per_second
+            ? e.ticks * 1000000.0 / header.ticks_per_second
+            : (double) e.ticks;
+        const char* name = e.id < _TRACE_ID_MAX ? trace_names[e.id] : "unknown";
+        char phase = e.phase == TRACE_BEGIN || e.phase == TRACE_END || e.phase == TRACE_COUNTER
+            ? e.phase : TRACE_INSTANT;
+        const char* separator = i + 1 < events ? "," : "";
+
+        /* counters have one value per series instead of a thread */
+        if (phase == TRACE_COUNTER) {
+            const char* series = e.id == TRACE_MEMORY_PEAK && e.cpu < sizeof(memory_series) / sizeof(*memory_series)
+                ? memory_series[e.cpu] : "value";
+            printf("  {\"name\": \"%s\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": 0, \"args\": {\"%s\": %u}}%s\n",
+                name, ts, series, e.arg, separator);
+            continue;
+        }
+
+        printf("  {\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 0, \"tid\": %u, ",
+            name, phase, ts, e.cpu);
+        if (phase == TRACE_INSTANT)
+            printf("\"s\": \"g\", ");
+        printf("\"args\": {\"arg\": %u}}%s\n", e.arg, separator);
+    }
+    printf("]\n");
+
+    return 0;
+}